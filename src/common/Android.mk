@@ -20,7 +20,21 @@ LOCAL_AIDL_INCLUDES := $(LOCAL_PATH)/aidl
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
 
 LOCAL_SRC_FILES := \
+	aidl/brillo/examples/homecloud/IHomeCloudService.aidl \
 	aidl/brillo/examples/ledflasher/ILEDService.aidl \
 	binder_constants.cpp \
+	led_framebuffer.cpp \
+	metrics.cpp \
+	service_module.cpp \
+	trace.cpp \
+
+LOCAL_SHARED_LIBRARIES := \
+	libbinder \
+	libbinderwrapper \
+	libbrillo \
+	libbrillo-binder \
+	libchrome \
+	libcutils \
+	libutils \
 
 include $(BUILD_STATIC_LIBRARY)
@@ -19,3 +19,15 @@ namespace ledservice {
 const char kBinderServiceName[] = "example_led_service";
 
 }  // namespace led_service
+
+namespace ledflasher {
+
+const char kBinderServiceName[] = "example_ledflasher_service";
+
+}  // namespace ledflasher
+
+namespace home_cloud {
+
+const char kBinderServiceName[] = "home_cloud_sensor_service";
+
+}  // namespace home_cloud
@@ -21,4 +21,16 @@ extern const char kBinderServiceName[];
 
 }  // namespace led_service
 
+namespace ledflasher {
+
+extern const char kBinderServiceName[];
+
+}  // namespace ledflasher
+
+namespace home_cloud {
+
+extern const char kBinderServiceName[];
+
+}  // namespace home_cloud
+
 #endif  // LEDFLASHER_COMMON_BINDER_CONSTANTS_H_
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "led_framebuffer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <cutils/ashmem.h>
+
+using android::Parcel;
+using android::status_t;
+
+namespace brillo {
+namespace examples {
+namespace ledflasher {
+
+namespace {
+
+const uint32_t kMagic = 0x4c454446;  // "LEDF"
+
+// How many times ReadLatest() tries again when the writer laps it.
+const int kReadAttempts = 4;
+
+}  // anonymous namespace
+
+LedFramebuffer::~LedFramebuffer() {
+  Close();
+}
+
+bool LedFramebuffer::Create(size_t led_count) {
+  Close();
+  if (led_count == 0 || led_count > kMaxLeds)
+    return false;
+  memory_fd_ = ashmem_create_region("led_framebuffer", sizeof(Region));
+  doorbell_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (memory_fd_ < 0 || doorbell_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create the LED framebuffer";
+    Close();
+    return false;
+  }
+  if (!Map()) {
+    Close();
+    return false;
+  }
+  region_->magic = kMagic;
+  region_->led_count = led_count;
+  region_->published.store(0, std::memory_order_relaxed);
+  for (Slot& slot : region_->slots) {
+    slot.sequence.store(0, std::memory_order_relaxed);
+    memset(slot.brightness, 0, sizeof(slot.brightness));
+  }
+  led_count_ = led_count;
+  last_read_ = 0;
+  return true;
+}
+
+bool LedFramebuffer::Share(LedFramebuffer* client) const {
+  return region_ && client->Adopt(memory_fd_, doorbell_fd_);
+}
+
+bool LedFramebuffer::Adopt(int memory_fd, int doorbell_fd) {
+  Close();
+  memory_fd_ = fcntl(memory_fd, F_DUPFD_CLOEXEC, 0);
+  doorbell_fd_ = fcntl(doorbell_fd, F_DUPFD_CLOEXEC, 0);
+  if (memory_fd_ < 0 || doorbell_fd_ < 0 || !Map()) {
+    Close();
+    return false;
+  }
+  if (region_->magic != kMagic) {
+    LOG(ERROR) << "Not an LED framebuffer";
+    Close();
+    return false;
+  }
+  led_count_ = std::min<size_t>(region_->led_count, kMaxLeds);
+  last_read_ = region_->published.load(std::memory_order_acquire);
+  return true;
+}
+
+bool LedFramebuffer::Map() {
+  int size = ashmem_get_size_region(memory_fd_);
+  if (size < static_cast<int>(sizeof(Region))) {
+    LOG(ERROR) << "LED framebuffer region is too small: " << size;
+    return false;
+  }
+  void* map = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, memory_fd_, 0);
+  if (map == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map the LED framebuffer";
+    return false;
+  }
+  region_ = static_cast<Region*>(map);
+  return true;
+}
+
+void LedFramebuffer::Close() {
+  if (region_)
+    munmap(region_, sizeof(Region));
+  region_ = nullptr;
+  if (memory_fd_ >= 0)
+    close(memory_fd_);
+  memory_fd_ = -1;
+  if (doorbell_fd_ >= 0)
+    close(doorbell_fd_);
+  doorbell_fd_ = -1;
+  led_count_ = 0;
+}
+
+bool LedFramebuffer::Publish(const uint8_t* brightness) {
+  if (!region_)
+    return false;
+  uint32_t frame = region_->published.load(std::memory_order_relaxed) + 1;
+  Slot& slot = region_->slots[frame % 2];
+  slot.sequence.store(2 * frame - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(slot.brightness, brightness, led_count_);
+  slot.sequence.store(2 * frame, std::memory_order_release);
+  region_->published.store(frame, std::memory_order_release);
+
+  uint64_t ring = 1;
+  return write(doorbell_fd_, &ring, sizeof(ring)) == sizeof(ring);
+}
+
+bool LedFramebuffer::ReadLatest(uint8_t* brightness) {
+  if (!region_)
+    return false;
+  uint64_t rings;
+  if (read(doorbell_fd_, &rings, sizeof(rings)) < 0 && errno != EAGAIN)
+    PLOG(ERROR) << "LED framebuffer doorbell";
+
+  for (int attempt = 0; attempt < kReadAttempts; attempt++) {
+    uint32_t frame = region_->published.load(std::memory_order_acquire);
+    if (frame == last_read_)
+      return false;
+    const Slot& slot = region_->slots[frame % 2];
+    uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+    // The writer has moved on to the frame after next in this slot.
+    if (sequence != 2 * frame)
+      continue;
+    memcpy(brightness, slot.brightness, led_count_);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+      continue;
+    last_read_ = frame;
+    return true;
+  }
+  // Still being written; the writer rings again when it is done.
+  return false;
+}
+
+status_t LedFramebuffer::writeToParcel(Parcel* parcel) const {
+  status_t err;
+  if ((err = parcel->writeDupFileDescriptor(memory_fd_)) != android::OK ||
+      (err = parcel->writeDupFileDescriptor(doorbell_fd_)) != android::OK) {
+    return err;
+  }
+  return android::OK;
+}
+
+status_t LedFramebuffer::readFromParcel(const Parcel* parcel) {
+  Close();
+  // The parcel keeps ownership of the descriptors it returns.
+  int memory_fd = parcel->readFileDescriptor();
+  int doorbell_fd = parcel->readFileDescriptor();
+  if (memory_fd < 0 || doorbell_fd < 0 || !Adopt(memory_fd, doorbell_fd))
+    return android::BAD_VALUE;
+  return android::OK;
+}
+
+}  // namespace ledflasher
+}  // namespace examples
+}  // namespace brillo
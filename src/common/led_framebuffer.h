@@ -0,0 +1,109 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LEDFLASHER_COMMON_LED_FRAMEBUFFER_H_
+#define LEDFLASHER_COMMON_LED_FRAMEBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <base/macros.h>
+#include <binder/Parcel.h>
+#include <binder/Parcelable.h>
+
+namespace brillo {
+namespace examples {
+namespace ledflasher {
+
+// A frame of LED brightnesses shared between ledservice and one client,
+// for animations that change the LEDs faster than is worth a binder call
+// each. ledservice creates an ashmem region and an eventfd doorbell and
+// hands both out through ILEDService.openFramebuffer(). The client writes
+// each frame into the region and rings the doorbell; ledservice reads the
+// newest frame and writes only the LEDs that changed.
+//
+// The region holds two frame slots. The client fills the slot it did not
+// publish last, so ledservice can read the current frame while the next
+// one is written. Each slot has a sequence number, odd while it is being
+// written, so a reader that races with a writer lapping it notices and
+// reads again instead of applying half a frame. Frames published faster
+// than ledservice reads them are skipped, never queued.
+//
+// Only one client may publish at a time.
+class LedFramebuffer : public android::Parcelable {
+ public:
+  static const size_t kMaxLeds = 64;
+
+  LedFramebuffer() = default;
+  ~LedFramebuffer() override;
+
+  // Service side: a new region and doorbell for led_count LEDs. The
+  // client side gets both from readFromParcel(), which maps the region.
+  bool Create(size_t led_count);
+  // Makes client a second handle on the same region and doorbell, to be
+  // returned from openFramebuffer().
+  bool Share(LedFramebuffer* client) const;
+  bool valid() const { return region_ != nullptr; }
+
+  size_t led_count() const { return led_count_; }
+  // Readable when a frame has been published.
+  int doorbell_fd() const { return doorbell_fd_; }
+
+  // Copies brightness, with led_count() entries, into the region as the
+  // next frame and rings the doorbell.
+  bool Publish(const uint8_t* brightness);
+  // Clears the doorbell and copies the newest frame into brightness.
+  // Returns false if nothing was published since the last call.
+  bool ReadLatest(uint8_t* brightness);
+
+  android::status_t writeToParcel(android::Parcel* parcel) const override;
+  android::status_t readFromParcel(const android::Parcel* parcel) override;
+
+ private:
+  struct Slot {
+    // 2 * frame once the slot holds that frame; odd while being written.
+    std::atomic<uint32_t> sequence;
+    uint8_t brightness[kMaxLeds];
+  };
+  struct Region {
+    uint32_t magic;
+    uint32_t led_count;
+    // Newest complete frame; it is in slots[published % 2].
+    std::atomic<uint32_t> published;
+    Slot slots[2];
+  };
+
+  // Takes copies of the descriptors and maps the region.
+  bool Adopt(int memory_fd, int doorbell_fd);
+  bool Map();
+  void Close();
+
+  int memory_fd_{-1};
+  int doorbell_fd_{-1};
+  Region* region_{nullptr};
+  size_t led_count_{0};
+  // Reader side: the last frame returned by ReadLatest().
+  uint32_t last_read_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(LedFramebuffer);
+};
+
+}  // namespace ledflasher
+}  // namespace examples
+}  // namespace brillo
+
+#endif  // LEDFLASHER_COMMON_LED_FRAMEBUFFER_H_
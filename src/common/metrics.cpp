@@ -0,0 +1,219 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include <base/strings/stringprintf.h>
+
+namespace metrics {
+
+namespace {
+
+pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t shard_key;
+std::atomic<int> next_shard{0};
+
+void CreateShardKey() {
+  pthread_key_create(&shard_key, nullptr);
+}
+
+// Builds run without exceptions, so there is no bad_alloc to throw.
+void* AlignedAlloc(size_t size) {
+  void* p = nullptr;
+  if (posix_memalign(&p, kCacheLineBytes, size) != 0)
+    abort();
+  return p;
+}
+
+}  // anonymous namespace
+
+// The shard is kept in a pthread key, stored off by one so that null means
+// not picked yet. Threads take shards in turn as they first record.
+int CurrentShard() {
+  pthread_once(&shard_key_once, CreateShardKey);
+  intptr_t shard = reinterpret_cast<intptr_t>(pthread_getspecific(shard_key));
+  if (shard == 0) {
+    shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kShards + 1;
+    pthread_setspecific(shard_key, reinterpret_cast<void*>(shard));
+  }
+  return shard - 1;
+}
+
+void* Counter::operator new(size_t size) {
+  return AlignedAlloc(size);
+}
+
+void Counter::operator delete(void* p) {
+  free(p);
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (const Shard& shard : shards_)
+    total += shard.value.load(std::memory_order_relaxed);
+  return total;
+}
+
+void* Histogram::operator new(size_t size) {
+  return AlignedAlloc(size);
+}
+
+void Histogram::operator delete(void* p) {
+  free(p);
+}
+
+Histogram::Histogram() {
+  for (Shard& shard : shards_) {
+    for (std::atomic<uint64_t>& bucket : shard.buckets)
+      bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+int Histogram::BucketFor(uint64_t value) {
+  const uint64_t sub_buckets = 1 << kSubBucketBits;
+  if (value < sub_buckets)
+    return value;
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent >= kMaxExponent)
+    return kBuckets - 1;
+  int sub_bucket = (value >> (exponent - kSubBucketBits)) & (sub_buckets - 1);
+  return ((exponent - kSubBucketBits + 1) << kSubBucketBits) + sub_bucket;
+}
+
+uint64_t Histogram::BucketStart(int bucket) {
+  const int sub_buckets = 1 << kSubBucketBits;
+  if (bucket < sub_buckets)
+    return bucket;
+  int exponent = (bucket >> kSubBucketBits) + kSubBucketBits - 1;
+  uint64_t sub_bucket = bucket & (sub_buckets - 1);
+  return (sub_buckets + sub_bucket) << (exponent - kSubBucketBits);
+}
+
+void Histogram::Record(uint64_t value) {
+  Shard& shard = shards_[CurrentShard()];
+  shard.count.fetch_add(1, std::memory_order_relaxed);
+  shard.sum.fetch_add(value, std::memory_order_relaxed);
+  shard.buckets[BucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+  uint64_t max = shard.max.load(std::memory_order_relaxed);
+  while (value > max &&
+         !shard.max.compare_exchange_weak(max, value,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::Read(Snapshot* snapshot) const {
+  snapshot->count = 0;
+  snapshot->sum = 0;
+  snapshot->max = 0;
+  for (int i = 0; i < kBuckets; i++)
+    snapshot->buckets[i] = 0;
+  for (const Shard& shard : shards_) {
+    snapshot->count += shard.count.load(std::memory_order_relaxed);
+    snapshot->sum += shard.sum.load(std::memory_order_relaxed);
+    snapshot->max = std::max(snapshot->max,
+                             shard.max.load(std::memory_order_relaxed));
+    for (int i = 0; i < kBuckets; i++)
+      snapshot->buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+  }
+}
+
+uint64_t Histogram::Snapshot::Percentile(double fraction) const {
+  // Shards are read one after another, so the buckets can hold a few more
+  // values than count; rank against what the buckets hold.
+  uint64_t total = 0;
+  for (int i = 0; i < kBuckets; i++)
+    total += buckets[i];
+  if (total == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(fraction * total + 0.5);
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      if (i == kBuckets - 1)
+        return max;
+      return std::min(max, BucketStart(i + 1) - 1);
+    }
+  }
+  return max;
+}
+
+Registry* Registry::Get() {
+  static Registry* registry = new Registry();
+  return registry;
+}
+
+Counter* Registry::GetCounter(const std::string& name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::unique_ptr<Counter>& counter = counters_[name];
+  if (!counter)
+    counter.reset(new Counter());
+  return counter.get();
+}
+
+Gauge* Registry::GetGauge(const std::string& name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::unique_ptr<Gauge>& gauge = gauges_[name];
+  if (!gauge)
+    gauge.reset(new Gauge());
+  return gauge.get();
+}
+
+Histogram* Registry::GetHistogram(const std::string& name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::unique_ptr<Histogram>& histogram = histograms_[name];
+  if (!histogram)
+    histogram.reset(new Histogram());
+  return histogram.get();
+}
+
+std::string Registry::Dump() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::map<std::string, std::string> lines;
+  for (const auto& counter : counters_) {
+    lines[counter.first] = base::StringPrintf(
+        "%llu", static_cast<unsigned long long>(counter.second->value()));
+  }
+  for (const auto& gauge : gauges_) {
+    lines[gauge.first] = base::StringPrintf(
+        "%lld", static_cast<long long>(gauge.second->value()));
+  }
+  Histogram::Snapshot snapshot;
+  for (const auto& histogram : histograms_) {
+    histogram.second->Read(&snapshot);
+    lines[histogram.first] = base::StringPrintf(
+        "count=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu",
+        static_cast<unsigned long long>(snapshot.count),
+        static_cast<unsigned long long>(
+            snapshot.count ? snapshot.sum / snapshot.count : 0),
+        static_cast<unsigned long long>(snapshot.Percentile(0.5)),
+        static_cast<unsigned long long>(snapshot.Percentile(0.9)),
+        static_cast<unsigned long long>(snapshot.Percentile(0.99)),
+        static_cast<unsigned long long>(snapshot.max));
+  }
+  std::string text;
+  for (const auto& line : lines)
+    text += "  " + line.first + " " + line.second + "\n";
+  return text;
+}
+
+}  // namespace metrics
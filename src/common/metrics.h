@@ -0,0 +1,183 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LEDFLASHER_COMMON_METRICS_H_
+#define LEDFLASHER_COMMON_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace metrics {
+
+// Each metric keeps this many copies of its state. A thread records into
+// the copy picked for it on its first record and reads add them up, so
+// threads on different cores seldom write the same cache line.
+const int kShards = 4;
+
+// Which shard the calling thread records into.
+int CurrentShard();
+
+// Shards are aligned to this, so that no two share a cache line.
+const size_t kCacheLineBytes = 64;
+
+// A count that only goes up.
+class Counter {
+ public:
+  void Increment(uint64_t n = 1) {
+    shards_[CurrentShard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t value() const;
+
+  // operator new only guarantees the alignment of the shards from C++17.
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+
+ private:
+  friend class Registry;
+  Counter() = default;
+
+  struct alignas(kCacheLineBytes) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  Shard shards_[kShards];
+
+  DISALLOW_COPY_AND_ASSIGN(Counter);
+};
+
+// A value that is set rather than accumulated.
+class Gauge {
+ public:
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void Add(int64_t delta) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  friend class Registry;
+  Gauge() = default;
+
+  std::atomic<int64_t> value_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(Gauge);
+};
+
+// Distribution of non-negative values, usually microseconds. Buckets are
+// log-linear: 0 to 3 exactly, then four buckets per power of two, so a
+// percentile is within 25% of the true value. Values of 2^40 and over all
+// land in the last bucket.
+class Histogram {
+ public:
+  static const int kSubBucketBits = 2;
+  static const int kMaxExponent = 40;
+  static const int kBuckets =
+      (kMaxExponent - kSubBucketBits + 1) << kSubBucketBits;
+
+  void Record(uint64_t value);
+  void RecordTime(base::TimeDelta time) {
+    Record(time.InMicroseconds() > 0 ? time.InMicroseconds() : 0);
+  }
+
+  // Every shard added up.
+  struct Snapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[kBuckets];
+
+    // Upper bound of the bucket holding the given fraction of values,
+    // capped at max.
+    uint64_t Percentile(double fraction) const;
+  };
+  void Read(Snapshot* snapshot) const;
+
+  static int BucketFor(uint64_t value);
+  // Smallest value in a bucket.
+  static uint64_t BucketStart(int bucket);
+
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+
+ private:
+  friend class Registry;
+  Histogram();
+
+  // Buckets are as wide as count, so a hot bucket cannot wrap first.
+  struct alignas(kCacheLineBytes) Shard {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+    std::atomic<uint64_t> buckets[kBuckets];
+  };
+  Shard shards_[kShards];
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+// Records the time from construction to destruction.
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Histogram* histogram)
+      : histogram_(histogram), start_(base::TimeTicks::Now()) {}
+  ~ScopedTimer() { histogram_->RecordTime(base::TimeTicks::Now() - start_); }
+
+ private:
+  Histogram* histogram_;
+  base::TimeTicks start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTimer);
+};
+
+// Every metric in the process, by name. Modules running together in
+// service_hub share it, so names start with the module's name.
+//
+// Looking a metric up takes a lock and may allocate: do it once, at init,
+// and keep the pointer, which is valid for the life of the process.
+// Recording through it never locks or allocates.
+class Registry {
+ public:
+  static Registry* Get();
+
+  // The metric of that name, created on first use.
+  Counter* GetCounter(const std::string& name);
+  Gauge* GetGauge(const std::string& name);
+  Histogram* GetHistogram(const std::string& name);
+
+  // Every metric, one per line, sorted by name, for dump().
+  std::string Dump() const;
+
+ private:
+  Registry() = default;
+
+  mutable std::mutex lock_;
+  std::map<std::string, std::unique_ptr<Counter>> counters_;
+  std::map<std::string, std::unique_ptr<Gauge>> gauges_;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms_;
+
+  DISALLOW_COPY_AND_ASSIGN(Registry);
+};
+
+}  // namespace metrics
+
+#endif  // LEDFLASHER_COMMON_METRICS_H_
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "service_module.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+#include <binderwrapper/binder_wrapper.h>
+
+namespace service_hub {
+
+namespace {
+
+// Services registered by this process. Only touched from the message loop.
+std::map<std::string, android::sp<android::IBinder>>& LocalServices() {
+  static std::map<std::string, android::sp<android::IBinder>>* services =
+      new std::map<std::string, android::sp<android::IBinder>>();
+  return *services;
+}
+
+const int64_t kFirstRetryMs = 50;
+const int64_t kMaxRetryMs = 1000;
+
+struct BootPhase {
+  const char* module;
+  const char* phase;
+  int64_t boot_ms;
+};
+
+std::mutex& BootPhaseLock() {
+  static std::mutex* lock = new std::mutex();
+  return *lock;
+}
+
+std::vector<BootPhase>& BootPhases() {
+  static std::vector<BootPhase>* phases = new std::vector<BootPhase>();
+  return *phases;
+}
+
+int64_t BootTimeMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+}  // namespace
+
+void ModuleDaemon::AddModule(std::unique_ptr<Module> module) {
+  modules_.push_back(std::move(module));
+}
+
+int ModuleDaemon::OnInit() {
+  int return_code = brillo::Daemon::OnInit();
+  if (return_code != EX_OK)
+    return return_code;
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  android::BinderWrapper::Create();
+  if (!binder_watcher_.Init())
+    return EX_OSERR;
+  for (const auto& module : modules_) {
+    MarkBootPhase(module->name(), "init");
+    return_code = module->OnInit();
+    if (return_code != EX_OK)
+      return return_code;
+  }
+  LOG(INFO) << "Started " << modules_.size() << " modules in "
+            << (base::TimeTicks::Now() - start).InMilliseconds() << " ms, "
+            << ResidentKb() << " kB resident";
+  return EX_OK;
+}
+
+void ModuleDaemon::OnShutdown(int* return_code) {
+  for (auto it = modules_.rbegin(); it != modules_.rend(); ++it)
+    (*it)->OnShutdown();
+  brillo::Daemon::OnShutdown(return_code);
+}
+
+bool RegisterService(const std::string& name,
+                     const android::sp<android::IBinder>& service) {
+  LocalServices()[name] = service;
+  return android::BinderWrapper::Get()->RegisterService(name, service);
+}
+
+android::sp<android::IBinder> GetService(const std::string& name) {
+  auto it = LocalServices().find(name);
+  if (it != LocalServices().end())
+    return it->second;
+  return android::BinderWrapper::Get()->GetService(name);
+}
+
+void WatchService(const android::sp<android::IBinder>& binder,
+                  const base::Closure& on_death) {
+  if (binder->localBinder())
+    return;
+  android::BinderWrapper::Get()->RegisterForDeathNotifications(binder,
+                                                               on_death);
+}
+
+void MarkBootPhase(const char* module, const char* phase) {
+  int64_t boot_ms = BootTimeMs();
+  {
+    std::lock_guard<std::mutex> lock(BootPhaseLock());
+    for (const BootPhase& earlier : BootPhases()) {
+      if (strcmp(earlier.module, module) == 0 &&
+          strcmp(earlier.phase, phase) == 0) {
+        return;
+      }
+    }
+    BootPhases().push_back({module, phase, boot_ms});
+  }
+  LOG(INFO) << "Boot: " << module << " " << phase << " at " << boot_ms
+            << " ms";
+}
+
+std::string BootTimeline() {
+  std::lock_guard<std::mutex> lock(BootPhaseLock());
+  std::string text;
+  for (const BootPhase& phase : BootPhases()) {
+    text += base::StringPrintf("%8lld ms  %s %s\n",
+                               static_cast<long long>(phase.boot_ms),
+                               phase.module, phase.phase);
+  }
+  return text;
+}
+
+base::TimeDelta RetryBackoff::Next() {
+  delay_ = delay_ == base::TimeDelta()
+               ? base::TimeDelta::FromMilliseconds(kFirstRetryMs)
+               : std::min(delay_ * 2,
+                          base::TimeDelta::FromMilliseconds(kMaxRetryMs));
+  return delay_;
+}
+
+int64_t ResidentKb() {
+  FILE* status = fopen("/proc/self/status", "r");
+  if (!status)
+    return -1;
+  char line[128];
+  long long kb = -1;
+  while (fgets(line, sizeof(line), status)) {
+    if (sscanf(line, "VmRSS: %lld kB", &kb) == 1)
+      break;
+  }
+  fclose(status);
+  return kb;
+}
+
+}  // namespace service_hub
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LEDFLASHER_COMMON_SERVICE_MODULE_H_
+#define LEDFLASHER_COMMON_SERVICE_MODULE_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <binder/IBinder.h>
+#include <brillo/binder_watcher.h>
+#include <brillo/daemons/daemon.h>
+#include <utils/StrongPointer.h>
+
+namespace service_hub {
+
+// One service, or client of services, running on a daemon's message loop.
+// Each service's executable runs its module alone; service_hub runs them
+// all in one process, on one loop and one binder connection.
+class Module {
+ public:
+  virtual ~Module() = default;
+
+  // Names the module's steps in the boot timeline.
+  virtual const char* name() const = 0;
+  // Called in the order modules were added, once binder is set up. Any
+  // code other than EX_OK stops the daemon.
+  virtual int OnInit() = 0;
+  // Called in reverse order.
+  virtual void OnShutdown() {}
+};
+
+class ModuleDaemon final : public brillo::Daemon {
+ public:
+  ModuleDaemon() = default;
+
+  void AddModule(std::unique_ptr<Module> module);
+
+ protected:
+  int OnInit() override;
+  void OnShutdown(int* return_code) override;
+
+ private:
+  brillo::BinderWatcher binder_watcher_;
+  std::vector<std::unique_ptr<Module>> modules_;
+
+  DISALLOW_COPY_AND_ASSIGN(ModuleDaemon);
+};
+
+// Registers a service with the service manager, for other processes, and
+// with this process, for GetService().
+bool RegisterService(const std::string& name,
+                     const android::sp<android::IBinder>& service);
+// The service of that name: the object itself if this process registered
+// it, so that interface_cast calls it directly, else a proxy from the
+// service manager. Null if neither has it yet.
+android::sp<android::IBinder> GetService(const std::string& name);
+// Runs on_death when the process serving binder dies. A service in this
+// process lives as long as its caller, so nothing is registered for it.
+void WatchService(const android::sp<android::IBinder>& binder,
+                  const base::Closure& on_death);
+
+// Records that a module reached a step of its startup, timed against
+// CLOCK_BOOTTIME so that the steps of every daemon line up with each other
+// and with init's. Each module marks "ready" once it can serve its first
+// command. Only the first time a step is reached counts. Safe to call from
+// any thread.
+void MarkBootPhase(const char* module, const char* phase);
+// The steps so far, one per line with milliseconds since boot, for dump().
+std::string BootTimeline();
+
+// Delays between attempts to reach a service that is still starting: short
+// at first, so that a client connects soon after the service registers,
+// growing to a second so that it does not spin while the service is down.
+class RetryBackoff {
+ public:
+  RetryBackoff() = default;
+
+  base::TimeDelta Next();
+  void Reset() { delay_ = base::TimeDelta(); }
+
+ private:
+  base::TimeDelta delay_;
+
+  DISALLOW_COPY_AND_ASSIGN(RetryBackoff);
+};
+
+// Resident set size of this process in kB, from /proc; -1 if unknown.
+int64_t ResidentKb();
+
+}  // namespace service_hub
+
+#endif  // LEDFLASHER_COMMON_SERVICE_MODULE_H_
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define ATRACE_TAG ATRACE_TAG_APP
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include <cutils/trace.h>
+
+namespace trace {
+
+namespace {
+
+std::atomic<uint32_t> next_sequence{0};
+
+}  // anonymous namespace
+
+int64_t NewCorrelationId() {
+  uint32_t sequence = next_sequence.fetch_add(1, std::memory_order_relaxed);
+  return (static_cast<int64_t>(getpid()) << 32) | (sequence + 1);
+}
+
+bool Enabled() {
+  return ATRACE_ENABLED();
+}
+
+ScopedSpan::ScopedSpan(const char* name) : active_(Enabled()) {
+  if (active_)
+    atrace_begin(ATRACE_TAG, name);
+}
+
+ScopedSpan::ScopedSpan(const char* name, int64_t correlation_id,
+                       const char* detail)
+    : active_(Enabled()) {
+  if (!active_)
+    return;
+  // atrace truncates labels to this length anyway.
+  char label[1024];
+  int length = snprintf(label, sizeof(label), "%s", name);
+  if (correlation_id && length < static_cast<int>(sizeof(label))) {
+    length += snprintf(label + length, sizeof(label) - length, " #%llx",
+                       static_cast<unsigned long long>(correlation_id));
+  }
+  if (detail && length < static_cast<int>(sizeof(label)))
+    snprintf(label + length, sizeof(label) - length, " %s", detail);
+  atrace_begin(ATRACE_TAG, label);
+}
+
+ScopedSpan::~ScopedSpan() {
+  if (active_)
+    atrace_end(ATRACE_TAG);
+}
+
+}  // namespace trace
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LEDFLASHER_COMMON_TRACE_H_
+#define LEDFLASHER_COMMON_TRACE_H_
+
+#include <stdint.h>
+
+#include <base/macros.h>
+
+namespace trace {
+
+// A new id for following one command through several processes: the pid
+// in the high half, a sequence number in the low half. 0 means no id.
+int64_t NewCorrelationId();
+
+// Whether spans are being recorded. One load.
+bool Enabled();
+
+// Marks the time from construction to destruction as a span of the
+// calling thread in systrace. Spans nest. They go to the ftrace
+// trace_marker through atrace, under the app tag. That tag is matched
+// against the whole of /proc/self/cmdline and needs ro.debuggable, so on
+// a debuggable build record them with
+//   atrace -a /system/bin/ledflasher,/system/bin/ledservice
+// (or -a /system/bin/service_hub).
+// When that is off, a span costs one load and writes nothing.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const char* name);
+  // Labels the span "name #<correlation_id in hex> detail"; either can be
+  // left out with 0 or null.
+  ScopedSpan(const char* name, int64_t correlation_id,
+             const char* detail = nullptr);
+  ~ScopedSpan();
+
+ private:
+  bool active_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedSpan);
+};
+
+}  // namespace trace
+
+#endif  // LEDFLASHER_COMMON_TRACE_H_
@@ -1,17 +1,109 @@
 LOCAL_PATH := $(call my-dir)
 
+# Brillo service, as a library for service_hub
+include $(CLEAR_VARS)
+LOCAL_MODULE := libhome_cloud_service
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+LOCAL_SRC_FILES := \
+    gpio_watcher.cpp \
+    home_cloud_service.cpp \
+    iio_buffer_reader.cpp \
+    iio_sensor_source.cpp \
+    orientation_filter.cpp \
+    replay_sensor_source.cpp \
+    rules_engine.cpp \
+    sample_store.cpp \
+    sensor_collector.cpp \
+    sensor_query_service.cpp \
+    sensor_recording.cpp \
+    sensor_source.cpp \
+    state_reporter.cpp \
+    time_series_codec.cpp \
+    window_aggregator.cpp
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_SHARED_LIBRARIES := \
+    libbinder \
+    libbinderwrapper \
+    libbrillo \
+    libbrillo-binder \
+    libchrome \
+    libsensor \
+    libutils \
+    libweaved
+LOCAL_STATIC_LIBRARIES := \
+    libledservice-common \
+    libmp3-player-service
+include $(BUILD_STATIC_LIBRARY)
+
+
 # Brillo service
 include $(CLEAR_VARS)
 LOCAL_MODULE := home_cloud_service
+LOCAL_INIT_RC := home_cloud_service.rc
+LOCAL_REQUIRED_MODULES := home_cloud.json rules.conf
 ifdef BRILLO
 LOCAL_MODULE_TAGS := eng
 endif
-LOCAL_SRC_FILES := home_cloud_service.cpp
-LOCAL_CFLAGS := -Wno-unused-parameter
-LOCAL_SHARED_LIBRARIES := libsensor
+LOCAL_SRC_FILES := main.cpp
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_SHARED_LIBRARIES := \
+    libbinder \
+    libbinderwrapper \
+    libbrillo \
+    libbrillo-binder \
+    libchrome \
+    libsensor \
+    libutils \
+    libweaved
+LOCAL_STATIC_LIBRARIES := \
+    libhome_cloud_service \
+    libledservice-common \
+    libmp3-player-service
 include $(BUILD_EXECUTABLE)
 
 
+# Weave schema files
+include $(CLEAR_VARS)
+LOCAL_MODULE := home_cloud.json
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)/weaved/traits
+LOCAL_SRC_FILES := etc/weaved/traits/$(LOCAL_MODULE)
+include $(BUILD_PREBUILT)
+
+
+# Rules
+include $(CLEAR_VARS)
+LOCAL_MODULE := rules.conf
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)/home_cloud
+LOCAL_SRC_FILES := etc/home_cloud/$(LOCAL_MODULE)
+include $(BUILD_PREBUILT)
+
+
+# Host benchmarks
+include $(CLEAR_VARS)
+LOCAL_MODULE := home_cloud_bench
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+    home_cloud_bench.cpp \
+    iio_buffer_reader.cpp \
+    orientation_filter.cpp \
+    rules_engine.cpp \
+    sample_store.cpp \
+    sensor_recording.cpp \
+    sensor_source.cpp \
+    time_series_codec.cpp \
+    window_aggregator.cpp
+# The sensor event and type definitions are plain headers.
+LOCAL_C_INCLUDES := \
+    $(TOP)/frameworks/native/include \
+    $(TOP)/hardware/libhardware/include \
+    $(TOP)/system/core/include
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_SHARED_LIBRARIES := libchrome
+include $(BUILD_HOST_EXECUTABLE)
+
+
 # TEST APP
 include $(CLEAR_VARS)
 LOCAL_C_INCLUDES:= external/tinyalsa/include \
@@ -19,6 +111,7 @@ LOCAL_C_INCLUDES:= external/tinyalsa/include \
   $(TOP)/frameworks/native/include/media/openmax \
   $(TOP)/device/generic/brillo/pts/audio/common
 LOCAL_SRC_FILES:= \
+    gpio_bench.cpp \
     include/peripherals/gpio/gpio.cpp \
     hc_test.cpp
 LOCAL_MODULE := home_cloud_test
@@ -27,3 +120,15 @@ LOCAL_SHARED_LIBRARIES:= libcutils libutils libtinyalsa libbrillo libbase \
     libmedia
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_EXECUTABLE)
+
+# Host build of the test app, for running the GPIO benchmark against a fake
+# sysfs directory: home_cloud_test b --fake
+include $(CLEAR_VARS)
+LOCAL_MODULE := home_cloud_test
+LOCAL_SRC_FILES := \
+    gpio_bench.cpp \
+    include/peripherals/gpio/gpio.cpp \
+    hc_test.cpp
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_MODULE_HOST_OS := linux
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_DURATION_H_
+#define HOME_CLOUD_SERVICE_DURATION_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <limits>
+#include <string>
+
+namespace home_cloud {
+
+// Parses a positive duration such as 500ms, 10s, 5m or 1h into
+// microseconds, as used by the flags and the rules file alike.
+inline bool ParseDuration(const std::string& text, int64_t* us) {
+  char* end = nullptr;
+  long long value = strtoll(text.c_str(), &end, 10);
+  if (end == text.c_str() || value <= 0)
+    return false;
+  std::string unit(end);
+  int64_t scale;
+  if (unit == "ms")
+    scale = 1000;
+  else if (unit == "s")
+    scale = 1000000;
+  else if (unit == "m")
+    scale = 60 * 1000000LL;
+  else if (unit == "h")
+    scale = 3600 * 1000000LL;
+  else
+    return false;
+  if (value > std::numeric_limits<int64_t>::max() / scale)
+    return false;
+  *us = value * scale;
+  return true;
+}
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_DURATION_H_
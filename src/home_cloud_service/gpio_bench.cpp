@@ -0,0 +1,521 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "gpio_bench.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__has_include)
+#if __has_include(<linux/gpio.h>)
+#include <linux/gpio.h>
+#endif
+#endif
+
+namespace home_cloud {
+
+namespace {
+
+// Writes between clock reads while toggling flat out.
+const int kToggleBurst = 64;
+
+int64_t NowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool WriteFile(const std::string& path, const std::string& value) {
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool ok = write(fd, value.data(), value.size()) ==
+            static_cast<ssize_t>(value.size());
+  close(fd);
+  return ok;
+}
+
+bool ReadFile(const std::string& path, std::string* value) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  char buffer[64];
+  ssize_t size = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  if (size <= 0)
+    return false;
+  value->assign(buffer, size);
+  return true;
+}
+
+bool CreateEmptyFile(const std::string& path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+
+// Exports each pin as an output through sysfs.
+bool ExportOutputs(const std::string& root, const std::vector<int>& pins) {
+  for (int pin : pins) {
+    // Already exported pins refuse a second export; that is fine.
+    WriteFile(root + "/export", std::to_string(pin));
+    if (!WriteFile(root + "/gpio" + std::to_string(pin) + "/direction",
+                   "out")) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Opens, writes and closes the value file every time, as WriteGPIO() does.
+class SysfsReopenBackend : public GpioBackend {
+ public:
+  explicit SysfsReopenBackend(const std::string& root) : root_(root) {}
+
+  const char* name() const override { return "sysfs-reopen"; }
+
+  bool Open(const std::vector<int>& pins) override {
+    if (!ExportOutputs(root_, pins))
+      return false;
+    paths_.clear();
+    for (int pin : pins)
+      paths_.push_back(root_ + "/gpio" + std::to_string(pin) + "/value");
+    pin_count_ = pins.size();
+    return true;
+  }
+
+  bool Write(size_t index, bool high) override {
+    int fd = open(paths_[index].c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    bool ok = write(fd, high ? "1" : "0", 1) == 1;
+    close(fd);
+    return ok;
+  }
+
+ private:
+  std::string root_;
+  std::vector<std::string> paths_;
+};
+
+// Keeps each value file open and rewrites it from the start.
+class SysfsFdBackend : public GpioBackend {
+ public:
+  explicit SysfsFdBackend(const std::string& root) : root_(root) {}
+  ~SysfsFdBackend() override { Close(); }
+
+  const char* name() const override { return "sysfs-fd"; }
+
+  bool Open(const std::vector<int>& pins) override {
+    Close();
+    if (!ExportOutputs(root_, pins))
+      return false;
+    for (int pin : pins) {
+      std::string path = root_ + "/gpio" + std::to_string(pin) + "/value";
+      int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+      if (fd < 0) {
+        Close();
+        return false;
+      }
+      fds_.push_back(fd);
+    }
+    pin_count_ = pins.size();
+    return true;
+  }
+
+  bool Write(size_t index, bool high) override {
+    return pwrite(fds_[index], high ? "1" : "0", 1, 0) == 1;
+  }
+
+ private:
+  void Close() {
+    for (int fd : fds_)
+      close(fd);
+    fds_.clear();
+  }
+
+  std::string root_;
+  std::vector<int> fds_;
+};
+
+#if defined(GPIOHANDLE_SET_LINE_VALUES_IOCTL)
+// The GPIO character device: one line handle per chip, which sets all of
+// its lines in a single ioctl.
+class ChardevBackend : public GpioBackend {
+ public:
+  ChardevBackend(const std::string& sysfs_root, const std::string& dev_root)
+      : sysfs_root_(sysfs_root), dev_root_(dev_root) {}
+  ~ChardevBackend() override { Close(); }
+
+  const char* name() const override { return "chardev"; }
+
+  bool Open(const std::vector<int>& pins) override {
+    Close();
+    for (int pin : pins) {
+      std::string device;
+      int offset = 0;
+      if (!FindLine(pin, &device, &offset)) {
+        Close();
+        return false;
+      }
+      auto chip = std::find_if(
+          chips_.begin(), chips_.end(),
+          [&device](const Chip& chip) { return chip.device == device; });
+      if (chip == chips_.end()) {
+        chips_.push_back(Chip());
+        chip = chips_.end() - 1;
+        chip->device = device;
+        memset(&chip->values, 0, sizeof(chip->values));
+      }
+      if (chip->offsets.size() == GPIOHANDLES_MAX) {
+        Close();
+        return false;
+      }
+      lines_.push_back(std::make_pair(chip - chips_.begin(),
+                                      chip->offsets.size()));
+      chip->offsets.push_back(offset);
+    }
+    for (Chip& chip : chips_) {
+      int chip_fd = open(chip.device.c_str(), O_RDWR | O_CLOEXEC);
+      if (chip_fd < 0) {
+        Close();
+        return false;
+      }
+      struct gpiohandle_request request;
+      memset(&request, 0, sizeof(request));
+      std::copy(chip.offsets.begin(), chip.offsets.end(),
+                request.lineoffsets);
+      request.lines = chip.offsets.size();
+      request.flags = GPIOHANDLE_REQUEST_OUTPUT;
+      strncpy(request.consumer_label, "hc_test",
+              sizeof(request.consumer_label) - 1);
+      int rc = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &request);
+      close(chip_fd);
+      if (rc < 0) {
+        Close();
+        return false;
+      }
+      chip.fd = request.fd;
+    }
+    pin_count_ = pins.size();
+    return true;
+  }
+
+  bool Write(size_t index, bool high) override {
+    Chip& chip = chips_[lines_[index].first];
+    chip.values.values[lines_[index].second] = high;
+    return ioctl(chip.fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &chip.values) >= 0;
+  }
+
+  bool WriteAll(bool high) override {
+    for (Chip& chip : chips_) {
+      memset(chip.values.values, high, chip.offsets.size());
+      if (ioctl(chip.fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &chip.values) < 0)
+        return false;
+    }
+    return true;
+  }
+
+  bool atomic_write_all() const override { return chips_.size() == 1; }
+
+ private:
+  struct Chip {
+    std::string device;
+    std::vector<uint32_t> offsets;
+    struct gpiohandle_data values;
+    int fd{-1};
+  };
+
+  // The character device and line of a pin in sysfs numbering: sysfs lists
+  // each chip as gpiochip<base>, with the character device's name under
+  // its device directory.
+  bool FindLine(int pin, std::string* device, int* offset) const {
+    DIR* dir = opendir(sysfs_root_.c_str());
+    if (!dir)
+      return false;
+    bool found = false;
+    while (struct dirent* entry = readdir(dir)) {
+      if (strncmp(entry->d_name, "gpiochip", 8) != 0)
+        continue;
+      std::string chip = sysfs_root_ + "/" + entry->d_name;
+      std::string base, ngpio;
+      if (!ReadFile(chip + "/base", &base) ||
+          !ReadFile(chip + "/ngpio", &ngpio)) {
+        continue;
+      }
+      int first = atoi(base.c_str());
+      if (pin < first || pin >= first + atoi(ngpio.c_str()))
+        continue;
+      DIR* chip_dir = opendir((chip + "/device").c_str());
+      if (!chip_dir)
+        break;
+      while (struct dirent* child = readdir(chip_dir)) {
+        if (strncmp(child->d_name, "gpiochip", 8) == 0) {
+          *device = dev_root_ + "/" + child->d_name;
+          *offset = pin - first;
+          found = true;
+          break;
+        }
+      }
+      closedir(chip_dir);
+      break;
+    }
+    closedir(dir);
+    return found;
+  }
+
+  void Close() {
+    for (Chip& chip : chips_) {
+      if (chip.fd >= 0)
+        close(chip.fd);
+    }
+    chips_.clear();
+    lines_.clear();
+  }
+
+  std::string sysfs_root_;
+  std::string dev_root_;
+  std::vector<Chip> chips_;
+  // Chip and line within its handle of each pin.
+  std::vector<std::pair<size_t, size_t>> lines_;
+};
+#endif  // GPIOHANDLE_SET_LINE_VALUES_IOCTL
+
+int64_t Percentile(const std::vector<int64_t>& sorted, double fraction) {
+  size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Mean, percentiles and a log2 histogram of durations, as JSON members.
+void PrintDistribution(std::vector<int64_t>* samples, FILE* out) {
+  std::sort(samples->begin(), samples->end());
+  int64_t sum = 0;
+  int buckets[64] = {0};
+  int top_bucket = 0;
+  for (int64_t ns : *samples) {
+    sum += ns;
+    int bucket = 0;
+    while (bucket < 63 && (2LL << bucket) <= ns)
+      bucket++;
+    buckets[bucket]++;
+    top_bucket = std::max(top_bucket, bucket);
+  }
+  fprintf(out,
+          "\"mean_ns\":%lld,\"min_ns\":%lld,\"p50_ns\":%lld,\"p90_ns\":%lld,"
+          "\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld,",
+          static_cast<long long>(sum / static_cast<int64_t>(samples->size())),
+          static_cast<long long>(samples->front()),
+          static_cast<long long>(Percentile(*samples, 0.5)),
+          static_cast<long long>(Percentile(*samples, 0.9)),
+          static_cast<long long>(Percentile(*samples, 0.99)),
+          static_cast<long long>(Percentile(*samples, 0.999)),
+          static_cast<long long>(samples->back()));
+  // Bucket i counts durations in [2^i, 2^(i+1)) ns.
+  fprintf(out, "\"log2_ns_histogram\":[");
+  for (int bucket = 0; bucket <= top_bucket; bucket++)
+    fprintf(out, "%s%d", bucket ? "," : "", buckets[bucket]);
+  fprintf(out, "]");
+}
+
+bool RunToggle(GpioBackend* backend, const GpioBenchOptions& options,
+               FILE* out) {
+  bool high = false;
+  uint64_t writes = 0;
+  int64_t start = NowNs();
+  int64_t end = start + static_cast<int64_t>(options.toggle_seconds * 1e9);
+  int64_t now;
+  do {
+    for (int i = 0; i < kToggleBurst; i++) {
+      high = !high;
+      if (!backend->Write(0, high))
+        return false;
+    }
+    writes += kToggleBurst;
+    now = NowNs();
+  } while (now < end);
+  double seconds = (now - start) / 1e9;
+  fprintf(out,
+          "{\"backend\":\"%s\",\"test\":\"toggle\",\"pin\":%d,"
+          "\"seconds\":%.3f,\"writes\":%llu,\"writes_per_s\":%.0f,"
+          "\"toggle_hz\":%.0f}\n",
+          backend->name(), options.pins[0], seconds,
+          static_cast<unsigned long long>(writes), writes / seconds,
+          writes / seconds / 2);
+  return true;
+}
+
+bool RunLatency(GpioBackend* backend, const GpioBenchOptions& options,
+                FILE* out) {
+  std::vector<int64_t> latencies(options.latency_writes);
+  bool high = false;
+  for (int64_t& latency : latencies) {
+    high = !high;
+    int64_t start = NowNs();
+    if (!backend->Write(0, high))
+      return false;
+    latency = NowNs() - start;
+  }
+  fprintf(out,
+          "{\"backend\":\"%s\",\"test\":\"latency\",\"pin\":%d,"
+          "\"writes\":%zu,",
+          backend->name(), options.pins[0], latencies.size());
+  PrintDistribution(&latencies, out);
+  fprintf(out, "}\n");
+  return true;
+}
+
+// Skew is how long the first and last pin disagree: from the first pin
+// being set until the last one is, or nothing when one operation sets
+// them all.
+bool RunSkew(GpioBackend* backend, const GpioBenchOptions& options,
+             FILE* out) {
+  const size_t pins = options.pins.size();
+  std::vector<int64_t> skews(options.skew_rounds);
+  std::vector<int64_t> calls(options.skew_rounds);
+  bool high = false;
+  for (size_t round = 0; round < skews.size(); round++) {
+    high = !high;
+    int64_t start = NowNs();
+    if (backend->atomic_write_all()) {
+      if (!backend->WriteAll(high))
+        return false;
+      skews[round] = 0;
+    } else {
+      if (!backend->Write(0, high))
+        return false;
+      int64_t first = NowNs();
+      for (size_t i = 1; i < pins; i++) {
+        if (!backend->Write(i, high))
+          return false;
+      }
+      skews[round] = NowNs() - first;
+    }
+    calls[round] = NowNs() - start;
+  }
+  fprintf(out,
+          "{\"backend\":\"%s\",\"test\":\"skew\",\"pins\":%zu,"
+          "\"rounds\":%zu,\"atomic\":%s,",
+          backend->name(), pins, skews.size(),
+          backend->atomic_write_all() ? "true" : "false");
+  PrintDistribution(&skews, out);
+  std::sort(calls.begin(), calls.end());
+  fprintf(out, ",\"set_all_p50_ns\":%lld}\n",
+          static_cast<long long>(Percentile(calls, 0.5)));
+  return true;
+}
+
+}  // namespace
+
+bool GpioBackend::WriteAll(bool high) {
+  for (size_t i = 0; i < pin_count_; i++) {
+    if (!Write(i, high))
+      return false;
+  }
+  return true;
+}
+
+std::vector<std::unique_ptr<GpioBackend>> CreateGpioBackends(
+    const GpioBenchOptions& options) {
+  std::vector<std::unique_ptr<GpioBackend>> backends;
+  backends.emplace_back(new SysfsReopenBackend(options.sysfs_root));
+  backends.emplace_back(new SysfsFdBackend(options.sysfs_root));
+#if defined(GPIOHANDLE_SET_LINE_VALUES_IOCTL)
+  backends.emplace_back(
+      new ChardevBackend(options.sysfs_root, options.dev_root));
+#endif
+  return backends;
+}
+
+bool RunGpioBench(const GpioBenchOptions& options, FILE* out) {
+  if (options.pins.empty() || options.latency_writes == 0 ||
+      options.skew_rounds == 0) {
+    return false;
+  }
+  struct utsname host;
+  if (uname(&host) != 0)
+    memset(&host, 0, sizeof(host));
+  fprintf(out,
+          "{\"test\":\"info\",\"host\":\"%s\",\"machine\":\"%s\","
+          "\"kernel\":\"%s\",\"sysfs_root\":\"%s\",\"pins\":[",
+          host.nodename, host.machine, host.release,
+          options.sysfs_root.c_str());
+  for (size_t i = 0; i < options.pins.size(); i++)
+    fprintf(out, "%s%d", i ? "," : "", options.pins[i]);
+  fprintf(out, "]}\n");
+
+  bool any = false;
+  for (const auto& backend : CreateGpioBackends(options)) {
+    if (!backend->Open(options.pins)) {
+      fprintf(out, "{\"backend\":\"%s\",\"available\":false}\n",
+              backend->name());
+      continue;
+    }
+    if (!RunToggle(backend.get(), options, out) ||
+        !RunLatency(backend.get(), options, out) ||
+        !RunSkew(backend.get(), options, out)) {
+      fprintf(out, "{\"backend\":\"%s\",\"error\":\"%s\"}\n",
+              backend->name(), strerror(errno));
+      continue;
+    }
+    any = true;
+  }
+  fflush(out);
+  return any;
+}
+
+bool CreateFakeGpioSysfs(const std::string& root,
+                         const std::vector<int>& pins) {
+  if (mkdir(root.c_str(), 0755) != 0 && errno != EEXIST)
+    return false;
+  if (!CreateEmptyFile(root + "/export"))
+    return false;
+  for (int pin : pins) {
+    std::string dir = root + "/gpio" + std::to_string(pin);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+    for (const char* file : {"direction", "value", "edge"}) {
+      if (!CreateEmptyFile(dir + "/" + file))
+        return false;
+    }
+  }
+  return true;
+}
+
+void RemoveFakeGpioSysfs(const std::string& root,
+                         const std::vector<int>& pins) {
+  for (int pin : pins) {
+    std::string dir = root + "/gpio" + std::to_string(pin);
+    for (const char* file : {"direction", "value", "edge"})
+      unlink((dir + "/" + file).c_str());
+    rmdir(dir.c_str());
+  }
+  unlink((root + "/export").c_str());
+  rmdir(root.c_str());
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_GPIO_BENCH_H_
+#define HOME_CLOUD_SERVICE_GPIO_BENCH_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace home_cloud {
+
+// One way of driving output pins.
+class GpioBackend {
+ public:
+  virtual ~GpioBackend() {}
+
+  virtual const char* name() const = 0;
+  // Claims the pins as outputs. Returns false if this backend cannot drive
+  // them here.
+  virtual bool Open(const std::vector<int>& pins) = 0;
+  // Sets the pin at index into the pins passed to Open().
+  virtual bool Write(size_t index, bool high) = 0;
+  // Sets every pin, as close together as the backend allows.
+  virtual bool WriteAll(bool high);
+  // Whether WriteAll() sets every pin in one operation.
+  virtual bool atomic_write_all() const { return false; }
+
+ protected:
+  size_t pin_count_{0};
+};
+
+struct GpioBenchOptions {
+  // /sys/class/gpio and /dev on a board.
+  std::string sysfs_root;
+  std::string dev_root;
+  std::vector<int> pins;
+  // How long to toggle a pin for, flat out.
+  double toggle_seconds;
+  // Writes timed one by one, and rounds of setting every pin.
+  size_t latency_writes;
+  size_t skew_rounds;
+};
+
+// Every backend this build has, whether or not it can drive pins here:
+// sysfs opening the value file for each write, as WriteGPIO() does; sysfs
+// keeping it open; and the GPIO character device where the kernel has it.
+std::vector<std::unique_ptr<GpioBackend>> CreateGpioBackends(
+    const GpioBenchOptions& options);
+
+// For each backend: the sustained toggle rate of the first pin, the
+// latency distribution of single writes and the skew between the first
+// and last pin when setting all of them. Writes one JSON object per line.
+// Returns false if no backend could drive the pins.
+bool RunGpioBench(const GpioBenchOptions& options, FILE* out);
+
+// Lays out a sysfs GPIO directory under root with the pins already
+// exported, for running the benchmark off a board.
+bool CreateFakeGpioSysfs(const std::string& root, const std::vector<int>& pins);
+// Removes what CreateFakeGpioSysfs() laid out.
+void RemoveFakeGpioSysfs(const std::string& root, const std::vector<int>& pins);
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_GPIO_BENCH_H_
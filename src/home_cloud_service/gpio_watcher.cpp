@@ -0,0 +1,151 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "gpio_watcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <base/logging.h>
+
+namespace home_cloud {
+
+namespace {
+bool WriteFile(const std::string& path, const std::string& value) {
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool ok = write(fd, value.data(), value.size()) ==
+            static_cast<ssize_t>(value.size());
+  close(fd);
+  return ok;
+}
+
+// The pin's value, from the start of its value file; -1 on error.
+int ReadValue(int fd) {
+  char value;
+  if (pread(fd, &value, 1, 0) != 1)
+    return -1;
+  return value == '0' ? 0 : 1;
+}
+
+int64_t BootTimeMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_BOOTTIME, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+}  // anonymous namespace
+
+GpioWatcher::GpioWatcher(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+    const EdgeCallback& callback, const std::string& sysfs_root)
+    : task_runner_(task_runner),
+      callback_(callback),
+      sysfs_root_(sysfs_root) {}
+
+GpioWatcher::~GpioWatcher() {
+  Stop();
+}
+
+bool GpioWatcher::Start(const std::vector<int>& pins) {
+  Stop();
+  for (int pin : pins) {
+    std::string dir = sysfs_root_ + "/gpio" + std::to_string(pin);
+    // Already exported pins refuse a second export; that is fine.
+    WriteFile(sysfs_root_ + "/export", std::to_string(pin));
+    if (!WriteFile(dir + "/direction", "in") ||
+        !WriteFile(dir + "/edge", "both")) {
+      LOG(WARNING) << "GPIO " << pin << " cannot interrupt on edges";
+      continue;
+    }
+    int fd = open((dir + "/value").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      PLOG(WARNING) << "Failed to open GPIO " << pin;
+      continue;
+    }
+    // Reading clears the pending edge, so the first poll waits for a new
+    // one.
+    ReadValue(fd);
+    pins_.push_back(pin);
+    fds_.push_back(fd);
+  }
+  if (fds_.empty())
+    return false;
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0) {
+    PLOG(ERROR) << "eventfd";
+    Stop();
+    return false;
+  }
+  stopping_ = false;
+  thread_ = std::thread(&GpioWatcher::Run, this);
+  LOG(INFO) << "Watching " << fds_.size() << " GPIO pins";
+  return true;
+}
+
+void GpioWatcher::Stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) != sizeof(one))
+      PLOG(WARNING) << "Failed to wake the GPIO thread";
+    thread_.join();
+  }
+  if (stop_fd_ >= 0)
+    close(stop_fd_);
+  stop_fd_ = -1;
+  for (int fd : fds_)
+    close(fd);
+  fds_.clear();
+  pins_.clear();
+}
+
+void GpioWatcher::Run() {
+  // sysfs signals an edge with POLLPRI and POLLERR on the value file.
+  std::vector<struct pollfd> fds(fds_.size() + 1);
+  for (size_t i = 0; i < fds_.size(); i++)
+    fds[i] = {fds_[i], POLLPRI | POLLERR, 0};
+  fds.back() = {stop_fd_, POLLIN, 0};
+  while (!stopping_) {
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      PLOG(ERROR) << "poll";
+      break;
+    }
+    if (fds.back().revents)
+      continue;
+    int64_t timestamp = BootTimeMicros();
+    for (size_t i = 0; i < fds_.size(); i++) {
+      if (!fds[i].revents)
+        continue;
+      int value = ReadValue(fds_[i]);
+      if (value >= 0) {
+        task_runner_->PostTask(
+            FROM_HERE, base::Bind(callback_, pins_[i], value, timestamp));
+      }
+    }
+  }
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_GPIO_WATCHER_H_
+#define HOME_CLOUD_SERVICE_GPIO_WATCHER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/memory/ref_counted.h>
+#include <base/single_thread_task_runner.h>
+
+namespace home_cloud {
+
+// Watches GPIO input pins through sysfs and reports every change of value
+// on the owner's message loop. The kernel wakes a thread of ours on each
+// edge, so nothing polls the pins.
+class GpioWatcher {
+ public:
+  // timestamp is microseconds since boot, taken as the edge woke us.
+  using EdgeCallback =
+      base::Callback<void(int pin, int value, int64_t timestamp)>;
+
+  // sysfs_root is /sys/class/gpio on a device.
+  GpioWatcher(scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+              const EdgeCallback& callback, const std::string& sysfs_root);
+  ~GpioWatcher();
+
+  // Exports the pins as inputs interrupting on both edges. Returns false
+  // if none of them can be watched.
+  bool Start(const std::vector<int>& pins);
+  void Stop();
+
+ private:
+  void Run();
+
+  scoped_refptr<base::SingleThreadTaskRunner> task_runner_;
+  EdgeCallback callback_;
+  std::string sysfs_root_;
+  std::vector<int> pins_;
+  // The value file of each pin.
+  std::vector<int> fds_;
+
+  std::thread thread_;
+  int stop_fd_{-1};
+  std::atomic<bool> stopping_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(GpioWatcher);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_GPIO_WATCHER_H_
@@ -1,9 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <unistd.h>
 
+#include "gpio_bench.h"
 #include "include/peripherals/gpio/gpio.h"
 
 void TestGPIO();
+bool BenchGPIO(int argc, char** argv);
 
 
 /**
@@ -14,8 +19,17 @@ int main(int argc, char** argv) {
     printf("Usage: hc-test test1 [... testN]\n");
     printf(" Options:\n");
     printf("  g - test GPIO\n");
+    printf("  b - benchmark GPIO backends, one JSON object per line\n");
+    printf("      --sysfs_root=DIR  sysfs GPIO directory (/sys/class/gpio)\n");
+    printf("      --dev_root=DIR    where the gpiochip devices are (/dev)\n");
+    printf("      --pins=N,N,...    pins to drive (pins A..D)\n");
+    printf("      --seconds=S       how long to toggle for (2)\n");
+    printf("      --writes=N        single writes to time (100000)\n");
+    printf("      --rounds=N        rounds of setting every pin (10000)\n");
+    printf("      --fake            run against a fake sysfs directory\n");
     printf(" Example: \n");
     printf("  hc-test g \n");
+    printf("  hc-test b --fake\n");
   }
 
   for (int i=1; i < argc; i++) {
@@ -24,6 +38,8 @@ int main(int argc, char** argv) {
     // Run the tests as issued
     if (mode == 'g')
       TestGPIO();
+    else if (mode == 'b')
+      return BenchGPIO(argc - i - 1, argv + i + 1) ? 0 : 1;
   }
 }
 
@@ -44,3 +60,81 @@ void TestGPIO() {
     isOn = !isOn;
   }
 }
+
+/**
+ * Benchmarks each way of driving the GPIO pins. Takes the rest of the
+ * command line as options.
+ */
+bool BenchGPIO(int argc, char** argv) {
+  home_cloud::GpioBenchOptions options;
+  options.sysfs_root = "/sys/class/gpio";
+  options.dev_root = "/dev";
+  options.pins = {GPIO::PIN_A, GPIO::PIN_B, GPIO::PIN_C, GPIO::PIN_D};
+  options.toggle_seconds = 2;
+  options.latency_writes = 100000;
+  options.skew_rounds = 10000;
+  bool fake = false;
+  bool sysfs_root_set = false;
+
+  for (int i = 0; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+    value = value ? value + 1 : "";
+    if (strncmp(arg, "--sysfs_root=", 13) == 0) {
+      options.sysfs_root = value;
+      sysfs_root_set = true;
+    } else if (strncmp(arg, "--dev_root=", 11) == 0) {
+      options.dev_root = value;
+    } else if (strncmp(arg, "--pins=", 7) == 0) {
+      options.pins.clear();
+      for (const char* pin = value; *pin;) {
+        char* end;
+        long number = strtol(pin, &end, 10);
+        if (end == pin || (*end && *end != ',')) {
+          fprintf(stderr, "Bad pin list %s\n", value);
+          return false;
+        }
+        options.pins.push_back(number);
+        pin = *end ? end + 1 : end;
+      }
+    } else if (strncmp(arg, "--seconds=", 10) == 0) {
+      options.toggle_seconds = atof(value);
+    } else if (strncmp(arg, "--writes=", 9) == 0) {
+      options.latency_writes = strtoul(value, nullptr, 10);
+    } else if (strncmp(arg, "--rounds=", 9) == 0) {
+      options.skew_rounds = strtoul(value, nullptr, 10);
+    } else if (strcmp(arg, "--fake") == 0) {
+      fake = true;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", arg);
+      return false;
+    }
+  }
+
+  if (options.pins.empty()) {
+    fprintf(stderr, "No pins to drive\n");
+    return false;
+  }
+
+  if (fake) {
+    if (!sysfs_root_set) {
+      char dir[] = "/tmp/hc_test_gpio.XXXXXX";
+      if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return false;
+      }
+      options.sysfs_root = dir;
+    }
+    if (!home_cloud::CreateFakeGpioSysfs(options.sysfs_root, options.pins)) {
+      fprintf(stderr, "Cannot create %s\n", options.sysfs_root.c_str());
+      return false;
+    }
+  }
+
+  bool ok = home_cloud::RunGpioBench(options, stdout);
+  if (!ok)
+    fprintf(stderr, "No GPIO backend could drive the pins\n");
+  if (fake)
+    home_cloud::RemoveFakeGpioSysfs(options.sysfs_root, options.pins);
+  return ok;
+}
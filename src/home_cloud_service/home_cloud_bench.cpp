@@ -0,0 +1,842 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host benchmarks for the home_cloud_service sensor pipeline.
+//
+//   home_cloud_bench aggregate [rate_hz] [seconds] [batch]
+//     Feeds synthetic three-axis samples through WindowAggregator in
+//     drain-sized batches, with tumbling windows only, sliding windows only
+//     and both, and reports samples per second on one core.
+//
+//   home_cloud_bench synthesize <recording> [seconds]
+//     Writes a recording of an accelerometer at 100 Hz, a light sensor at
+//     5 Hz and a thermometer at 1 Hz, for hosts without a real one.
+//
+//   home_cloud_bench replay <recording> [repeat]
+//     Feeds a recording made with home_cloud_service --record through the
+//     sample store and the window aggregator in drain-sized batches, as
+//     fast as they take it, and reports the speed as a multiple of real
+//     time.
+//
+//   home_cloud_bench iio [records]
+//     Lays out a fake BMP085 IIO device under /tmp, a sysfs directory and a
+//     file of buffer records standing in for /dev/iio:deviceN, checks that
+//     IioBufferReader decodes every record, and compares its speed with
+//     reading the same values from sysfs attributes one at a time.
+//
+//   home_cloud_bench fusion [rate_hz] [seconds]
+//     Simulates a device tumbling along a known path, with noisy accel,
+//     gyro and magnetometer readings, runs OrientationFusion over them
+//     with and without the gyro, and reports updates per second on one
+//     core and how far the estimate strays from the truth.
+//
+//   home_cloud_bench rules [rules] [events]
+//     Compiles a set of threshold, edge and window rules over eight
+//     sensors and four GPIO pins, feeds random walks through RulesEngine,
+//     and reports evaluation time per event and any allocation made while
+//     evaluating. Window rules are checked against a brute force
+//     evaluation of the same samples.
+
+#include <math.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <new>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <hardware/sensors.h>
+
+#include "iio_buffer_reader.h"
+#include "orientation_filter.h"
+#include "rules_engine.h"
+#include "sample_store.h"
+#include "sensor_recording.h"
+#include "window_aggregator.h"
+
+using home_cloud::FusionInput;
+using home_cloud::IioBufferReader;
+using home_cloud::OrientationFilter;
+using home_cloud::OrientationFusion;
+using home_cloud::RuleAction;
+using home_cloud::RuleInput;
+using home_cloud::RulesEngine;
+using home_cloud::SampleStore;
+using home_cloud::SensorRecorder;
+using home_cloud::SensorRecording;
+using home_cloud::SensorSource;
+using home_cloud::WindowAggregator;
+using home_cloud::WindowResult;
+using home_cloud::WindowSpec;
+
+// Counts allocations, so benchmarks can show a path makes none. Kept out of
+// line so that compilers do not pair the malloc and free up with the
+// new and delete they replace.
+std::atomic<uint64_t> g_allocations(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  g_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double SecondsSince(Clock::time_point begin) {
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+// Three axes of accelerometer-like data: gravity, a slow swing and noise,
+// with a few microseconds of timestamp jitter.
+struct SyntheticSeries {
+  std::vector<int64_t> timestamps;
+  std::vector<float> axes[3];
+
+  SyntheticSeries(int rate_hz, int seconds) {
+    std::mt19937 rng(1);
+    std::normal_distribution<float> noise(0, 0.05f);
+    std::uniform_int_distribution<int> jitter(-20, 20);
+    const int64_t period = 1000000 / rate_hz;
+    const size_t count = static_cast<size_t>(rate_hz) * seconds;
+    timestamps.resize(count);
+    for (auto& axis : axes)
+      axis.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      timestamps[i] = 1000000000000LL + i * period + jitter(rng);
+      float phase = static_cast<float>(i) / rate_hz;
+      axes[0][i] = 0.3f * sinf(phase) + noise(rng);
+      axes[1][i] = 0.2f * cosf(phase * 0.7f) + noise(rng);
+      axes[2][i] = 9.81f + noise(rng);
+    }
+  }
+};
+
+double RunAggregate(const SyntheticSeries& series,
+                    const std::vector<WindowSpec>& windows, int rate_hz,
+                    size_t batch, uint64_t* results) {
+  WindowAggregator aggregator(windows);
+  aggregator.AddSensor(1, 3, 1000000 / rate_hz);
+  *results = 0;
+  aggregator.Subscribe([results](const WindowResult&) { (*results)++; });
+
+  const size_t count = series.timestamps.size();
+  Clock::time_point begin = Clock::now();
+  for (size_t i = 0; i < count; i += batch) {
+    size_t n = std::min(batch, count - i);
+    const float* axes[3] = {&series.axes[0][i], &series.axes[1][i],
+                            &series.axes[2][i]};
+    aggregator.AddBatch(1, &series.timestamps[i], axes, n);
+  }
+  return SecondsSince(begin);
+}
+
+int BenchAggregate(int rate_hz, int seconds, size_t batch) {
+  SyntheticSeries series(rate_hz, seconds);
+  const size_t count = series.timestamps.size();
+  printf("%zu samples at %d Hz, batches of %zu, %s block statistics\n", count,
+         rate_hz, batch, home_cloud::AggregatorSimdName());
+
+  const WindowSpec kSecond = {1000000, 1000000};
+  const WindowSpec kMinute = {60000000, 60000000};
+  const WindowSpec kTenSecondsEverySecond = {10000000, 1000000};
+  const WindowSpec kMinuteEveryFiveSeconds = {60000000, 5000000};
+  struct Config {
+    const char* name;
+    std::vector<WindowSpec> windows;
+  } configs[] = {
+    {"tumbling 1s+1m", {kSecond, kMinute}},
+    {"sliding 10s/1s+1m/5s", {kTenSecondsEverySecond, kMinuteEveryFiveSeconds}},
+    {"all four", {kSecond, kMinute, kTenSecondsEverySecond,
+                  kMinuteEveryFiveSeconds}},
+  };
+  for (const Config& config : configs) {
+    uint64_t results;
+    double elapsed = RunAggregate(series, config.windows, rate_hz, batch,
+                                  &results);
+    printf("%-22s %8.2f M samples/s per core, %.1f ns/sample, %llu results\n",
+           config.name, count / elapsed / 1e6, elapsed * 1e9 / count,
+           static_cast<unsigned long long>(results));
+  }
+  return 0;
+}
+
+int BenchSynthesize(const std::string& path, int seconds) {
+  struct Synthetic {
+    int type;
+    const char* name;
+    int rate_hz;
+  } const kSensors[] = {
+    {SENSOR_TYPE_ACCELEROMETER, "Synthetic accelerometer", 100},
+    {SENSOR_TYPE_LIGHT, "Synthetic light", 5},
+    {SENSOR_TYPE_TEMPERATURE, "Synthetic thermometer", 1},
+  };
+  std::vector<SensorSource::SensorInfo> sensors;
+  for (const Synthetic& sensor : kSensors)
+    sensors.push_back({sensor.type, sensor.name, 0.01f,
+                       1000000 / sensor.rate_hz, 0, 0});
+  std::unique_ptr<SensorRecorder> recorder =
+      SensorRecorder::Create(path, sensors);
+  if (!recorder)
+    return 1;
+
+  std::mt19937 rng(1);
+  std::normal_distribution<float> noise(0, 0.05f);
+  const int64_t kTick = 10000000;  // 10 ms, the fastest sensor.
+  for (int64_t t = 0; t < seconds * 1000000000LL; t += kTick) {
+    for (const Synthetic& sensor : kSensors) {
+      if (t % (1000000000LL / sensor.rate_hz) != 0)
+        continue;
+      ASensorEvent event;
+      memset(&event, 0, sizeof(event));
+      event.version = sizeof(event);
+      event.type = sensor.type;
+      event.timestamp = 1000000000LL + t;
+      float phase = t / 1e9f;
+      if (sensor.type == SENSOR_TYPE_ACCELEROMETER) {
+        event.data[0] = 0.3f * sinf(phase) + noise(rng);
+        event.data[1] = 0.2f * cosf(phase * 0.7f) + noise(rng);
+        event.data[2] = 9.81f + noise(rng);
+      } else if (sensor.type == SENSOR_TYPE_LIGHT) {
+        event.data[0] = 300 + 200 * sinf(phase / 3600) + 10 * noise(rng);
+      } else {
+        event.data[0] = 21 + sinf(phase / 7200) + noise(rng);
+      }
+      if (!recorder->Write(&event, 1))
+        return 1;
+    }
+  }
+  printf("%llu events over %d s written to %s\n",
+         static_cast<unsigned long long>(recorder->events()), seconds,
+         path.c_str());
+  return 0;
+}
+
+int BenchReplay(const std::string& path, int repeat) {
+  std::unique_ptr<SensorRecording> recording = SensorRecording::Open(path);
+  if (!recording)
+    return 1;
+  // Read up front so that the rounds time the pipeline, not the file.
+  std::vector<ASensorEvent> events;
+  ASensorEvent recorded;
+  while (recording->Next(&recorded))
+    events.push_back(recorded);
+  if (events.empty()) {
+    fprintf(stderr, "%s has no events\n", path.c_str());
+    return 1;
+  }
+  const int64_t duration_ns =
+      events.back().timestamp - events.front().timestamp;
+  char directory[] = "/tmp/home_cloud_bench.XXXXXX";
+  if (!mkdtemp(directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  // The daemon's default windows.
+  const std::vector<WindowSpec> windows = {
+    {1000000, 1000000}, {60000000, 60000000}, {10000000, 1000000}};
+  const size_t kBatch = 256;
+  double total_seconds = 0;
+  uint64_t results = 0;
+  SampleStore::Stats store_stats = {0, 0, 0, 0, 0};
+  for (int round = 0; round < repeat; round++) {
+    SampleStore store(SampleStore::DefaultOptions(directory));
+    WindowAggregator aggregator(windows);
+    aggregator.Subscribe([&results](const WindowResult&) { results++; });
+    struct Column {
+      int type;
+      int axes;
+      std::vector<int64_t> timestamps;
+      std::vector<float> values[home_cloud::kMaxAxes];
+    };
+    std::vector<Column> columns;
+    for (const SensorSource::SensorInfo& sensor : recording->sensors()) {
+      int axes = home_cloud::SensorAxes(sensor.type);
+      store.AddSensor(sensor.type, axes, sensor.resolution);
+      aggregator.AddSensor(sensor.type, axes, sensor.period_us);
+      columns.push_back({sensor.type, axes, {}, {}});
+    }
+    // Later rounds carry on where the previous one ended.
+    const int64_t offset =
+        round * (duration_ns / 1000 + 1000000);
+
+    Clock::time_point begin = Clock::now();
+    for (size_t i = 0; i < events.size(); i += kBatch) {
+      size_t end = std::min(events.size(), i + kBatch);
+      for (size_t j = i; j < end; j++) {
+        const ASensorEvent& event = events[j];
+        if (event.sensor < 0)
+          continue;
+        Column& column = columns[event.sensor];
+        int64_t timestamp = event.timestamp / 1000 + offset;
+        store.Append(event.type, timestamp, event.data);
+        column.timestamps.push_back(timestamp);
+        for (int axis = 0; axis < column.axes; axis++)
+          column.values[axis].push_back(event.data[axis]);
+      }
+      for (Column& column : columns) {
+        if (column.timestamps.empty())
+          continue;
+        const float* values[home_cloud::kMaxAxes];
+        for (int axis = 0; axis < column.axes; axis++)
+          values[axis] = column.values[axis].data();
+        aggregator.AddBatch(column.type, column.timestamps.data(), values,
+                            column.timestamps.size());
+        column.timestamps.clear();
+        for (int axis = 0; axis < column.axes; axis++)
+          column.values[axis].clear();
+      }
+    }
+    store.Flush();
+    total_seconds += SecondsSince(begin);
+    store_stats = store.stats();
+  }
+
+  double recorded_seconds = duration_ns / 1e9 * repeat;
+  uint64_t total_events = static_cast<uint64_t>(events.size()) * repeat;
+  printf("%llu events, %.0f s of recording, from %s\n",
+         static_cast<unsigned long long>(total_events), recorded_seconds,
+         path.c_str());
+  printf("%.2f M events/s, %.0fx real time, %llu window results\n",
+         total_events / total_seconds / 1e6, recorded_seconds / total_seconds,
+         static_cast<unsigned long long>(results));
+  printf("last round stored %llu samples in %llu bytes\n",
+         static_cast<unsigned long long>(store_stats.flushed_samples),
+         static_cast<unsigned long long>(store_stats.bytes_written));
+  std::string cleanup = std::string("rm -rf ") + directory;
+  return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
+
+bool WriteFile(const std::string& path, const void* data, size_t size) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = write(fd, data, size) == static_cast<ssize_t>(size);
+  close(fd);
+  return ok;
+}
+
+bool WriteFile(const std::string& path, const std::string& text) {
+  return WriteFile(path, text.data(), text.size());
+}
+
+// Raw BMP085 readings, in Pa and hundredths of a degree.
+uint32_t FakePressure(size_t i) {
+  return 101325 + static_cast<uint32_t>(i % 500);
+}
+
+int16_t FakeTemperature(size_t i) {
+  return static_cast<int16_t>(2150 - static_cast<int>(i % 300));
+}
+
+int BenchIio(size_t records) {
+  char directory[] = "/tmp/home_cloud_iio.XXXXXX";
+  if (!mkdtemp(directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string sysfs = std::string(directory) + "/iio:device0";
+  const std::string scan = sysfs + "/scan_elements/";
+  mkdir(sysfs.c_str(), 0755);
+  mkdir(scan.c_str(), 0755);
+  mkdir((sysfs + "/buffer").c_str(), 0755);
+  mkdir((sysfs + "/trigger").c_str(), 0755);
+  // The driver's data-ready trigger, not yet assigned to the buffer.
+  const std::string trigger = std::string(directory) + "/trigger0";
+  mkdir(trigger.c_str(), 0755);
+  // The bmp280 driver's layout: pressure, temperature, then the timestamp,
+  // in 16 byte records.
+  const struct {
+    const char* name;
+    const char* index;
+    const char* type;
+  } kElements[] = {
+    {"pressure", "0", "le:u32/32>>0"},
+    {"temp", "1", "le:s16/16>>0"},
+    {"timestamp", "2", "le:s64/64>>0"},
+  };
+  bool ok = WriteFile(sysfs + "/name", "bmp085\n") &&
+            WriteFile(sysfs + "/in_pressure_scale", "0.001\n") &&
+            WriteFile(sysfs + "/in_temp_scale", "10\n") &&
+            WriteFile(sysfs + "/sampling_frequency", "10\n") &&
+            WriteFile(sysfs + "/buffer/enable", "0\n") &&
+            WriteFile(sysfs + "/buffer/length", "0\n") &&
+            WriteFile(sysfs + "/trigger/current_trigger", "\n") &&
+            WriteFile(trigger + "/name", "bmp085-dev0\n");
+  for (const auto& element : kElements) {
+    std::string base = scan + "in_" + element.name;
+    ok = ok && WriteFile(base + "_en", "0\n") &&
+         WriteFile(base + "_index", std::string(element.index) + "\n") &&
+         WriteFile(base + "_type", std::string(element.type) + "\n");
+  }
+  std::vector<uint8_t> data(records * 16);
+  for (size_t i = 0; i < records; i++) {
+    uint32_t pressure = FakePressure(i);
+    int16_t temperature = FakeTemperature(i);
+    int64_t timestamp = 1000000000LL + i * 100000000LL;
+    memcpy(&data[i * 16], &pressure, 4);
+    memcpy(&data[i * 16 + 4], &temperature, 2);
+    memcpy(&data[i * 16 + 8], &timestamp, 8);
+  }
+  const std::string device = sysfs + "/device";
+  ok = ok && WriteFile(device, data.data(), data.size()) &&
+       WriteFile(sysfs + "/in_pressure_input", "101.325\n") &&
+       WriteFile(sysfs + "/in_temp_input", "21500\n");
+  if (!ok) {
+    perror("Failed to lay out the fake device");
+    return 1;
+  }
+  if (IioBufferReader::FindDevice(directory, {"bmp180", "bmp085"}) != sysfs) {
+    fprintf(stderr, "The fake device was not found\n");
+    return 1;
+  }
+
+  IioBufferReader::Options options;
+  options.channels = {"pressure", "temp"};
+  options.buffer_records = 256;
+  options.sampling_frequency = 0;
+  options.max_latency_us = 0;
+  std::unique_ptr<IioBufferReader> reader =
+      IioBufferReader::Open(sysfs, device, options);
+  if (!reader)
+    return 1;
+  char current[32] = {};
+  FILE* file = fopen((sysfs + "/trigger/current_trigger").c_str(), "r");
+  if (!file || !fgets(current, sizeof(current), file) ||
+      strcmp(current, "bmp085-dev0") != 0) {
+    fprintf(stderr, "The data-ready trigger was not assigned\n");
+    return 1;
+  }
+  fclose(file);
+  std::vector<IioBufferReader::Sample> samples;
+  samples.reserve(records);
+  Clock::time_point begin = Clock::now();
+  if (!reader->Read(&samples))
+    return 1;
+  double buffered = SecondsSince(begin);
+
+  size_t bad = samples.size() == records ? 0 : records;
+  for (size_t i = 0; i < samples.size() && !bad; i++) {
+    if (fabs(samples[i].values[0] - FakePressure(i) * 0.001) > 1e-9 ||
+        fabs(samples[i].values[1] - FakeTemperature(i) * 10.0) > 1e-9 ||
+        samples[i].timestamp != 1000000000LL + static_cast<int64_t>(i) *
+                                                   100000000LL)
+      bad++;
+  }
+
+  // The alternative: one open, read and parse per value.
+  const size_t kAttributeReads = std::min<size_t>(records, 20000);
+  begin = Clock::now();
+  double sum = 0;
+  for (size_t i = 0; i < kAttributeReads; i++) {
+    for (const char* file : {"/in_pressure_input", "/in_temp_input"}) {
+      char text[32];
+      int fd = open((sysfs + file).c_str(), O_RDONLY);
+      ssize_t n = fd >= 0 ? read(fd, text, sizeof(text) - 1) : -1;
+      if (fd >= 0)
+        close(fd);
+      text[std::max<ssize_t>(n, 0)] = '\0';
+      sum += strtod(text, nullptr);
+    }
+  }
+  double attributes = SecondsSince(begin);
+
+  printf("%zu records of %zu bytes, %zu decoded wrong\n", records,
+         reader->record_bytes(), bad);
+  printf("buffer:     %8.2f M records/s, %.1f ns/record\n",
+         records / buffered / 1e6, buffered * 1e9 / records);
+  printf("attributes: %8.2f M records/s, %.1f ns/record (checksum %.0f)\n",
+         kAttributeReads / attributes / 1e6,
+         attributes * 1e9 / kAttributeReads, sum);
+  reader.reset();
+  std::string cleanup = std::string("rm -rf ") + directory;
+  return system(cleanup.c_str()) == 0 && bad == 0 ? 0 : 1;
+}
+
+// Scalar-first quaternion product a * b.
+void QuaternionMultiply(const double* a, const double* b, double* out) {
+  double w = a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3];
+  double x = a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2];
+  double y = a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1];
+  double z = a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0];
+  out[0] = w;
+  out[1] = x;
+  out[2] = y;
+  out[3] = z;
+}
+
+// Earth vector v seen from a device whose rotation to the earth is q.
+void ToDevice(const double* q, const double* v, float* out) {
+  const double conjugate[4] = {q[0], -q[1], -q[2], -q[3]};
+  const double pure[4] = {0, v[0], v[1], v[2]};
+  double t[4], r[4];
+  QuaternionMultiply(conjugate, pure, t);
+  QuaternionMultiply(t, q, r);
+  for (int i = 0; i < 3; i++)
+    out[i] = static_cast<float>(r[i + 1]);
+}
+
+// Noisy readings of a device tumbling about all three axes at up to half a
+// radian per second, and its true orientation as a rotation vector.
+struct SyntheticMotion {
+  std::vector<int64_t> timestamps;
+  std::vector<float> accel[3];
+  std::vector<float> gyro[3];
+  std::vector<float> mag[3];
+  std::vector<float> truth[4];
+
+  SyntheticMotion(int rate_hz, int seconds) {
+    std::mt19937 rng(1);
+    std::normal_distribution<float> accel_noise(0, 0.05f);
+    std::normal_distribution<float> gyro_noise(0, 0.005f);
+    std::normal_distribution<float> mag_noise(0, 0.5f);
+    // East, north, up; the field points north and down, in microtesla.
+    const double kGravity[3] = {0, 0, 9.81};
+    const double kField[3] = {0, 22, -40};
+    const int64_t period = 1000000 / rate_hz;
+    const size_t count = static_cast<size_t>(rate_hz) * seconds;
+    timestamps.resize(count);
+    for (int axis = 0; axis < 3; axis++) {
+      accel[axis].resize(count);
+      gyro[axis].resize(count);
+      mag[axis].resize(count);
+    }
+    for (auto& axis : truth)
+      axis.resize(count);
+
+    // Start well away from the identity the filter starts from.
+    double q[4] = {cos(1.0), sin(1.0) * 0.6, sin(1.0) * 0.0, sin(1.0) * 0.8};
+    for (size_t i = 0; i < count; i++) {
+      double t = static_cast<double>(i) / rate_hz;
+      double w[3] = {0.5 * sin(0.3 * t), 0.4 * cos(0.2 * t),
+                     0.3 * sin(0.1 * t + 1)};
+      timestamps[i] = 1000000000000LL + i * period;
+      float reading[3];
+      ToDevice(q, kGravity, reading);
+      for (int axis = 0; axis < 3; axis++)
+        accel[axis][i] = reading[axis] + accel_noise(rng);
+      ToDevice(q, kField, reading);
+      for (int axis = 0; axis < 3; axis++) {
+        mag[axis][i] = reading[axis] + mag_noise(rng);
+        gyro[axis][i] = static_cast<float>(w[axis]) + gyro_noise(rng);
+      }
+      double sign = q[0] < 0 ? -1 : 1;
+      for (int axis = 0; axis < 3; axis++)
+        truth[axis][i] = static_cast<float>(sign * q[axis + 1]);
+      truth[3][i] = static_cast<float>(sign * q[0]);
+
+      // Turn at the rate the gyro reports until the next sample.
+      double angle = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]) / rate_hz;
+      double turn[4] = {1, 0, 0, 0};
+      if (angle > 0) {
+        double s = sin(angle / 2) / (angle * rate_hz);
+        turn[0] = cos(angle / 2);
+        for (int axis = 0; axis < 3; axis++)
+          turn[axis + 1] = w[axis] * s;
+      }
+      QuaternionMultiply(q, turn, q);
+    }
+  }
+};
+
+int BenchFusion(int rate_hz, int seconds) {
+  SyntheticMotion motion(rate_hz, seconds);
+  const size_t count = motion.timestamps.size();
+  const size_t kBatch = 64;
+  const int kSettleSeconds = 5;
+  printf("%zu samples per sensor at %d Hz, %s quaternion math\n", count,
+         rate_hz, home_cloud::FusionSimdName());
+
+  std::vector<int64_t> timestamps(2 * kBatch);
+  std::vector<float> output[4];
+  for (auto& axis : output)
+    axis.resize(2 * kBatch);
+  float* values[4] = {output[0].data(), output[1].data(), output[2].data(),
+                      output[3].data()};
+  for (bool with_gyro : {true, false}) {
+    OrientationFusion fusion(OrientationFilter::DefaultOptions());
+    double error_sum = 0;
+    double error_max = 0;
+    size_t errors = 0;
+    double seconds_spent = 0;
+    for (size_t i = 0; i < count; i += kBatch) {
+      size_t n = std::min(kBatch, count - i);
+      FusionInput accel = {&motion.timestamps[i],
+                           {&motion.accel[0][i], &motion.accel[1][i],
+                            &motion.accel[2][i]},
+                           n};
+      FusionInput mag = {&motion.timestamps[i],
+                         {&motion.mag[0][i], &motion.mag[1][i],
+                          &motion.mag[2][i]},
+                         n};
+      FusionInput gyro = {&motion.timestamps[i],
+                          {&motion.gyro[0][i], &motion.gyro[1][i],
+                           &motion.gyro[2][i]},
+                          with_gyro ? n : 0};
+      Clock::time_point begin = Clock::now();
+      size_t produced =
+          fusion.AddBatch(accel, mag, gyro, timestamps.data(), values);
+      seconds_spent += SecondsSince(begin);
+
+      // Output timestamps match inputs one to one, so line them up with the
+      // truth and measure the angle between the two rotations.
+      for (size_t j = 0; j < produced; j++) {
+        size_t k = i + (timestamps[j] - motion.timestamps[i]) /
+                           (1000000 / rate_hz);
+        if (k < static_cast<size_t>(kSettleSeconds * rate_hz))
+          continue;
+        double dot = 0;
+        for (int axis = 0; axis < 4; axis++)
+          dot += values[axis][j] * motion.truth[axis][k];
+        double error = 2 * acos(std::min(1.0, fabs(dot))) * 180 / M_PI;
+        error_sum += error;
+        error_max = std::max(error_max, error);
+        errors++;
+      }
+    }
+    printf("%-18s %6.2f M updates/s, %5.1f ns/update, error after %ds: "
+           "mean %.2f max %.2f degrees\n",
+           with_gyro ? "accel+gyro+mag:" : "accel+mag:",
+           fusion.updates() / seconds_spent / 1e6,
+           seconds_spent * 1e9 / fusion.updates(), kSettleSeconds,
+           errors ? error_sum / errors : 0.0, error_max);
+  }
+  return 0;
+}
+
+// How often "when s<input> <stat> over 1s > threshold" fires over a series,
+// evaluated the slow way.
+uint64_t BruteForceWindowRule(const std::vector<int64_t>& timestamps,
+                              const std::vector<float>& values,
+                              const char* stat, float threshold) {
+  const int64_t kLength = 1000000;
+  std::deque<size_t> window;
+  bool active = false;
+  uint64_t fired = 0;
+  for (size_t i = 0; i < values.size(); i++) {
+    window.push_back(i);
+    while (timestamps[window.front()] <= timestamps[i] - kLength)
+      window.pop_front();
+    bool mean = strcmp(stat, "mean") == 0;
+    double result = mean ? 0 : values[i];
+    for (size_t j : window) {
+      if (mean)
+        result += values[j];
+      else if (strcmp(stat, "min") == 0)
+        result = std::min<double>(result, values[j]);
+      else
+        result = std::max<double>(result, values[j]);
+    }
+    if (mean)
+      result /= window.size();
+    bool all = result > threshold;
+    if (all && !active)
+      fired++;
+    active = all;
+  }
+  return fired;
+}
+
+int BenchRules(int rule_count, int events) {
+  const int kSensors = 8;
+  const int kPins = 4;
+  const int64_t kPeriodUs = 10000;
+  const char* const kStats[] = {"mean", "min", "max"};
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> threshold(-1, 1);
+
+  // Rules cycle through the kinds of predicate, two predicates for every
+  // fourth one, and through the actions.
+  std::string text;
+  for (int i = 0; i < rule_count; i++) {
+    int sensor = i % kSensors;
+    char rule[256];
+    switch (i % 4) {
+      case 0:
+        snprintf(rule, sizeof(rule), "when s%d > %.2f", sensor, threshold(rng));
+        break;
+      case 1:
+        snprintf(rule, sizeof(rule), "when s%d rises above %.2f", sensor,
+                 threshold(rng));
+        break;
+      case 2:
+        snprintf(rule, sizeof(rule), "when s%d %s over 1s > %.2f", sensor,
+                 kStats[(i / 4) % 3], threshold(rng));
+        break;
+      default:
+        snprintf(rule, sizeof(rule), "when gpio%d falls and s%d < %.2f",
+                 900 + (i / 4) % kPins, sensor, threshold(rng));
+        break;
+    }
+    char actions[64];
+    snprintf(actions, sizeof(actions), "led %d toggle, media %s", i % 4,
+             i % 2 ? "pause" : "play");
+    text += "rule" + std::to_string(i) + ": " + rule + " then " + actions +
+            "\n";
+  }
+  auto resolver = [](const std::string& name, int* axes) {
+    *axes = 1;
+    return name.size() > 1 && name[0] == 's' ? 100 + atoi(name.c_str() + 1)
+                                             : -1;
+  };
+  std::unique_ptr<RulesEngine> engine =
+      RulesEngine::Compile(text, resolver, kPeriodUs);
+  if (!engine) {
+    fprintf(stderr, "Rules did not compile\n");
+    return 1;
+  }
+
+  // Random walks between -1 and 1 at 100 Hz, sensors taking turns, with a
+  // GPIO pin flipping now and then.
+  std::vector<int64_t> timestamps(events);
+  std::vector<int> inputs(events);
+  std::vector<float> values(events);
+  std::normal_distribution<float> step(0, 0.05f);
+  std::uniform_int_distribution<int> flip(0, 49);
+  float walks[kSensors] = {0};
+  float pins[kPins] = {0};
+  for (int i = 0; i < events; i++) {
+    timestamps[i] = 1000000000LL + static_cast<int64_t>(i / kSensors) *
+                                       kPeriodUs;
+    if (flip(rng) == 0) {
+      int pin = i % kPins;
+      pins[pin] = 1 - pins[pin];
+      inputs[i] = engine->FindInput(RuleInput::kGpio, 900 + pin);
+      values[i] = pins[pin];
+    } else {
+      int sensor = i % kSensors;
+      walks[sensor] = std::max(-1.0f, std::min(1.0f, walks[sensor] +
+                                                         step(rng)));
+      inputs[i] = engine->FindInput(RuleInput::kSensor, 100 + sensor);
+      values[i] = walks[sensor];
+    }
+  }
+
+  uint64_t actions = 0;
+  uint64_t allocations = g_allocations;
+  Clock::time_point begin = Clock::now();
+  for (int i = 0; i < events; i++) {
+    if (inputs[i] < 0)
+      continue;
+    actions += engine->Evaluate(inputs[i], timestamps[i], &values[i]).size();
+  }
+  double seconds = SecondsSince(begin);
+  allocations = g_allocations - allocations;
+  const RulesEngine::Stats& stats = engine->stats();
+  printf("%d rules over %zu inputs, %llu events\n", rule_count,
+         engine->inputs().size(),
+         static_cast<unsigned long long>(stats.events));
+  printf("%.1f ns/event (%.1f ns timed inside, max %.1f us), %llu rules "
+         "fired, %llu actions, %llu allocations\n",
+         seconds * 1e9 / stats.events,
+         static_cast<double>(stats.total_ns) / stats.events,
+         stats.max_ns / 1e3, static_cast<unsigned long long>(stats.fired),
+         static_cast<unsigned long long>(actions),
+         static_cast<unsigned long long>(allocations));
+
+  // Window rules see one sensor's samples only; replay those by brute
+  // force.
+  int wrong = 0;
+  int checked = 0;
+  for (int i = 2; i < rule_count; i += 4) {
+    int sensor = i % kSensors;
+    int input = engine->FindInput(RuleInput::kSensor, 100 + sensor);
+    std::vector<int64_t> series_timestamps;
+    std::vector<float> series_values;
+    for (int j = 0; j < events; j++) {
+      if (inputs[j] == input) {
+        series_timestamps.push_back(timestamps[j]);
+        series_values.push_back(values[j]);
+      }
+    }
+    float limit = 0;
+    char stat[8] = {0};
+    std::string line = "rule" + std::to_string(i) + ": when s" +
+                       std::to_string(sensor) + " ";
+    size_t at = text.find(line);
+    sscanf(text.c_str() + at + line.size(), "%7s over 1s > %f", stat, &limit);
+    uint64_t expected =
+        BruteForceWindowRule(series_timestamps, series_values, stat, limit);
+    checked++;
+    if (engine->rule_fired(i) != expected) {
+      wrong++;
+      printf("%s fired %llu times, expected %llu\n",
+             engine->rule_name(i).c_str(),
+             static_cast<unsigned long long>(engine->rule_fired(i)),
+             static_cast<unsigned long long>(expected));
+    }
+  }
+  printf("%d of %d window rules match brute force\n", checked - wrong,
+         checked);
+  return wrong == 0 && allocations == 0 ? 0 : 1;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Usage: home_cloud_bench <mode> [args...]\n");
+    printf("  aggregate [rate_hz] [seconds] [batch]\n");
+    printf("  synthesize <recording> [seconds]\n");
+    printf("  replay <recording> [repeat]\n");
+    printf("  iio [records]\n");
+    printf("  fusion [rate_hz] [seconds]\n");
+    printf("  rules [rules] [events]\n");
+    return 1;
+  }
+  std::string mode = argv[1];
+  if (mode == "aggregate")
+    return BenchAggregate(std::max(1, argc > 2 ? atoi(argv[2]) : 200),
+                          std::max(1, argc > 3 ? atoi(argv[3]) : 3600),
+                          std::max(1, argc > 4 ? atoi(argv[4]) : 64));
+  if (mode == "synthesize" && argc > 2)
+    return BenchSynthesize(argv[2],
+                           std::max(1, argc > 3 ? atoi(argv[3]) : 3600));
+  if (mode == "replay" && argc > 2)
+    return BenchReplay(argv[2], std::max(1, argc > 3 ? atoi(argv[3]) : 1));
+  if (mode == "iio")
+    return BenchIio(std::max(1, argc > 2 ? atoi(argv[2]) : 1000000));
+  if (mode == "fusion")
+    return BenchFusion(std::max(1, argc > 2 ? atoi(argv[2]) : 100),
+                       std::max(10, argc > 3 ? atoi(argv[3]) : 600));
+  if (mode == "rules")
+    return BenchRules(std::max(1, argc > 2 ? atoi(argv[2]) : 64),
+                      std::max(1, argc > 3 ? atoi(argv[3]) : 1000000));
+  fprintf(stderr, "Unknown mode '%s'\n", mode.c_str());
+  return 1;
+}
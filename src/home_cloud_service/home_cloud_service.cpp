@@ -1,88 +1,290 @@
-#include <getopt.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
-#include <android/looper.h>
 #include <android/sensor.h>
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/macros.h>
+#include <base/memory/weak_ptr.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+#include <base/thread_task_runner_handle.h>
+#include <base/time/time.h>
+#include <base/values.h>
+#include <brillo/flag_helper.h>
+#include <brillo/message_loops/message_loop.h>
 #include <hardware/sensors.h>
+#include <libweaved/service.h>
+
+#include "binder_constants.h"
+#include "brillo/demo/IMp3PlayerService.h"
+#include "brillo/examples/ledflasher/ILEDService.h"
+#include "duration.h"
+#include "gpio_watcher.h"
+#include "home_cloud_service.h"
+#include "iio_buffer_reader.h"
+#include "iio_sensor_source.h"
+#include "mp3-player-service.h"
+#include "orientation_filter.h"
+#include "replay_sensor_source.h"
+#include "rules_engine.h"
+#include "sample_store.h"
+#include "sensor_collector.h"
+#include "sensor_query_service.h"
+#include "sensor_recording.h"
+#include "service_module.h"
+#include "state_reporter.h"
+#include "window_aggregator.h"
+
+using brillo::demo::IMp3PlayerService;
+using brillo::examples::ledflasher::ILEDService;
+using home_cloud::FusionInput;
+using home_cloud::GpioWatcher;
+using home_cloud::IioBufferReader;
+using home_cloud::IioSensorSource;
+using home_cloud::OrientationFilter;
+using home_cloud::OrientationFusion;
+using home_cloud::ParseDuration;
+using home_cloud::ReplaySensorSource;
+using home_cloud::ReportPolicy;
+using home_cloud::RuleAction;
+using home_cloud::RuleInput;
+using home_cloud::RulesEngine;
+using home_cloud::SampleStore;
+using home_cloud::SensorCollector;
+using home_cloud::SensorQueryService;
+using home_cloud::SensorAxes;
+using home_cloud::SensorRecorder;
+using home_cloud::SensorSource;
+using home_cloud::StateReporter;
+using home_cloud::WindowAggregator;
+using home_cloud::WindowResult;
+using home_cloud::WindowSpec;
 
-#define DEFAULT_SENSOR_TYPE SENSOR_TYPE_ACCELEROMETER
+DEFINE_string(sensors, "",
+              "Comma-separated sensors to enable (accel, temp, light, orient, "
+              "prox, motion, pressure, ambient, mag, gyro); all of them when "
+              "empty");
+DEFINE_int32(sample_period_ms, 100,
+             "Sampling period for continuous sensors, in milliseconds");
+DEFINE_int32(max_report_latency_ms, 5000,
+             "How long sensors may batch events in their hardware FIFO "
+             "before waking us up, in milliseconds; 0 to stream every event");
+DEFINE_int32(stats_interval_s, 60,
+             "Seconds between event rate reports in the log, 0 to disable");
+DEFINE_bool(print_samples, false, "Print every sample to stdout");
+DEFINE_string(windows, "1s,1m,10s/1s",
+              "Aggregation windows: a length for a tumbling window, "
+              "length/hop for a sliding one");
+DEFINE_bool(print_windows, false, "Print every window result to stdout");
+DEFINE_string(store_dir, "/data/misc/home_cloud",
+              "Directory keeping sensor history, empty to keep none; a "
+              "replay keeps none unless given another directory");
+DEFINE_string(iio_device, "auto",
+              "sysfs directory of a BMP085 family IIO pressure sensor to "
+              "read through its buffer, auto to look for one, empty for "
+              "none");
+DEFINE_bool(fusion, true,
+            "Fuse accel, magnetometer and gyro into a rotation vector");
+DEFINE_double(fusion_beta, 0.1,
+              "Gyro error of the orientation filter in rad/s: higher trusts "
+              "accel and magnetometer more");
+DEFINE_string(rules, "/system/etc/home_cloud/rules.conf",
+              "Rules linking sensors and GPIO pins to the LEDs and the media "
+              "player; none if the file does not exist");
+DEFINE_string(record, "", "File to record every sensor event to");
+DEFINE_string(replay, "",
+              "Recording to replay instead of reading the sensors, without "
+              "reporting to weave");
+DEFINE_double(replay_speed, 1.0,
+              "Replay speed as a multiple of real time, 0 for as fast as "
+              "possible");
+DEFINE_string(weave_reporting,
+              "accel=0.5/1s/10m,orient=5/1s/10m,temp=0.2/10s/15m,"
+              "light=10/5s/15m,prox=1/1s/15m,motion=0.5/1s/1h,"
+              "rotation=0.02/1s/10m,game_rotation=0.02/1s/10m",
+              "How sensor state is reported to weave: comma-separated "
+              "sensor[.property]=deadband/min_interval/max_interval");
+
+namespace {
+// The default --store_dir.
+const char kHistoryDir[] = "/data/misc/home_cloud";
+const char kIioSysfsRoot[] = "/sys/bus/iio/devices";
+const char kGpioSysfsRoot[] = "/sys/class/gpio";
+const char kSensorInfoTrait[] = "_sensorInfo";
+const char kScalarTrait[] = "_scalarReading";
+const char kVectorTrait[] = "_vectorReading";
+const char* const kVectorProperties[] = {"x", "y", "z", "w"};
+// For sensors and properties --weave_reporting leaves out.
+const ReportPolicy kDefaultReportPolicy = {0, 1000000, 15 * 60 * 1000000LL};
+// Publishing ticks no more often than this, whatever the policies ask.
+const int64_t kMinPublishTickUs = 100000;
+// Likewise for closing windows, whatever the shortest hop.
+const int64_t kMinWindowTickUs = 100000;
+// A change in the wall clock's offset from boot time larger than this is
+// taken to be the clock being set, e.g. by NTP on a board without an RTC.
+const int64_t kWallClockStepUs = 1000000;
+
+struct SensorName {
+  const char* name;
+  int type;
+};
 
-// Structure to hold the decoded command line options
-struct pgm_options {
-  int    sensor_type;
+// Be sure to provide a case in DisplaySensorData() for each sensor here.
+const SensorName kSensorNames[] = {
+  {"accel",  SENSOR_TYPE_ACCELEROMETER},
+  {"temp",   SENSOR_TYPE_TEMPERATURE},
+  {"light",  SENSOR_TYPE_LIGHT},
+  {"orient", SENSOR_TYPE_ORIENTATION},
+  {"prox",   SENSOR_TYPE_PROXIMITY},
+  {"motion", SENSOR_TYPE_SIGNIFICANT_MOTION},
+  {"pressure", SENSOR_TYPE_PRESSURE},
+  {"ambient", SENSOR_TYPE_AMBIENT_TEMPERATURE},
+  {"mag",    SENSOR_TYPE_MAGNETIC_FIELD},
+  {"gyro",   SENSOR_TYPE_GYROSCOPE},
 };
 
-// Be sure to keep the options for longopts and shortopts in the same order
-// so that Usage() is correct.
-static struct option longopts[] = {
-  {"help",     no_argument,  NULL,  '?'},
-  {"accel",    no_argument,  NULL,  'a'},
-  {"temp",     no_argument,  NULL,  't'},
-  {"light",    no_argument,  NULL,  'l'},
-  {"orient",   no_argument,  NULL,  'o'},
-  {"prox",     no_argument,  NULL,  'p'},
-  {"motion",   no_argument,  NULL,  'm'},
-  {NULL,       0,            NULL,   0}
+// Sensors derived here rather than read.
+const SensorName kVirtualSensorNames[] = {
+  {"rotation", SENSOR_TYPE_ROTATION_VECTOR},
+  {"game_rotation", SENSOR_TYPE_GAME_ROTATION_VECTOR},
 };
-static char shortopts[] = "?atlopm";
 
-// Describes the options for this program.
-void Usage(char *pgm_name) {
-  printf("Usage: %s [options...]\n", pgm_name);
-  printf("Exercises the sensors NDK by calling into the sensorserver.\n");
-  printf("Options:\n");
-  for (int i = 0; longopts[i].name; i++) {
-    printf("  --%-6s or -%c\n", longopts[i].name, shortopts[i]);
+const char* SensorTypeName(int type) {
+  for (const SensorName& sensor : kSensorNames) {
+    if (sensor.type == type)
+      return sensor.name;
   }
+  for (const SensorName& sensor : kVirtualSensorNames) {
+    if (sensor.type == type)
+      return sensor.name;
+  }
+  return "unknown";
 }
 
-// Processes all command line options.
-//   sets the options members for commnd line options
-//   returns (0) on success, -1 otherwise.
-int ReadOpts(int argc, char **argv, struct pgm_options *options) {
-  int ch = 0;
+// Sensor type for a name in kSensorNames or kVirtualSensorNames, or -1.
+int FindSensorType(const std::string& name) {
+  for (const SensorName& sensor : kSensorNames) {
+    if (name == sensor.name)
+      return sensor.type;
+  }
+  for (const SensorName& sensor : kVirtualSensorNames) {
+    if (name == sensor.name)
+      return sensor.type;
+  }
+  return -1;
+}
 
-  if (!options) {
-    fprintf(stderr, "Invalid options pointer\n");
-    return 1;
+// Parses --sensors into sensor types. Returns false on an unknown name.
+bool ParseSensorTypes(const std::string& names, std::vector<int>* types) {
+  types->clear();
+  for (const std::string& name : base::SplitString(
+           names, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    auto it = std::find_if(std::begin(kSensorNames), std::end(kSensorNames),
+                           [&name](const SensorName& sensor) {
+                             return name == sensor.name;
+                           });
+    if (it == std::end(kSensorNames)) {
+      LOG(ERROR) << "Unknown sensor '" << name << "'";
+      return false;
+    }
+    types->push_back(it->type);
   }
+  if (types->empty()) {
+    for (const SensorName& sensor : kSensorNames)
+      types->push_back(sensor.type);
+  }
+  return true;
+}
 
-  while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
-    switch (ch) {
-    case 'a':
-      options->sensor_type  = SENSOR_TYPE_ACCELEROMETER;
-      break;
-    case 't':
-      options->sensor_type  = SENSOR_TYPE_TEMPERATURE;
-      break;
-    case 'l':
-      options->sensor_type  = SENSOR_TYPE_LIGHT;
-      break;
-    case 'o':
-      options->sensor_type  = SENSOR_TYPE_ORIENTATION;
-      break;
-    case 'p':
-      options->sensor_type  = SENSOR_TYPE_PROXIMITY;
-      break;
-    case 'm':
-      options->sensor_type  = SENSOR_TYPE_SIGNIFICANT_MOTION;
-      break;
-    default:
-      Usage(argv[0]);
-      return -1;
+// Parses --windows: comma-separated lengths for tumbling windows, or
+// length/hop for sliding ones.
+bool ParseWindows(const std::string& text, std::vector<WindowSpec>* windows) {
+  windows->clear();
+  for (const std::string& item : base::SplitString(
+           text, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    std::vector<std::string> parts = base::SplitString(
+        item, "/", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    WindowSpec window;
+    if (parts.size() > 2 || !ParseDuration(parts[0], &window.length_us)) {
+      LOG(ERROR) << "Invalid window '" << item << "'";
+      return false;
+    }
+    window.hop_us = window.length_us;
+    if (parts.size() == 2 && (!ParseDuration(parts[1], &window.hop_us) ||
+                              window.hop_us > window.length_us)) {
+      LOG(ERROR) << "Invalid window '" << item << "'";
+      return false;
+    }
+    windows->push_back(window);
+  }
+  return true;
+}
+
+// Parses --weave_reporting into policies keyed by sensor name, or by
+// sensor.property for a single property.
+bool ParseReportPolicies(const std::string& text,
+                         std::map<std::string, ReportPolicy>* policies) {
+  policies->clear();
+  for (const std::string& item : base::SplitString(
+           text, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    std::vector<std::string> key_value = base::SplitString(
+        item, "=", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    std::vector<std::string> parts;
+    if (key_value.size() == 2) {
+      parts = base::SplitString(key_value[1], "/", base::TRIM_WHITESPACE,
+                                base::SPLIT_WANT_ALL);
+    }
+    ReportPolicy policy;
+    char* end = nullptr;
+    if (parts.size() == 3)
+      policy.deadband = strtof(parts[0].c_str(), &end);
+    if (parts.size() != 3 || end == parts[0].c_str() || *end ||
+        policy.deadband < 0 ||
+        !ParseDuration(parts[1], &policy.min_interval_us) ||
+        !ParseDuration(parts[2], &policy.max_interval_us) ||
+        policy.max_interval_us < policy.min_interval_us) {
+      LOG(ERROR) << "Invalid weave reporting policy '" << item << "'";
+      return false;
     }
+    (*policies)[key_value[0]] = policy;
   }
-  argc -= optind;
-  argv += optind;
-  return 0;
+  return true;
 }
 
+int64_t BootTimeMicros() {
+  struct timespec boot;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  return boot.tv_sec * 1000000LL + boot.tv_nsec / 1000;
+}
+
+// Sensor timestamps count from boot; history and windows use wall-clock
+// time.
+int64_t BootToWallClockMicros() {
+  struct timespec boot, wall;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  clock_gettime(CLOCK_REALTIME, &wall);
+  return (wall.tv_sec - boot.tv_sec) * 1000000LL +
+         (wall.tv_nsec - boot.tv_nsec) / 1000;
+}
+}  // anonymous namespace
+
 // Prints data associated with each supported sensor type.
-// Be sure to provide a case for each sensor type supported in
-// the ReadOpts() function.
+// Be sure to provide a case for each sensor type in kSensorNames.
 void DisplaySensorData(int sensor_type, const ASensorEvent *data) {
   switch (sensor_type) {
     case SENSOR_TYPE_PROXIMITY:
@@ -103,6 +305,33 @@ void DisplaySensorData(int sensor_type, const ASensorEvent *data) {
     case SENSOR_TYPE_LIGHT:
       printf("Light: %f\n", data->light);
       break;
+    case SENSOR_TYPE_PRESSURE:
+      printf("Pressure: %f hPa\n", data->pressure);
+      break;
+    case SENSOR_TYPE_AMBIENT_TEMPERATURE:
+      printf("Ambient temperature: %f\n", data->temperature);
+      break;
+    case SENSOR_TYPE_MAGNETIC_FIELD:
+      printf("Magnetic field: x = %f, y = %f, z = %f\n",
+             data->magnetic.x, data->magnetic.y, data->magnetic.z);
+      break;
+    case SENSOR_TYPE_GYROSCOPE:
+      printf("Rotation rate: x = %f, y = %f, z = %f\n",
+             data->vector.x, data->vector.y, data->vector.z);
+      break;
+    case SENSOR_TYPE_ROTATION_VECTOR:
+    case SENSOR_TYPE_GAME_ROTATION_VECTOR: {
+      // Heading of the device's y axis, clockwise from north.
+      const float* q = data->data;
+      float heading = atan2(2.0 * (q[0] * q[1] - q[2] * q[3]),
+                            1.0 - 2.0 * (q[0] * q[0] + q[2] * q[2])) *
+                      180.0 / M_PI;
+      if (heading < 0.0)
+        heading += 360.0;
+      printf("Heading: %f, Rotation: x = %f, y = %f, z = %f, w = %f\n",
+             heading, q[0], q[1], q[2], q[3]);
+      }
+      break;
     case SENSOR_TYPE_ORIENTATION: {
       float heading =
         atan2(static_cast<double>(data->magnetic.y),
@@ -116,103 +345,892 @@ void DisplaySensorData(int sensor_type, const ASensorEvent *data) {
   }
 }
 
-int main(int argc, char* argv[]) {
-  pgm_options options = {DEFAULT_SENSOR_TYPE};
-  if (ReadOpts(argc, argv, &options) < 0)
-    return 1;
-
-  const char kPackageName[] = "ndk-example-app";
-  ASensorManager* sensor_manager =
-    ASensorManager_getInstanceForPackage(kPackageName);
-  if (!sensor_manager) {
-    fprintf(stderr, "Failed to get a sensor manager\n");
-    return 1;
-  }
-
-  ASensorList sensor_list = nullptr;
-  int sensor_count = ASensorManager_getSensorList(sensor_manager, &sensor_list);
-  printf("Found %d supported sensors\n", sensor_count);
-  for (int i = 0; i < sensor_count; i++) {
-    printf("HAL supports sensor %s\n", ASensor_getName(sensor_list[i]));
-  }
-  const int kLooperId = 1;
-  ASensorEventQueue* queue = ASensorManager_createEventQueue(
-      sensor_manager,
-      ALooper_prepare(ALOOPER_PREPARE_ALLOW_NON_CALLBACKS),
-      kLooperId,
-      NULL, /* no callback */
-      NULL  /* no private data for a callback  */);
-  if (!queue) {
-    fprintf(stderr, "Failed to create a sensor event queue\n");
-    return 1;
-  }
-
-  // Find the first sensor of the specified type that can be opened
-  const int kTimeoutMicroSecs = 1000000;
-  const int kTimeoutMilliSecs = 1000;
-  ASensorRef sensor = nullptr;
-  bool sensor_found = false;
-  for (int i = 0; i < sensor_count; i++) {
-    sensor = sensor_list[i];
-    if (ASensor_getType(sensor) != options.sensor_type)
-      continue;
-    if (ASensorEventQueue_enableSensor(queue, sensor) < 0)
-      continue;
-    if (ASensorEventQueue_setEventRate(queue, sensor, kTimeoutMicroSecs) < 0) {
-      fprintf(stderr, "Failed to set the %s sample rate\n",
-          ASensor_getName(sensor));
-      return 1;
-    }
-
-    // Found an equipped sensor of the specified type.
-    sensor_found = true;
-    break;
-  }
-
-  if (!sensor_found) {
-    fprintf(stderr, "No sensor of the specified type found\n");
-    int ret = ASensorManager_destroyEventQueue(sensor_manager, queue);
-    if (ret < 0)
-      fprintf(stderr, "Failed to destroy event queue: %s\n", strerror(-ret));
-    return 1;
-  }
-  printf("\nSensor %s activated\n", ASensor_getName(sensor));
-
-  const int kNumEvents = 1;
-  const int kNumSamples = 10;
-  const int kWaitTimeSecs = 1;
-  for (int i = 0; i < kNumSamples; i++) {
-    ASensorEvent data[kNumEvents];
-    memset(data, 0, sizeof(data));
-    int ident = ALooper_pollAll(
-        kTimeoutMilliSecs,
-        NULL /* no output file descriptor */,
-        NULL /* no output event */,
-        NULL /* no output data */);
-    if (ident != kLooperId) {
-      fprintf(stderr, "Incorrect Looper ident read from poll.\n");
+namespace {
+
+class Daemon final : public service_hub::Module {
+ public:
+  struct Options {
+    std::vector<int> types;
+    int32_t period_us;
+    int64_t max_latency_us;
+    std::vector<WindowSpec> windows;
+    base::TimeDelta stats_interval;
+    bool print_samples;
+    bool print_windows;
+    std::string store_dir;
+    std::map<std::string, ReportPolicy> report_policies;
+    // Whether to fuse orientation, and the filter's settings.
+    bool fusion;
+    OrientationFilter::Options fusion_options;
+    // File of rules for RulesEngine.
+    std::string rules_path;
+    // sysfs directory of an IIO pressure sensor, "auto" or empty.
+    std::string iio_device;
+    // Recording to write every event to, if any.
+    std::string record_path;
+    // Recording to read events from instead of the sensors, if any.
+    std::string replay_path;
+    // Replay speed factor; 0 for as fast as possible.
+    double replay_speed;
+  };
+
+  explicit Daemon(const Options& options) : options_(options) {}
+
+  const char* name() const override { return "home_cloud"; }
+  int OnInit() override;
+  void OnShutdown() override;
+
+ private:
+  struct SensorState {
+    int type;
+    int axes;
+    std::string name;
+    int64_t period_ns;
+    int64_t last_timestamp;
+    // Counters since the last report.
+    uint64_t events;
+    uint64_t missed;
+    // This sensor's part of the batch being handled, one column per axis.
+    std::vector<int64_t> batch_timestamps;
+    std::vector<float> batch_values[home_cloud::kMaxAxes];
+    // StateReporter properties, one per axis.
+    int report_ids[home_cloud::kMaxAxes];
+    // RulesEngine input, -1 if no rule reads the sensor.
+    int rule_input;
+  };
+
+  // How long rule actions took, from the event that fired them.
+  struct RuleLatency {
+    uint64_t triggers;
+    uint64_t failed_actions;
+    // Until the event was evaluated, and until its actions were done.
+    int64_t delivery_total_us;
+    int64_t delivery_max_us;
+    int64_t action_total_us;
+    int64_t action_max_us;
+  };
+
+  bool StartSource(std::unique_ptr<SensorSource> source,
+                   const std::vector<int>& types, int64_t max_latency_us);
+  const SensorSource::SensorInfo* EnabledSensor(int type) const;
+  void StartFusion();
+  void OnSensorEvents(const ASensorEvent* events, size_t count);
+  void CheckWallClock();
+  void FuseOrientation();
+
+  bool LoadRules();
+  bool RulesRead(int type) const;
+  void WatchRuleInputs();
+  void RunRules(int input, int64_t timestamp, const float* values);
+  bool RunAction(const RuleAction& action);
+  void OnGpioEdge(int pin, int value, int64_t timestamp);
+  void ConnectToLEDService();
+  void OnLEDServiceDisconnected();
+  void ConnectToMediaService();
+  void OnMediaServiceDisconnected();
+  SensorState* StateFor(int type);
+  void OnWindowResult(const WindowResult& result);
+  void OnWindowTick();
+  void ReportStats();
+
+  const ReportPolicy& PolicyFor(const std::string& component,
+                                const std::string& property) const;
+  void OnWeaveServiceConnected(const std::weak_ptr<weaved::Service>& service);
+  void PublishState();
+  void OnPublishTick();
+
+  Options options_;
+
+  std::vector<std::unique_ptr<SensorSource>> sources_;
+  // What the sources enabled between them.
+  std::vector<SensorSource::SensorInfo> enabled_sensors_;
+  std::unique_ptr<SensorRecorder> recorder_;
+  std::unique_ptr<OrientationFusion> fusion_;
+  // The sensor fused orientation is published as, and the one it takes the
+  // magnetic field from; 0 if none.
+  int fused_type_{0};
+  int fusion_mag_type_{0};
+  std::unique_ptr<RulesEngine> rules_;
+  std::unique_ptr<GpioWatcher> gpio_watcher_;
+  android::sp<ILEDService> led_service_;
+  // LEDs the board has, read when ledservice connects.
+  int32_t led_count_{0};
+  android::sp<IMp3PlayerService> media_service_;
+  service_hub::RetryBackoff led_service_retry_;
+  service_hub::RetryBackoff media_service_retry_;
+  RuleLatency rule_latency_{0, 0, 0, 0, 0, 0};
+  std::unique_ptr<SampleStore> store_;
+  std::unique_ptr<WindowAggregator> aggregator_;
+  android::sp<SensorQueryService> query_service_;
+  StateReporter reporter_;
+  std::weak_ptr<weaved::Service> weave_service_;
+  std::unique_ptr<weaved::Service::Subscription> weave_service_subscription_;
+  int64_t boot_to_wall_us_{0};
+  std::vector<SensorState> sensors_;
+  base::TimeTicks stats_since_;
+  uint64_t batches_{0};
+  size_t largest_batch_{0};
+  uint64_t wakeups_reported_{0};
+  uint64_t dropped_reported_{0};
+
+  base::WeakPtrFactory<Daemon> weak_ptr_factory_{this};
+  DISALLOW_COPY_AND_ASSIGN(Daemon);
+};
+
+int Daemon::OnInit() {
+  if (!LoadRules())
+    return EX_CONFIG;
+
+  // weaved handles the connection while the sensors start; the components
+  // are added once it calls back, after this returns. A replay is not the
+  // device's state and is kept from the cloud.
+  if (options_.replay_path.empty()) {
+    weave_service_subscription_ = weaved::Service::Connect(
+        brillo::MessageLoop::current(),
+        base::Bind(&Daemon::OnWeaveServiceConnected,
+                   weak_ptr_factory_.GetWeakPtr()));
+  }
+
+  SensorSource::EventsCallback on_events =
+      base::Bind(&Daemon::OnSensorEvents, weak_ptr_factory_.GetWeakPtr());
+  if (!options_.replay_path.empty()) {
+    StartSource(std::unique_ptr<SensorSource>(new ReplaySensorSource(
+                    base::ThreadTaskRunnerHandle::Get(), on_events,
+                    options_.replay_path, options_.replay_speed)),
+                options_.types, options_.max_latency_us);
+  } else {
+    // Sensors the HAL does not know about go first; the sensor service
+    // gets whatever they leave.
+    std::vector<int> types = options_.types;
+    std::string iio_device = options_.iio_device;
+    if (iio_device == "auto") {
+      iio_device = IioBufferReader::FindDevice(kIioSysfsRoot,
+                                               IioSensorSource::DeviceNames());
+    }
+    std::vector<int> iio_types;
+    int64_t iio_latency_us = options_.max_latency_us;
+    for (int type : IioSensorSource::SensorTypes()) {
+      if (std::find(types.begin(), types.end(), type) != types.end()) {
+        iio_types.push_back(type);
+        if (RulesRead(type))
+          iio_latency_us = 0;
+      }
+    }
+    if (!iio_device.empty() && !iio_types.empty()) {
+      std::string device =
+          "/dev/" + iio_device.substr(iio_device.rfind('/') + 1);
+      if (StartSource(std::unique_ptr<SensorSource>(new IioSensorSource(
+                          base::ThreadTaskRunnerHandle::Get(), on_events,
+                          iio_device, device)),
+                      iio_types, iio_latency_us)) {
+        for (int type : iio_types)
+          types.erase(std::remove(types.begin(), types.end(), type),
+                      types.end());
+      }
+    }
+    // Sensors that rules read stream rather than wait in the hub's FIFO,
+    // so that rules react to them at once.
+    std::vector<int> streaming;
+    for (int type : types) {
+      if (RulesRead(type))
+        streaming.push_back(type);
+    }
+    for (int type : streaming)
+      types.erase(std::remove(types.begin(), types.end(), type), types.end());
+    if (!streaming.empty()) {
+      StartSource(std::unique_ptr<SensorSource>(new SensorCollector(
+                      base::ThreadTaskRunnerHandle::Get(), on_events)),
+                  streaming, 0);
+    }
+    if (!types.empty()) {
+      StartSource(std::unique_ptr<SensorSource>(new SensorCollector(
+                      base::ThreadTaskRunnerHandle::Get(), on_events)),
+                  types, options_.max_latency_us);
+    }
+  }
+  if (enabled_sensors_.empty())
+    return EX_UNAVAILABLE;
+  service_hub::MarkBootPhase(name(), "sensors started");
+  if (!options_.record_path.empty()) {
+    recorder_ = SensorRecorder::Create(options_.record_path,
+                                       enabled_sensors_);
+    if (!recorder_)
+      return EX_CANTCREAT;
+  }
+  // Not recorded: a replay fuses the recorded inputs again.
+  if (options_.fusion)
+    StartFusion();
+
+  boot_to_wall_us_ = BootToWallClockMicros();
+  aggregator_.reset(new WindowAggregator(options_.windows));
+  if (options_.print_windows) {
+    aggregator_->Subscribe(
+        [this](const WindowResult& result) { OnWindowResult(result); });
+  }
+  for (const SensorSource::SensorInfo& sensor : enabled_sensors_) {
+    SensorState state;
+    state.type = sensor.type;
+    state.axes = SensorAxes(sensor.type);
+    state.name = sensor.name;
+    state.period_ns = static_cast<int64_t>(sensor.period_us) * 1000;
+    state.last_timestamp = 0;
+    state.events = 0;
+    state.missed = 0;
+    state.rule_input = -1;
+    const char* component = SensorTypeName(sensor.type);
+    for (int axis = 0; axis < state.axes; axis++) {
+      std::string property = state.axes == 1
+                                 ? std::string(kScalarTrait) + ".value"
+                                 : std::string(kVectorTrait) + "." +
+                                       kVectorProperties[axis];
+      state.report_ids[axis] = reporter_.AddProperty(
+          component, property, PolicyFor(component, property));
+    }
+    sensors_.push_back(state);
+    aggregator_->AddSensor(sensor.type, state.axes, sensor.period_us);
+  }
+
+  if (!options_.store_dir.empty()) {
+    mkdir(options_.store_dir.c_str(), 0770);
+    store_.reset(
+        new SampleStore(SampleStore::DefaultOptions(options_.store_dir)));
+    std::vector<int> types;
+    for (const SensorSource::SensorInfo& sensor : enabled_sensors_) {
+      store_->AddSensor(sensor.type, SensorAxes(sensor.type),
+                        sensor.resolution);
+      types.push_back(sensor.type);
+    }
+
+    query_service_ = new SensorQueryService(store_.get(), types);
+    service_hub::MarkBootPhase(name(), "store opened");
+  }
+
+  WatchRuleInputs();
+
+  if (rules_) {
+    ConnectToLEDService();
+    ConnectToMediaService();
+  }
+  if (query_service_) {
+    service_hub::RegisterService(home_cloud::kBinderServiceName,
+                                 query_service_);
+  }
+  OnPublishTick();
+  if (!options_.windows.empty())
+    OnWindowTick();
+  stats_since_ = base::TimeTicks::Now();
+  if (options_.stats_interval > base::TimeDelta()) {
+    brillo::MessageLoop::current()->PostDelayedTask(
+        base::Bind(&Daemon::ReportStats, weak_ptr_factory_.GetWeakPtr()),
+        options_.stats_interval);
+  }
+
+  LOG(INFO) << "Collecting from " << sensors_.size() << " sensors";
+  service_hub::MarkBootPhase(name(), "ready");
+  return EX_OK;
+}
+
+bool Daemon::StartSource(std::unique_ptr<SensorSource> source,
+                         const std::vector<int>& types,
+                         int64_t max_latency_us) {
+  if (!source->Start(types, options_.period_us, max_latency_us))
+    return false;
+  enabled_sensors_.insert(enabled_sensors_.end(), source->sensors().begin(),
+                          source->sensors().end());
+  sources_.push_back(std::move(source));
+  return true;
+}
+
+const SensorSource::SensorInfo* Daemon::EnabledSensor(int type) const {
+  for (const SensorSource::SensorInfo& sensor : enabled_sensors_) {
+    if (sensor.type == type)
+      return &sensor;
+  }
+  return nullptr;
+}
+
+// Adds a virtual sensor for orientation fused from whatever accel,
+// magnetometer and gyro there are, handled from here on like any other.
+void Daemon::StartFusion() {
+  const SensorSource::SensorInfo* accel =
+      EnabledSensor(SENSOR_TYPE_ACCELEROMETER);
+  if (!accel)
+    return;
+  const SensorSource::SensorInfo* gyro = EnabledSensor(SENSOR_TYPE_GYROSCOPE);
+  // Boards without a magnetic field sensor report the raw field through
+  // their orientation sensor.
+  if (EnabledSensor(SENSOR_TYPE_MAGNETIC_FIELD))
+    fusion_mag_type_ = SENSOR_TYPE_MAGNETIC_FIELD;
+  else if (EnabledSensor(SENSOR_TYPE_ORIENTATION))
+    fusion_mag_type_ = SENSOR_TYPE_ORIENTATION;
+  // Without a magnetometer there is no absolute heading.
+  fused_type_ = fusion_mag_type_ ? SENSOR_TYPE_ROTATION_VECTOR
+                                 : SENSOR_TYPE_GAME_ROTATION_VECTOR;
+
+  SensorSource::SensorInfo fused;
+  fused.type = fused_type_;
+  fused.name = base::StringPrintf(
+      "Madgwick fusion of accel%s%s", gyro ? ", gyro" : "",
+      fusion_mag_type_ ? ", magnetic field" : "");
+  fused.resolution = 1e-4f;
+  fused.period_us = (gyro ? gyro : accel)->period_us;
+  fused.max_latency_us = 0;
+  fused.fifo_events = 0;
+  enabled_sensors_.push_back(fused);
+  fusion_.reset(new OrientationFusion(options_.fusion_options));
+  LOG(INFO) << "Fusing " << fused.name << " at the "
+            << (gyro ? "gyro" : "accel") << " rate, "
+            << home_cloud::FusionSimdName() << " quaternion math";
+}
+
+void Daemon::OnShutdown() {
+  for (auto& source : sources_)
+    source->Stop();
+  gpio_watcher_.reset();
+  recorder_.reset();
+  if (store_)
+    store_->Flush();
+}
+
+Daemon::SensorState* Daemon::StateFor(int type) {
+  for (SensorState& state : sensors_) {
+    if (state.type == type)
+      return &state;
+  }
+  return nullptr;
+}
+
+void Daemon::OnSensorEvents(const ASensorEvent* events, size_t count) {
+  if (batches_++ == 0)
+    service_hub::MarkBootPhase(name(), "first sample");
+  largest_batch_ = std::max(largest_batch_, count);
+  if (recorder_)
+    recorder_->Write(events, count);
+  CheckWallClock();
+
+  SensorState* state = nullptr;
+  for (size_t i = 0; i < count; i++) {
+    const ASensorEvent& event = events[i];
+    if (!state || state->type != event.type) {
+      state = StateFor(event.type);
+      if (!state)
+        continue;
+    }
+    state->events++;
+    // A continuous sensor that skips more than one period has lost samples
+    // somewhere between the HAL and us.
+    if (state->period_ns > 0 && state->last_timestamp > 0) {
+      int64_t gap = event.timestamp - state->last_timestamp;
+      if (gap > 2 * state->period_ns)
+        state->missed += (gap + state->period_ns / 2) / state->period_ns - 1;
+    }
+    state->last_timestamp = event.timestamp;
+    if (state->rule_input >= 0)
+      RunRules(state->rule_input, event.timestamp / 1000, event.data);
+
+    int64_t timestamp = event.timestamp / 1000 + boot_to_wall_us_;
+    if (store_)
+      store_->Append(event.type, timestamp, event.data);
+    state->batch_timestamps.push_back(timestamp);
+    for (int axis = 0; axis < state->axes; axis++) {
+      state->batch_values[axis].push_back(event.data[axis]);
+      reporter_.Offer(state->report_ids[axis], event.data[axis]);
+    }
+
+    if (options_.print_samples)
+      DisplaySensorData(event.type, &event);
+  }
+
+  if (fusion_)
+    FuseOrientation();
+
+  // Aggregate a column at a time, so whole runs go through the vector path.
+  for (SensorState& sensor : sensors_) {
+    if (sensor.batch_timestamps.empty())
       continue;
+    const float* values[home_cloud::kMaxAxes];
+    for (int axis = 0; axis < sensor.axes; axis++)
+      values[axis] = sensor.batch_values[axis].data();
+    aggregator_->AddBatch(sensor.type, sensor.batch_timestamps.data(), values,
+                          sensor.batch_timestamps.size());
+    sensor.batch_timestamps.clear();
+    for (int axis = 0; axis < sensor.axes; axis++)
+      sensor.batch_values[axis].clear();
+  }
+}
+
+// Sensor timestamps are mapped to the wall clock through an offset that is
+// only right until the clock is set. When it has been, history and windows
+// start afresh on the new offset instead of mixing the two timelines.
+void Daemon::CheckWallClock() {
+  int64_t offset = BootToWallClockMicros();
+  int64_t step = offset - boot_to_wall_us_;
+  if (step > -kWallClockStepUs && step < kWallClockStepUs)
+    return;
+  LOG(INFO) << "Wall clock stepped by " << step / 1000 << " ms";
+  boot_to_wall_us_ = offset;
+  if (store_)
+    store_->Split();
+  aggregator_->Reset();
+}
+
+// Runs the batch's accel, magnetometer and gyro columns through the
+// orientation filter, filling the fused sensor's columns.
+void Daemon::FuseOrientation() {
+  auto input = [this](int type) {
+    FusionInput input = {nullptr, {nullptr, nullptr, nullptr}, 0};
+    SensorState* state = type ? StateFor(type) : nullptr;
+    if (state) {
+      input.timestamps = state->batch_timestamps.data();
+      for (int axis = 0; axis < 3; axis++)
+        input.values[axis] = state->batch_values[axis].data();
+      input.count = state->batch_timestamps.size();
+    }
+    return input;
+  };
+  FusionInput accel = input(SENSOR_TYPE_ACCELEROMETER);
+  FusionInput mag = input(fusion_mag_type_);
+  FusionInput gyro = input(SENSOR_TYPE_GYROSCOPE);
+  size_t capacity = accel.count + gyro.count;
+  SensorState* fused = StateFor(fused_type_);
+  if (capacity == 0 || !fused)
+    return;
+
+  fused->batch_timestamps.resize(capacity);
+  float* columns[home_cloud::kMaxAxes];
+  for (int axis = 0; axis < fused->axes; axis++) {
+    fused->batch_values[axis].resize(capacity);
+    columns[axis] = fused->batch_values[axis].data();
+  }
+  size_t count = fusion_->AddBatch(accel, mag, gyro,
+                                   fused->batch_timestamps.data(), columns);
+  fused->batch_timestamps.resize(count);
+  for (int axis = 0; axis < fused->axes; axis++)
+    fused->batch_values[axis].resize(count);
+
+  fused->events += count;
+  for (size_t i = 0; i < count; i++) {
+    ASensorEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = fused_type_;
+    for (int axis = 0; axis < fused->axes; axis++) {
+      event.data[axis] = columns[axis][i];
+      reporter_.Offer(fused->report_ids[axis], columns[axis][i]);
     }
-    if (ASensorEventQueue_getEvents(queue, data, kNumEvents) <= 0) {
-      fprintf(stderr, "Failed to read data from the sensor.\n");
+    if (store_)
+      store_->Append(fused_type_, fused->batch_timestamps[i], event.data);
+    if (fused->rule_input >= 0) {
+      RunRules(fused->rule_input,
+               fused->batch_timestamps[i] - boot_to_wall_us_, event.data);
+    }
+    if (options_.print_samples)
+      DisplaySensorData(fused_type_, &event);
+  }
+}
+
+// Compiles the rules file, if there is one. Returns false if the rules do
+// not compile.
+bool Daemon::LoadRules() {
+  std::string text;
+  if (options_.rules_path.empty() ||
+      !base::ReadFileToString(base::FilePath(options_.rules_path), &text)) {
+    LOG(INFO) << "No rules to run";
+    return true;
+  }
+  auto resolver = [](const std::string& name, int* axes) {
+    int type = FindSensorType(name);
+    *axes = type >= 0 ? SensorAxes(type) : 0;
+    return type;
+  };
+  rules_ = RulesEngine::Compile(text, resolver, options_.period_us);
+  if (!rules_)
+    return false;
+  if (rules_->rule_count() == 0) {
+    LOG(INFO) << "No rules to run";
+    rules_.reset();
+    return true;
+  }
+  LOG(INFO) << "Running " << rules_->rule_count() << " rules from "
+            << options_.rules_path;
+  return true;
+}
+
+// Whether a rule reads the sensor, or the orientation fused from it.
+bool Daemon::RulesRead(int type) const {
+  if (!rules_)
+    return false;
+  if (rules_->FindInput(RuleInput::kSensor, type) >= 0)
+    return true;
+  bool fusion_input = type == SENSOR_TYPE_ACCELEROMETER ||
+                      type == SENSOR_TYPE_MAGNETIC_FIELD ||
+                      type == SENSOR_TYPE_ORIENTATION ||
+                      type == SENSOR_TYPE_GYROSCOPE;
+  return fusion_input && options_.fusion &&
+         (rules_->FindInput(RuleInput::kSensor,
+                            SENSOR_TYPE_ROTATION_VECTOR) >= 0 ||
+          rules_->FindInput(RuleInput::kSensor,
+                            SENSOR_TYPE_GAME_ROTATION_VECTOR) >= 0);
+}
+
+// Points the sensors rules read at their inputs, and watches the GPIO pins
+// they read.
+void Daemon::WatchRuleInputs() {
+  if (!rules_)
+    return;
+  std::vector<int> pins;
+  for (const RuleInput& input : rules_->inputs()) {
+    if (input.kind == RuleInput::kGpio)
+      pins.push_back(input.id);
+    else if (!StateFor(input.id))
+      LOG(WARNING) << "Rules read " << SensorTypeName(input.id)
+                   << ", which is not enabled";
+  }
+  for (SensorState& state : sensors_)
+    state.rule_input = rules_->FindInput(RuleInput::kSensor, state.type);
+  if (!pins.empty()) {
+    gpio_watcher_.reset(new GpioWatcher(
+        base::ThreadTaskRunnerHandle::Get(),
+        base::Bind(&Daemon::OnGpioEdge, weak_ptr_factory_.GetWeakPtr()),
+        kGpioSysfsRoot));
+    if (!gpio_watcher_->Start(pins))
+      LOG(WARNING) << "Rules read GPIO pins that cannot be watched";
+  }
+}
+
+// Evaluates the rules reading an input, timestamp in microseconds since
+// boot, and runs the actions of those that fire.
+void Daemon::RunRules(int input, int64_t timestamp, const float* values) {
+  const std::vector<const RuleAction*>& actions =
+      rules_->Evaluate(input, timestamp, values);
+  if (actions.empty())
+    return;
+  int64_t evaluated = BootTimeMicros();
+  for (const RuleAction* action : actions) {
+    if (!RunAction(*action))
+      rule_latency_.failed_actions++;
+  }
+  int64_t done = BootTimeMicros();
+  rule_latency_.triggers++;
+  rule_latency_.delivery_total_us += evaluated - timestamp;
+  rule_latency_.delivery_max_us =
+      std::max(rule_latency_.delivery_max_us, evaluated - timestamp);
+  rule_latency_.action_total_us += done - timestamp;
+  rule_latency_.action_max_us =
+      std::max(rule_latency_.action_max_us, done - timestamp);
+}
+
+bool Daemon::RunAction(const RuleAction& action) {
+  android::binder::Status status;
+  switch (action.kind) {
+    case RuleAction::kLed: {
+      if (!led_service_.get())
+        return false;
+      if (action.led < 0 || action.led >= led_count_) {
+        LOG(WARNING) << "Rules set LED " << action.led << " of " << led_count_;
+        return false;
+      }
+      bool on = action.command == RuleAction::kOn;
+      if (action.command == RuleAction::kToggle) {
+        status = led_service_->getLED(action.led, &on);
+        if (!status.isOk())
+          return false;
+        on = !on;
+      }
+      status = led_service_->setLED(action.led, on);
+      break;
+    }
+    case RuleAction::kAllLeds:
+      if (!led_service_.get())
+        return false;
+      status = led_service_->setAllLEDs(action.command == RuleAction::kOn);
+      break;
+    case RuleAction::kMedia:
+      if (!media_service_.get())
+        return false;
+      if (action.command == RuleAction::kPlay)
+        status = media_service_->play();
+      else if (action.command == RuleAction::kPause)
+        status = media_service_->pause();
+      else if (action.command == RuleAction::kStop)
+        status = media_service_->stop();
+      else
+        status = media_service_->next();
+      break;
+    case RuleAction::kVolume:
+      if (!media_service_.get())
+        return false;
+      status = media_service_->setVolume(action.volume);
+      break;
+  }
+  return status.isOk();
+}
+
+void Daemon::OnGpioEdge(int pin, int value, int64_t timestamp) {
+  int input = rules_->FindInput(RuleInput::kGpio, pin);
+  float values[1] = {static_cast<float>(value)};
+  if (input >= 0)
+    RunRules(input, timestamp, values);
+}
+
+void Daemon::ConnectToLEDService() {
+  auto binder = service_hub::GetService(ledservice::kBinderServiceName);
+  if (!binder.get()) {
+    brillo::MessageLoop::current()->PostDelayedTask(
+        base::Bind(&Daemon::ConnectToLEDService,
+                   weak_ptr_factory_.GetWeakPtr()),
+        led_service_retry_.Next());
+    return;
+  }
+  led_service_retry_.Reset();
+  service_hub::MarkBootPhase(name(), "ledservice connected");
+  service_hub::WatchService(
+      binder,
+      base::Bind(&Daemon::OnLEDServiceDisconnected,
+                 weak_ptr_factory_.GetWeakPtr()));
+  led_service_ = android::interface_cast<ILEDService>(binder);
+  if (!led_service_->getLEDCount(&led_count_).isOk())
+    led_count_ = 0;
+}
+
+void Daemon::OnLEDServiceDisconnected() {
+  led_service_ = nullptr;
+  ConnectToLEDService();
+}
+
+void Daemon::ConnectToMediaService() {
+  auto binder = service_hub::GetService(mp3_player_service::kBinderServiceName);
+  if (!binder.get()) {
+    brillo::MessageLoop::current()->PostDelayedTask(
+        base::Bind(&Daemon::ConnectToMediaService,
+                   weak_ptr_factory_.GetWeakPtr()),
+        media_service_retry_.Next());
+    return;
+  }
+  media_service_retry_.Reset();
+  service_hub::MarkBootPhase(name(), "mp3 player connected");
+  service_hub::WatchService(
+      binder,
+      base::Bind(&Daemon::OnMediaServiceDisconnected,
+                 weak_ptr_factory_.GetWeakPtr()));
+  media_service_ = android::interface_cast<IMp3PlayerService>(binder);
+}
+
+void Daemon::OnMediaServiceDisconnected() {
+  media_service_ = nullptr;
+  ConnectToMediaService();
+}
+
+void Daemon::OnWindowResult(const WindowResult& result) {
+  printf("%s[%d] %.1fs window ending %lld: n=%u min=%f max=%f mean=%f "
+         "var=%f\n",
+         SensorTypeName(result.type), result.axis,
+         (result.end - result.start) / 1e6,
+         static_cast<long long>(result.end), result.count, result.min,
+         result.max, result.mean, result.variance);
+}
+
+const ReportPolicy& Daemon::PolicyFor(const std::string& component,
+                                      const std::string& property) const {
+  // Properties are named trait.property; a policy names just the property.
+  std::string name = property.substr(property.find('.') + 1);
+  auto it = options_.report_policies.find(component + "." + name);
+  if (it == options_.report_policies.end())
+    it = options_.report_policies.find(component);
+  return it != options_.report_policies.end() ? it->second
+                                               : kDefaultReportPolicy;
+}
+
+void Daemon::OnWeaveServiceConnected(
+    const std::weak_ptr<weaved::Service>& service) {
+  weave_service_ = service;
+  auto weave_service = weave_service_.lock();
+  if (!weave_service)
+    return;
+
+  for (const SensorState& sensor : sensors_) {
+    const char* component = SensorTypeName(sensor.type);
+    const char* reading = sensor.axes == 1 ? kScalarTrait : kVectorTrait;
+    if (!weave_service->AddComponent(component, {kSensorInfoTrait, reading},
+                                     nullptr))
       continue;
+    weave_service->SetStateProperty(component, kSensorInfoTrait, "name",
+                                    *brillo::ToValue(sensor.name), nullptr);
+  }
+  service_hub::MarkBootPhase(name(), "weave components added");
+  // A new weaved connection has none of our state yet.
+  reporter_.RepublishAll();
+  PublishState();
+}
+
+// Sends each component with something due to report as a single state
+// update.
+void Daemon::PublishState() {
+  auto weave_service = weave_service_.lock();
+  if (weave_service) {
+    std::vector<StateReporter::ComponentUpdate> updates;
+    reporter_.Collect(BootTimeMicros(), &updates);
+    for (const StateReporter::ComponentUpdate& update : updates) {
+      base::DictionaryValue state;
+      for (const auto& property : update.properties)
+        state.SetDouble(property.first, property.second);
+      weave_service->SetStateProperties(update.component, state, nullptr);
     }
+  }
+}
 
-    DisplaySensorData(options.sensor_type, data);
-    sleep(kWaitTimeSecs);
+void Daemon::OnPublishTick() {
+  PublishState();
+  if (store_)
+    store_->FlushAged(BootTimeMicros() + boot_to_wall_us_);
+  brillo::MessageLoop::current()->PostDelayedTask(
+      base::Bind(&Daemon::OnPublishTick, weak_ptr_factory_.GetWeakPtr()),
+      base::TimeDelta::FromMicroseconds(
+          std::max(reporter_.tick_us(), kMinPublishTickUs)));
+}
+
+// Closes the windows of sensors that went quiet, once per shortest hop.
+// Windows are held open for one longest window and the longest batch
+// latency past the clock, so samples that arrive late from a batching
+// sensor still land in the right one.
+void Daemon::OnWindowTick() {
+  int64_t longest = 0;
+  int64_t shortest_hop = std::numeric_limits<int64_t>::max();
+  for (const WindowSpec& window : options_.windows) {
+    longest = std::max(longest, window.length_us);
+    shortest_hop = std::min(shortest_hop, window.hop_us);
   }
+  int64_t latency = 0;
+  for (const SensorSource::SensorInfo& sensor : enabled_sensors_)
+    latency = std::max(latency, sensor.max_latency_us);
+  aggregator_->Advance(BootTimeMicros() + boot_to_wall_us_ - longest -
+                       latency);
+  brillo::MessageLoop::current()->PostDelayedTask(
+      base::Bind(&Daemon::OnWindowTick, weak_ptr_factory_.GetWeakPtr()),
+      base::TimeDelta::FromMicroseconds(
+          std::max(shortest_hop, kMinWindowTickUs)));
+}
 
-  int ret = ASensorEventQueue_disableSensor(queue, sensor);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to disable %s: %s\n",
-            ASensor_getName(sensor), strerror(-ret));
+void Daemon::ReportStats() {
+  base::TimeTicks now = base::TimeTicks::Now();
+  double seconds = std::max((now - stats_since_).InSecondsF(), 1e-3);
+  uint64_t total = 0;
+  for (SensorState& stats : sensors_) {
+    LOG(INFO) << base::StringPrintf(
+        "%s (%s): %llu events, %.2f/s, %llu missed", SensorTypeName(stats.type),
+        stats.name.c_str(), static_cast<unsigned long long>(stats.events),
+        stats.events / seconds, static_cast<unsigned long long>(stats.missed));
+    if (stats.type != fused_type_)
+      total += stats.events;
+    stats.events = 0;
+    stats.missed = 0;
   }
 
-  ret = ASensorManager_destroyEventQueue(sensor_manager, queue);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to destroy event queue: %s\n", strerror(-ret));
-    return 1;
+  // Streaming, every event is a wake-up of its own; the difference is what
+  // batching in the sensor hub saves.
+  uint64_t wakeups = 0;
+  uint64_t dropped = 0;
+  for (const auto& source : sources_) {
+    wakeups += source->wakeups();
+    dropped += source->backlog_dropped();
   }
+  wakeups -= wakeups_reported_;
+  dropped -= dropped_reported_;
+  LOG(INFO) << base::StringPrintf(
+      "%.2f events/s, %.1f wake-ups/min (%.1f/min streaming), %.1f events "
+      "per batch (max %zu), %llu dropped in backlog",
+      total / seconds, wakeups * 60 / seconds, total * 60 / seconds,
+      batches_ ? static_cast<double>(total) / batches_ : 0.0, largest_batch_,
+      static_cast<unsigned long long>(dropped));
+  LOG(INFO) << aggregator_->published() << " windows published";
+  const StateReporter::Stats& report = reporter_.stats();
+  LOG(INFO) << base::StringPrintf(
+      "Weave: %llu of %llu samples published in %llu state updates, %llu "
+      "within the deadband, %llu rate limited, %llu heartbeats",
+      static_cast<unsigned long long>(report.published),
+      static_cast<unsigned long long>(report.samples),
+      static_cast<unsigned long long>(report.updates),
+      static_cast<unsigned long long>(report.deadband_suppressed),
+      static_cast<unsigned long long>(report.rate_suppressed),
+      static_cast<unsigned long long>(report.heartbeats));
 
-  return 0;
+  if (rules_) {
+    const RulesEngine::Stats& rules = rules_->stats();
+    uint64_t triggers = std::max<uint64_t>(rule_latency_.triggers, 1);
+    LOG(INFO) << base::StringPrintf(
+        "Rules: %llu events evaluated in %.2f us on average (max %.2f us), "
+        "%llu fired",
+        static_cast<unsigned long long>(rules.events),
+        rules.events ? rules.total_ns / 1e3 / rules.events : 0.0,
+        rules.max_ns / 1e3, static_cast<unsigned long long>(rules.fired));
+    LOG(INFO) << base::StringPrintf(
+        "Rules: event to action %.2f ms on average (max %.2f ms), %.2f ms "
+        "(max %.2f ms) of it before evaluation, %llu actions failed",
+        rule_latency_.action_total_us / 1e3 / triggers,
+        rule_latency_.action_max_us / 1e3,
+        rule_latency_.delivery_total_us / 1e3 / triggers,
+        rule_latency_.delivery_max_us / 1e3,
+        static_cast<unsigned long long>(rule_latency_.failed_actions));
+  }
+
+  if (store_) {
+    const SampleStore::Stats& store = store_->stats();
+    LOG(INFO) << base::StringPrintf(
+        "Store: %llu samples on disk in %llu bytes, %llu lost, %llu write "
+        "errors",
+        static_cast<unsigned long long>(store.flushed_samples),
+        static_cast<unsigned long long>(store.bytes_written),
+        static_cast<unsigned long long>(store.lost_samples),
+        static_cast<unsigned long long>(store.write_errors));
+  }
+  wakeups_reported_ += wakeups;
+  dropped_reported_ += dropped;
+  batches_ = 0;
+  largest_batch_ = 0;
+  stats_since_ = now;
+
+  brillo::MessageLoop::current()->PostDelayedTask(
+      base::Bind(&Daemon::ReportStats, weak_ptr_factory_.GetWeakPtr()),
+      options_.stats_interval);
+}
+
+}  // anonymous namespace
+
+namespace home_cloud {
+
+std::unique_ptr<service_hub::Module> CreateModule() {
+  std::vector<int> types;
+  std::vector<WindowSpec> windows;
+  std::map<std::string, ReportPolicy> report_policies;
+  if (!ParseSensorTypes(FLAGS_sensors, &types) ||
+      !ParseWindows(FLAGS_windows, &windows) ||
+      !ParseReportPolicies(FLAGS_weave_reporting, &report_policies))
+    return nullptr;
+  Daemon::Options options;
+  options.types = types;
+  options.period_us = std::max(FLAGS_sample_period_ms, 1) * 1000;
+  options.max_latency_us = std::max(FLAGS_max_report_latency_ms, 0) * 1000LL;
+  options.windows = windows;
+  options.stats_interval = base::TimeDelta::FromSeconds(FLAGS_stats_interval_s);
+  options.print_samples = FLAGS_print_samples;
+  options.print_windows = FLAGS_print_windows;
+  options.store_dir = FLAGS_store_dir;
+  options.report_policies = report_policies;
+  options.fusion = FLAGS_fusion;
+  options.fusion_options = OrientationFilter::DefaultOptions();
+  options.fusion_options.beta = static_cast<float>(FLAGS_fusion_beta);
+  options.rules_path = FLAGS_rules;
+  options.iio_device = FLAGS_iio_device;
+  options.record_path = FLAGS_record;
+  options.replay_path = FLAGS_replay;
+  options.replay_speed = FLAGS_replay_speed;
+  // Replayed events are stamped with the current time, and would land in
+  // the device's own history among the real ones.
+  if (!options.replay_path.empty() && options.store_dir == kHistoryDir) {
+    LOG(INFO) << "Not keeping history of the replay; give --store_dir "
+              << "another directory to keep it";
+    options.store_dir.clear();
+  }
+  return std::unique_ptr<service_hub::Module>(new Daemon(options));
 }
+
+}  // namespace home_cloud
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_HOME_CLOUD_SERVICE_H_
+#define HOME_CLOUD_SERVICE_HOME_CLOUD_SERVICE_H_
+
+#include <memory>
+
+#include "service_module.h"
+
+namespace home_cloud {
+
+// Collects, stores and publishes sensor data and runs the rules, as set
+// up by the command line flags. Null if the flags do not parse.
+std::unique_ptr<service_hub::Module> CreateModule();
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_HOME_CLOUD_SERVICE_H_
@@ -0,0 +1,437 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "iio_buffer_reader.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace home_cloud {
+
+namespace {
+const char kTimestampChannel[] = "timestamp";
+// Records read per read() call.
+const size_t kReadRecords = 128;
+const size_t kMaxChannels = 4;
+// Where configfs makes high resolution timer triggers.
+const char kHrtimerTriggers[] = "/config/iio/triggers/hrtimer/";
+// Rate of a timer trigger when neither the caller nor the device gives one.
+const double kDefaultTriggerFrequency = 1.0;
+
+bool ReadAttribute(const std::string& path, std::string* value) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  char text[128];
+  ssize_t n = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (n < 0)
+    return false;
+  while (n > 0 && (text[n - 1] == '\n' || text[n - 1] == ' '))
+    n--;
+  value->assign(text, n);
+  return true;
+}
+
+bool WriteAttribute(const std::string& path, const std::string& value) {
+  int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool ok = write(fd, value.data(), value.size()) ==
+            static_cast<ssize_t>(value.size());
+  close(fd);
+  return ok;
+}
+
+double ReadNumber(const std::string& path, double fallback) {
+  std::string text;
+  if (!ReadAttribute(path, &text) || text.empty())
+    return fallback;
+  return strtod(text.c_str(), nullptr);
+}
+
+bool ReadDouble(const std::string& path, double* value) {
+  std::string text;
+  if (!ReadAttribute(path, &text) || text.empty())
+    return false;
+  char* end;
+  *value = strtod(text.c_str(), &end);
+  return *end == '\0';
+}
+
+// Finds the trigger named name, or with a name starting with it if prefix.
+// Returns its sysfs directory, or an empty string.
+std::string FindTrigger(const std::string& sysfs_root, const std::string& name,
+                        bool prefix) {
+  DIR* dir = opendir(sysfs_root.c_str());
+  if (!dir)
+    return std::string();
+  std::string found;
+  while (struct dirent* entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "trigger", 7) != 0)
+      continue;
+    std::string path = sysfs_root + "/" + entry->d_name;
+    std::string trigger;
+    if (ReadAttribute(path + "/name", &trigger) &&
+        (prefix ? trigger.compare(0, name.size(), name) == 0
+                : trigger == name)) {
+      found = path;
+      break;
+    }
+  }
+  closedir(dir);
+  return found;
+}
+
+// Parses a scan element type such as "le:s16/32>>0". Repeated elements
+// (an X count) are not supported.
+bool ParseType(const std::string& text, IioChannel* channel) {
+  char endian[3];
+  char sign;
+  int storage_bits;
+  if (sscanf(text.c_str(), "%2s:%c%d/%d>>%d", endian, &sign, &channel->bits,
+             &storage_bits, &channel->shift) != 5)
+    return false;
+  if ((sign != 's' && sign != 'u') ||
+      (storage_bits != 8 && storage_bits != 16 && storage_bits != 32 &&
+       storage_bits != 64) ||
+      channel->bits <= 0 || channel->bits + channel->shift > storage_bits)
+    return false;
+  channel->is_signed = sign == 's';
+  channel->big_endian = strcmp(endian, "be") == 0;
+  channel->storage_bytes = storage_bits / 8;
+  return true;
+}
+}  // anonymous namespace
+
+IioBufferReader::IioBufferReader(const std::string& sysfs_dir)
+    : sysfs_dir_(sysfs_dir) {}
+
+IioBufferReader::~IioBufferReader() {
+  if (fd_ >= 0)
+    close(fd_);
+  if (enabled_)
+    WriteAttribute(sysfs_dir_ + "/buffer/enable", "0");
+}
+
+std::unique_ptr<IioBufferReader> IioBufferReader::Open(
+    const std::string& sysfs_dir, const std::string& device,
+    const Options& options) {
+  std::unique_ptr<IioBufferReader> reader(new IioBufferReader(sysfs_dir));
+  if (!reader->Setup(device, options))
+    return nullptr;
+  return reader;
+}
+
+bool IioBufferReader::Setup(const std::string& device,
+                            const Options& options) {
+  const std::vector<std::string>& channels = options.channels;
+  if (channels.empty() || channels.size() > kMaxChannels) {
+    LOG(ERROR) << "IIO reads take 1 to " << kMaxChannels << " channels";
+    return false;
+  }
+  // The buffer has to be off while the scan changes.
+  WriteAttribute(sysfs_dir_ + "/buffer/enable", "0");
+  const std::string scan_dir = sysfs_dir_ + "/scan_elements/";
+  std::vector<std::string> wanted = channels;
+  wanted.push_back(kTimestampChannel);
+  for (const std::string& name : wanted) {
+    std::string enable = scan_dir + "in_" + name + "_en";
+    std::string value;
+    if (!WriteAttribute(enable, "1") &&
+        !(ReadAttribute(enable, &value) && value == "1")) {
+      if (name == kTimestampChannel)
+        continue;
+      PLOG(ERROR) << "Failed to enable IIO channel " << name << " of "
+                  << sysfs_dir_;
+      return false;
+    }
+  }
+
+  // Every enabled element takes space in a record, asked for or not.
+  DIR* dir = opendir(scan_dir.c_str());
+  if (!dir) {
+    PLOG(ERROR) << "No scan elements in " << sysfs_dir_;
+    return false;
+  }
+  std::vector<IioChannel> layout;
+  while (struct dirent* entry = readdir(dir)) {
+    std::string file = entry->d_name;
+    const std::string kSuffix = "_en";
+    if (file.compare(0, 3, "in_") != 0 || file.size() <= 3 + kSuffix.size() ||
+        file.compare(file.size() - kSuffix.size(), kSuffix.size(), kSuffix) !=
+            0)
+      continue;
+    std::string value;
+    if (!ReadAttribute(scan_dir + file, &value) || value != "1")
+      continue;
+    IioChannel channel;
+    channel.name = file.substr(3, file.size() - 3 - kSuffix.size());
+    std::string base = scan_dir + "in_" + channel.name;
+    std::string type;
+    if (!ReadAttribute(base + "_type", &type) || !ParseType(type, &channel)) {
+      LOG(ERROR) << "Unsupported IIO scan type '" << type << "' for "
+                 << channel.name;
+      closedir(dir);
+      return false;
+    }
+    channel.index = static_cast<int>(ReadNumber(base + "_index", -1));
+    channel.scale = ReadNumber(sysfs_dir_ + "/in_" + channel.name + "_scale",
+                               1.0);
+    channel.raw_offset =
+        ReadNumber(sysfs_dir_ + "/in_" + channel.name + "_offset", 0.0);
+    layout.push_back(channel);
+  }
+  closedir(dir);
+
+  // Elements follow in index order, each aligned to its own size, and the
+  // record is padded to the largest of them.
+  std::sort(layout.begin(), layout.end(),
+            [](const IioChannel& a, const IioChannel& b) {
+              return a.index < b.index;
+            });
+  size_t offset = 0;
+  size_t alignment = 1;
+  for (IioChannel& channel : layout) {
+    size_t size = channel.storage_bytes;
+    offset = (offset + size - 1) / size * size;
+    channel.offset = offset;
+    offset += size;
+    alignment = std::max(alignment, size);
+  }
+  record_bytes_ = (offset + alignment - 1) / alignment * alignment;
+
+  channels_.clear();
+  for (const std::string& name : channels) {
+    auto it = std::find_if(layout.begin(), layout.end(),
+                           [&name](const IioChannel& channel) {
+                             return channel.name == name;
+                           });
+    if (it == layout.end()) {
+      LOG(ERROR) << "IIO channel " << name << " is not in the scan";
+      return false;
+    }
+    channels_.push_back(*it);
+  }
+  for (const IioChannel& channel : layout) {
+    if (channel.name == kTimestampChannel && channel.storage_bytes == 8)
+      timestamp_offset_ = channel.offset;
+  }
+
+  // Sensor event timestamps count from boot; IIO's default to wall time.
+  std::string clock;
+  WriteAttribute(sysfs_dir_ + "/current_timestamp_clock", "boottime");
+  boottime_ = ReadAttribute(sysfs_dir_ + "/current_timestamp_clock",
+                            &clock) &&
+              clock == "boottime";
+  if (options.sampling_frequency > 0) {
+    WriteAttribute(sysfs_dir_ + "/sampling_frequency",
+                   std::to_string(options.sampling_frequency));
+  }
+  sampling_frequency_ = ReadNumber(sysfs_dir_ + "/sampling_frequency", 0);
+  if (!AssignTrigger(options.sampling_frequency))
+    return false;
+
+  WriteAttribute(sysfs_dir_ + "/buffer/length",
+                 std::to_string(options.buffer_records));
+  if (options.max_latency_us > 0 && sampling_frequency_ > 0) {
+    // Keep half the buffer free for records that come in while we read.
+    size_t watermark = std::min<size_t>(
+        options.buffer_records / 2,
+        options.max_latency_us * sampling_frequency_ / 1000000);
+    WriteAttribute(sysfs_dir_ + "/buffer/watermark",
+                   std::to_string(std::max<size_t>(watermark, 1)));
+  }
+  if (!WriteAttribute(sysfs_dir_ + "/buffer/enable", "1")) {
+    PLOG(ERROR) << "Failed to enable the IIO buffer of " << sysfs_dir_;
+    return false;
+  }
+  enabled_ = true;
+
+  fd_ = open(device.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Failed to open " << device;
+    return false;
+  }
+  buffer_.resize(record_bytes_ * kReadRecords);
+  return true;
+}
+
+bool IioBufferReader::AssignTrigger(double frequency) {
+  const std::string current = sysfs_dir_ + "/trigger/current_trigger";
+  std::string trigger;
+  // Buffers filled from a hardware FIFO have no trigger to set, and one
+  // somebody already set is left alone.
+  if (!ReadAttribute(current, &trigger) || !trigger.empty())
+    return true;
+
+  // Drivers name their data-ready trigger after the device, as
+  // "<name>-dev<N>".
+  const std::string sysfs_root = sysfs_dir_.substr(0, sysfs_dir_.rfind('/'));
+  std::string name;
+  ReadAttribute(sysfs_dir_ + "/name", &name);
+  std::string trigger_dir = FindTrigger(sysfs_root, name + "-dev", true);
+  if (trigger_dir.empty()) {
+    // Otherwise a timer drives the conversions.
+    std::string timer = name + "-timer";
+    if (mkdir((kHrtimerTriggers + timer).c_str(), 0755) < 0 &&
+        errno != EEXIST) {
+      PLOG(ERROR) << "No trigger for " << sysfs_dir_
+                  << " and no timer trigger could be made";
+      return false;
+    }
+    trigger_dir = FindTrigger(sysfs_root, timer, false);
+    if (trigger_dir.empty()) {
+      LOG(ERROR) << "Timer trigger " << timer << " did not show up";
+      return false;
+    }
+    if (frequency <= 0)
+      frequency = sampling_frequency_ > 0 ? sampling_frequency_
+                                          : kDefaultTriggerFrequency;
+    WriteAttribute(trigger_dir + "/sampling_frequency",
+                   std::to_string(frequency));
+    sampling_frequency_ = ReadNumber(trigger_dir + "/sampling_frequency",
+                                     frequency);
+  }
+  ReadAttribute(trigger_dir + "/name", &trigger);
+  if (!WriteAttribute(current, trigger)) {
+    PLOG(ERROR) << "Failed to set trigger " << trigger << " on " << sysfs_dir_;
+    return false;
+  }
+  return true;
+}
+
+bool IioBufferReader::Read(std::vector<Sample>* samples) {
+  for (;;) {
+    ssize_t n = read(fd_, buffer_.data() + buffered_,
+                     buffer_.size() - buffered_);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return true;
+      PLOG(ERROR) << "Failed to read the IIO buffer";
+      return false;
+    }
+    if (n == 0)
+      return true;
+    buffered_ += n;
+    size_t records = buffered_ / record_bytes_;
+    size_t first = samples->size();
+    samples->resize(first + records);
+    for (size_t i = 0; i < records; i++)
+      Decode(&buffer_[i * record_bytes_], &(*samples)[first + i]);
+    size_t used = records * record_bytes_;
+    memmove(buffer_.data(), buffer_.data() + used, buffered_ - used);
+    buffered_ -= used;
+  }
+}
+
+void IioBufferReader::Decode(const uint8_t* record, Sample* sample) const {
+  for (size_t i = 0; i < channels_.size(); i++) {
+    const IioChannel& channel = channels_[i];
+    const uint8_t* field = record + channel.offset;
+    uint64_t raw;
+    switch (channel.storage_bytes) {
+      case 1:
+        raw = field[0];
+        break;
+      case 2: {
+        uint16_t value;
+        memcpy(&value, field, sizeof(value));
+        raw = channel.big_endian ? be16toh(value) : le16toh(value);
+        break;
+      }
+      case 4: {
+        uint32_t value;
+        memcpy(&value, field, sizeof(value));
+        raw = channel.big_endian ? be32toh(value) : le32toh(value);
+        break;
+      }
+      default: {
+        uint64_t value;
+        memcpy(&value, field, sizeof(value));
+        raw = channel.big_endian ? be64toh(value) : le64toh(value);
+        break;
+      }
+    }
+    raw >>= channel.shift;
+    if (channel.bits < 64) {
+      raw &= (1ULL << channel.bits) - 1;
+      // Sign-extend from the top bit of the field.
+      if (channel.is_signed && (raw >> (channel.bits - 1)))
+        raw |= ~((1ULL << channel.bits) - 1);
+    }
+    double value = channel.is_signed ? static_cast<int64_t>(raw) : raw;
+    sample->values[i] = (value + channel.raw_offset) * channel.scale;
+  }
+  if (timestamp_offset_ >= 0)
+    memcpy(&sample->timestamp, record + timestamp_offset_,
+           sizeof(sample->timestamp));
+  else
+    sample->timestamp = 0;
+}
+
+bool IioBufferReader::HasBuffer(const std::string& sysfs_dir) {
+  struct stat info;
+  return stat((sysfs_dir + "/buffer/enable").c_str(), &info) == 0;
+}
+
+bool IioBufferReader::ReadInput(const std::string& sysfs_dir,
+                                const std::string& channel, double* value) {
+  const std::string base = sysfs_dir + "/in_" + channel;
+  if (ReadDouble(base + "_input", value))
+    return true;
+  double raw;
+  if (!ReadDouble(base + "_raw", &raw))
+    return false;
+  *value = (raw + ReadNumber(base + "_offset", 0.0)) *
+           ReadNumber(base + "_scale", 1.0);
+  return true;
+}
+
+std::string IioBufferReader::FindDevice(
+    const std::string& sysfs_root, const std::vector<std::string>& names) {
+  DIR* dir = opendir(sysfs_root.c_str());
+  if (!dir)
+    return std::string();
+  std::string found;
+  while (struct dirent* entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "iio:device", 10) != 0)
+      continue;
+    std::string path = sysfs_root + "/" + entry->d_name;
+    std::string name;
+    if (ReadAttribute(path + "/name", &name) &&
+        std::find(names.begin(), names.end(), name) != names.end()) {
+      found = path;
+      break;
+    }
+  }
+  closedir(dir);
+  return found;
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_IIO_BUFFER_READER_H_
+#define HOME_CLOUD_SERVICE_IIO_BUFFER_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace home_cloud {
+
+// One enabled channel of an IIO scan, as laid out in a buffer record.
+struct IioChannel {
+  std::string name;
+  int index;
+  bool is_signed;
+  bool big_endian;
+  int bits;
+  int storage_bytes;
+  int shift;
+  // Byte offset of the channel within a record.
+  size_t offset;
+  // value = (raw + raw_offset) * scale, in the channel's IIO units.
+  double raw_offset;
+  double scale;
+};
+
+// Reads an IIO device through its triggered buffer rather than one sysfs
+// attribute at a time.
+//
+// Open() enables the requested scan elements and the timestamp, works out
+// the record layout from their index and type attributes once, gives a
+// triggered buffer a trigger if it has none, and starts the buffer. After that Read() takes whole records from the character
+// device in bulk and decodes them with shifts and masks; no strings are
+// parsed per sample. The sysfs directory and the device are plain paths, so
+// a directory of attribute files and a file of records stand in for a real
+// device off target.
+class IioBufferReader {
+ public:
+  // Decoded values of one record, in the order the channels were asked
+  // for.
+  struct Sample {
+    // Nanoseconds on the IIO timestamp clock; 0 without a timestamp.
+    int64_t timestamp;
+    double values[4];
+  };
+
+  struct Options {
+    // Scan element names without the in_ prefix, like "pressure" or
+    // "temp"; at most four.
+    std::vector<std::string> channels;
+    // Records the kernel buffer holds.
+    size_t buffer_records;
+    // Asked of the device unless 0; drivers round it to what they support.
+    double sampling_frequency;
+    // How long records may wait in the buffer before the device becomes
+    // readable, where the kernel supports a watermark.
+    int64_t max_latency_us;
+  };
+
+  // sysfs_dir is /sys/bus/iio/devices/iio:deviceN and device the matching
+  // /dev/iio:deviceN.
+  static std::unique_ptr<IioBufferReader> Open(const std::string& sysfs_dir,
+                                               const std::string& device,
+                                               const Options& options);
+  ~IioBufferReader();
+
+  // Non-blocking; wait for POLLIN before calling Read().
+  int fd() const { return fd_; }
+  // Appends every complete record available now. Returns false on a read
+  // error; a device with nothing to read is not one.
+  bool Read(std::vector<Sample>* samples);
+
+  const std::vector<IioChannel>& channels() const { return channels_; }
+  size_t record_bytes() const { return record_bytes_; }
+  // True if timestamps are on CLOCK_BOOTTIME rather than CLOCK_REALTIME.
+  bool boottime_timestamps() const { return boottime_; }
+  // Samples per second the device is set to; 0 if it does not say.
+  double sampling_frequency() const { return sampling_frequency_; }
+
+  // True if the device has a buffer. Drivers without one can only be read
+  // a value at a time, with ReadInput().
+  static bool HasBuffer(const std::string& sysfs_dir);
+  // Reads the current value of channel, in the channel's IIO units, from
+  // in_<channel>_input or else from in_<channel>_raw, offset and scale.
+  static bool ReadInput(const std::string& sysfs_dir,
+                        const std::string& channel, double* value);
+
+  // Finds the IIO device whose name is one of names. Returns its sysfs
+  // directory, or an empty string.
+  static std::string FindDevice(const std::string& sysfs_root,
+                                const std::vector<std::string>& names);
+
+ private:
+  explicit IioBufferReader(const std::string& sysfs_dir);
+  bool Setup(const std::string& device, const Options& options);
+  // Sets the device's data-ready trigger, or a timer trigger at frequency,
+  // as the buffer's trigger unless it has one.
+  bool AssignTrigger(double frequency);
+  void Decode(const uint8_t* record, Sample* sample) const;
+
+  std::string sysfs_dir_;
+  int fd_{-1};
+  bool enabled_{false};
+  std::vector<IioChannel> channels_;
+  // Where the timestamp is in a record, or -1.
+  int timestamp_offset_{-1};
+  size_t record_bytes_{0};
+  bool boottime_{false};
+  double sampling_frequency_{0};
+  // Bytes read but not yet a whole record.
+  std::vector<uint8_t> buffer_;
+  size_t buffered_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(IioBufferReader);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_IIO_BUFFER_READER_H_
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "iio_sensor_source.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <hardware/sensors.h>
+
+namespace home_cloud {
+
+namespace {
+// Records the kernel buffer holds.
+const size_t kBufferRecords = 256;
+// How often a device without a buffer is read when no period is asked for.
+const int32_t kDefaultPollPeriodUs = 1000000;
+
+struct ChannelMapping {
+  const char* channel;
+  int type;
+  const char* name;
+  // From IIO units (kPa, milli degrees Celsius) to sensor event units.
+  double factor;
+};
+
+const ChannelMapping kChannels[] = {
+  {"pressure", SENSOR_TYPE_PRESSURE, "IIO pressure", 10.0},
+  {"temp", SENSOR_TYPE_AMBIENT_TEMPERATURE, "IIO temperature", 0.001},
+};
+
+int64_t ClockNanos(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+}  // anonymous namespace
+
+const std::vector<std::string>& IioSensorSource::DeviceNames() {
+  // The IIO bmp280 driver also drives the BMP085 and BMP180.
+  static const std::vector<std::string> names = {"bmp085", "bmp180",
+                                                 "bmp280"};
+  return names;
+}
+
+const std::vector<int>& IioSensorSource::SensorTypes() {
+  static const std::vector<int> types = {SENSOR_TYPE_PRESSURE,
+                                         SENSOR_TYPE_AMBIENT_TEMPERATURE};
+  return types;
+}
+
+IioSensorSource::IioSensorSource(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+    const EventsCallback& callback, const std::string& sysfs_dir,
+    const std::string& device)
+    : SensorSource(task_runner, callback),
+      sysfs_dir_(sysfs_dir),
+      device_(device) {}
+
+IioSensorSource::~IioSensorSource() {
+  Stop();
+}
+
+bool IioSensorSource::Start(const std::vector<int>& types, int32_t period_us,
+                            int64_t max_latency_us) {
+  Stop();
+  IioBufferReader::Options options;
+  channel_types_.clear();
+  for (const ChannelMapping& mapping : kChannels) {
+    if (std::find(types.begin(), types.end(), mapping.type) != types.end()) {
+      options.channels.push_back(mapping.channel);
+      channel_types_.push_back(mapping.type);
+    }
+  }
+  if (options.channels.empty())
+    return false;
+  double frequency;
+  if (IioBufferReader::HasBuffer(sysfs_dir_)) {
+    options.buffer_records = kBufferRecords;
+    options.sampling_frequency = period_us > 0 ? 1000000.0 / period_us : 0;
+    options.max_latency_us = max_latency_us;
+    reader_ = IioBufferReader::Open(sysfs_dir_, device_, options);
+    if (!reader_)
+      return false;
+    frequency = reader_->sampling_frequency();
+    timestamp_correction_ns_ =
+        reader_->boottime_timestamps()
+            ? 0
+            : ClockNanos(CLOCK_BOOTTIME) - ClockNanos(CLOCK_REALTIME);
+  } else {
+    // Drivers without a buffer are polled, one attribute per value.
+    for (const std::string& channel : options.channels) {
+      double value;
+      if (!IioBufferReader::ReadInput(sysfs_dir_, channel, &value)) {
+        LOG(ERROR) << "No buffer and no readable " << channel << " in "
+                   << sysfs_dir_;
+        return false;
+      }
+    }
+    poll_period_us_ = period_us > 0 ? period_us : kDefaultPollPeriodUs;
+    frequency = 1000000.0 / poll_period_us_;
+    max_latency_us = 0;
+  }
+  channels_ = options.channels;
+
+  sensors_.clear();
+  for (int type : channel_types_) {
+    for (const ChannelMapping& mapping : kChannels) {
+      if (mapping.type != type)
+        continue;
+      SensorInfo sensor;
+      sensor.type = type;
+      sensor.name = mapping.name;
+      sensor.resolution = 0.01f;
+      sensor.period_us =
+          frequency > 0 ? static_cast<int32_t>(1000000 / frequency) : 0;
+      sensor.max_latency_us = max_latency_us;
+      sensor.fifo_events = reader_ ? kBufferRecords : 0;
+      sensors_.push_back(sensor);
+    }
+  }
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0) {
+    PLOG(ERROR) << "eventfd";
+    reader_.reset();
+    return false;
+  }
+  stopping_ = false;
+  if (reader_) {
+    thread_ = std::thread(&IioSensorSource::Run, this);
+    LOG(INFO) << "Reading " << channels_.size() << " IIO channels from "
+              << sysfs_dir_ << " in " << reader_->record_bytes()
+              << " byte records";
+  } else {
+    thread_ = std::thread(&IioSensorSource::Poll, this);
+    LOG(INFO) << "Polling " << channels_.size() << " IIO channels from "
+              << sysfs_dir_ << " every " << poll_period_us_ << " us";
+  }
+  return true;
+}
+
+void IioSensorSource::Stop() {
+  if (!thread_.joinable())
+    return;
+  stopping_ = true;
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) != sizeof(one))
+    PLOG(WARNING) << "Failed to wake the IIO thread";
+  thread_.join();
+  close(stop_fd_);
+  stop_fd_ = -1;
+  reader_.reset();
+}
+
+void IioSensorSource::Run() {
+  std::vector<IioBufferReader::Sample> samples;
+  std::vector<ASensorEvent> events;
+  while (!stopping_) {
+    struct pollfd fds[2] = {{reader_->fd(), POLLIN, 0},
+                            {stop_fd_, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      PLOG(ERROR) << "poll";
+      break;
+    }
+    if (fds[1].revents)
+      continue;
+    // An error or hang-up stays pending, so polling again would spin.
+    if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      LOG(ERROR) << "Lost the IIO device " << device_;
+      break;
+    }
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    samples.clear();
+    if (!reader_->Read(&samples))
+      break;
+    if (samples.empty())
+      continue;
+    wakeups_++;
+    events.clear();
+    for (IioBufferReader::Sample& sample : samples) {
+      sample.timestamp = sample.timestamp
+                             ? sample.timestamp + timestamp_correction_ns_
+                             : ClockNanos(CLOCK_BOOTTIME);
+      AppendEvents(sample, &events);
+    }
+    Post(events.data(), events.size());
+  }
+}
+
+void IioSensorSource::Poll() {
+  std::vector<ASensorEvent> events;
+  int64_t next_ns = ClockNanos(CLOCK_BOOTTIME);
+  while (!stopping_) {
+    IioBufferReader::Sample sample;
+    sample.timestamp = ClockNanos(CLOCK_BOOTTIME);
+    bool ok = true;
+    for (size_t i = 0; i < channels_.size() && ok; i++)
+      ok = IioBufferReader::ReadInput(sysfs_dir_, channels_[i],
+                                      &sample.values[i]);
+    if (ok) {
+      wakeups_++;
+      events.clear();
+      AppendEvents(sample, &events);
+      Post(events.data(), events.size());
+    } else {
+      LOG(WARNING) << "Failed to read " << sysfs_dir_;
+    }
+
+    next_ns += poll_period_us_ * 1000LL;
+    int64_t wait_ns = next_ns - ClockNanos(CLOCK_BOOTTIME);
+    if (wait_ns < 0) {
+      // Fell behind; start counting from now rather than catching up.
+      next_ns -= wait_ns;
+      wait_ns = 0;
+    }
+    struct pollfd fds = {stop_fd_, POLLIN, 0};
+    if (poll(&fds, 1, static_cast<int>(wait_ns / 1000000)) < 0 &&
+        errno != EINTR) {
+      PLOG(ERROR) << "poll";
+      break;
+    }
+  }
+}
+
+void IioSensorSource::AppendEvents(const IioBufferReader::Sample& sample,
+                                   std::vector<ASensorEvent>* events) const {
+  for (size_t i = 0; i < channel_types_.size(); i++) {
+    ASensorEvent event;
+    memset(&event, 0, sizeof(event));
+    event.version = sizeof(event);
+    event.sensor = static_cast<int32_t>(i);
+    event.type = channel_types_[i];
+    event.timestamp = sample.timestamp;
+    for (const ChannelMapping& mapping : kChannels) {
+      if (mapping.type == event.type)
+        event.data[0] = sample.values[i] * mapping.factor;
+    }
+    events->push_back(event);
+  }
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_IIO_SENSOR_SOURCE_H_
+#define HOME_CLOUD_SERVICE_IIO_SENSOR_SOURCE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "iio_buffer_reader.h"
+#include "sensor_source.h"
+
+namespace home_cloud {
+
+// Reads a barometric pressure sensor of the BMP085 family that the sensor
+// HAL does not know about, through its IIO buffer, or by polling its
+// channels where the driver has no buffer, and presents its
+// pressure and temperature channels as SENSOR_TYPE_PRESSURE (hPa) and
+// SENSOR_TYPE_AMBIENT_TEMPERATURE (degrees Celsius).
+class IioSensorSource : public SensorSource {
+ public:
+  // Names IIO drivers give the sensors this source reads.
+  static const std::vector<std::string>& DeviceNames();
+  // Sensor types this source can provide.
+  static const std::vector<int>& SensorTypes();
+
+  // sysfs_dir and device as for IioBufferReader::Open().
+  IioSensorSource(scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+                  const EventsCallback& callback, const std::string& sysfs_dir,
+                  const std::string& device);
+  ~IioSensorSource() override;
+
+  // Sets the device's sampling frequency from period_us where it allows,
+  // and its buffer watermark so that a read wakes us up no more often than
+  // max_latency_us. Without a buffer, reads every period_us instead.
+  bool Start(const std::vector<int>& types, int32_t period_us,
+             int64_t max_latency_us) override;
+  void Stop() override;
+
+ private:
+  // Reads records from the buffer until stopped.
+  void Run();
+  // Reads the channels' attributes every poll_period_us_ until stopped.
+  void Poll();
+  // Appends one event per channel of sample.
+  void AppendEvents(const IioBufferReader::Sample& sample,
+                    std::vector<ASensorEvent>* events) const;
+
+  std::string sysfs_dir_;
+  std::string device_;
+  // Null when the device is polled.
+  std::unique_ptr<IioBufferReader> reader_;
+  // Scan element names of the channels read.
+  std::vector<std::string> channels_;
+  int32_t poll_period_us_{0};
+  // The sensor type of each channel read.
+  std::vector<int> channel_types_;
+  // Added to IIO timestamps to bring them to boot time.
+  int64_t timestamp_correction_ns_{0};
+
+  std::thread thread_;
+  int stop_fd_{-1};
+  std::atomic<bool> stopping_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(IioSensorSource);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_IIO_SENSOR_SOURCE_H_
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <sysexits.h>
+
+#include <memory>
+
+#include <brillo/flag_helper.h>
+#include <brillo/syslog_logging.h>
+
+#include "home_cloud_service.h"
+
+int main(int argc, char* argv[]) {
+  brillo::FlagHelper::Init(argc, argv, "Home cloud sensor service");
+  brillo::InitLog(brillo::kLogToSyslog | brillo::kLogHeader);
+
+  std::unique_ptr<service_hub::Module> module = home_cloud::CreateModule();
+  if (!module)
+    return EX_USAGE;
+  service_hub::ModuleDaemon daemon;
+  daemon.AddModule(std::move(module));
+  return daemon.Run();
+}
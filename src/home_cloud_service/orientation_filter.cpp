@@ -0,0 +1,317 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "orientation_filter.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FUSION_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FUSION_SSE2 1
+#endif
+
+namespace home_cloud {
+
+namespace {
+// Beta for the first seconds after a reset, to converge from the identity.
+const float kWarmupBeta = 2.5f;
+const float kWarmupSeconds = 2.0f;
+// Largest gradient step without a gyro, beyond which descent overshoots.
+const float kMaxNoGyroStep = 0.25f;
+// Gaps longer than this are not integrated over.
+const int64_t kMaxGapUs = 500000;
+}  // anonymous namespace
+
+// Four floats: a quaternion, or a row of the filter's Jacobian.
+#if FUSION_NEON
+
+typedef float32x4_t Vec4;
+
+static inline Vec4 Set(float a, float b, float c, float d) {
+  const float v[4] = {a, b, c, d};
+  return vld1q_f32(v);
+}
+static inline Vec4 Load(const float* p) { return vld1q_f32(p); }
+static inline void Store(float* p, Vec4 v) { vst1q_f32(p, v); }
+static inline Vec4 Zero() { return vdupq_n_f32(0); }
+static inline Vec4 Mul(Vec4 a, Vec4 b) { return vmulq_f32(a, b); }
+static inline Vec4 Scale(Vec4 v, float s) { return vmulq_n_f32(v, s); }
+// acc + v * s
+static inline Vec4 Madd(Vec4 acc, Vec4 v, float s) {
+  return vmlaq_n_f32(acc, v, s);
+}
+static inline float Dot(Vec4 a, Vec4 b) {
+  float32x4_t p = vmulq_f32(a, b);
+  float32x2_t s = vadd_f32(vget_low_f32(p), vget_high_f32(p));
+  return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+// (1, 0, 3, 2), (2, 3, 0, 1) and (3, 2, 1, 0) lane orders.
+static inline Vec4 SwapPairs(Vec4 v) { return vrev64q_f32(v); }
+static inline Vec4 SwapHalves(Vec4 v) { return vextq_f32(v, v, 2); }
+static inline Vec4 Reverse(Vec4 v) { return vrev64q_f32(vextq_f32(v, v, 2)); }
+
+#elif FUSION_SSE2
+
+typedef __m128 Vec4;
+
+static inline Vec4 Set(float a, float b, float c, float d) {
+  return _mm_setr_ps(a, b, c, d);
+}
+static inline Vec4 Load(const float* p) { return _mm_load_ps(p); }
+static inline void Store(float* p, Vec4 v) { _mm_store_ps(p, v); }
+static inline Vec4 Zero() { return _mm_setzero_ps(); }
+static inline Vec4 Mul(Vec4 a, Vec4 b) { return _mm_mul_ps(a, b); }
+static inline Vec4 Scale(Vec4 v, float s) {
+  return _mm_mul_ps(v, _mm_set1_ps(s));
+}
+static inline Vec4 Madd(Vec4 acc, Vec4 v, float s) {
+  return _mm_add_ps(acc, _mm_mul_ps(v, _mm_set1_ps(s)));
+}
+static inline float Dot(Vec4 a, Vec4 b) {
+  __m128 p = _mm_mul_ps(a, b);
+  p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+  p = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(p);
+}
+static inline Vec4 SwapPairs(Vec4 v) {
+  return _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+static inline Vec4 SwapHalves(Vec4 v) {
+  return _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+static inline Vec4 Reverse(Vec4 v) {
+  return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+#else
+
+struct Vec4 {
+  float v[4];
+};
+
+static inline Vec4 Set(float a, float b, float c, float d) {
+  return Vec4{{a, b, c, d}};
+}
+static inline Vec4 Load(const float* p) {
+  return Vec4{{p[0], p[1], p[2], p[3]}};
+}
+static inline void Store(float* p, Vec4 v) { memcpy(p, v.v, sizeof(v.v)); }
+static inline Vec4 Zero() { return Vec4{{0, 0, 0, 0}}; }
+static inline Vec4 Mul(Vec4 a, Vec4 b) {
+  for (int i = 0; i < 4; i++)
+    a.v[i] *= b.v[i];
+  return a;
+}
+static inline Vec4 Scale(Vec4 v, float s) {
+  for (int i = 0; i < 4; i++)
+    v.v[i] *= s;
+  return v;
+}
+static inline Vec4 Madd(Vec4 acc, Vec4 v, float s) {
+  for (int i = 0; i < 4; i++)
+    acc.v[i] += v.v[i] * s;
+  return acc;
+}
+static inline float Dot(Vec4 a, Vec4 b) {
+  return a.v[0] * b.v[0] + a.v[1] * b.v[1] + a.v[2] * b.v[2] +
+         a.v[3] * b.v[3];
+}
+static inline Vec4 SwapPairs(Vec4 v) {
+  return Vec4{{v.v[1], v.v[0], v.v[3], v.v[2]}};
+}
+static inline Vec4 SwapHalves(Vec4 v) {
+  return Vec4{{v.v[2], v.v[3], v.v[0], v.v[1]}};
+}
+static inline Vec4 Reverse(Vec4 v) {
+  return Vec4{{v.v[3], v.v[2], v.v[1], v.v[0]}};
+}
+
+#endif
+
+const char* FusionSimdName() {
+#if FUSION_NEON
+  return "neon";
+#elif FUSION_SSE2
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+OrientationFilter::Options OrientationFilter::DefaultOptions() {
+  Options options;
+  options.beta = 0.1f;
+  options.no_gyro_gain = 5.0f;
+  return options;
+}
+
+OrientationFilter::OrientationFilter(const Options& options)
+    : options_(options) {
+  Reset();
+}
+
+void OrientationFilter::Reset() {
+  q_[0] = 1;
+  q_[1] = q_[2] = q_[3] = 0;
+  elapsed_ = 0;
+}
+
+bool OrientationFilter::Update(const float* accel, const float* mag,
+                               const float* gyro, float dt) {
+  float norm = sqrtf(accel[0] * accel[0] + accel[1] * accel[1] +
+                     accel[2] * accel[2]);
+  if (norm == 0)
+    return false;
+  float ax = accel[0] / norm, ay = accel[1] / norm, az = accel[2] / norm;
+  float q0 = q_[0], q1 = q_[1], q2 = q_[2], q3 = q_[3];
+
+  // The gradient of half the squared error, J^T f, a row of the Jacobian
+  // at a time. Every row is a shuffle of q with signs and scales, so the
+  // rows stay in vector registers. Gravity first: it should read (0, 0, 1)
+  // in the earth frame.
+  Vec4 q = Load(q_);
+  Vec4 halves = SwapHalves(q);
+  float f1 = 2 * (q1 * q3 - q0 * q2) - ax;
+  float f2 = 2 * (q0 * q1 + q2 * q3) - ay;
+  float f3 = 1 - 2 * (q1 * q1 + q2 * q2) - az;
+  Vec4 gradient = Zero();
+
+  norm = mag ? sqrtf(mag[0] * mag[0] + mag[1] * mag[1] + mag[2] * mag[2])
+             : 0;
+  if (norm > 0) {
+    float mx = mag[0] / norm, my = mag[1] / norm, mz = mag[2] / norm;
+    // The field as the current estimate puts it in the earth frame, turned
+    // to point north: (bx, 0, bz).
+    float hx = mx * (1 - 2 * (q2 * q2 + q3 * q3)) +
+               2 * my * (q1 * q2 - q0 * q3) + 2 * mz * (q1 * q3 + q0 * q2);
+    float hy = 2 * mx * (q1 * q2 + q0 * q3) +
+               my * (1 - 2 * (q1 * q1 + q3 * q3)) +
+               2 * mz * (q2 * q3 - q0 * q1);
+    float bx = sqrtf(hx * hx + hy * hy);
+    float bz = 2 * mx * (q1 * q3 - q0 * q2) + 2 * my * (q0 * q1 + q2 * q3) +
+               mz * (1 - 2 * (q1 * q1 + q2 * q2));
+    float f4 = bx * (1 - 2 * (q2 * q2 + q3 * q3)) +
+               2 * bz * (q1 * q3 - q0 * q2) - mx;
+    float f5 = 2 * bx * (q1 * q2 - q0 * q3) + 2 * bz * (q0 * q1 + q2 * q3) -
+               my;
+    float f6 = 2 * bx * (q0 * q2 + q1 * q3) +
+               bz * (1 - 2 * (q1 * q1 + q2 * q2)) - mz;
+    // The field rows are bz times the gravity rows plus bx times these.
+    gradient = Madd(gradient, Mul(q, Set(0, 0, -4, -4)), bx * f4);
+    gradient = Madd(gradient, Mul(Reverse(q), Set(-2, 2, 2, -2)), bx * f5);
+    gradient = Madd(gradient, halves, 2 * bx * f6);
+    f1 += bz * f4;
+    f2 += bz * f5;
+    f3 += bz * f6;
+  }
+  gradient = Madd(gradient, Mul(halves, Set(-2, 2, -2, 2)), f1);
+  gradient = Madd(gradient, SwapPairs(q), 2 * f2);
+  gradient = Madd(gradient, Mul(q, Set(0, -4, -4, 0)), f3);
+
+  Vec4 step;
+  if (gyro) {
+    // dq/dt = q * (0, w) / 2, as the sum of q * i, q * j and q * k scaled
+    // by the rates about each axis.
+    step = Madd(Zero(), Mul(SwapPairs(q), Set(-1, 1, 1, -1)), gyro[0] / 2);
+    step = Madd(step, Mul(SwapHalves(q), Set(-1, -1, 1, 1)), gyro[1] / 2);
+    step = Madd(step, Mul(Reverse(q), Set(-1, 1, -1, 1)), gyro[2] / 2);
+    float beta = elapsed_ < kWarmupSeconds ? kWarmupBeta : options_.beta;
+    float squared = Dot(gradient, gradient);
+    if (squared > 0)
+      step = Madd(step, gradient, -beta / sqrtf(squared));
+    q = Madd(q, step, dt);
+  } else {
+    q = Madd(q, gradient, -std::min(options_.no_gyro_gain * dt,
+                                    kMaxNoGyroStep));
+  }
+  Store(q_, Scale(q, 1 / sqrtf(Dot(q, q))));
+  if (elapsed_ < kWarmupSeconds)
+    elapsed_ += dt;
+  return true;
+}
+
+void OrientationFilter::RotationVector(float* out) const {
+  // Earth frame x north, y west is a quarter turn about z from east, north.
+  const float c = static_cast<float>(M_SQRT1_2);
+  float w = c * (q_[0] - q_[3]);
+  float x = c * (q_[1] - q_[2]);
+  float y = c * (q_[2] + q_[1]);
+  float z = c * (q_[3] + q_[0]);
+  // q and -q are the same rotation; keep w positive so that the components
+  // can be averaged and compared.
+  float sign = w < 0 ? -1 : 1;
+  out[0] = sign * x;
+  out[1] = sign * y;
+  out[2] = sign * z;
+  out[3] = sign * w;
+}
+
+OrientationFusion::OrientationFusion(const OrientationFilter::Options& options)
+    : filter_(options), have_{false, false, false} {}
+
+size_t OrientationFusion::AddBatch(const FusionInput& accel,
+                                   const FusionInput& mag,
+                                   const FusionInput& gyro,
+                                   int64_t* timestamps, float* const* values) {
+  const FusionInput* inputs[kInputs] = {&accel, &mag, &gyro};
+  size_t next[kInputs] = {0, 0, 0};
+  size_t count = 0;
+  while (true) {
+    // Merge the three inputs by time.
+    int input = -1;
+    for (int i = 0; i < kInputs; i++) {
+      if (next[i] < inputs[i]->count &&
+          (input < 0 || inputs[i]->timestamps[next[i]] <
+                            inputs[input]->timestamps[next[input]])) {
+        input = i;
+      }
+    }
+    if (input < 0)
+      break;
+    size_t index = next[input]++;
+    for (int axis = 0; axis < 3; axis++)
+      latest_[input][axis] = inputs[input]->values[axis][index];
+    have_[input] = true;
+
+    // Updates are driven by the gyro if there is one, otherwise by accel.
+    if (input != (have_[kGyro] ? kGyro : kAccel) || !have_[kAccel])
+      continue;
+    int64_t timestamp = inputs[input]->timestamps[index];
+    int64_t gap = timestamp - last_update_;
+    float dt = last_update_ > 0 && gap > 0 && gap <= kMaxGapUs ? gap * 1e-6f
+                                                                : 0;
+    last_update_ = timestamp;
+    if (!filter_.Update(latest_[kAccel], have_[kMag] ? latest_[kMag] : nullptr,
+                        have_[kGyro] ? latest_[kGyro] : nullptr, dt)) {
+      continue;
+    }
+    updates_++;
+    float rotation[4];
+    filter_.RotationVector(rotation);
+    timestamps[count] = timestamp;
+    for (int axis = 0; axis < 4; axis++)
+      values[axis][count] = rotation[axis];
+    count++;
+  }
+  return count;
+}
+
+}  // namespace home_cloud
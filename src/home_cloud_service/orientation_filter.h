@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_ORIENTATION_FILTER_H_
+#define HOME_CLOUD_SERVICE_ORIENTATION_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <base/macros.h>
+
+namespace home_cloud {
+
+// Vectorized where the CPU allows; see FusionSimdName().
+const char* FusionSimdName();
+
+// Madgwick's gradient descent orientation filter. Each update integrates
+// the gyro rate and steps the estimate along the gradient of the error
+// between where gravity and the magnetic field should point and where
+// accel and mag say they do. Without a gyro there is nothing to integrate,
+// and the estimate follows the unnormalized gradient instead, a
+// complementary filter that settles rather than chattering around the
+// answer by a fixed step.
+//
+// The state is a single quaternion; updates neither allocate nor block.
+class OrientationFilter {
+ public:
+  struct Options {
+    // Gyro measurement error in rad/s: how hard accel and mag pull the
+    // estimate back when a gyro is fused.
+    float beta;
+    // Fraction of the accel and mag error corrected per second without a
+    // gyro.
+    float no_gyro_gain;
+  };
+
+  static Options DefaultOptions();
+
+  explicit OrientationFilter(const Options& options);
+
+  // Back to the identity, converging quickly again.
+  void Reset();
+
+  // accel and mag in any units; mag may be null to fuse gravity alone,
+  // leaving heading to the gyro. gyro in rad/s, or null. dt in seconds.
+  // Returns false if accel is zero.
+  bool Update(const float* accel, const float* mag, const float* gyro,
+              float dt);
+
+  // Scalar first, rotating the sensor frame into Madgwick's earth frame:
+  // x magnetic north, y west, z up.
+  const float* quaternion() const { return q_; }
+  // As Android's rotation vector: x, y, z, w of the rotation from the
+  // device frame to east, north, up.
+  void RotationVector(float* out) const;
+
+ private:
+  Options options_;
+  alignas(16) float q_[4];
+  // Seconds of updates since Reset(), up to the end of warm-up.
+  float elapsed_;
+
+  DISALLOW_COPY_AND_ASSIGN(OrientationFilter);
+};
+
+// One sensor's part of a batch, in time order, one array per axis.
+struct FusionInput {
+  const int64_t* timestamps;
+  const float* values[3];
+  size_t count;
+};
+
+// Runs an OrientationFilter over batches of accel, mag and gyro samples,
+// taken together in time order, and produces a rotation vector for every
+// gyro sample, or every accel sample when there is no gyro: the filter
+// runs at the native rate of the fastest sensor it is driven by.
+class OrientationFusion {
+ public:
+  explicit OrientationFusion(const OrientationFilter::Options& options);
+
+  // Any input may be empty. Writes up to accel.count + gyro.count rotation
+  // vectors to timestamps and values, one array per axis, and returns how
+  // many. Timestamps are microseconds.
+  size_t AddBatch(const FusionInput& accel, const FusionInput& mag,
+                  const FusionInput& gyro, int64_t* timestamps,
+                  float* const* values);
+
+  uint64_t updates() const { return updates_; }
+
+ private:
+  enum Input { kAccel, kMag, kGyro, kInputs };
+
+  OrientationFilter filter_;
+  float latest_[kInputs][3];
+  bool have_[kInputs];
+  int64_t last_update_{0};
+  uint64_t updates_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(OrientationFusion);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_ORIENTATION_FILTER_H_
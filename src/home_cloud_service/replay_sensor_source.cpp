@@ -0,0 +1,144 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "replay_sensor_source.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <base/logging.h>
+
+namespace home_cloud {
+
+namespace {
+// Events posted at a time when replaying as fast as possible.
+const size_t kFastBatchEvents = 256;
+// Most events posted at a time when replaying in real time.
+const size_t kMaxBatchEvents = 4096;
+
+int64_t BootTimeNanos() {
+  struct timespec boot;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  return boot.tv_sec * 1000000000LL + boot.tv_nsec;
+}
+}  // anonymous namespace
+
+ReplaySensorSource::ReplaySensorSource(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+    const EventsCallback& callback, const std::string& path, double speed)
+    : SensorSource(task_runner, callback),
+      path_(path),
+      speed_(std::max(speed, 0.0)) {}
+
+ReplaySensorSource::~ReplaySensorSource() {
+  Stop();
+}
+
+bool ReplaySensorSource::Start(const std::vector<int>& types,
+                               int32_t period_us, int64_t max_latency_us) {
+  Stop();
+  recording_ = SensorRecording::Open(path_);
+  if (!recording_)
+    return false;
+
+  sensors_.clear();
+  for (const SensorInfo& sensor : recording_->sensors()) {
+    if (std::find(types.begin(), types.end(), sensor.type) != types.end())
+      sensors_.push_back(sensor);
+  }
+  if (sensors_.empty()) {
+    LOG(ERROR) << path_ << " has none of the requested sensors";
+    return false;
+  }
+  types_ = types;
+  first_ns_ = -1;
+  LOG(INFO) << "Replaying " << sensors_.size() << " sensors from " << path_
+            << (speed_ > 0 ? " at " + std::to_string(speed_) + "x"
+                           : std::string(" as fast as possible"));
+
+  stopping_ = false;
+  finished_ = false;
+  int64_t start_ns = BootTimeNanos();
+  thread_ = std::thread(&ReplaySensorSource::Run, this, start_ns);
+  return true;
+}
+
+void ReplaySensorSource::Stop() {
+  if (!thread_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  thread_.join();
+}
+
+bool ReplaySensorSource::NextEvent(int64_t start_ns, ASensorEvent* event) {
+  while (recording_->Next(event)) {
+    if (std::find(types_.begin(), types_.end(), event->type) == types_.end())
+      continue;
+    if (first_ns_ < 0)
+      first_ns_ = event->timestamp;
+    event->timestamp = event->timestamp - first_ns_ + start_ns;
+    return true;
+  }
+  return false;
+}
+
+void ReplaySensorSource::Run(int64_t start_ns) {
+  ASensorEvent next;
+  bool have_next = NextEvent(start_ns, &next);
+  batch_.clear();
+  while (have_next && !stopping_) {
+    if (speed_ > 0) {
+      // Sleep until the next event is due, then take everything that is.
+      int64_t due = start_ns + static_cast<int64_t>(
+          (next.timestamp - start_ns) / speed_);
+      int64_t now = BootTimeNanos();
+      if (due > now) {
+        std::unique_lock<std::mutex> guard(lock_);
+        wake_.wait_for(guard, std::chrono::nanoseconds(due - now),
+                       [this]() { return stopping_.load(); });
+        continue;
+      }
+      int64_t reached = start_ns + static_cast<int64_t>((now - start_ns) *
+                                                        speed_);
+      while (have_next && next.timestamp <= reached &&
+             batch_.size() < kMaxBatchEvents) {
+        batch_.push_back(next);
+        have_next = NextEvent(start_ns, &next);
+      }
+    } else {
+      while (have_next && batch_.size() < kFastBatchEvents) {
+        batch_.push_back(next);
+        have_next = NextEvent(start_ns, &next);
+      }
+      WaitForRoom(batch_.size(), stopping_);
+      if (stopping_)
+        break;
+    }
+    wakeups_++;
+    Post(batch_.data(), batch_.size());
+    batch_.clear();
+  }
+  finished_ = !have_next && batch_.empty();
+  if (finished_)
+    LOG(INFO) << "Replay of " << path_ << " finished";
+}
+
+}  // namespace home_cloud
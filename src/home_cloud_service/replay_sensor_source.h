@@ -0,0 +1,87 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_REPLAY_SENSOR_SOURCE_H_
+#define HOME_CLOUD_SERVICE_REPLAY_SENSOR_SOURCE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "sensor_recording.h"
+#include "sensor_source.h"
+
+namespace home_cloud {
+
+// Plays a SensorRecording back as if it came from the sensors, reading it
+// as it goes.
+//
+// Event timestamps keep their recorded spacing but are moved to start at
+// the boot time of Start(), so the rest of the pipeline sees current times.
+// At a positive speed events are posted when they fall due, scaled by that
+// factor, in batches of whatever is due, up to kMaxBatchEvents at a time;
+// a loop that falls behind loses
+// events like it would on a device. At speed 0 the recording is posted as
+// fast as the owner's loop takes it, waiting rather than dropping.
+class ReplaySensorSource : public SensorSource {
+ public:
+  ReplaySensorSource(scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+                     const EventsCallback& callback, const std::string& path,
+                     double speed);
+  ~ReplaySensorSource() override;
+
+  // Replays the recorded sensors of the given types; period_us and
+  // max_latency_us are whatever the recording was made with.
+  bool Start(const std::vector<int>& types, int32_t period_us,
+             int64_t max_latency_us) override;
+  void Stop() override;
+
+  // True once the whole recording has been posted.
+  bool finished() const { return finished_; }
+
+ private:
+  void Run(int64_t start_ns);
+  // The next event of a requested sensor, moved to start at start_ns.
+  bool NextEvent(int64_t start_ns, ASensorEvent* event);
+
+  std::string path_;
+  double speed_;
+  std::unique_ptr<SensorRecording> recording_;
+  std::vector<int> types_;
+  // Replay thread only: the recorded timestamp of the first event, and the
+  // events about to be posted.
+  int64_t first_ns_{-1};
+  std::vector<ASensorEvent> batch_;
+
+  std::thread thread_;
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::atomic<bool> stopping_{false};
+  std::atomic<bool> finished_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ReplaySensorSource);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_REPLAY_SENSOR_SOURCE_H_
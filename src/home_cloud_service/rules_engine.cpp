@@ -0,0 +1,438 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "rules_engine.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_split.h>
+
+#include "duration.h"
+
+namespace home_cloud {
+
+namespace {
+// Window rings never grow beyond this many samples; longer windows at high
+// rates cover the most recent samples only.
+const size_t kMaxWindowSamples = 65536;
+const char kGpioPrefix[] = "gpio";
+const char* const kAxisNames[] = {"x", "y", "z", "w"};
+
+uint64_t MonotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+size_t RoundUpPowerOfTwo(size_t n) {
+  size_t size = 1;
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+bool ParseNumber(const std::string& text, float* value) {
+  char* end = nullptr;
+  *value = strtof(text.c_str(), &end);
+  return end != text.c_str() && *end == '\0';
+}
+
+std::vector<std::string> SplitWords(const std::string& text) {
+  return base::SplitString(text, " \t", base::TRIM_WHITESPACE,
+                           base::SPLIT_WANT_NONEMPTY);
+}
+}  // anonymous namespace
+
+RulesEngine::RulesEngine() {}
+
+RulesEngine::~RulesEngine() {}
+
+std::unique_ptr<RulesEngine> RulesEngine::Compile(
+    const std::string& text, const SensorResolver& resolver,
+    int64_t sample_period_us) {
+  std::unique_ptr<RulesEngine> engine(new RulesEngine());
+  int line_number = 0;
+  for (std::string line : base::SplitString(text, "\n", base::KEEP_WHITESPACE,
+                                            base::SPLIT_WANT_ALL)) {
+    line_number++;
+    line = line.substr(0, line.find('#'));
+    if (SplitWords(line).empty())
+      continue;
+    if (!engine->ParseRule(line, resolver, sample_period_us)) {
+      LOG(ERROR) << "Invalid rule on line " << line_number << ": " << line;
+      return nullptr;
+    }
+  }
+  engine->Link();
+  return engine;
+}
+
+bool RulesEngine::ParseRule(const std::string& line,
+                            const SensorResolver& resolver,
+                            int64_t sample_period_us) {
+  size_t colon = line.find(':');
+  if (colon == std::string::npos)
+    return false;
+  std::vector<std::string> name = SplitWords(line.substr(0, colon));
+  std::vector<std::string> words = SplitWords(line.substr(colon + 1));
+  auto then = std::find(words.begin(), words.end(), "then");
+  if (name.size() != 1 || words.empty() || words[0] != "when" ||
+      then == words.end())
+    return false;
+
+  Rule rule;
+  uint32_t index = rules_.size();
+  rule.first_predicate = predicates_.size();
+  rule.first_action = actions_.size();
+  rule.active = false;
+  rule.queued = 0;
+  rule.fired = 0;
+  std::vector<std::string> predicate;
+  for (auto it = words.begin() + 1; it <= then; ++it) {
+    if (it != then && *it != "and") {
+      predicate.push_back(*it);
+      continue;
+    }
+    if (!ParsePredicate(predicate, index, resolver, sample_period_us))
+      return false;
+    predicate.clear();
+  }
+  std::string actions;
+  for (auto it = then + 1; it != words.end(); ++it)
+    actions += *it + " ";
+  for (const std::string& action : base::SplitString(
+           actions, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL)) {
+    if (!ParseAction(SplitWords(action)))
+      return false;
+  }
+  rule.predicate_count = predicates_.size() - rule.first_predicate;
+  rule.action_count = actions_.size() - rule.first_action;
+  rules_.push_back(rule);
+  names_.push_back(name[0]);
+  return true;
+}
+
+bool RulesEngine::ParsePredicate(const std::vector<std::string>& words,
+                                 uint32_t rule,
+                                 const SensorResolver& resolver,
+                                 int64_t sample_period_us) {
+  if (words.size() < 2)
+    return false;
+  Predicate predicate;
+  predicate.rule = rule;
+  predicate.axis = 0;
+  predicate.window = -1;
+  predicate.value = false;
+  predicate.past = false;
+  predicate.primed = false;
+  predicate.stat = Predicate::kMean;
+  predicate.op = Predicate::kGreater;
+
+  // The input: gpio<pin>, or a sensor with an optional axis.
+  const std::string& input = words[0];
+  bool gpio = input.compare(0, strlen(kGpioPrefix), kGpioPrefix) == 0;
+  if (gpio) {
+    char* end = nullptr;
+    const char* pin = input.c_str() + strlen(kGpioPrefix);
+    long id = strtol(pin, &end, 10);
+    if (end == pin || *end || id < 0)
+      return false;
+    predicate.input = AddInput(RuleInput::kGpio, static_cast<int>(id));
+  } else {
+    std::string sensor = input.substr(0, input.find('.'));
+    if (sensor.size() < input.size()) {
+      std::string axis = input.substr(sensor.size() + 1);
+      auto it = std::find(std::begin(kAxisNames), std::end(kAxisNames), axis);
+      if (it == std::end(kAxisNames))
+        return false;
+      predicate.axis = it - std::begin(kAxisNames);
+    }
+    int axes = 0;
+    int type = resolver(sensor, &axes);
+    if (type < 0 || predicate.axis >= axes)
+      return false;
+    predicate.input = AddInput(RuleInput::kSensor, type);
+  }
+
+  auto parse_op = [&predicate](const std::string& op) {
+    if (op == "<")
+      predicate.op = Predicate::kLess;
+    else if (op == "<=")
+      predicate.op = Predicate::kLessEqual;
+    else if (op == ">")
+      predicate.op = Predicate::kGreater;
+    else if (op == ">=")
+      predicate.op = Predicate::kGreaterEqual;
+    else
+      return false;
+    return true;
+  };
+
+  const std::string& verb = words[1];
+  if (verb == "rises" || verb == "falls") {
+    predicate.kind = verb == "rises" ? Predicate::kRise : Predicate::kFall;
+    const char* side = verb == "rises" ? "above" : "below";
+    if (words.size() == 2 && gpio) {
+      predicate.threshold = 0.5f;
+    } else if (words.size() != 4 || words[2] != side ||
+               !ParseNumber(words[3], &predicate.threshold)) {
+      return false;
+    }
+  } else if (verb == "mean" || verb == "min" || verb == "max") {
+    predicate.kind = Predicate::kWindow;
+    predicate.stat = verb == "mean" ? Predicate::kMean
+                                    : verb == "min" ? Predicate::kMin
+                                                    : Predicate::kMax;
+    Window window;
+    if (words.size() != 6 || words[2] != "over" ||
+        !ParseDuration(words[3], &window.length_us) || !parse_op(words[4]) ||
+        !ParseNumber(words[5], &predicate.threshold)) {
+      return false;
+    }
+    // Room for twice the samples the window should see, for jitter.
+    size_t expected = window.length_us / std::max<int64_t>(sample_period_us, 1);
+    size_t capacity =
+        RoundUpPowerOfTwo(std::min(2 * expected + 2, kMaxWindowSamples));
+    window.offset = window_timestamps_.size();
+    window.mask = capacity - 1;
+    window.head = window.tail = 0;
+    window.extremes_head = window.extremes_tail = 0;
+    window.sum = 0;
+    window_timestamps_.resize(window.offset + capacity);
+    window_values_.resize(window.offset + capacity);
+    window_extremes_.resize(window.offset + capacity);
+    predicate.window = windows_.size();
+    windows_.push_back(window);
+  } else {
+    predicate.kind = Predicate::kThreshold;
+    if (words.size() != 3 || !parse_op(verb) ||
+        !ParseNumber(words[2], &predicate.threshold))
+      return false;
+  }
+  predicates_.push_back(predicate);
+  return true;
+}
+
+bool RulesEngine::ParseAction(const std::vector<std::string>& words) {
+  RuleAction action;
+  action.led = 0;
+  action.volume = 0;
+  if (words.size() == 3 && words[0] == "led") {
+    char* end = nullptr;
+    action.kind = RuleAction::kLed;
+    action.led = strtol(words[1].c_str(), &end, 10);
+    if (end == words[1].c_str() || *end || action.led < 0)
+      return false;
+    if (words[2] == "on")
+      action.command = RuleAction::kOn;
+    else if (words[2] == "off")
+      action.command = RuleAction::kOff;
+    else if (words[2] == "toggle")
+      action.command = RuleAction::kToggle;
+    else
+      return false;
+  } else if (words.size() == 2 && words[0] == "leds") {
+    action.kind = RuleAction::kAllLeds;
+    if (words[1] == "on")
+      action.command = RuleAction::kOn;
+    else if (words[1] == "off")
+      action.command = RuleAction::kOff;
+    else
+      return false;
+  } else if (words.size() == 2 && words[0] == "media") {
+    action.kind = RuleAction::kMedia;
+    if (words[1] == "play")
+      action.command = RuleAction::kPlay;
+    else if (words[1] == "pause")
+      action.command = RuleAction::kPause;
+    else if (words[1] == "stop")
+      action.command = RuleAction::kStop;
+    else if (words[1] == "next")
+      action.command = RuleAction::kNext;
+    else
+      return false;
+  } else if (words.size() == 3 && words[0] == "media" &&
+             words[1] == "volume") {
+    action.kind = RuleAction::kVolume;
+    action.command = RuleAction::kOn;
+    if (!ParseNumber(words[2], &action.volume) || action.volume < 0 ||
+        action.volume > 1)
+      return false;
+  } else {
+    return false;
+  }
+  actions_.push_back(action);
+  return true;
+}
+
+uint32_t RulesEngine::AddInput(RuleInput::Kind kind, int id) {
+  int index = FindInput(kind, id);
+  if (index >= 0)
+    return index;
+  inputs_.push_back(RuleInput{kind, id});
+  return inputs_.size() - 1;
+}
+
+// Indexes predicates by input and sizes everything Evaluate() fills.
+void RulesEngine::Link() {
+  input_offsets_.assign(inputs_.size() + 1, 0);
+  for (const Predicate& predicate : predicates_)
+    input_offsets_[predicate.input + 1]++;
+  for (size_t i = 0; i < inputs_.size(); i++)
+    input_offsets_[i + 1] += input_offsets_[i];
+  input_predicates_.resize(predicates_.size());
+  std::vector<uint32_t> next(input_offsets_.begin(), input_offsets_.end() - 1);
+  for (size_t i = 0; i < predicates_.size(); i++)
+    input_predicates_[next[predicates_[i].input]++] = i;
+  queued_rules_.reserve(rules_.size());
+  fired_.reserve(actions_.size());
+}
+
+int RulesEngine::FindInput(RuleInput::Kind kind, int id) const {
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    if (inputs_[i].kind == kind && inputs_[i].id == id)
+      return i;
+  }
+  return -1;
+}
+
+const std::vector<const RuleAction*>& RulesEngine::Evaluate(
+    int input, int64_t timestamp, const float* values) {
+  uint64_t start = MonotonicNanos();
+  evaluation_++;
+  fired_.clear();
+  queued_rules_.clear();
+  uint32_t begin = input_offsets_[input];
+  uint32_t end = input_offsets_[input + 1];
+  for (uint32_t i = begin; i < end; i++) {
+    Predicate* predicate = &predicates_[input_predicates_[i]];
+    predicate->value = EvaluatePredicate(predicate, timestamp, values);
+    Rule& rule = rules_[predicate->rule];
+    if (rule.queued != evaluation_) {
+      rule.queued = evaluation_;
+      queued_rules_.push_back(predicate->rule);
+    }
+  }
+
+  for (uint32_t index : queued_rules_) {
+    Rule& rule = rules_[index];
+    bool all = true;
+    for (uint32_t i = 0; i < rule.predicate_count && all; i++)
+      all = predicates_[rule.first_predicate + i].value;
+    if (all && !rule.active) {
+      rule.fired++;
+      stats_.fired++;
+      for (uint32_t i = 0; i < rule.action_count; i++)
+        fired_.push_back(&actions_[rule.first_action + i]);
+    }
+    rule.active = all;
+  }
+
+  // An edge holds for the sample that crossed the threshold only.
+  for (uint32_t i = begin; i < end; i++) {
+    Predicate* predicate = &predicates_[input_predicates_[i]];
+    if (predicate->kind == Predicate::kRise ||
+        predicate->kind == Predicate::kFall)
+      predicate->value = false;
+  }
+
+  uint64_t elapsed = MonotonicNanos() - start;
+  stats_.events++;
+  stats_.total_ns += elapsed;
+  stats_.max_ns = std::max(stats_.max_ns, elapsed);
+  return fired_;
+}
+
+bool RulesEngine::EvaluatePredicate(Predicate* predicate, int64_t timestamp,
+                                    const float* values) {
+  float value = values[predicate->axis];
+  switch (predicate->kind) {
+    case Predicate::kRise:
+    case Predicate::kFall: {
+      bool past = predicate->kind == Predicate::kRise
+                      ? value > predicate->threshold
+                      : value < predicate->threshold;
+      bool crossed = predicate->primed && past && !predicate->past;
+      predicate->past = past;
+      predicate->primed = true;
+      return crossed;
+    }
+    case Predicate::kWindow:
+      value = AddToWindow(&windows_[predicate->window], predicate->stat,
+                          timestamp, value);
+      break;
+    case Predicate::kThreshold:
+      break;
+  }
+  switch (predicate->op) {
+    case Predicate::kLess:
+      return value < predicate->threshold;
+    case Predicate::kLessEqual:
+      return value <= predicate->threshold;
+    case Predicate::kGreater:
+      return value > predicate->threshold;
+    case Predicate::kGreaterEqual:
+      return value >= predicate->threshold;
+  }
+  return false;
+}
+
+float RulesEngine::AddToWindow(Window* window, Predicate::Stat stat,
+                               int64_t timestamp, float value) {
+  int64_t* timestamps = &window_timestamps_[window->offset];
+  float* values = &window_values_[window->offset];
+  uint64_t* extremes = &window_extremes_[window->offset];
+  uint64_t mask = window->mask;
+
+  // Drop the samples that have left the window, and the oldest one if the
+  // ring is full.
+  while (window->head < window->tail &&
+         (timestamps[window->head & mask] <= timestamp - window->length_us ||
+          window->tail - window->head > mask)) {
+    window->sum -= values[window->head & mask];
+    if (window->extremes_head < window->extremes_tail &&
+        extremes[window->extremes_head & mask] == window->head)
+      window->extremes_head++;
+    window->head++;
+  }
+  if (window->head == window->tail)
+    window->sum = 0;
+
+  timestamps[window->tail & mask] = timestamp;
+  values[window->tail & mask] = value;
+  window->sum += value;
+  if (stat != Predicate::kMean) {
+    // Samples the new one outlasts can never be the extreme again.
+    while (window->extremes_head < window->extremes_tail) {
+      float last = values[extremes[(window->extremes_tail - 1) & mask] & mask];
+      if (stat == Predicate::kMin ? last < value : last > value)
+        break;
+      window->extremes_tail--;
+    }
+    extremes[window->extremes_tail++ & mask] = window->tail;
+  }
+  window->tail++;
+
+  if (stat == Predicate::kMean)
+    return window->sum / (window->tail - window->head);
+  return values[extremes[window->extremes_head & mask] & mask];
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_RULES_ENGINE_H_
+#define HOME_CLOUD_SERVICE_RULES_ENGINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace home_cloud {
+
+// What a rule does when it fires.
+struct RuleAction {
+  enum Kind { kLed, kAllLeds, kMedia, kVolume };
+  enum Command { kOff, kOn, kToggle, kPlay, kPause, kStop, kNext };
+
+  Kind kind;
+  // LED index for kLed.
+  int led;
+  Command command;
+  // Volume for kVolume, 0 to 1.
+  float volume;
+};
+
+// Something rules watch: a sensor by Android sensor type, or a GPIO pin,
+// whose value is 0 or 1.
+struct RuleInput {
+  enum Kind { kSensor, kGpio };
+
+  Kind kind;
+  int id;
+};
+
+// Reacts to sensor and GPIO events on the device, without a round trip
+// through the cloud. Rules are compiled from text, one per line:
+//
+//   name: when <predicate> [and <predicate>]... then <action>[, <action>]...
+//
+// with predicates on an input, a sensor name with an optional .x, .y, .z
+// or .w axis that the sensor has, or gpio<pin>:
+//
+//   <input> <op> <number>                   threshold: < <= > >=
+//   <input> rises above <number>            edge, true for one event
+//   <input> falls below <number>            edge; gpio needs no number
+//   <input> mean|min|max over <duration> <op> <number>
+//                                           window of recent samples
+//
+// and actions on the LEDs and the media player:
+//
+//   led <index> on|off|toggle    leds on|off
+//   media play|pause|stop|next   media volume <0 to 1>
+//
+// A rule fires when its predicates all become true, and not again until
+// one of them has been false. Everything is laid out at compile time in
+// flat tables: each input has the range of predicates that read it,
+// windows keep their samples in preallocated rings and track min and max
+// with monotonic queues, so evaluating an event touches only the rules
+// that depend on it and allocates nothing.
+class RulesEngine {
+ public:
+  // Sensor type for a sensor name, or -1 if there is no such sensor. Sets
+  // axes to the number of values the sensor's events carry.
+  using SensorResolver =
+      std::function<int(const std::string& name, int* axes)>;
+
+  struct Stats {
+    uint64_t events;
+    uint64_t fired;
+    // Time spent evaluating, in nanoseconds.
+    uint64_t total_ns;
+    uint64_t max_ns;
+  };
+
+  // Logs the first error and returns null if the text does not compile.
+  // sample_period_us sizes window rings.
+  static std::unique_ptr<RulesEngine> Compile(const std::string& text,
+                                              const SensorResolver& resolver,
+                                              int64_t sample_period_us);
+  ~RulesEngine();
+
+  const std::vector<RuleInput>& inputs() const { return inputs_; }
+  // Index into inputs(), or -1 if no rule reads the input.
+  int FindInput(RuleInput::Kind kind, int id) const;
+
+  // Evaluates the rules that read an input against one of its samples,
+  // timestamp in microseconds, values indexed by axis. Returns the actions
+  // of the rules that fired, valid until the next call.
+  const std::vector<const RuleAction*>& Evaluate(int input, int64_t timestamp,
+                                                 const float* values);
+
+  size_t rule_count() const { return rules_.size(); }
+  const std::string& rule_name(size_t rule) const { return names_[rule]; }
+  // Times a rule fired.
+  uint64_t rule_fired(size_t rule) const { return rules_[rule].fired; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Predicate {
+    enum Kind : uint8_t { kThreshold, kRise, kFall, kWindow };
+    enum Op : uint8_t { kLess, kLessEqual, kGreater, kGreaterEqual };
+    enum Stat : uint8_t { kMean, kMin, kMax };
+
+    Kind kind;
+    Op op;
+    Stat stat;
+    int8_t axis;
+    float threshold;
+    uint32_t input;
+    uint32_t rule;
+    // Index into windows_ for kWindow.
+    int32_t window;
+    bool value;
+    // Edges: whether the last sample was past the threshold, and whether
+    // there was one.
+    bool past;
+    bool primed;
+  };
+  struct Window {
+    int64_t length_us;
+    // Where the window's ring starts in the pools; capacity is mask + 1.
+    size_t offset;
+    uint64_t mask;
+    // Sequence numbers of the oldest and next sample, and of the ends of
+    // the monotonic queue.
+    uint64_t head;
+    uint64_t tail;
+    uint64_t extremes_head;
+    uint64_t extremes_tail;
+    double sum;
+  };
+  struct Rule {
+    uint32_t first_predicate;
+    uint32_t predicate_count;
+    uint32_t first_action;
+    uint32_t action_count;
+    bool active;
+    // Evaluation that last queued the rule.
+    uint64_t queued;
+    uint64_t fired;
+  };
+  RulesEngine();
+  bool ParseRule(const std::string& line, const SensorResolver& resolver,
+                 int64_t sample_period_us);
+  bool ParsePredicate(const std::vector<std::string>& words, uint32_t rule,
+                      const SensorResolver& resolver,
+                      int64_t sample_period_us);
+  bool ParseAction(const std::vector<std::string>& words);
+  uint32_t AddInput(RuleInput::Kind kind, int id);
+  void Link();
+  bool EvaluatePredicate(Predicate* predicate, int64_t timestamp,
+                         const float* values);
+  float AddToWindow(Window* window, Predicate::Stat stat, int64_t timestamp,
+                    float value);
+
+  std::vector<RuleInput> inputs_;
+  // Predicates of rule r are contiguous, as are the predicates reading an
+  // input: input_predicates_[input_offsets_[i], input_offsets_[i + 1]).
+  std::vector<Predicate> predicates_;
+  std::vector<uint32_t> input_offsets_;
+  std::vector<uint32_t> input_predicates_;
+  std::vector<Window> windows_;
+  // Window rings: timestamps and values, and the monotonic queue of
+  // sample sequence numbers, at each window's offset.
+  std::vector<int64_t> window_timestamps_;
+  std::vector<float> window_values_;
+  std::vector<uint64_t> window_extremes_;
+  std::vector<RuleAction> actions_;
+  std::vector<Rule> rules_;
+  std::vector<std::string> names_;
+
+  // Reserved to their largest size at compile time.
+  std::vector<uint32_t> queued_rules_;
+  std::vector<const RuleAction*> fired_;
+  uint64_t evaluation_{0};
+  Stats stats_{0, 0, 0, 0};
+
+  DISALLOW_COPY_AND_ASSIGN(RulesEngine);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_RULES_ENGINE_H_
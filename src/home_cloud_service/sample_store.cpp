@@ -0,0 +1,576 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sample_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+
+#include <base/logging.h>
+
+namespace home_cloud {
+
+namespace {
+const char kSegmentMagic[4] = {'H', 'C', 'S', 'G'};
+const uint16_t kSegmentVersion = 1;
+const uint32_t kChunkMagic = 0x4b4e4843;  // "CHNK"
+const int64_t kMicrosPerDay = 86400LL * 1000000;
+
+struct SegmentHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t axes;
+  int32_t type;
+  uint32_t reserved;
+};
+
+struct ChunkHeader {
+  uint32_t magic;
+  uint32_t bytes;
+  uint32_t count;
+  uint32_t reserved;
+  int64_t first_timestamp;
+  int64_t last_timestamp;
+};
+
+// Segments are named <type>-<first timestamp>.seg, zero-padded so that
+// sorting the names sorts them by time.
+std::string SegmentName(int type, int64_t timestamp) {
+  char name[64];
+  snprintf(name, sizeof(name), "%d-%016" PRId64 ".seg", type, timestamp);
+  return name;
+}
+
+bool ParseSegmentName(const char* name, int* type, int64_t* timestamp) {
+  int consumed = 0;
+  long long start;
+  if (sscanf(name, "%d-%lld.seg%n", type, &start, &consumed) != 2 ||
+      name[consumed] != '\0')
+    return false;
+  *timestamp = start;
+  return true;
+}
+
+int64_t SegmentStart(const std::string& path) {
+  size_t slash = path.rfind('/');
+  int type;
+  int64_t timestamp = 0;
+  ParseSegmentName(path.c_str() + (slash == std::string::npos ? 0 : slash + 1),
+                   &type, &timestamp);
+  return timestamp;
+}
+
+bool WriteAll(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Orders samples by timestamp, keeping the order of equal ones.
+void SortSamples(int axes, std::vector<int64_t>* timestamps,
+                 std::vector<float>* values) {
+  std::vector<size_t> order(timestamps->size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [timestamps](size_t a, size_t b) {
+                     return (*timestamps)[a] < (*timestamps)[b];
+                   });
+  std::vector<int64_t> sorted_timestamps(order.size());
+  std::vector<float> sorted_values(values->size());
+  for (size_t i = 0; i < order.size(); i++) {
+    sorted_timestamps[i] = (*timestamps)[order[i]];
+    std::copy(values->begin() + order[i] * axes,
+              values->begin() + (order[i] + 1) * axes,
+              sorted_values.begin() + i * axes);
+  }
+  timestamps->swap(sorted_timestamps);
+  values->swap(sorted_values);
+}
+}  // anonymous namespace
+
+SampleRing::SampleRing(int axes, size_t capacity) : axes_(axes) {
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+  mask_ = size - 1;
+  timestamps_.resize(size);
+  values_.resize(size * axes);
+}
+
+void SampleRing::Push(int64_t timestamp, const float* values) {
+  size_t slot;
+  if (size_ == capacity()) {
+    slot = head_;
+    head_ = (head_ + 1) & mask_;
+  } else {
+    slot = (head_ + size_) & mask_;
+    size_++;
+  }
+  timestamps_[slot] = timestamp;
+  for (int axis = 0; axis < axes_; axis++)
+    values_[axis * capacity() + slot] = values[axis];
+}
+
+size_t SampleRing::LowerBound(int64_t t) const {
+  size_t lo = 0, hi = size_;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (timestamp(mid) < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+std::unique_ptr<SegmentReader> SegmentReader::Open(const std::string& path) {
+  std::unique_ptr<SegmentReader> reader(new SegmentReader(path));
+  if (!reader->Map())
+    return nullptr;
+  return reader;
+}
+
+SegmentReader::SegmentReader(const std::string& path) : path_(path) {}
+
+SegmentReader::~SegmentReader() {
+  if (map_)
+    munmap(const_cast<uint8_t*>(map_), map_size_);
+}
+
+bool SegmentReader::Map() {
+  int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(SegmentHeader))) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const SegmentHeader* header = static_cast<const SegmentHeader*>(map);
+  if (memcmp(header->magic, kSegmentMagic, sizeof(kSegmentMagic)) != 0 ||
+      header->version != kSegmentVersion) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  if (map_)
+    munmap(const_cast<uint8_t*>(map_), map_size_);
+  map_ = static_cast<const uint8_t*>(map);
+  map_size_ = st.st_size;
+  axes_ = std::min<int>(header->axes, kMaxAxes);
+  if (indexed_ == 0)
+    indexed_ = sizeof(SegmentHeader);
+  IndexChunks();
+  return true;
+}
+
+bool SegmentReader::Refresh() {
+  struct stat st;
+  if (stat(path_.c_str(), &st) != 0)
+    return false;
+  if (static_cast<size_t>(st.st_size) == map_size_)
+    return true;
+  return Map();
+}
+
+void SegmentReader::IndexChunks() {
+  while (indexed_ + sizeof(ChunkHeader) <= map_size_) {
+    ChunkHeader header;
+    memcpy(&header, map_ + indexed_, sizeof(header));
+    if (header.magic != kChunkMagic ||
+        header.bytes > map_size_ - indexed_ - sizeof(header))
+      break;
+    ChunkRef chunk = {indexed_ + sizeof(header), header.bytes, header.count,
+                      header.first_timestamp, header.last_timestamp};
+    chunks_.push_back(chunk);
+    indexed_ += sizeof(header) + header.bytes;
+  }
+}
+
+void SegmentReader::Read(int64_t from, int64_t to, size_t max_samples,
+                         std::vector<int64_t>* timestamps,
+                         std::vector<float>* values) const {
+  // Chunks are in time order; skip straight to the first that can overlap.
+  auto it = std::lower_bound(chunks_.begin(), chunks_.end(), from,
+                             [](const ChunkRef& chunk, int64_t t) {
+                               return chunk.last_timestamp < t;
+                             });
+  float sample[kMaxAxes];
+  for (; it != chunks_.end() && it->first_timestamp < to &&
+         timestamps->size() < max_samples;
+       ++it) {
+    ChunkDecoder decoder(map_ + it->offset, it->bytes, axes_, it->count);
+    int64_t t;
+    while (timestamps->size() < max_samples && decoder.Next(&t, sample)) {
+      if (t >= to)
+        break;
+      if (t < from)
+        continue;
+      timestamps->push_back(t);
+      values->insert(values->end(), sample, sample + axes_);
+    }
+  }
+}
+
+struct SampleStore::Series {
+  Series(int type, int axes, float step, size_t ring_samples)
+      : type(type), axes(axes), step(step), ring(axes, ring_samples),
+        encoder(axes) {}
+
+  int type;
+  int axes;
+  float step;
+  SampleRing ring;
+  // The newest samples of the ring that are not on disk yet.
+  size_t unflushed{0};
+
+  ChunkEncoder encoder;
+  std::vector<uint8_t> chunk;
+
+  // Segment currently appended to.
+  int fd{-1};
+  size_t segment_bytes{0};
+  int64_t segment_day{-1};
+
+  // Every segment of this sensor, oldest first, including the current one.
+  std::vector<std::string> segments;
+  // Segments opened since the last Split(), which may hold what the ring
+  // does.
+  std::set<std::string> since_split;
+  std::map<std::string, std::unique_ptr<SegmentReader>> readers;
+};
+
+SampleStore::Options SampleStore::DefaultOptions(const std::string& directory) {
+  Options options;
+  options.directory = directory;
+  options.ring_samples = 4096;
+  options.chunk_samples = 1024;
+  options.max_chunk_age_us = 10LL * 60 * 1000000;
+  options.max_segment_bytes = 4 << 20;
+  options.retention_us = 7 * kMicrosPerDay;
+  return options;
+}
+
+SampleStore::SampleStore(const Options& options) : options_(options) {}
+
+SampleStore::~SampleStore() {
+  Flush();
+  for (auto& series : series_)
+    CloseSegment(series.get());
+}
+
+SampleStore::Series* SampleStore::Find(int type) const {
+  for (const auto& series : series_) {
+    if (series->type == type)
+      return series.get();
+  }
+  return nullptr;
+}
+
+int SampleStore::axes(int type) const {
+  Series* series = Find(type);
+  return series ? series->axes : 0;
+}
+
+void SampleStore::AddSensor(int type, int axes, float resolution) {
+  if (Find(type))
+    return;
+  std::unique_ptr<Series> series(new Series(
+      type, std::min(axes, kMaxAxes), QuantizeStep(resolution),
+      std::max(options_.ring_samples, options_.chunk_samples * 2)));
+
+  DIR* dir = opendir(options_.directory.c_str());
+  if (dir) {
+    while (struct dirent* entry = readdir(dir)) {
+      int segment_type;
+      int64_t start;
+      if (ParseSegmentName(entry->d_name, &segment_type, &start) &&
+          segment_type == type)
+        series->segments.push_back(options_.directory + "/" + entry->d_name);
+    }
+    closedir(dir);
+  }
+  std::sort(series->segments.begin(), series->segments.end());
+  series_.push_back(std::move(series));
+}
+
+void SampleStore::Append(int type, int64_t timestamp, const float* values) {
+  Series* series = Find(type);
+  if (!series)
+    return;
+
+  float quantized[kMaxAxes];
+  for (int axis = 0; axis < series->axes; axis++)
+    quantized[axis] = Quantize(values[axis], series->step);
+
+  SampleRing& ring = series->ring;
+  if (ring.size() == ring.capacity() && series->unflushed == ring.size()) {
+    series->unflushed--;
+    stats_.lost_samples++;
+  }
+  ring.Push(timestamp, quantized);
+  series->unflushed++;
+  stats_.samples++;
+
+  if (series->unflushed >= options_.chunk_samples) {
+    FlushChunk(series, options_.chunk_samples);
+  } else if (timestamp - ring.timestamp(ring.size() - series->unflushed) >=
+             options_.max_chunk_age_us) {
+    FlushChunk(series, series->unflushed);
+  }
+}
+
+void SampleStore::Flush() {
+  for (auto& series : series_) {
+    if (series->unflushed > 0)
+      FlushChunk(series.get(), series->unflushed);
+  }
+}
+
+void SampleStore::FlushAged(int64_t now) {
+  for (auto& series : series_) {
+    const SampleRing& ring = series->ring;
+    if (series->unflushed > 0 &&
+        now - ring.timestamp(ring.size() - series->unflushed) >=
+            options_.max_chunk_age_us)
+      FlushChunk(series.get(), series->unflushed);
+  }
+}
+
+void SampleStore::Split() {
+  Flush();
+  for (auto& series : series_) {
+    CloseSegment(series.get());
+    series->ring.Clear();
+    series->since_split.clear();
+  }
+}
+
+void SampleStore::FlushChunk(Series* series, size_t count) {
+  const SampleRing& ring = series->ring;
+  size_t first = ring.size() - series->unflushed;
+  float sample[kMaxAxes];
+  for (size_t i = first; i < first + count; i++) {
+    for (int axis = 0; axis < series->axes; axis++)
+      sample[axis] = ring.value(axis, i);
+    series->encoder.Append(ring.timestamp(i), sample);
+  }
+
+  ChunkHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kChunkMagic;
+  header.count = count;
+  header.first_timestamp = series->encoder.first_timestamp();
+  header.last_timestamp = series->encoder.last_timestamp();
+  series->chunk.resize(sizeof(header));
+  series->encoder.Finish(&series->chunk);
+  header.bytes = series->chunk.size() - sizeof(header);
+  memcpy(series->chunk.data(), &header, sizeof(header));
+
+  // Either way these samples are done with; a failed write is not retried
+  // so that a full or broken disk cannot back up the ring.
+  series->unflushed -= count;
+
+  if (!OpenSegment(series, header.first_timestamp) ||
+      !WriteAll(series->fd, series->chunk.data(), series->chunk.size())) {
+    if (stats_.write_errors++ == 0)
+      PLOG(ERROR) << "Unable to write sensor " << series->type << " samples";
+    CloseSegment(series);
+    return;
+  }
+  series->segment_bytes += series->chunk.size();
+  stats_.flushed_samples += count;
+  stats_.bytes_written += series->chunk.size();
+}
+
+bool SampleStore::OpenSegment(Series* series, int64_t timestamp) {
+  int64_t day = timestamp / kMicrosPerDay;
+  if (series->fd >= 0 && series->segment_day == day &&
+      series->segment_bytes < options_.max_segment_bytes)
+    return true;
+  CloseSegment(series);
+  ExpireSegments(series, timestamp);
+
+  std::string path =
+      options_.directory + "/" + SegmentName(series->type, timestamp);
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                0640);
+  if (fd < 0)
+    return false;
+  SegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSegmentMagic, sizeof(kSegmentMagic));
+  header.version = kSegmentVersion;
+  header.axes = series->axes;
+  header.type = series->type;
+  if (!WriteAll(fd, reinterpret_cast<const uint8_t*>(&header), sizeof(header))) {
+    close(fd);
+    unlink(path.c_str());
+    return false;
+  }
+  series->fd = fd;
+  series->segment_bytes = sizeof(header);
+  series->segment_day = day;
+  // After the clock steps back a new segment can sort before older ones.
+  series->segments.insert(std::upper_bound(series->segments.begin(),
+                                           series->segments.end(), path),
+                          path);
+  series->since_split.insert(path);
+  stats_.bytes_written += sizeof(header);
+  return true;
+}
+
+void SampleStore::CloseSegment(Series* series) {
+  if (series->fd < 0)
+    return;
+  fdatasync(series->fd);
+  close(series->fd);
+  series->fd = -1;
+}
+
+// A segment ends where the next one starts, so the names alone say which
+// segments hold nothing newer than the retention period.
+void SampleStore::ExpireSegments(Series* series, int64_t now) {
+  std::vector<std::string>& segments = series->segments;
+  size_t expired = 0;
+  while (expired + 1 < segments.size() &&
+         SegmentStart(segments[expired + 1]) < now - options_.retention_us)
+    expired++;
+  for (size_t i = 0; i < expired; i++) {
+    series->readers.erase(segments[i]);
+    series->since_split.erase(segments[i]);
+    if (unlink(segments[i].c_str()) != 0)
+      PLOG(WARNING) << "Unable to remove " << segments[i];
+  }
+  segments.erase(segments.begin(), segments.begin() + expired);
+}
+
+SegmentReader* SampleStore::Reader(Series* series, const std::string& path) {
+  auto it = series->readers.find(path);
+  if (it != series->readers.end()) {
+    it->second->Refresh();
+    return it->second.get();
+  }
+  std::unique_ptr<SegmentReader> reader = SegmentReader::Open(path);
+  if (!reader)
+    return nullptr;
+  SegmentReader* result = reader.get();
+  series->readers[path] = std::move(reader);
+  return result;
+}
+
+size_t SampleStore::Query(int type, int64_t from, int64_t to,
+                          size_t max_samples,
+                          std::vector<int64_t>* timestamps,
+                          std::vector<float>* values) {
+  timestamps->clear();
+  values->clear();
+  Series* series = Find(type);
+  if (!series || from >= to)
+    return 0;
+
+  // The ring overlaps the segments written since the last split; take
+  // whatever it holds from the ring and only the older part of those from
+  // disk. After the clock steps back, segments overlap in time, so each is
+  // picked by the span of its own chunks, and whatever overlaps what was
+  // already read is merged in by timestamp.
+  const SampleRing& ring = series->ring;
+  int64_t ring_start = ring.size() > 0 ? ring.timestamp(0)
+                                       : std::numeric_limits<int64_t>::max();
+  int64_t newest = std::numeric_limits<int64_t>::min();
+  bool sorted = true;
+  for (const std::string& path : series->segments) {
+    int64_t start = SegmentStart(path);
+    // Segments are in order of their first sample, so once max_samples are
+    // in hand the rest only hold later ones.
+    if (timestamps->size() >= max_samples && start > newest)
+      break;
+    int64_t segment_to =
+        series->since_split.count(path) ? std::min(to, ring_start) : to;
+    if (start >= segment_to || from >= segment_to)
+      continue;
+    SegmentReader* reader = Reader(series, path);
+    if (!reader || reader->axes() != series->axes ||
+        reader->last_timestamp() < from)
+      continue;
+    size_t limit = max_samples;
+    if (reader->first_timestamp() < newest) {
+      sorted = false;
+      limit = timestamps->size() + max_samples;
+    }
+    reader->Read(from, segment_to, limit, timestamps, values);
+    if (!timestamps->empty())
+      newest = std::max(newest, timestamps->back());
+  }
+
+  size_t first = ring.LowerBound(from);
+  size_t limit = max_samples;
+  if (first < ring.size() && ring.timestamp(first) < newest) {
+    sorted = false;
+    limit = timestamps->size() + max_samples;
+  }
+  for (size_t i = first; i < ring.size() && ring.timestamp(i) < to &&
+                         timestamps->size() < limit;
+       i++) {
+    timestamps->push_back(ring.timestamp(i));
+    for (int axis = 0; axis < series->axes; axis++)
+      values->push_back(ring.value(axis, i));
+  }
+
+  if (!sorted)
+    SortSamples(series->axes, timestamps, values);
+  if (timestamps->size() > max_samples) {
+    timestamps->resize(max_samples);
+    values->resize(max_samples * series->axes);
+  }
+  return timestamps->size();
+}
+
+bool SampleStore::Latest(int type, int64_t* timestamp, float* values) const {
+  Series* series = Find(type);
+  if (!series || series->ring.size() == 0)
+    return false;
+  size_t last = series->ring.size() - 1;
+  *timestamp = series->ring.timestamp(last);
+  for (int axis = 0; axis < series->axes; axis++)
+    values[axis] = series->ring.value(axis, last);
+  return true;
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_SAMPLE_STORE_H_
+#define HOME_CLOUD_SERVICE_SAMPLE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "time_series_codec.h"
+
+namespace home_cloud {
+
+// Fixed-capacity history of one sensor, oldest sample first. Timestamps and
+// each axis live in their own arrays, so a scan over time or over one axis
+// walks contiguous memory.
+class SampleRing {
+ public:
+  // capacity is rounded up to a power of two.
+  SampleRing(int axes, size_t capacity);
+
+  int axes() const { return axes_; }
+  size_t size() const { return size_; }
+  size_t capacity() const { return mask_ + 1; }
+
+  // Overwrites the oldest sample when full.
+  void Push(int64_t timestamp, const float* values);
+  void Clear() { size_ = 0; }
+
+  int64_t timestamp(size_t i) const { return timestamps_[(head_ + i) & mask_]; }
+  float value(int axis, size_t i) const {
+    return values_[axis * capacity() + ((head_ + i) & mask_)];
+  }
+  // Index of the first sample at or after timestamp; size() if none.
+  size_t LowerBound(int64_t timestamp) const;
+
+ private:
+  int axes_;
+  size_t mask_;
+  size_t head_{0};
+  size_t size_{0};
+  std::vector<int64_t> timestamps_;
+  // Axis-major: all of axis 0, then all of axis 1, ...
+  std::vector<float> values_;
+
+  DISALLOW_COPY_AND_ASSIGN(SampleRing);
+};
+
+// Read-only view of one segment file, mapped into memory. Chunk headers are
+// indexed once; only the chunks a query overlaps are decoded.
+class SegmentReader {
+ public:
+  static std::unique_ptr<SegmentReader> Open(const std::string& path);
+  ~SegmentReader();
+
+  // Picks up chunks appended since the file was mapped.
+  bool Refresh();
+
+  int axes() const { return axes_; }
+  // Timestamps of the oldest and newest sample indexed; first is above last
+  // while there is none.
+  int64_t first_timestamp() const {
+    return chunks_.empty() ? std::numeric_limits<int64_t>::max()
+                           : chunks_.front().first_timestamp;
+  }
+  int64_t last_timestamp() const {
+    return chunks_.empty() ? std::numeric_limits<int64_t>::min()
+                           : chunks_.back().last_timestamp;
+  }
+  // Appends samples in [from, to) to timestamps, and axes() values per
+  // sample to values, until timestamps holds max_samples.
+  void Read(int64_t from, int64_t to, size_t max_samples,
+            std::vector<int64_t>* timestamps,
+            std::vector<float>* values) const;
+
+ private:
+  struct ChunkRef {
+    size_t offset;
+    uint32_t bytes;
+    uint32_t count;
+    int64_t first_timestamp;
+    int64_t last_timestamp;
+  };
+
+  explicit SegmentReader(const std::string& path);
+  bool Map();
+  void IndexChunks();
+
+  std::string path_;
+  int axes_{0};
+  const uint8_t* map_{nullptr};
+  size_t map_size_{0};
+  size_t indexed_{0};
+  std::vector<ChunkRef> chunks_;
+
+  DISALLOW_COPY_AND_ASSIGN(SegmentReader);
+};
+
+// Sample history for every sensor: the most recent samples in a SampleRing
+// each, everything older in compressed, append-only segment files.
+//
+// Samples are written out a chunk at a time, once per chunk_samples samples
+// or max_chunk_age, whichever comes first, with a single append. Nothing is
+// ever rewritten, and a new segment is started each day or once the current
+// one reaches max_segment_bytes, so expiring old data is just deleting
+// files. A chunk cut short by a crash is ignored when reading.
+//
+// Timestamps are microseconds since the epoch.
+class SampleStore {
+ public:
+  struct Options {
+    std::string directory;
+    size_t ring_samples;
+    size_t chunk_samples;
+    int64_t max_chunk_age_us;
+    size_t max_segment_bytes;
+    int64_t retention_us;
+  };
+
+  struct Stats {
+    uint64_t samples;
+    uint64_t flushed_samples;
+    uint64_t bytes_written;
+    // Samples pushed out of a ring before they could be written.
+    uint64_t lost_samples;
+    uint64_t write_errors;
+  };
+
+  static Options DefaultOptions(const std::string& directory);
+
+  explicit SampleStore(const Options& options);
+  ~SampleStore();
+
+  // Values are rounded to the largest power of two below resolution.
+  void AddSensor(int type, int axes, float resolution);
+  void Append(int type, int64_t timestamp, const float* values);
+  // Writes out every sample not yet on disk.
+  void Flush();
+  // Writes out the samples of every sensor whose oldest one not on disk is
+  // max_chunk_age older than now. Append() only checks the age of the
+  // sensor it is given, so this is what writes out a sensor that stopped.
+  void FlushAged(int64_t now);
+  // Flushes, then starts every sensor on a new segment and an empty ring,
+  // so samples timed by a clock that has stepped do not share a segment or
+  // a ring with the ones before them.
+  void Split();
+
+  // The first max_samples samples of a sensor in [from, to), oldest first,
+  // with axes() values per sample. Returns the number of samples.
+  size_t Query(int type, int64_t from, int64_t to, size_t max_samples,
+               std::vector<int64_t>* timestamps, std::vector<float>* values);
+  // The newest sample of a sensor; false if there is none yet.
+  bool Latest(int type, int64_t* timestamp, float* values) const;
+  int axes(int type) const;
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Series;
+
+  Series* Find(int type) const;
+  void FlushChunk(Series* series, size_t count);
+  bool OpenSegment(Series* series, int64_t timestamp);
+  void CloseSegment(Series* series);
+  void ExpireSegments(Series* series, int64_t now);
+  SegmentReader* Reader(Series* series, const std::string& path);
+
+  Options options_;
+  std::vector<std::unique_ptr<Series>> series_;
+  Stats stats_{0, 0, 0, 0, 0};
+
+  DISALLOW_COPY_AND_ASSIGN(SampleStore);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_SAMPLE_STORE_H_
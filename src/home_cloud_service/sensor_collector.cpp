@@ -0,0 +1,207 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sensor_collector.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <future>
+
+#include <base/logging.h>
+
+namespace home_cloud {
+
+namespace {
+const char kPackageName[] = "home_cloud_service";
+const int kLooperId = 1;
+// Events read per ASensorEventQueue_getEvents() call.
+const size_t kDrainEvents = 256;
+}  // anonymous namespace
+
+SensorCollector::SensorCollector(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+    const EventsCallback& callback)
+    : SensorSource(task_runner, callback) {}
+
+SensorCollector::~SensorCollector() {
+  Stop();
+}
+
+bool SensorCollector::Start(const std::vector<int>& types, int32_t period_us,
+                            int64_t max_latency_us) {
+  Stop();
+  stopping_ = false;
+
+  // The queue has to be created on the thread whose looper it wakes.
+  std::promise<bool> started;
+  std::future<bool> result = started.get_future();
+  thread_ = std::thread([this, types, period_us, max_latency_us, &started]() {
+    // Held until Stop() so that waking it never races the thread's exit.
+    looper_ = ALooper_prepare(ALOOPER_PREPARE_ALLOW_NON_CALLBACKS);
+    ALooper_acquire(looper_);
+    bool ok = EnableSensors(types, period_us, max_latency_us);
+    started.set_value(ok);
+    if (ok)
+      Run();
+  });
+  if (!result.get()) {
+    Stop();
+    return false;
+  }
+  return true;
+}
+
+void SensorCollector::Stop() {
+  if (!thread_.joinable())
+    return;
+  stopping_ = true;
+  ALooper_wake(looper_);
+  thread_.join();
+  ALooper_release(looper_);
+  looper_ = nullptr;
+}
+
+bool SensorCollector::EnableSensors(const std::vector<int>& types,
+                                    int32_t period_us,
+                                    int64_t max_latency_us) {
+  manager_ = ASensorManager_getInstanceForPackage(kPackageName);
+  if (!manager_) {
+    LOG(ERROR) << "Failed to get a sensor manager";
+    return false;
+  }
+  queue_ = ASensorManager_createEventQueue(manager_, looper_, kLooperId,
+                                           nullptr, nullptr);
+  if (!queue_) {
+    LOG(ERROR) << "Failed to create a sensor event queue";
+    return false;
+  }
+
+  ASensorList list = nullptr;
+  int count = ASensorManager_getSensorList(manager_, &list);
+  std::vector<ASensorRef> chosen;
+  for (int type : types) {
+    for (int i = 0; i < count; i++) {
+      if (ASensor_getType(list[i]) == type) {
+        chosen.push_back(list[i]);
+        break;
+      }
+    }
+  }
+
+  // Sensors without a reserved share of the hub's FIFO split what is left
+  // of it between them.
+  int sharing = 0;
+  for (ASensorRef sensor : chosen) {
+    if (ASensor_getFifoReservedEventCount(sensor) == 0 &&
+        ASensor_getFifoMaxEventCount(sensor) > 0)
+      sharing++;
+  }
+
+  sensors_.clear();
+  size_t fifo_total = 0;
+  for (ASensorRef sensor : chosen) {
+    // A positive minimum delay marks a continuous sensor; on-change and
+    // one-shot sensors report when something happens.
+    int32_t period = 0;
+    int min_delay = ASensor_getMinDelay(sensor);
+    if (min_delay > 0)
+      period = std::max<int32_t>(period_us, min_delay);
+
+    // Ask the hub to hold events no longer than its FIFO can take at this
+    // rate, with some headroom, or the oldest would be overwritten before
+    // the batch is delivered.
+    int fifo = ASensor_getFifoReservedEventCount(sensor);
+    if (fifo == 0 && ASensor_getFifoMaxEventCount(sensor) > 0)
+      fifo = ASensor_getFifoMaxEventCount(sensor) / std::max(sharing, 1);
+    int64_t latency = 0;
+    if (max_latency_us > 0 && fifo > 0 && period > 0)
+      latency = std::min<int64_t>(max_latency_us,
+                                  static_cast<int64_t>(period) * fifo * 3 / 4);
+
+    if (ASensorEventQueue_registerSensor(queue_, sensor, period, latency) < 0) {
+      // Older sensor HALs reject batching; stream from those instead.
+      latency = 0;
+      if (ASensorEventQueue_enableSensor(queue_, sensor) < 0 ||
+          (period > 0 &&
+           ASensorEventQueue_setEventRate(queue_, sensor, period) < 0)) {
+        LOG(WARNING) << "Failed to enable " << ASensor_getName(sensor);
+        ASensorEventQueue_disableSensor(queue_, sensor);
+        continue;
+      }
+    }
+    enabled_.push_back(sensor);
+    sensors_.push_back({ASensor_getType(sensor), ASensor_getName(sensor),
+                        ASensor_getResolution(sensor), period, latency, fifo});
+    if (latency > 0)
+      fifo_total += fifo;
+    LOG(INFO) << "Sensor " << ASensor_getName(sensor) << " enabled"
+              << (period ? ", every " + std::to_string(period) + " us"
+                         : std::string())
+              << (latency ? ", batched up to " + std::to_string(latency) +
+                                " us in a " + std::to_string(fifo) +
+                                " event FIFO"
+                          : std::string());
+  }
+  // The FIFOs tend to be flushed together and arrive all at once; leave room
+  // for two rounds of them while the owner's loop catches up.
+  max_pending_ = std::max(max_pending_, 2 * fifo_total);
+  if (enabled_.empty()) {
+    LOG(ERROR) << "None of the requested sensors could be enabled";
+    ASensorManager_destroyEventQueue(manager_, queue_);
+    queue_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void SensorCollector::Run() {
+  while (!stopping_) {
+    int ident = ALooper_pollAll(-1, nullptr, nullptr, nullptr);
+    if (ident == kLooperId) {
+      wakeups_++;
+      Drain();
+    } else if (ident == ALOOPER_POLL_ERROR) {
+      LOG(ERROR) << "Sensor looper failed";
+      break;
+    }
+  }
+
+  for (ASensorRef sensor : enabled_) {
+    int ret = ASensorEventQueue_disableSensor(queue_, sensor);
+    if (ret < 0)
+      LOG(WARNING) << "Failed to disable " << ASensor_getName(sensor) << ": "
+                   << strerror(-ret);
+  }
+  enabled_.clear();
+  int ret = ASensorManager_destroyEventQueue(manager_, queue_);
+  if (ret < 0)
+    LOG(WARNING) << "Failed to destroy event queue: " << strerror(-ret);
+  queue_ = nullptr;
+}
+
+void SensorCollector::Drain() {
+  ASensorEvent events[kDrainEvents];
+  ssize_t n;
+  // A short read means the queue is empty until the next wake-up.
+  do {
+    n = ASensorEventQueue_getEvents(queue_, events, kDrainEvents);
+    if (n <= 0)
+      break;
+    Post(events, n);
+  } while (static_cast<size_t>(n) == kDrainEvents);
+}
+
+}  // namespace home_cloud
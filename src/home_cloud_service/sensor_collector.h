@@ -0,0 +1,73 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_SENSOR_COLLECTOR_H_
+#define HOME_CLOUD_SERVICE_SENSOR_COLLECTOR_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <android/looper.h>
+#include <android/sensor.h>
+#include <base/macros.h>
+
+#include "sensor_source.h"
+
+namespace home_cloud {
+
+// Reads every enabled sensor through a single NDK event queue.
+//
+// The NDK does not hand out the queue's file descriptor, so the queue lives
+// on its own ALooper thread. Each wake-up drains everything pending with
+// large ASensorEventQueue_getEvents() reads and posts it to the owner's
+// loop in one go.
+class SensorCollector : public SensorSource {
+ public:
+  SensorCollector(scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+                  const EventsCallback& callback);
+  ~SensorCollector() override;
+
+  // Enables the first sensor of each of the given types, sampling
+  // continuous ones every period_us (clamped to what the sensor supports).
+  // With max_latency_us the hub batches events in its FIFO and wakes us up
+  // at most that late, and sooner if the FIFO would overflow. Returns false
+  // if no sensor could be enabled.
+  bool Start(const std::vector<int>& types, int32_t period_us,
+             int64_t max_latency_us) override;
+  void Stop() override;
+
+ private:
+  void Run();
+  bool EnableSensors(const std::vector<int>& types, int32_t period_us,
+                     int64_t max_latency_us);
+  void Drain();
+
+  std::thread thread_;
+  ALooper* looper_{nullptr};
+  ASensorManager* manager_{nullptr};
+  ASensorEventQueue* queue_{nullptr};
+  std::vector<ASensorRef> enabled_;
+
+  std::atomic<bool> stopping_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(SensorCollector);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_SENSOR_COLLECTOR_H_
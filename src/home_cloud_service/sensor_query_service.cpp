@@ -0,0 +1,161 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sensor_query_service.h"
+
+#include <algorithm>
+#include <string>
+
+#include <base/files/file_util.h>
+
+#include "sample_store.h"
+#include "service_module.h"
+#include "time_series_codec.h"
+
+using android::binder::Status;
+
+namespace home_cloud {
+
+namespace {
+// Reply size limit, well inside the 1 MB binder buffer a process shares
+// between all of its transactions in flight.
+const size_t kMaxReplyBytes = 512 * 1024;
+// Raw samples taken from the store at a time, so that a long range with a
+// high downsample factor is reduced as it is read instead of held whole.
+const size_t kReadSamples = 16384;
+// Raw samples one call may decode, about 10 ms of work on the board. The
+// query runs on the thread that takes in sensor events, which pile up
+// behind it.
+const size_t kMaxScanSamples = 1 << 18;
+}  // anonymous namespace
+
+SensorQueryService::SensorQueryService(SampleStore* store,
+                                       const std::vector<int>& types)
+    : store_(store), types_(types) {}
+
+Status SensorQueryService::getSensorTypes(std::vector<int32_t>* types) {
+  types->assign(types_.begin(), types_.end());
+  return Status::ok();
+}
+
+Status SensorQueryService::getAxes(int32_t sensor_type, int32_t* axes) {
+  *axes = store_->axes(sensor_type);
+  if (*axes == 0)
+    return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT);
+  return Status::ok();
+}
+
+Status SensorQueryService::querySamples(int32_t sensor_type, int64_t from_us,
+                                        int32_t skip, int64_t to_us,
+                                        int32_t downsample, int32_t max_samples,
+                                        std::vector<int64_t>* timestamps_us,
+                                        std::vector<float>* values,
+                                        std::vector<int32_t>* next_skip,
+                                        int64_t* next_us) {
+  const int axes = store_->axes(sensor_type);
+  if (axes == 0 || skip < 0 || static_cast<size_t>(skip) > kMaxScanSamples ||
+      downsample < 1 || static_cast<size_t>(downsample) > kMaxScanSamples ||
+      max_samples < 1)
+    return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT);
+  const size_t limit = std::min<size_t>(
+      {static_cast<size_t>(max_samples), kMaxReplyBytes / (8 + 4 * axes),
+       kMaxScanSamples / downsample});
+  timestamps_us->clear();
+  values->clear();
+  timestamps_us->reserve(std::min(limit, kReadSamples));
+  values->reserve(std::min(limit, kReadSamples) * axes);
+
+  // Each run of downsample samples is averaged into one, carried across
+  // reads from the store.
+  const int64_t group = downsample;
+  int64_t run = 0;
+  int64_t run_start = 0;
+  double sums[kMaxAxes];
+  // The cursor: the last sample taken, and how many taken share its
+  // timestamp. Every read from the store starts at it.
+  int64_t cursor = from_us;
+  size_t cursor_skip = skip;
+  bool done = false;
+  while (!done && timestamps_us->size() < limit) {
+    const size_t want = kReadSamples + cursor_skip;
+    size_t count = store_->Query(sensor_type, cursor, to_us, want,
+                                 &read_timestamps_, &read_values_);
+    done = count < want;
+    for (size_t i = cursor_skip; i < count; i++) {
+      if (read_timestamps_[i] == cursor) {
+        cursor_skip++;
+      } else {
+        cursor = read_timestamps_[i];
+        cursor_skip = 1;
+      }
+      const float* sample = &read_values_[i * axes];
+      if (run == 0) {
+        run_start = read_timestamps_[i];
+        std::fill(sums, sums + axes, 0.0);
+      }
+      for (int axis = 0; axis < axes; axis++)
+        sums[axis] += sample[axis];
+      if (++run < group)
+        continue;
+      timestamps_us->push_back(run_start);
+      for (int axis = 0; axis < axes; axis++)
+        values->push_back(static_cast<float>(sums[axis] / run));
+      run = 0;
+      if (timestamps_us->size() == limit) {
+        done = done && i + 1 == count;
+        break;
+      }
+    }
+  }
+  next_skip->clear();
+  if (!done) {
+    *next_us = cursor;
+    next_skip->push_back(cursor_skip);
+    return Status::ok();
+  }
+  // A short run at the end of the range still counts.
+  if (run > 0) {
+    timestamps_us->push_back(run_start);
+    for (int axis = 0; axis < axes; axis++)
+      values->push_back(static_cast<float>(sums[axis] / run));
+  }
+  *next_us = to_us;
+  next_skip->push_back(0);
+  return Status::ok();
+}
+
+Status SensorQueryService::getLatestSample(int32_t sensor_type,
+                                           std::vector<float>* values,
+                                           int64_t* timestamp_us) {
+  const int axes = store_->axes(sensor_type);
+  if (axes == 0)
+    return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT);
+  float sample[kMaxAxes];
+  *timestamp_us = 0;
+  values->clear();
+  if (store_->Latest(sensor_type, timestamp_us, sample))
+    values->assign(sample, sample + axes);
+  return Status::ok();
+}
+
+android::status_t SensorQueryService::dump(
+    int fd, const android::Vector<android::String16>& args) {
+  std::string text = "Boot timeline:\n" + service_hub::BootTimeline();
+  return base::WriteFileDescriptor(fd, text.data(), text.size())
+             ? android::OK
+             : android::UNKNOWN_ERROR;
+}
+
+}  // namespace home_cloud
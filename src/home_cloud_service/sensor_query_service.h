@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_SENSOR_QUERY_SERVICE_H_
+#define HOME_CLOUD_SERVICE_SENSOR_QUERY_SERVICE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <base/macros.h>
+
+#include "brillo/examples/homecloud/BnHomeCloudService.h"
+
+namespace home_cloud {
+
+class SampleStore;
+
+// Answers IHomeCloudService queries from the sample store. Binder calls are
+// dispatched on the daemon's message loop, the same thread that appends to
+// the store, so the store needs no locking; in exchange each call reads a
+// bounded number of samples, so that a long query cannot hold up sensor
+// events for long.
+class SensorQueryService
+    : public brillo::examples::homecloud::BnHomeCloudService {
+ public:
+  SensorQueryService(SampleStore* store, const std::vector<int>& types);
+
+  android::binder::Status getSensorTypes(std::vector<int32_t>* types) override;
+  android::binder::Status getAxes(int32_t sensor_type, int32_t* axes) override;
+  android::binder::Status querySamples(int32_t sensor_type, int64_t from_us,
+                                       int32_t skip, int64_t to_us,
+                                       int32_t downsample, int32_t max_samples,
+                                       std::vector<int64_t>* timestamps_us,
+                                       std::vector<float>* values,
+                                       std::vector<int32_t>* next_skip,
+                                       int64_t* next_us) override;
+  android::binder::Status getLatestSample(int32_t sensor_type,
+                                          std::vector<float>* values,
+                                          int64_t* timestamp_us) override;
+  android::status_t dump(
+      int fd, const android::Vector<android::String16>& args) override;
+
+ private:
+  SampleStore* store_;
+  std::vector<int> types_;
+  // Raw samples read from the store per step of a downsampled query.
+  std::vector<int64_t> read_timestamps_;
+  std::vector<float> read_values_;
+
+  DISALLOW_COPY_AND_ASSIGN(SensorQueryService);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_SENSOR_QUERY_SERVICE_H_
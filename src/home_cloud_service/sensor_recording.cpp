@@ -0,0 +1,192 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sensor_recording.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+
+namespace home_cloud {
+
+namespace {
+const char kRecordingMagic[4] = {'H', 'C', 'R', 'C'};
+const uint16_t kRecordingVersion = 1;
+const size_t kWriteBuffer = 64 * 1024;
+const size_t kReadBuffer = 64 * 1024;
+// ASensorEvent::data has room for 16 values.
+const int kMaxValues = 16;
+
+struct RecordingHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t sensor_count;
+  uint32_t reserved;
+};
+
+// Followed by name_length bytes of name.
+struct SensorRecord {
+  int32_t type;
+  int32_t period_us;
+  float resolution;
+  uint16_t name_length;
+  uint16_t reserved;
+};
+
+// Followed by value_count floats.
+struct EventRecord {
+  int64_t timestamp;
+  int32_t type;
+  uint16_t value_count;
+  uint16_t reserved;
+};
+
+int SensorIndex(const std::vector<SensorSource::SensorInfo>& sensors,
+                int type) {
+  for (size_t i = 0; i < sensors.size(); i++) {
+    if (sensors[i].type == type)
+      return static_cast<int>(i);
+  }
+  return -1;
+}
+}  // anonymous namespace
+
+std::unique_ptr<SensorRecorder> SensorRecorder::Create(
+    const std::string& path,
+    const std::vector<SensorSource::SensorInfo>& sensors) {
+  FILE* file = fopen(path.c_str(), "we");
+  if (!file) {
+    PLOG(ERROR) << "Failed to create " << path;
+    return nullptr;
+  }
+  std::unique_ptr<SensorRecorder> recorder(new SensorRecorder(file));
+  RecordingHeader header;
+  memcpy(header.magic, kRecordingMagic, sizeof(header.magic));
+  header.version = kRecordingVersion;
+  header.sensor_count = sensors.size();
+  header.reserved = 0;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (const SensorSource::SensorInfo& sensor : sensors) {
+    SensorRecord record;
+    record.type = sensor.type;
+    record.period_us = sensor.period_us;
+    record.resolution = sensor.resolution;
+    record.name_length = sensor.name.size();
+    record.reserved = 0;
+    ok = ok && fwrite(&record, sizeof(record), 1, file) == 1 &&
+         fwrite(sensor.name.data(), 1, sensor.name.size(), file) ==
+             sensor.name.size();
+  }
+  if (!ok) {
+    PLOG(ERROR) << "Failed to write " << path;
+    return nullptr;
+  }
+  return recorder;
+}
+
+SensorRecorder::SensorRecorder(FILE* file)
+    : file_(file), buffer_(kWriteBuffer) {
+  setvbuf(file_, buffer_.data(), _IOFBF, buffer_.size());
+}
+
+SensorRecorder::~SensorRecorder() {
+  if (fclose(file_) != 0 && !failed_)
+    PLOG(ERROR) << "Failed to finish the sensor recording";
+}
+
+bool SensorRecorder::Write(const ASensorEvent* events, size_t count) {
+  for (size_t i = 0; i < count && !failed_; i++) {
+    const ASensorEvent& event = events[i];
+    int values = kMaxValues;
+    while (values > 0 && event.data[values - 1] == 0)
+      values--;
+    EventRecord record;
+    record.timestamp = event.timestamp;
+    record.type = event.type;
+    record.value_count = values;
+    record.reserved = 0;
+    if (fwrite(&record, sizeof(record), 1, file_) != 1 ||
+        fwrite(event.data, sizeof(float), values, file_) !=
+            static_cast<size_t>(values)) {
+      PLOG(ERROR) << "Failed to write to the sensor recording";
+      failed_ = true;
+      break;
+    }
+    events_++;
+  }
+  return !failed_;
+}
+
+std::unique_ptr<SensorRecording> SensorRecording::Open(
+    const std::string& path) {
+  FILE* file = fopen(path.c_str(), "re");
+  if (!file) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return nullptr;
+  }
+  std::unique_ptr<SensorRecording> recording(new SensorRecording(file));
+  RecordingHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, kRecordingMagic, sizeof(kRecordingMagic)) ==
+                0 &&
+            header.version == kRecordingVersion;
+  for (int i = 0; ok && i < header.sensor_count; i++) {
+    SensorRecord record;
+    ok = fread(&record, sizeof(record), 1, file) == 1;
+    if (!ok)
+      break;
+    SensorSource::SensorInfo sensor;
+    sensor.type = record.type;
+    sensor.name.resize(record.name_length);
+    ok = fread(&sensor.name[0], 1, record.name_length, file) ==
+         record.name_length;
+    sensor.resolution = record.resolution;
+    sensor.period_us = record.period_us;
+    sensor.max_latency_us = 0;
+    sensor.fifo_events = 0;
+    recording->sensors_.push_back(sensor);
+  }
+  if (!ok) {
+    LOG(ERROR) << path << " is not a sensor recording";
+    return nullptr;
+  }
+  return recording;
+}
+
+SensorRecording::SensorRecording(FILE* file)
+    : file_(file), buffer_(kReadBuffer) {
+  setvbuf(file_, buffer_.data(), _IOFBF, buffer_.size());
+}
+
+SensorRecording::~SensorRecording() {
+  fclose(file_);
+}
+
+// A record cut short ends the recording.
+bool SensorRecording::Next(ASensorEvent* event) {
+  EventRecord record;
+  if (fread(&record, sizeof(record), 1, file_) != 1 ||
+      record.value_count > kMaxValues)
+    return false;
+  memset(event, 0, sizeof(*event));
+  event->version = sizeof(*event);
+  event->sensor = SensorIndex(sensors_, record.type);
+  event->type = record.type;
+  event->timestamp = record.timestamp;
+  return fread(event->data, sizeof(float), record.value_count, file_) ==
+         record.value_count;
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_SENSOR_RECORDING_H_
+#define HOME_CLOUD_SERVICE_SENSOR_RECORDING_H_
+
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android/sensor.h>
+#include <base/macros.h>
+
+#include "sensor_source.h"
+
+namespace home_cloud {
+
+// Writes the events a SensorSource delivers to a file that
+// SensorRecording can read back, on a device or on a host.
+//
+// The file starts with the sensors, followed by every event with its
+// original timestamp and its values up to the last non-zero one. Writes are
+// buffered; a recording cut short by a crash loses at most the tail.
+class SensorRecorder {
+ public:
+  static std::unique_ptr<SensorRecorder> Create(
+      const std::string& path,
+      const std::vector<SensorSource::SensorInfo>& sensors);
+  ~SensorRecorder();
+
+  // Returns false once a write has failed; later events are not written.
+  bool Write(const ASensorEvent* events, size_t count);
+  uint64_t events() const { return events_; }
+
+ private:
+  explicit SensorRecorder(FILE* file);
+
+  FILE* file_;
+  std::vector<char> buffer_;
+  bool failed_{false};
+  uint64_t events_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SensorRecorder);
+};
+
+// A recording read back an event at a time, so that a recording of any
+// length plays back in constant memory.
+class SensorRecording {
+ public:
+  static std::unique_ptr<SensorRecording> Open(const std::string& path);
+  ~SensorRecording();
+
+  const std::vector<SensorSource::SensorInfo>& sensors() const {
+    return sensors_;
+  }
+  // The next event in recorded order; false at the end of the recording.
+  // The sensor field holds the index into sensors().
+  bool Next(ASensorEvent* event);
+
+ private:
+  explicit SensorRecording(FILE* file);
+
+  FILE* file_;
+  std::vector<char> buffer_;
+  std::vector<SensorSource::SensorInfo> sensors_;
+
+  DISALLOW_COPY_AND_ASSIGN(SensorRecording);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_SENSOR_RECORDING_H_
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sensor_source.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <hardware/sensors.h>
+
+namespace home_cloud {
+
+namespace {
+// Events held for the owner's loop before new ones are dropped; a few
+// seconds of every sensor at full rate. Sources raise it as they need.
+const size_t kDefaultMaxPendingEvents = 16384;
+// How often WaitForRoom() looks at the stop flag.
+const std::chrono::milliseconds kStopPollInterval(10);
+}  // anonymous namespace
+
+int SensorAxes(int type) {
+  switch (type) {
+    case SENSOR_TYPE_ACCELEROMETER:
+    case SENSOR_TYPE_MAGNETIC_FIELD:
+    case SENSOR_TYPE_ORIENTATION:
+    case SENSOR_TYPE_GYROSCOPE:
+      return 3;
+    case SENSOR_TYPE_ROTATION_VECTOR:
+    case SENSOR_TYPE_GAME_ROTATION_VECTOR:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+SensorSource::SensorSource(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+    const EventsCallback& callback)
+    : max_pending_(kDefaultMaxPendingEvents),
+      task_runner_(task_runner),
+      callback_(callback) {}
+
+SensorSource::~SensorSource() {}
+
+void SensorSource::Post(const ASensorEvent* events, size_t count) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (pending_.capacity() < max_pending_)
+    pending_.reserve(max_pending_);
+  size_t room = max_pending_ - std::min(max_pending_, pending_.size());
+  size_t keep = std::min(count, room);
+  pending_.insert(pending_.end(), events, events + keep);
+  backlog_dropped_ += count - keep;
+  if (!deliver_posted_ && !pending_.empty()) {
+    deliver_posted_ = true;
+    task_runner_->PostTask(
+        FROM_HERE, base::Bind(&SensorSource::Deliver, base::Unretained(this)));
+  }
+}
+
+void SensorSource::WaitForRoom(size_t count, const std::atomic<bool>& stop) {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (!stop && pending_.size() + count > max_pending_)
+    drained_.wait_for(guard, kStopPollInterval);
+}
+
+void SensorSource::Deliver() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    delivering_.swap(pending_);
+    deliver_posted_ = false;
+  }
+  drained_.notify_all();
+  if (!delivering_.empty())
+    callback_.Run(delivering_.data(), delivering_.size());
+  delivering_.clear();
+}
+
+}  // namespace home_cloud
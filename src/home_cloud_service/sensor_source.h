@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_SENSOR_SOURCE_H_
+#define HOME_CLOUD_SERVICE_SENSOR_SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android/sensor.h>
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/memory/ref_counted.h>
+#include <base/single_thread_task_runner.h>
+
+namespace home_cloud {
+
+// Values an event carries for a sensor type, starting at data[0].
+int SensorAxes(int type);
+
+// Where sensor events come from: the sensor service on a device, or a
+// recording anywhere else. Sources produce events on a thread of their own
+// and hand them to the owner's message loop in batches, with at most one
+// task in flight, so a busy loop receives fewer, larger batches rather than
+// a task per event.
+class SensorSource {
+ public:
+  // Called on the owner's message loop with every event produced since the
+  // previous call, in order. The loop must not outlive the source.
+  using EventsCallback = base::Callback<void(const ASensorEvent* events,
+                                             size_t count)>;
+
+  struct SensorInfo {
+    int type;
+    std::string name;
+    // Smallest change the sensor reports, in its own units.
+    float resolution;
+    // Requested sampling period; 0 for on-change and one-shot sensors.
+    int32_t period_us;
+    // How long the sensor hub may hold events back; 0 when not batching.
+    int64_t max_latency_us;
+    // Hardware FIFO events available to this sensor.
+    int fifo_events;
+  };
+
+  virtual ~SensorSource();
+
+  // Starts producing events of the given sensor types, sampling continuous
+  // sensors every period_us where the source has a say, and letting them
+  // batch up to max_latency_us. Returns false if no sensor is available.
+  virtual bool Start(const std::vector<int>& types, int32_t period_us,
+                     int64_t max_latency_us) = 0;
+  virtual void Stop() = 0;
+
+  // Only valid after Start().
+  const std::vector<SensorInfo>& sensors() const { return sensors_; }
+
+  // Times the source woke up with events to hand over.
+  uint64_t wakeups() const { return wakeups_; }
+  // Events discarded because the owner's loop fell too far behind.
+  uint64_t backlog_dropped() const { return backlog_dropped_; }
+
+ protected:
+  SensorSource(scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+               const EventsCallback& callback);
+
+  // Queues events for the owner's loop from the source's thread. Events
+  // beyond max_pending_ are dropped and counted.
+  void Post(const ASensorEvent* events, size_t count);
+  // Blocks until count more events fit under max_pending_, or until stop
+  // is set. For sources that would rather wait than drop.
+  void WaitForRoom(size_t count, const std::atomic<bool>& stop);
+
+  std::vector<SensorInfo> sensors_;
+  // Set before the source's thread starts.
+  size_t max_pending_;
+  std::atomic<uint64_t> wakeups_{0};
+  std::atomic<uint64_t> backlog_dropped_{0};
+
+ private:
+  void Deliver();
+
+  scoped_refptr<base::SingleThreadTaskRunner> task_runner_;
+  EventsCallback callback_;
+
+  std::mutex lock_;
+  std::condition_variable drained_;
+  std::vector<ASensorEvent> pending_;
+  bool deliver_posted_{false};
+  // Owner's loop only; swapped with pending_ so neither side allocates.
+  std::vector<ASensorEvent> delivering_;
+
+  DISALLOW_COPY_AND_ASSIGN(SensorSource);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_SENSOR_SOURCE_H_
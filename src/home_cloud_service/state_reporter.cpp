@@ -0,0 +1,113 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "state_reporter.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace home_cloud {
+
+int StateReporter::AddProperty(const std::string& component,
+                               const std::string& property,
+                               const ReportPolicy& policy) {
+  Property entry;
+  entry.component = component;
+  entry.name = property;
+  entry.policy = policy;
+  entry.has_value = false;
+  entry.value = 0;
+  entry.published_once = false;
+  entry.published_value = 0;
+  entry.published_at = 0;
+  entry.pending = false;
+  properties_.push_back(entry);
+  return static_cast<int>(properties_.size() - 1);
+}
+
+void StateReporter::Offer(int id, float value) {
+  Property& property = properties_[id];
+  stats_.samples++;
+  property.has_value = true;
+  property.value = value;
+  if (property.published_once &&
+      fabsf(value - property.published_value) <= property.policy.deadband) {
+    // Back within the deadband; an earlier change is no longer worth a
+    // report either.
+    if (property.pending)
+      stats_.rate_suppressed++;
+    property.pending = false;
+    stats_.deadband_suppressed++;
+    return;
+  }
+  if (property.pending)
+    stats_.rate_suppressed++;
+  property.pending = true;
+}
+
+void StateReporter::Collect(int64_t now,
+                            std::vector<ComponentUpdate>* updates) {
+  updates->clear();
+  for (Property& property : properties_) {
+    if (!property.has_value)
+      continue;
+    int64_t since = now - property.published_at;
+    bool due = false;
+    if (property.pending) {
+      due = !property.published_once ||
+            since >= property.policy.min_interval_us;
+    } else if (property.published_once &&
+               since >= property.policy.max_interval_us) {
+      due = true;
+      stats_.heartbeats++;
+    }
+    if (!due)
+      continue;
+
+    auto it = std::find_if(updates->begin(), updates->end(),
+                           [&property](const ComponentUpdate& update) {
+                             return update.component == property.component;
+                           });
+    if (it == updates->end()) {
+      updates->push_back({property.component, {}});
+      it = updates->end() - 1;
+    }
+    it->properties.emplace_back(property.name, property.value);
+    property.published_once = true;
+    property.published_value = property.value;
+    property.published_at = now;
+    property.pending = false;
+    stats_.published++;
+  }
+  stats_.updates += updates->size();
+}
+
+void StateReporter::RepublishAll() {
+  for (Property& property : properties_) {
+    property.published_once = false;
+    property.pending = property.has_value;
+  }
+}
+
+int64_t StateReporter::tick_us() const {
+  int64_t tick = std::numeric_limits<int64_t>::max();
+  for (const Property& property : properties_)
+    tick = std::min(tick, property.policy.min_interval_us);
+  return tick;
+}
+
+}  // namespace home_cloud
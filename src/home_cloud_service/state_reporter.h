@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_STATE_REPORTER_H_
+#define HOME_CLOUD_SERVICE_STATE_REPORTER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace home_cloud {
+
+// When a state property is worth telling the cloud about.
+struct ReportPolicy {
+  // Changes within this of the last published value are not reported.
+  float deadband;
+  // Significant changes are held back until this long after the last
+  // report, and only the newest is sent.
+  int64_t min_interval_us;
+  // The value is reported at least this often even if it did not change, so
+  // a quiet sensor can be told from a dead one.
+  int64_t max_interval_us;
+};
+
+// Decides which samples make it into weave state. Every sample is offered;
+// Collect() then returns, once per publishing tick, the properties due for
+// a report grouped by component, so that each component gets at most one
+// state update per tick.
+class StateReporter {
+ public:
+  struct ComponentUpdate {
+    std::string component;
+    // Property names and values.
+    std::vector<std::pair<std::string, double>> properties;
+  };
+
+  struct Stats {
+    uint64_t samples;
+    uint64_t published;
+    // Samples within the deadband of the last published value.
+    uint64_t deadband_suppressed;
+    // Significant samples replaced by a newer one before they were due.
+    uint64_t rate_suppressed;
+    // Reports of an unchanged value at the maximum interval.
+    uint64_t heartbeats;
+    uint64_t updates;
+  };
+
+  StateReporter() = default;
+
+  // Returns the id to offer samples of the property with.
+  int AddProperty(const std::string& component, const std::string& property,
+                  const ReportPolicy& policy);
+  void Offer(int id, float value);
+  // Properties due at now; clears updates first.
+  void Collect(int64_t now, std::vector<ComponentUpdate>* updates);
+  // Reports every property that has a value at the next Collect(), as
+  // after reconnecting to weaved.
+  void RepublishAll();
+
+  // The shortest minimum interval of any property: how often Collect() is
+  // worth calling.
+  int64_t tick_us() const;
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Property {
+    std::string component;
+    std::string name;
+    ReportPolicy policy;
+    bool has_value;
+    float value;
+    bool published_once;
+    float published_value;
+    int64_t published_at;
+    // A significant change waits for the minimum interval.
+    bool pending;
+  };
+
+  std::vector<Property> properties_;
+  Stats stats_{0, 0, 0, 0, 0, 0};
+
+  DISALLOW_COPY_AND_ASSIGN(StateReporter);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_STATE_REPORTER_H_
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "time_series_codec.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace home_cloud {
+
+namespace {
+// Delta-of-delta buckets: a prefix of ones ended by a zero picks how many
+// bits follow. The last bucket has no terminating zero.
+struct Bucket {
+  int prefix_bits;
+  uint32_t prefix;
+  int value_bits;
+};
+const Bucket kBuckets[] = {
+  {2, 0x2, 7},
+  {3, 0x6, 9},
+  {4, 0xe, 12},
+  {5, 0x1e, 32},
+  {5, 0x1f, 64},
+};
+
+bool FitsSigned(int64_t value, int bits) {
+  if (bits >= 64)
+    return true;
+  int64_t limit = int64_t(1) << (bits - 1);
+  return value >= -limit && value < limit;
+}
+
+int64_t SignExtend(uint64_t value, int bits) {
+  if (bits >= 64)
+    return static_cast<int64_t>(value);
+  uint64_t sign = uint64_t(1) << (bits - 1);
+  return static_cast<int64_t>((value ^ sign) - sign);
+}
+
+uint32_t FloatBits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+float BitsFloat(uint32_t bits) {
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+}  // anonymous namespace
+
+ChunkEncoder::ChunkEncoder(int axes) : axes_(std::min(axes, kMaxAxes)) {}
+
+void ChunkEncoder::WriteBits(uint64_t value, int bits) {
+  if (bits > 32) {
+    WriteBits(value >> 32, bits - 32);
+    bits = 32;
+  }
+  value &= (uint64_t(1) << bits) - 1;
+  pending_ = (pending_ << bits) | value;
+  pending_bits_ += bits;
+  while (pending_bits_ >= 8) {
+    pending_bits_ -= 8;
+    bytes_.push_back(static_cast<uint8_t>(pending_ >> pending_bits_));
+  }
+  pending_ &= (uint64_t(1) << pending_bits_) - 1;
+}
+
+void ChunkEncoder::Append(int64_t timestamp, const float* values) {
+  if (count_ == 0) {
+    first_timestamp_ = timestamp;
+    WriteBits(static_cast<uint64_t>(timestamp), 64);
+    for (int axis = 0; axis < axes_; axis++) {
+      last_value_[axis] = FloatBits(values[axis]);
+      last_leading_[axis] = -1;
+      last_trailing_[axis] = 0;
+      WriteBits(last_value_[axis], 32);
+    }
+    last_timestamp_ = timestamp;
+    last_delta_ = 0;
+    count_++;
+    return;
+  }
+
+  int64_t delta = timestamp - last_timestamp_;
+  int64_t dod = delta - last_delta_;
+  if (dod == 0) {
+    WriteBits(0, 1);
+  } else {
+    for (const Bucket& bucket : kBuckets) {
+      if (FitsSigned(dod, bucket.value_bits)) {
+        WriteBits(bucket.prefix, bucket.prefix_bits);
+        WriteBits(static_cast<uint64_t>(dod), bucket.value_bits);
+        break;
+      }
+    }
+  }
+  last_delta_ = delta;
+  last_timestamp_ = timestamp;
+
+  for (int axis = 0; axis < axes_; axis++) {
+    uint32_t bits = FloatBits(values[axis]);
+    uint32_t x = bits ^ last_value_[axis];
+    last_value_[axis] = bits;
+    if (x == 0) {
+      WriteBits(0, 1);
+      continue;
+    }
+    int leading = std::min(__builtin_clz(x), 31);
+    int trailing = __builtin_ctz(x);
+    // Reuse the previous window when the new bits fit in it; it saves the
+    // eleven bits describing a window.
+    if (last_leading_[axis] >= 0 && leading >= last_leading_[axis] &&
+        trailing >= last_trailing_[axis]) {
+      int meaningful = 32 - last_leading_[axis] - last_trailing_[axis];
+      WriteBits(0x2, 2);
+      WriteBits(x >> last_trailing_[axis], meaningful);
+    } else {
+      int meaningful = 32 - leading - trailing;
+      WriteBits(0x3, 2);
+      WriteBits(leading, 5);
+      WriteBits(meaningful - 1, 5);
+      WriteBits(x >> trailing, meaningful);
+      last_leading_[axis] = leading;
+      last_trailing_[axis] = trailing;
+    }
+  }
+  count_++;
+}
+
+void ChunkEncoder::Finish(std::vector<uint8_t>* out) {
+  if (pending_bits_ > 0)
+    bytes_.push_back(static_cast<uint8_t>(pending_ << (8 - pending_bits_)));
+  out->insert(out->end(), bytes_.begin(), bytes_.end());
+  bytes_.clear();
+  pending_ = 0;
+  pending_bits_ = 0;
+  count_ = 0;
+}
+
+ChunkDecoder::ChunkDecoder(const uint8_t* data, size_t size, int axes,
+                           size_t count)
+    : data_(data),
+      size_(size),
+      axes_(std::min(axes, kMaxAxes)),
+      remaining_(count) {}
+
+bool ChunkDecoder::ReadBits(int bits, uint64_t* value) {
+  if (bit_offset_ + bits > size_ * 8)
+    return false;
+  uint64_t v = 0;
+  while (bits > 0) {
+    int available = 8 - static_cast<int>(bit_offset_ & 7);
+    int take = std::min(available, bits);
+    uint8_t byte = data_[bit_offset_ >> 3];
+    v = (v << take) | ((byte >> (available - take)) & ((1u << take) - 1));
+    bits -= take;
+    bit_offset_ += take;
+  }
+  *value = v;
+  return true;
+}
+
+bool ChunkDecoder::Next(int64_t* timestamp, float* values) {
+  if (index_ == remaining_)
+    return false;
+
+  uint64_t v;
+  if (index_ == 0) {
+    if (!ReadBits(64, &v))
+      return false;
+    last_timestamp_ = static_cast<int64_t>(v);
+    for (int axis = 0; axis < axes_; axis++) {
+      if (!ReadBits(32, &v))
+        return false;
+      last_value_[axis] = static_cast<uint32_t>(v);
+      last_leading_[axis] = -1;
+      last_trailing_[axis] = 0;
+    }
+  } else {
+    // Count the prefix ones, at most four before the bucket is decided.
+    int ones = 0;
+    while (ones < 5) {
+      if (!ReadBits(1, &v))
+        return false;
+      if (v == 0)
+        break;
+      ones++;
+    }
+    int64_t dod = 0;
+    if (ones > 0) {
+      int bits = kBuckets[ones - 1].value_bits;
+      if (!ReadBits(bits, &v))
+        return false;
+      dod = SignExtend(v, bits);
+    }
+    last_delta_ += dod;
+    last_timestamp_ += last_delta_;
+
+    for (int axis = 0; axis < axes_; axis++) {
+      if (!ReadBits(1, &v))
+        return false;
+      if (v == 0)
+        continue;
+      if (!ReadBits(1, &v))
+        return false;
+      if (v == 1) {
+        uint64_t leading, meaningful;
+        if (!ReadBits(5, &leading) || !ReadBits(5, &meaningful))
+          return false;
+        last_leading_[axis] = static_cast<int>(leading);
+        last_trailing_[axis] = 32 - static_cast<int>(leading) -
+                               static_cast<int>(meaningful + 1);
+        if (last_trailing_[axis] < 0)
+          return false;
+      } else if (last_leading_[axis] < 0) {
+        return false;
+      }
+      int meaningful = 32 - last_leading_[axis] - last_trailing_[axis];
+      if (!ReadBits(meaningful, &v))
+        return false;
+      last_value_[axis] ^= static_cast<uint32_t>(v) << last_trailing_[axis];
+    }
+  }
+
+  *timestamp = last_timestamp_;
+  for (int axis = 0; axis < axes_; axis++)
+    values[axis] = BitsFloat(last_value_[axis]);
+  index_++;
+  return true;
+}
+
+float QuantizeStep(float resolution) {
+  if (!(resolution > 0) || !isfinite(resolution))
+    return 0;
+  return ldexpf(1.0f, static_cast<int>(floorf(log2f(resolution))));
+}
+
+}  // namespace home_cloud
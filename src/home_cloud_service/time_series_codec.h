@@ -0,0 +1,109 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_TIME_SERIES_CODEC_H_
+#define HOME_CLOUD_SERVICE_TIME_SERIES_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace home_cloud {
+
+// Maximum number of values per sample, e.g. x, y and z of a vector sensor.
+const int kMaxAxes = 4;
+
+// Compresses a run of samples the way Facebook's Gorilla does: timestamps as
+// the delta of their deltas, which is a single bit for a steady sample rate,
+// and each value as the XOR with the previous one, of which only the
+// meaningful bits are kept. Values quantized to a power of two (see
+// QuantizeStep()) have long runs of trailing zero bits and compress best.
+class ChunkEncoder {
+ public:
+  explicit ChunkEncoder(int axes);
+
+  void Append(int64_t timestamp, const float* values);
+  // Appends the encoded chunk to out and starts a new one.
+  void Finish(std::vector<uint8_t>* out);
+
+  size_t count() const { return count_; }
+  int64_t first_timestamp() const { return first_timestamp_; }
+  int64_t last_timestamp() const { return last_timestamp_; }
+
+ private:
+  void WriteBits(uint64_t value, int bits);
+
+  int axes_;
+  std::vector<uint8_t> bytes_;
+  uint64_t pending_{0};
+  int pending_bits_{0};
+
+  size_t count_{0};
+  int64_t first_timestamp_{0};
+  int64_t last_timestamp_{0};
+  int64_t last_delta_{0};
+  uint32_t last_value_[kMaxAxes];
+  int last_leading_[kMaxAxes];
+  int last_trailing_[kMaxAxes];
+};
+
+// Reads back a chunk written by ChunkEncoder; count and axes come from the
+// chunk's header.
+class ChunkDecoder {
+ public:
+  ChunkDecoder(const uint8_t* data, size_t size, int axes, size_t count);
+
+  // Returns false once all samples have been read or the data is corrupt.
+  bool Next(int64_t* timestamp, float* values);
+
+ private:
+  bool ReadBits(int bits, uint64_t* value);
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t bit_offset_{0};
+  int axes_;
+  size_t remaining_;
+  size_t index_{0};
+
+  int64_t last_timestamp_{0};
+  int64_t last_delta_{0};
+  uint32_t last_value_[kMaxAxes];
+  int last_leading_[kMaxAxes];
+  int last_trailing_[kMaxAxes];
+};
+
+// Largest power of two no greater than resolution, or 0 to keep values as
+// they are. Rounding to it loses nothing the sensor can resolve.
+float QuantizeStep(float resolution);
+
+// Values of 2^24 steps or more are already multiples of a power-of-two
+// step, and NaN and infinity have no multiple at all; both are kept as they
+// are rather than overflowing the conversion.
+inline float Quantize(float value, float step) {
+  if (step <= 0)
+    return value;
+  const float steps = value / step;
+  if (!(steps > -16777216.0f && steps < 16777216.0f))
+    return value;
+  return static_cast<float>(
+             static_cast<int64_t>(steps + (value < 0 ? -0.5f : 0.5f))) *
+         step;
+}
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_TIME_SERIES_CODEC_H_
@@ -0,0 +1,558 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "window_aggregator.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define AGGREGATOR_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define AGGREGATOR_SSE2 1
+#endif
+
+namespace home_cloud {
+
+namespace {
+// Values summed in float lanes before the total is moved to a double.
+const size_t kLaneBlock = 1024;
+const size_t kMinHistory = 64;
+
+int64_t AlignDown(int64_t t, int64_t step) {
+  int64_t r = t % step;
+  return r < 0 ? t - r - step : t - r;
+}
+
+size_t RoundUpPowerOfTwo(size_t n) {
+  size_t size = 1;
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+struct Accumulator {
+  uint32_t count;
+  double mean;
+  double m2;
+  float min;
+  float max;
+
+  void Reset() {
+    count = 0;
+    mean = 0;
+    m2 = 0;
+    min = std::numeric_limits<float>::infinity();
+    max = -std::numeric_limits<float>::infinity();
+  }
+
+  void Add(float x) {
+    count++;
+    double delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+
+  // Welford's update run backwards.
+  void Remove(float x) {
+    if (count <= 1) {
+      Reset();
+      return;
+    }
+    double delta = x - mean;
+    count--;
+    mean -= delta / count;
+    m2 = std::max(0.0, m2 - delta * (x - mean));
+  }
+
+  // Chan et al.'s pairwise combination.
+  void Merge(const BlockStats& block) {
+    if (block.count == 0)
+      return;
+    uint32_t total = count + block.count;
+    double delta = block.mean - mean;
+    mean += delta * block.count / total;
+    m2 += block.m2 + delta * delta * count / total * block.count;
+    count = total;
+    min = std::min(min, block.min);
+    max = std::max(max, block.max);
+  }
+};
+
+// Ring of sample sequence numbers, used as a monotonic deque.
+class SeqQueue {
+ public:
+  void Reserve(size_t capacity) {
+    if (capacity <= seqs_.size())
+      return;
+    std::vector<uint64_t> seqs(capacity);
+    size_t n = tail_ - head_;
+    for (size_t i = 0; i < n; i++)
+      seqs[i] = seqs_[(head_ + i) & (seqs_.size() - 1)];
+    seqs_.swap(seqs);
+    head_ = 0;
+    tail_ = n;
+  }
+
+  bool empty() const { return head_ == tail_; }
+  uint64_t front() const { return seqs_[head_ & (seqs_.size() - 1)]; }
+  uint64_t back() const { return seqs_[(tail_ - 1) & (seqs_.size() - 1)]; }
+  void push_back(uint64_t seq) { seqs_[tail_++ & (seqs_.size() - 1)] = seq; }
+  void pop_back() { tail_--; }
+  void pop_front() { head_++; }
+  void clear() { head_ = tail_; }
+
+ private:
+  std::vector<uint64_t> seqs_;
+  size_t head_{0};
+  size_t tail_{0};
+};
+}  // anonymous namespace
+
+#if AGGREGATOR_NEON
+
+static inline float HorizontalMin(float32x4_t v) {
+  float32x2_t m = vpmin_f32(vget_low_f32(v), vget_high_f32(v));
+  return vget_lane_f32(vpmin_f32(m, m), 0);
+}
+
+static inline float HorizontalMax(float32x4_t v) {
+  float32x2_t m = vpmax_f32(vget_low_f32(v), vget_high_f32(v));
+  return vget_lane_f32(vpmax_f32(m, m), 0);
+}
+
+static inline double HorizontalSum(float32x4_t v) {
+  return static_cast<double>(vgetq_lane_f32(v, 0)) + vgetq_lane_f32(v, 1) +
+         vgetq_lane_f32(v, 2) + vgetq_lane_f32(v, 3);
+}
+
+#elif AGGREGATOR_SSE2
+
+static inline float HorizontalMin(__m128 v) {
+  v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_min_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+static inline float HorizontalMax(__m128 v) {
+  v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+static inline double HorizontalSum(__m128 v) {
+  __m128d lo = _mm_cvtps_pd(v);
+  __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+  __m128d s = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+#endif
+
+BlockStats ComputeBlockStats(const float* values, size_t count) {
+  BlockStats stats;
+  stats.count = count;
+  stats.min = std::numeric_limits<float>::infinity();
+  stats.max = -std::numeric_limits<float>::infinity();
+  stats.mean = 0;
+  stats.m2 = 0;
+  if (count == 0)
+    return stats;
+
+  // First pass: extremes and sum. Second pass: squared deviations from the
+  // mean, which stays accurate where a sum of squares would cancel.
+  double sum = 0;
+  size_t i = 0;
+#if AGGREGATOR_NEON
+  float32x4_t vmin = vdupq_n_f32(stats.min);
+  float32x4_t vmax = vdupq_n_f32(stats.max);
+  while (i + 4 <= count) {
+    size_t end = std::min(count & ~size_t(3), i + kLaneBlock);
+    float32x4_t vsum = vdupq_n_f32(0);
+    for (; i < end; i += 4) {
+      float32x4_t x = vld1q_f32(values + i);
+      vmin = vminq_f32(vmin, x);
+      vmax = vmaxq_f32(vmax, x);
+      vsum = vaddq_f32(vsum, x);
+    }
+    sum += HorizontalSum(vsum);
+  }
+  stats.min = HorizontalMin(vmin);
+  stats.max = HorizontalMax(vmax);
+#elif AGGREGATOR_SSE2
+  __m128 vmin = _mm_set1_ps(stats.min);
+  __m128 vmax = _mm_set1_ps(stats.max);
+  while (i + 4 <= count) {
+    size_t end = std::min(count & ~size_t(3), i + kLaneBlock);
+    __m128 vsum = _mm_setzero_ps();
+    for (; i < end; i += 4) {
+      __m128 x = _mm_loadu_ps(values + i);
+      vmin = _mm_min_ps(vmin, x);
+      vmax = _mm_max_ps(vmax, x);
+      vsum = _mm_add_ps(vsum, x);
+    }
+    sum += HorizontalSum(vsum);
+  }
+  stats.min = HorizontalMin(vmin);
+  stats.max = HorizontalMax(vmax);
+#endif
+  for (; i < count; i++) {
+    stats.min = std::min(stats.min, values[i]);
+    stats.max = std::max(stats.max, values[i]);
+    sum += values[i];
+  }
+  stats.mean = sum / count;
+
+  double m2 = 0;
+  i = 0;
+#if AGGREGATOR_NEON
+  float32x4_t vmean = vdupq_n_f32(static_cast<float>(stats.mean));
+  while (i + 4 <= count) {
+    size_t end = std::min(count & ~size_t(3), i + kLaneBlock);
+    float32x4_t vsq = vdupq_n_f32(0);
+    for (; i < end; i += 4) {
+      float32x4_t d = vsubq_f32(vld1q_f32(values + i), vmean);
+      vsq = vmlaq_f32(vsq, d, d);
+    }
+    m2 += HorizontalSum(vsq);
+  }
+#elif AGGREGATOR_SSE2
+  __m128 vmean = _mm_set1_ps(static_cast<float>(stats.mean));
+  while (i + 4 <= count) {
+    size_t end = std::min(count & ~size_t(3), i + kLaneBlock);
+    __m128 vsq = _mm_setzero_ps();
+    for (; i < end; i += 4) {
+      __m128 d = _mm_sub_ps(_mm_loadu_ps(values + i), vmean);
+      vsq = _mm_add_ps(vsq, _mm_mul_ps(d, d));
+    }
+    m2 += HorizontalSum(vsq);
+  }
+#endif
+  for (; i < count; i++) {
+    double d = values[i] - stats.mean;
+    m2 += d * d;
+  }
+  stats.m2 = m2;
+  return stats;
+}
+
+const char* AggregatorSimdName() {
+#if AGGREGATOR_NEON
+  return "neon";
+#elif AGGREGATOR_SSE2
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+struct WindowAggregator::Window {
+  WindowSpec spec;
+  int index;
+  bool sliding;
+  bool open{false};
+  // Tumbling: the current window. Sliding: end is the next result due.
+  int64_t start{0};
+  int64_t end{0};
+  // Sliding: oldest sample of the history still in the window.
+  uint64_t first_seq{0};
+  Accumulator acc[kMaxAxes];
+  SeqQueue min_queue[kMaxAxes];
+  SeqQueue max_queue[kMaxAxes];
+};
+
+struct WindowAggregator::Sensor {
+  int type;
+  int axes;
+  std::vector<Window> windows;
+  bool has_sliding{false};
+
+  // Recent samples for the sliding windows, by sequence number.
+  std::vector<int64_t> timestamps;
+  std::vector<float> values;
+  size_t mask{0};
+  uint64_t next_seq{0};
+
+  size_t capacity() const { return mask + 1; }
+  int64_t timestamp(uint64_t seq) const { return timestamps[seq & mask]; }
+  float value(int axis, uint64_t seq) const {
+    return values[axis * capacity() + (seq & mask)];
+  }
+
+  void Reserve(size_t capacity);
+};
+
+void WindowAggregator::Sensor::Reserve(size_t size) {
+  size = RoundUpPowerOfTwo(size);
+  if (size <= timestamps.size())
+    return;
+  uint64_t oldest = next_seq;
+  for (const Window& window : windows) {
+    if (window.sliding)
+      oldest = std::min(oldest, window.first_seq);
+  }
+  std::vector<int64_t> new_timestamps(size);
+  std::vector<float> new_values(size * axes);
+  for (uint64_t seq = oldest; seq < next_seq; seq++) {
+    new_timestamps[seq & (size - 1)] = timestamp(seq);
+    for (int axis = 0; axis < axes; axis++)
+      new_values[axis * size + (seq & (size - 1))] = value(axis, seq);
+  }
+  timestamps.swap(new_timestamps);
+  values.swap(new_values);
+  mask = size - 1;
+  for (Window& window : windows) {
+    for (int axis = 0; axis < axes; axis++) {
+      window.min_queue[axis].Reserve(size);
+      window.max_queue[axis].Reserve(size);
+    }
+  }
+}
+
+WindowAggregator::WindowAggregator(const std::vector<WindowSpec>& windows)
+    : specs_(windows) {}
+
+WindowAggregator::~WindowAggregator() {}
+
+WindowAggregator::Sensor* WindowAggregator::Find(int type) const {
+  for (const auto& sensor : sensors_) {
+    if (sensor->type == type)
+      return sensor.get();
+  }
+  return nullptr;
+}
+
+void WindowAggregator::AddSensor(int type, int axes, int64_t period_us) {
+  if (Find(type))
+    return;
+  std::unique_ptr<Sensor> sensor(new Sensor);
+  sensor->type = type;
+  sensor->axes = std::min(axes, kMaxAxes);
+
+  int64_t longest = 0;
+  for (size_t i = 0; i < specs_.size(); i++) {
+    Window window;
+    window.spec = specs_[i];
+    window.spec.hop_us = std::max<int64_t>(1, window.spec.hop_us);
+    window.spec.length_us = std::max(window.spec.length_us, window.spec.hop_us);
+    window.index = i;
+    window.sliding = window.spec.hop_us < window.spec.length_us;
+    for (int axis = 0; axis < kMaxAxes; axis++)
+      window.acc[axis].Reset();
+    if (window.sliding) {
+      sensor->has_sliding = true;
+      longest = std::max(longest, window.spec.length_us + window.spec.hop_us);
+    }
+    sensor->windows.push_back(window);
+  }
+  if (sensor->has_sliding) {
+    size_t expected = period_us > 0 ? longest / period_us + longest / period_us / 2
+                                    : 0;
+    sensor->Reserve(std::max(kMinHistory, expected));
+  }
+  sensors_.push_back(std::move(sensor));
+}
+
+int WindowAggregator::Subscribe(const Subscriber& subscriber) {
+  subscribers_.push_back(std::make_pair(next_subscriber_, subscriber));
+  return next_subscriber_++;
+}
+
+void WindowAggregator::Unsubscribe(int id) {
+  subscribers_.erase(
+      std::remove_if(subscribers_.begin(), subscribers_.end(),
+                     [id](const std::pair<int, Subscriber>& s) {
+                       return s.first == id;
+                     }),
+      subscribers_.end());
+}
+
+void WindowAggregator::AddBatch(int type, const int64_t* timestamps,
+                                const float* const* values, size_t count) {
+  Sensor* sensor = Find(type);
+  if (!sensor || count == 0)
+    return;
+  for (Window& window : sensor->windows) {
+    if (!window.sliding)
+      AddTumbling(sensor, &window, timestamps, values, count);
+  }
+  if (sensor->has_sliding)
+    AddSliding(sensor, timestamps, values, count);
+}
+
+void WindowAggregator::AddTumbling(Sensor* sensor, Window* window,
+                                   const int64_t* timestamps,
+                                   const float* const* values, size_t count) {
+  const int64_t length = window->spec.length_us;
+  size_t i = 0;
+  while (i < count) {
+    int64_t t = timestamps[i];
+    if (!window->open || t >= window->end || t < window->start) {
+      if (window->open)
+        Publish(*sensor, *window, window->start, window->end);
+      window->start = AlignDown(t, length);
+      window->end = window->start + length;
+      window->open = true;
+      for (int axis = 0; axis < sensor->axes; axis++)
+        window->acc[axis].Reset();
+    }
+    // Everything up to the window's end goes in as one block.
+    size_t j = std::lower_bound(timestamps + i, timestamps + count,
+                                window->end) - timestamps;
+    for (int axis = 0; axis < sensor->axes; axis++)
+      window->acc[axis].Merge(
+          ComputeBlockStats(values[axis] + i, j - i));
+    i = j;
+  }
+}
+
+void WindowAggregator::AddSliding(Sensor* sensor, const int64_t* timestamps,
+                                  const float* const* values, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const int64_t t = timestamps[i];
+
+    // Publish every result due before this sample.
+    for (Window& window : sensor->windows) {
+      if (!window.sliding)
+        continue;
+      if (!window.open) {
+        window.end = AlignDown(t, window.spec.hop_us) + window.spec.hop_us;
+        window.first_seq = sensor->next_seq;
+        window.open = true;
+      }
+      AdvanceSliding(sensor, &window, t);
+    }
+
+    uint64_t oldest = sensor->next_seq;
+    for (const Window& window : sensor->windows) {
+      if (window.sliding)
+        oldest = std::min(oldest, window.first_seq);
+    }
+    if (sensor->next_seq - oldest == sensor->capacity())
+      sensor->Reserve(sensor->capacity() * 2);
+
+    const uint64_t seq = sensor->next_seq++;
+    sensor->timestamps[seq & sensor->mask] = t;
+    for (int axis = 0; axis < sensor->axes; axis++)
+      sensor->values[axis * sensor->capacity() + (seq & sensor->mask)] =
+          values[axis][i];
+
+    for (Window& window : sensor->windows) {
+      if (!window.sliding)
+        continue;
+      for (int axis = 0; axis < sensor->axes; axis++) {
+        const float x = values[axis][i];
+        window.acc[axis].Add(x);
+        SeqQueue& min_queue = window.min_queue[axis];
+        while (!min_queue.empty() && sensor->value(axis, min_queue.back()) >= x)
+          min_queue.pop_back();
+        min_queue.push_back(seq);
+        SeqQueue& max_queue = window.max_queue[axis];
+        while (!max_queue.empty() && sensor->value(axis, max_queue.back()) <= x)
+          max_queue.pop_back();
+        max_queue.push_back(seq);
+      }
+    }
+  }
+}
+
+void WindowAggregator::AdvanceSliding(Sensor* sensor, Window* window,
+                                      int64_t now) {
+  const int64_t hop = window->spec.hop_us;
+  while (window->open && now >= window->end) {
+    Evict(sensor, window, window->end - window->spec.length_us);
+    if (window->acc[0].count > 0) {
+      Publish(*sensor, *window, window->end - window->spec.length_us,
+              window->end);
+      window->end += hop;
+    } else {
+      // Nothing left to report; skip the silence in one step.
+      window->end = AlignDown(now, hop) + hop;
+    }
+  }
+}
+
+void WindowAggregator::Advance(int64_t now) {
+  for (const auto& sensor : sensors_) {
+    for (Window& window : sensor->windows) {
+      if (window.sliding) {
+        AdvanceSliding(sensor.get(), &window, now);
+      } else if (window.open && now >= window.end) {
+        Publish(*sensor, window, window.start, window.end);
+        window.open = false;
+      }
+    }
+  }
+}
+
+void WindowAggregator::Reset() {
+  for (const auto& sensor : sensors_) {
+    for (Window& window : sensor->windows) {
+      window.open = false;
+      window.first_seq = sensor->next_seq;
+      for (int axis = 0; axis < kMaxAxes; axis++) {
+        window.acc[axis].Reset();
+        window.min_queue[axis].clear();
+        window.max_queue[axis].clear();
+      }
+    }
+  }
+}
+
+void WindowAggregator::Evict(Sensor* sensor, Window* window, int64_t before) {
+  while (window->first_seq < sensor->next_seq &&
+         sensor->timestamp(window->first_seq) < before) {
+    const uint64_t seq = window->first_seq++;
+    for (int axis = 0; axis < sensor->axes; axis++) {
+      window->acc[axis].Remove(sensor->value(axis, seq));
+      if (!window->min_queue[axis].empty() &&
+          window->min_queue[axis].front() == seq)
+        window->min_queue[axis].pop_front();
+      if (!window->max_queue[axis].empty() &&
+          window->max_queue[axis].front() == seq)
+        window->max_queue[axis].pop_front();
+    }
+  }
+}
+
+void WindowAggregator::Publish(const Sensor& sensor, const Window& window,
+                               int64_t start, int64_t end) {
+  for (int axis = 0; axis < sensor.axes; axis++) {
+    const Accumulator& acc = window.acc[axis];
+    WindowResult result;
+    result.type = sensor.type;
+    result.axis = axis;
+    result.window = window.index;
+    result.start = start;
+    result.end = end;
+    result.count = acc.count;
+    if (window.sliding) {
+      result.min = sensor.value(axis, window.min_queue[axis].front());
+      result.max = sensor.value(axis, window.max_queue[axis].front());
+    } else {
+      result.min = acc.min;
+      result.max = acc.max;
+    }
+    result.mean = acc.mean;
+    result.variance = acc.count > 1 ? acc.m2 / (acc.count - 1) : 0.0;
+    for (const auto& subscriber : subscribers_)
+      subscriber.second(result);
+  }
+  published_++;
+}
+
+}  // namespace home_cloud
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOME_CLOUD_SERVICE_WINDOW_AGGREGATOR_H_
+#define HOME_CLOUD_SERVICE_WINDOW_AGGREGATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "time_series_codec.h"
+
+namespace home_cloud {
+
+struct WindowSpec {
+  int64_t length_us;
+  // A result every hop_us; equal to length_us for a tumbling window.
+  int64_t hop_us;
+};
+
+struct WindowResult {
+  int type;
+  int axis;
+  // Index of the window in the aggregator's specs.
+  int window;
+  // The window covers [start, end).
+  int64_t start;
+  int64_t end;
+  uint32_t count;
+  float min;
+  float max;
+  double mean;
+  // Sample variance; 0 for fewer than two samples.
+  double variance;
+};
+
+// Count, extremes, mean and sum of squared deviations of a run of values.
+struct BlockStats {
+  uint32_t count;
+  float min;
+  float max;
+  double mean;
+  double m2;
+};
+
+// Vectorized where the CPU allows; see AggregatorSimdName().
+BlockStats ComputeBlockStats(const float* values, size_t count);
+const char* AggregatorSimdName();
+
+// Keeps per-axis min, max, mean and variance over a set of time windows for
+// every sensor and publishes each window as it closes.
+//
+// Windows are aligned to multiples of their hop in sample time. Tumbling
+// windows take a drained batch a block at a time: the part of the batch
+// inside the current window is reduced with ComputeBlockStats() and merged
+// in with Chan's parallel form of Welford's update. Sliding windows keep the
+// samples they cover in a ring shared by the sensor's windows, add and
+// remove them from a running Welford mean and variance, and track min and
+// max with monotonic queues, so every sample costs O(1) whatever the window
+// length.
+class WindowAggregator {
+ public:
+  using Subscriber = std::function<void(const WindowResult&)>;
+
+  explicit WindowAggregator(const std::vector<WindowSpec>& windows);
+  ~WindowAggregator();
+
+  // period_us sizes the sliding window history; it grows if samples come
+  // faster.
+  void AddSensor(int type, int axes, int64_t period_us);
+
+  int Subscribe(const Subscriber& subscriber);
+  void Unsubscribe(int id);
+
+  // Samples of one sensor in time order, one array per axis.
+  void AddBatch(int type, const int64_t* timestamps,
+                const float* const* values, size_t count);
+  // Publishes windows that ended by now, for sensors that have gone quiet.
+  void Advance(int64_t now);
+  // Drops every open window and the sliding history without publishing
+  // them, for when sample time has jumped.
+  void Reset();
+
+  const std::vector<WindowSpec>& windows() const { return specs_; }
+  uint64_t published() const { return published_; }
+
+ private:
+  struct Sensor;
+  struct Window;
+
+  Sensor* Find(int type) const;
+  void AddTumbling(Sensor* sensor, Window* window, const int64_t* timestamps,
+                   const float* const* values, size_t count);
+  void AddSliding(Sensor* sensor, const int64_t* timestamps,
+                  const float* const* values, size_t count);
+  void AdvanceSliding(Sensor* sensor, Window* window, int64_t now);
+  void Evict(Sensor* sensor, Window* window, int64_t before);
+  void Publish(const Sensor& sensor, const Window& window, int64_t start,
+               int64_t end);
+
+  std::vector<WindowSpec> specs_;
+  std::vector<std::unique_ptr<Sensor>> sensors_;
+  std::vector<std::pair<int, Subscriber>> subscribers_;
+  int next_subscriber_{1};
+  uint64_t published_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(WindowAggregator);
+};
+
+}  // namespace home_cloud
+
+#endif  // HOME_CLOUD_SERVICE_WINDOW_AGGREGATOR_H_
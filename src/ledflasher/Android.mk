@@ -15,9 +15,8 @@
 LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_MODULE := ledflasher
-LOCAL_INIT_RC := ledflasher.rc
-LOCAL_REQUIRED_MODULES := ledflasher.json
+LOCAL_MODULE := libledflasher
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
 
 LOCAL_SRC_FILES := \
 	animation.cpp \
@@ -25,6 +24,32 @@ LOCAL_SRC_FILES := \
 	animation_marquee.cpp \
 	ledflasher.cpp \
 
+LOCAL_SHARED_LIBRARIES := \
+	libbinder \
+	libbinderwrapper \
+	libbrillo \
+	libbrillo-binder \
+	libchrome \
+	libcutils \
+	libutils \
+	libweaved \
+
+LOCAL_STATIC_LIBRARIES := \
+	libledservice-common \
+
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CLANG := true
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ledflasher
+LOCAL_INIT_RC := ledflasher.rc
+LOCAL_REQUIRED_MODULES := ledflasher.json
+
+LOCAL_SRC_FILES := \
+	main.cpp \
+
 LOCAL_SHARED_LIBRARIES := \
 	libbinder \
 	libbinderwrapper \
@@ -32,10 +57,12 @@ LOCAL_SHARED_LIBRARIES := \
 	libbrillo-binder \
 	libbrillo-stream \
 	libchrome \
+	libcutils \
 	libutils \
 	libweaved \
 
 LOCAL_STATIC_LIBRARIES := \
+	libledflasher \
 	libledservice-common \
 
 LOCAL_C_INCLUDES := external/gtest/include
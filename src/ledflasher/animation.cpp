@@ -24,19 +24,33 @@
 Animation::Animation(
     android::sp<brillo::examples::ledflasher::ILEDService> led_service,
     const base::TimeDelta& step_duration)
-  : led_service_{led_service}, step_duration_{step_duration} {
+  : led_service_{led_service},
+    step_duration_{step_duration},
+    step_time_{metrics::Registry::Get()->GetHistogram(
+        "ledflasher.animation_step_us")} {
   int led_count;
   led_service_->getLEDCount(&led_count);
   num_leds = static_cast<size_t>(led_count);
   step_duration_ /= num_leds;
+  if (led_service_->openFramebuffer(&framebuffer_).isOk() &&
+      framebuffer_.valid() && framebuffer_.led_count() == num_leds) {
+    frame_.assign(num_leds, 0);
+  }
 }
 
 Animation::~Animation() {
   SetAllLEDs(false);
+  if (!frame_.empty())
+    framebuffer_.Publish(frame_.data());
 }
 
 void Animation::Start() {
-  DoAnimationStep();
+  {
+    metrics::ScopedTimer timer(step_time_);
+    DoAnimationStep();
+    if (!frame_.empty())
+      framebuffer_.Publish(frame_.data());
+  }
   base::MessageLoop::current()->PostDelayedTask(
       FROM_HERE,
       base::Bind(&Animation::Start, weak_ptr_factory_.GetWeakPtr()),
@@ -48,12 +62,18 @@ void Animation::Stop() {
 }
 
 bool Animation::GetLED(size_t index) const {
+  if (!frame_.empty())
+    return frame_[index] != 0;
   bool on = false;
   led_service_->getLED(index, &on);
   return on;
 }
 
 void Animation::SetLED(size_t index, bool on) {
+  if (!frame_.empty()) {
+    frame_[index] = on ? 255 : 0;
+    return;
+  }
   led_service_->setLED(index, on);
 }
 
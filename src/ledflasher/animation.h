@@ -24,6 +24,8 @@
 #include <base/memory/weak_ptr.h>
 
 #include "brillo/examples/ledflasher/ILEDService.h"
+#include "led_framebuffer.h"
+#include "metrics.h"
 
 class Animation {
  public:
@@ -51,6 +53,12 @@ class Animation {
  private:
   android::sp<brillo::examples::ledflasher::ILEDService> led_service_;
   base::TimeDelta step_duration_;
+  metrics::Histogram* step_time_;
+  // When ledservice hands one out, steps draw into frame_ and publish it
+  // through the framebuffer, one frame per step, instead of making a
+  // binder call per LED.
+  brillo::examples::ledflasher::LedFramebuffer framebuffer_;
+  std::vector<uint8_t> frame_;
 
   base::WeakPtrFactory<Animation> weak_ptr_factory_{this};
   DISALLOW_COPY_AND_ASSIGN(Animation);
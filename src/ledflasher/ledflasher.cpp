@@ -14,22 +14,25 @@
  * limitations under the License.
  */
 
+#include "ledflasher.h"
+
 #include <string>
 #include <sysexits.h>
 
 #include <base/bind.h>
-#include <base/command_line.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
 #include <base/macros.h>
 #include <base/memory/weak_ptr.h>
-#include <binderwrapper/binder_wrapper.h>
-#include <brillo/binder_watcher.h>
-#include <brillo/daemons/daemon.h>
-#include <brillo/syslog_logging.h>
+#include <binder/Binder.h>
+#include <brillo/message_loops/message_loop.h>
 #include <libweaved/service.h>
 
 #include "animation.h"
 #include "binder_constants.h"
 #include "brillo/examples/ledflasher/ILEDService.h"
+#include "metrics.h"
+#include "trace.h"
 
 using android::String16;
 
@@ -45,11 +48,35 @@ const char kLedInfoTrait[] = "_ledInfo";
 
 using brillo::examples::ledflasher::ILEDService;
 
-class Daemon final : public brillo::Daemon {
+namespace {
+
+// ledflasher serves nothing over binder itself; this is only there so that
+// dumpsys can reach its boot timeline and metrics.
+class DumpService : public android::BBinder {
  public:
-  Daemon() = default;
+  android::status_t dump(int fd,
+                         const android::Vector<String16>& args) override {
+    std::string text = "Boot timeline:\n" + service_hub::BootTimeline() +
+                       "Metrics:\n" + metrics::Registry::Get()->Dump();
+    return base::WriteFileDescriptor(fd, text.data(), text.size())
+               ? android::OK
+               : android::UNKNOWN_ERROR;
+  }
+};
 
- protected:
+class Daemon final : public service_hub::Module {
+ public:
+  Daemon()
+      : commands_(metrics::Registry::Get()->GetCounter("ledflasher.commands")),
+        failed_commands_(metrics::Registry::Get()->GetCounter(
+            "ledflasher.failed_commands")),
+        ledservice_connects_(metrics::Registry::Get()->GetCounter(
+            "ledflasher.ledservice_connects")),
+        animating_(metrics::Registry::Get()->GetGauge("ledflasher.animating")),
+        set_led_time_(metrics::Registry::Get()->GetHistogram(
+            "ledflasher.set_led_us")) {}
+
+  const char* name() const override { return "ledflasher"; }
   int OnInit() override;
 
  private:
@@ -78,33 +105,34 @@ class Daemon final : public brillo::Daemon {
 
   // LED service interface.
   android::sp<ILEDService> led_service_;
+  service_hub::RetryBackoff led_service_retry_;
 
   // Current animation;
   std::unique_ptr<Animation> animation_;
 
-  brillo::BinderWatcher binder_watcher_;
   std::unique_ptr<weaved::Service::Subscription> weave_service_subscription_;
 
   bool led_components_added_{false};
 
+  metrics::Counter* commands_;
+  metrics::Counter* failed_commands_;
+  metrics::Counter* ledservice_connects_;
+  metrics::Gauge* animating_;
+  // Round trip of a setLED() call to ledservice.
+  metrics::Histogram* set_led_time_;
+
   base::WeakPtrFactory<Daemon> weak_ptr_factory_{this};
   DISALLOW_COPY_AND_ASSIGN(Daemon);
 };
 
 int Daemon::OnInit() {
-  int return_code = brillo::Daemon::OnInit();
-  if (return_code != EX_OK)
-    return return_code;
-
-  android::BinderWrapper::Create();
-  if (!binder_watcher_.Init())
-    return EX_OSERR;
-
   weave_service_subscription_ = weaved::Service::Connect(
       brillo::MessageLoop::current(),
       base::Bind(&Daemon::OnWeaveServiceConnected,
                  weak_ptr_factory_.GetWeakPtr()));
   ConnectToLEDService();
+  service_hub::RegisterService(ledflasher::kBinderServiceName,
+                               new DumpService());
 
   LOG(INFO) << "Waiting for commands...";
   return EX_OK;
@@ -117,6 +145,7 @@ void Daemon::OnWeaveServiceConnected(
   auto weave_service = weave_service_.lock();
   if (!weave_service)
     return;
+  service_hub::MarkBootPhase(name(), "weave connected");
 
   weave_service->AddComponent(
       kLedFlasherComponent, {kLedFlasherTrait}, nullptr);
@@ -139,16 +168,18 @@ void Daemon::OnWeaveServiceConnected(
 }
 
 void Daemon::ConnectToLEDService() {
-  android::BinderWrapper* binder_wrapper = android::BinderWrapper::Get();
-  auto binder = binder_wrapper->GetService(ledservice::kBinderServiceName);
+  auto binder = service_hub::GetService(ledservice::kBinderServiceName);
   if (!binder.get()) {
     brillo::MessageLoop::current()->PostDelayedTask(
         base::Bind(&Daemon::ConnectToLEDService,
                    weak_ptr_factory_.GetWeakPtr()),
-        base::TimeDelta::FromSeconds(1));
+        led_service_retry_.Next());
     return;
   }
-  binder_wrapper->RegisterForDeathNotifications(
+  led_service_retry_.Reset();
+  ledservice_connects_->Increment();
+  service_hub::MarkBootPhase(name(), "ledservice connected");
+  service_hub::WatchService(
       binder,
       base::Bind(&Daemon::OnLEDServiceDisconnected,
                  weak_ptr_factory_.GetWeakPtr()));
@@ -201,34 +232,52 @@ void Daemon::CreateLedComponentsIfNeeded() {
     }
   }
   led_components_added_ = true;
+  service_hub::MarkBootPhase(name(), "ready");
 }
 
 void Daemon::OnLEDServiceDisconnected() {
   animation_.reset();
+  animating_->Set(0);
   led_service_ = nullptr;
   ConnectToLEDService();
 }
 
 void Daemon::OnSetConfig(size_t led_index,
                          std::unique_ptr<weaved::Command> command) {
+  // Traced end to end: the span starts when weaved's call reaches us, and
+  // ledservice labels its spans with the same id. The weave command id ties
+  // it back to weaved's log.
+  int64_t trace_id = trace::NewCorrelationId();
+  trace::ScopedSpan span("ledflasher.setConfig", trace_id,
+                         command->GetID().c_str());
+  commands_->Increment();
   if (!led_service_.get()) {
+    failed_commands_->Increment();
     command->Abort("_system_error", "ledservice unavailable", nullptr);
     return;
   }
 
   auto state = command->GetParameter<std::string>("state");
   bool on = (state == "on");
-  android::binder::Status status = led_service_->setLED(led_index, on);
+  android::binder::Status status;
+  {
+    trace::ScopedSpan binder_span("ledflasher.setLED");
+    metrics::ScopedTimer timer(set_led_time_);
+    status = led_service_->setLEDTraced(led_index, on, trace_id);
+  }
   if (!status.isOk()) {
+    failed_commands_->Increment();
     command->AbortWithCustomError(status, nullptr);
     return;
   }
   if (animation_) {
     animation_.reset();
+    animating_->Set(0);
     status_ = "idle";
     UpdateDeviceState();
   }
 
+  trace::ScopedSpan reply_span("ledflasher.weave_reply");
   auto weave_service = weave_service_.lock();
   if (weave_service) {
     std::string component_name =
@@ -243,13 +292,16 @@ void Daemon::OnSetConfig(size_t led_index,
 }
 
 void Daemon::OnAnimate(std::unique_ptr<weaved::Command> command) {
+  commands_->Increment();
   if (!led_service_.get()) {
+    failed_commands_->Increment();
     command->Abort("_system_error", "ledservice unavailable", nullptr);
     return;
   }
 
   double duration = command->GetParameter<double>("duration");
   if(duration <= 0.0) {
+    failed_commands_->Increment();
     command->Abort("_invalid_parameter", "Invalid parameter value", nullptr);
     return;
   }
@@ -259,7 +311,9 @@ void Daemon::OnAnimate(std::unique_ptr<weaved::Command> command) {
 }
 
 void Daemon::OnIdentify(std::unique_ptr<weaved::Command> command) {
+  commands_->Increment();
   if (!led_service_.get()) {
+    failed_commands_->Increment();
     command->Abort("_system_error", "ledservice unavailable", nullptr);
     return;
   }
@@ -287,6 +341,7 @@ void Daemon::StartAnimation(const std::string& type, base::TimeDelta duration) {
   } else {
     status_ = "idle";
   }
+  animating_->Set(animation_ ? 1 : 0);
   UpdateDeviceState();
 }
 
@@ -295,6 +350,7 @@ void Daemon::StopAnimation() {
     return;
 
   animation_.reset();
+  animating_->Set(0);
   status_ = "idle";
   UpdateDeviceState();
 }
@@ -311,9 +367,12 @@ void Daemon::UpdateDeviceState() {
                                   nullptr);
 }
 
-int main(int argc, char* argv[]) {
-  base::CommandLine::Init(argc, argv);
-  brillo::InitLog(brillo::kLogToSyslog | brillo::kLogHeader);
-  Daemon daemon;
-  return daemon.Run();
+}  // anonymous namespace
+
+namespace ledflasher {
+
+std::unique_ptr<service_hub::Module> CreateModule() {
+  return std::unique_ptr<service_hub::Module>(new Daemon());
 }
+
+}  // namespace ledflasher
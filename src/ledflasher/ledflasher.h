@@ -0,0 +1,31 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LEDFLASHER_SRC_LEDFLASHER_LEDFLASHER_H_
+#define LEDFLASHER_SRC_LEDFLASHER_LEDFLASHER_H_
+
+#include <memory>
+
+#include "service_module.h"
+
+namespace ledflasher {
+
+// Exposes the LEDs and their animations to weave, through ledservice.
+std::unique_ptr<service_hub::Module> CreateModule();
+
+}  // namespace ledflasher
+
+#endif  // LEDFLASHER_SRC_LEDFLASHER_LEDFLASHER_H_
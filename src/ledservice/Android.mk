@@ -15,13 +15,38 @@
 LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_MODULE := ledservice
-LOCAL_INIT_RC := ledservice.rc
+LOCAL_MODULE := libledservice
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
 
 LOCAL_SRC_FILES := \
 	ledservice.cpp \
 	ledstatus.cpp \
 
+LOCAL_SHARED_LIBRARIES := \
+	libbinder \
+	libbinderwrapper \
+	libbrillo \
+	libbrillo-binder \
+	libchrome \
+	libcutils \
+	libhardware \
+	libutils \
+
+LOCAL_STATIC_LIBRARIES := \
+	libledservice-common \
+
+LOCAL_CLANG := true
+LOCAL_CFLAGS := -Wall -Werror
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ledservice
+LOCAL_INIT_RC := ledservice.rc
+
+LOCAL_SRC_FILES := \
+	main.cpp \
+
 LOCAL_SHARED_LIBRARIES := \
 	libbinder \
 	libbinderwrapper \
@@ -29,10 +54,12 @@ LOCAL_SHARED_LIBRARIES := \
 	libbrillo-binder \
 	libbrillo-stream \
 	libchrome \
+	libcutils \
 	libhardware \
 	libutils \
 
 LOCAL_STATIC_LIBRARIES := \
+	libledservice \
 	libledservice-common \
 
 LOCAL_CLANG := true
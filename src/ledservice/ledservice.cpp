@@ -14,46 +14,87 @@
  * limitations under the License.
  */
 
-#include <string>
+#include "ledservice.h"
+
 #include <sysexits.h>
 
+#include <algorithm>
+
 #include <base/bind.h>
-#include <base/command_line.h>
+#include <base/files/file_util.h>
 #include <base/macros.h>
-#include <binderwrapper/binder_wrapper.h>
-#include <brillo/binder_watcher.h>
-#include <brillo/daemons/daemon.h>
-#include <brillo/syslog_logging.h>
+#include <brillo/message_loops/message_loop.h>
 
 #include "binder_constants.h"
 #include "brillo/examples/ledflasher/BnLEDService.h"
+#include "led_framebuffer.h"
 #include "ledstatus.h"
+#include "metrics.h"
+#include "trace.h"
 
 using android::String16;
+using brillo::examples::ledflasher::LedFramebuffer;
+
+namespace {
 
 class LEDService : public brillo::examples::ledflasher::BnLEDService {
  public:
+  LEDService()
+      : calls_(metrics::Registry::Get()->GetCounter("ledservice.calls")),
+        set_led_time_(metrics::Registry::Get()->GetHistogram(
+            "ledservice.set_led_us")),
+        get_led_time_(metrics::Registry::Get()->GetHistogram(
+            "ledservice.get_led_us")),
+        frames_(metrics::Registry::Get()->GetCounter("ledservice.frames")),
+        frame_writes_(
+            metrics::Registry::Get()->GetCounter("ledservice.frame_writes")) {}
+
+  ~LEDService() override { StopFramebuffer(); }
+
   android::binder::Status getLEDCount(int32_t* count) override {
+    calls_->Increment();
     *count = leds_.GetLedCount();
     return android::binder::Status::ok();
   }
 
   android::binder::Status setLED(int32_t ledIndex, bool on) override {
+    return setLEDTraced(ledIndex, on, 0);
+  }
+
+  android::binder::Status setLEDTraced(int32_t ledIndex,
+                                       bool on,
+                                       int64_t traceId) override {
+    trace::ScopedSpan span("ledservice.setLED", traceId);
+    calls_->Increment();
+    if (!IsValidIndex(ledIndex)) {
+      return android::binder::Status::fromExceptionCode(
+          android::binder::Status::EX_ILLEGAL_ARGUMENT);
+    }
+    metrics::ScopedTimer timer(set_led_time_);
     leds_.SetLedStatus(ledIndex, on);
+    SetApplied(ledIndex, on ? 255 : 0);
     return android::binder::Status::ok();
   }
 
   android::binder::Status getLED(int32_t ledIndex, bool* on) override {
+    calls_->Increment();
+    if (!IsValidIndex(ledIndex)) {
+      return android::binder::Status::fromExceptionCode(
+          android::binder::Status::EX_ILLEGAL_ARGUMENT);
+    }
+    metrics::ScopedTimer timer(get_led_time_);
     *on = leds_.IsLedOn(ledIndex);
     return android::binder::Status::ok();
   }
 
   android::binder::Status getAllLEDs(std::vector<bool>* leds) override {
+    calls_->Increment();
     *leds = leds_.GetStatus();
     return android::binder::Status::ok();
   }
 
   android::binder::Status getAllLEDNames(std::vector<String16>* leds) override {
+    calls_->Increment();
     std::vector<std::string> ledNames = leds_.GetNames();
     for (const std::string& name : ledNames) {
       leds->push_back(String16{name.c_str()});
@@ -62,41 +103,119 @@ class LEDService : public brillo::examples::ledflasher::BnLEDService {
   }
 
   android::binder::Status setAllLEDs(bool on) override {
+    calls_->Increment();
     leds_.SetAllLeds(on);
+    for (size_t i = 0; i < applied_.size(); i++)
+      SetApplied(i, on ? 255 : 0);
     return android::binder::Status::ok();
   }
 
+  android::binder::Status openFramebuffer(
+      LedFramebuffer* framebuffer) override {
+    calls_->Increment();
+    StopFramebuffer();
+    size_t led_count =
+        std::min(leds_.GetLedCount(), LedFramebuffer::kMaxLeds);
+    if (!framebuffer_.Create(led_count) || !framebuffer_.Share(framebuffer)) {
+      return android::binder::Status::fromExceptionCode(
+          android::binder::Status::EX_ILLEGAL_STATE);
+    }
+    // Unknown until written, so that the first frame sets every LED.
+    applied_.assign(led_count, -1);
+    doorbell_watch_ = brillo::MessageLoop::current()->WatchFileDescriptor(
+        FROM_HERE, framebuffer_.doorbell_fd(),
+        brillo::MessageLoop::kWatchRead, true,
+        base::Bind(&LEDService::OnDoorbell, base::Unretained(this)));
+    return android::binder::Status::ok();
+  }
+
+  android::status_t dump(int fd,
+                         const android::Vector<String16>& args) override {
+    std::string text = "Boot timeline:\n" + service_hub::BootTimeline() +
+                       "Metrics:\n" + metrics::Registry::Get()->Dump();
+    return base::WriteFileDescriptor(fd, text.data(), text.size())
+               ? android::OK
+               : android::UNKNOWN_ERROR;
+  }
+
  private:
+  // Applies the newest frame, writing only the LEDs that changed.
+  void OnDoorbell() {
+    uint8_t frame[LedFramebuffer::kMaxLeds];
+    if (!framebuffer_.ReadLatest(frame))
+      return;
+    trace::ScopedSpan span("ledservice.frame");
+    frames_->Increment();
+    for (size_t i = 0; i < applied_.size(); i++) {
+      if (applied_[i] == frame[i])
+        continue;
+      leds_.SetLedBrightness(i, frame[i]);
+      applied_[i] = frame[i];
+      frame_writes_->Increment();
+    }
+  }
+
+  void StopFramebuffer() {
+    if (doorbell_watch_ != brillo::MessageLoop::kTaskIdNull)
+      brillo::MessageLoop::current()->CancelTask(doorbell_watch_);
+    doorbell_watch_ = brillo::MessageLoop::kTaskIdNull;
+    applied_.clear();
+  }
+
+  // Client indices are checked here; LedStatus CHECKs its own.
+  bool IsValidIndex(int32_t index) const {
+    return index >= 0 && static_cast<size_t>(index) < leds_.GetLedCount();
+  }
+
+  // Keeps the framebuffer's idea of the LEDs in step with setLED().
+  void SetApplied(size_t index, int brightness) {
+    if (index < applied_.size())
+      applied_[index] = brightness;
+  }
+
   LedStatus leds_;
+  metrics::Counter* calls_;
+  metrics::Histogram* set_led_time_;
+  metrics::Histogram* get_led_time_;
+  metrics::Counter* frames_;
+  metrics::Counter* frame_writes_;
+
+  LedFramebuffer framebuffer_;
+  brillo::MessageLoop::TaskId doorbell_watch_{brillo::MessageLoop::kTaskIdNull};
+  // Brightness last written to each LED, -1 if not known.
+  std::vector<int> applied_;
 };
 
-class Daemon final : public brillo::Daemon {
+class LedServiceModule final : public service_hub::Module {
  public:
-  Daemon() = default;
+  LedServiceModule() = default;
+
+  const char* name() const override { return "ledservice"; }
 
- protected:
+  // The lights HAL is still being probed; calls wait for it, and the
+  // module is only marked ready once the probe is done.
   int OnInit() override {
-    android::BinderWrapper::Create();
-    if (!binder_watcher_.Init())
-      return EX_OSERR;
-
-    led_service_ = new LEDService();
-    android::BinderWrapper::Get()->RegisterService(
-        ledservice::kBinderServiceName,
-        led_service_);
-    return brillo::Daemon::OnInit();
+    led_service_ = ledservice::CreateService();
+    service_hub::RegisterService(ledservice::kBinderServiceName, led_service_);
+    return EX_OK;
   }
 
  private:
-  brillo::BinderWatcher binder_watcher_;
-  android::sp<LEDService> led_service_;
+  android::sp<android::IBinder> led_service_;
 
-  DISALLOW_COPY_AND_ASSIGN(Daemon);
+  DISALLOW_COPY_AND_ASSIGN(LedServiceModule);
 };
 
-int main(int argc, char* argv[]) {
-  base::CommandLine::Init(argc, argv);
-  brillo::InitLog(brillo::kLogToSyslog | brillo::kLogHeader);
-  Daemon daemon;
-  return daemon.Run();
+}  // anonymous namespace
+
+namespace ledservice {
+
+android::sp<android::IBinder> CreateService() {
+  return new LEDService();
 }
+
+std::unique_ptr<service_hub::Module> CreateModule() {
+  return std::unique_ptr<service_hub::Module>(new LedServiceModule());
+}
+
+}  // namespace ledservice
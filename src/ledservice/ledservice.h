@@ -0,0 +1,36 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LEDFLASHER_SRC_LEDSERVICE_LEDSERVICE_H_
+#define LEDFLASHER_SRC_LEDSERVICE_LEDSERVICE_H_
+
+#include <memory>
+
+#include <binder/IBinder.h>
+#include <utils/StrongPointer.h>
+
+#include "service_module.h"
+
+namespace ledservice {
+
+// An ILEDService over the LEDs of the lights HAL.
+android::sp<android::IBinder> CreateService();
+// Serves the LEDs of the lights HAL as ledservice::kBinderServiceName.
+std::unique_ptr<service_hub::Module> CreateModule();
+
+}  // namespace ledservice
+
+#endif  // LEDFLASHER_SRC_LEDSERVICE_LEDSERVICE_H_
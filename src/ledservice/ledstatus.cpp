@@ -27,6 +27,9 @@
 #include <brillo/streams/file_stream.h>
 #include <brillo/streams/stream_utils.h>
 
+#include "service_module.h"
+#include "trace.h"
+
 namespace {
 
 brillo::StreamPtr GetLEDDataStream(size_t index, bool write) {
@@ -46,7 +49,30 @@ brillo::StreamPtr GetLEDDataStream(size_t index, bool write) {
 
 }  // anonymous namespace
 
-LedStatus::LedStatus() {
+LedStatus::LedStatus()
+    : probe_(std::async(std::launch::async, [this] { ProbeHal(); })) {}
+
+LedStatus::~LedStatus() {
+  WaitForProbe();
+  for (light_device_t* light_device : hal_devices_) {
+    light_device->common.close(
+        reinterpret_cast<hw_device_t*>(light_device));
+  }
+}
+
+void LedStatus::WaitForProbe() const {
+  if (probe_.valid())
+    probe_.get();
+}
+
+void LedStatus::ProbeHal() {
+  ProbeLights();
+  service_hub::MarkBootPhase("ledservice", "lights probed");
+  // Calls no longer wait from here on.
+  service_hub::MarkBootPhase("ledservice", "ready");
+}
+
+void LedStatus::ProbeLights() {
   // Try to open the lights HAL.
   int ret = hw_get_module(LIGHTS_HARDWARE_MODULE_ID, &lights_hal_);
   if (ret) {
@@ -73,6 +99,7 @@ LedStatus::LedStatus() {
     }
     hal_leds_.push_back(light_name);
     hal_led_status_.push_back(false);
+    hal_devices_.push_back(light_device);
   }
 
   // If the size of the map is zero, then the lights HAL doesn't have any valid
@@ -85,10 +112,12 @@ LedStatus::LedStatus() {
 }
 
 size_t LedStatus::GetLedCount() const {
+  WaitForProbe();
   return lights_hal_ ? hal_leds_.size() : 1;
 }
 
 std::vector<bool> LedStatus::GetStatus() const {
+  WaitForProbe();
   if (lights_hal_)
     return hal_led_status_;
 
@@ -99,6 +128,7 @@ std::vector<bool> LedStatus::GetStatus() const {
 }
 
 std::vector<std::string> LedStatus::GetNames() const {
+  WaitForProbe();
   return lights_hal_ ? hal_leds_ : std::vector<std::string>(GetLedCount());
 }
 
@@ -127,44 +157,43 @@ bool LedStatus::IsLedOn(size_t index) const {
 }
 
 void LedStatus::SetLedStatus(size_t index, bool on) {
+  SetLedBrightness(index, on ? 255 : 0);
+}
+
+void LedStatus::SetLedBrightness(size_t index, uint8_t brightness) {
+  // Grey at the given level, opaque.
+  uint32_t color = brightness ? 0xff000000 | brightness * 0x010101 : 0;
+  WriteLed(index, color, brightness);
+}
+
+void LedStatus::WriteLed(size_t index, uint32_t hal_color,
+                         int sysfs_brightness) {
   CHECK(index < GetLedCount());
   if (lights_hal_) {
+    trace::ScopedSpan span("ledservice.set_light");
     light_state_t state = {};
-    state.color = on;
+    state.color = hal_color;
     state.flashMode = LIGHT_FLASH_NONE;
     state.flashOnMS = 0;
     state.flashOffMS = 0;
     state.brightnessMode = BRIGHTNESS_MODE_USER;
-    light_device_t* light_device = nullptr;
-    int rc = lights_hal_->methods->open(
-        lights_hal_,
-        hal_leds_[index].c_str(),
-        reinterpret_cast<hw_device_t**>(&light_device));
-    if (rc) {
-      LOG(ERROR) << "Unable to open " << hal_leds_[index];
-      return;
-    }
-    CHECK(light_device);
-    rc = light_device->set_light(light_device, &state);
+    light_device_t* light_device = hal_devices_[index];
+    int rc = light_device->set_light(light_device, &state);
     if (rc) {
       LOG(ERROR) << "Unable to set " << hal_leds_[index];
       return;
     }
-    hal_led_status_[index] = on;
-    light_device->common.close(
-        reinterpret_cast<hw_device_t*>(light_device));
-    if (rc) {
-      LOG(ERROR) << "Unable to close " << hal_leds_[index];
-      return;
-    }
+    hal_led_status_[index] = hal_color != 0;
     return;
   }
 
+  trace::ScopedSpan span("ledservice.sysfs_brightness");
   brillo::StreamPtr stream = GetLEDDataStream(index, true);
   if (!stream)
     return;
 
-  std::string brightness = on ? "255" : "0";
+  std::string brightness = std::to_string(sysfs_brightness);
+  trace::ScopedSpan write_span("ledservice.sysfs_write");
   stream->WriteAllBlocking(brightness.data(), brightness.size(), nullptr);
 }
 
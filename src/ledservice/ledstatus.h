@@ -17,30 +17,49 @@
 #ifndef LEDFLASHER_SRC_LEDSERVICE_LEDSTATUS_H_
 #define LEDFLASHER_SRC_LEDSERVICE_LEDSTATUS_H_
 
+#include <stdint.h>
+
+#include <future>
 #include <string>
 #include <vector>
 
 #include <base/macros.h>
 #include <hardware/lights.h>
 
+// Probing the lights HAL opens every logical light in turn, so it runs on
+// a thread of its own while the service registers; the first call waits
+// for it if it has not finished.
 class LedStatus final {
  public:
   LedStatus();
+  ~LedStatus();
 
   std::vector<bool> GetStatus() const;
   std::vector<std::string> GetNames() const;
   bool IsLedOn(size_t index) const;
   void SetLedStatus(size_t index, bool on);
+  // 0 is off, 255 full brightness.
+  void SetLedBrightness(size_t index, uint8_t brightness);
   void SetAllLeds(bool on);
   size_t GetLedCount() const;
 
  private:
+  void ProbeHal();
+  void ProbeLights();
+  void WaitForProbe() const;
+  // Sets hal_color through the lights HAL, or writes sysfs_brightness.
+  void WriteLed(size_t index, uint32_t hal_color, int sysfs_brightness);
+
   const hw_module_t* lights_hal_{nullptr};
   // Contains the names of LEDs in the HAL for each of supported LEDs.
   std::vector<std::string> hal_leds_;
+  // The devices opened while probing, kept open for setting the LEDs.
+  std::vector<light_device_t*> hal_devices_;
   // Since the HAL doesn't have a way to track the led status, we maintain that
   // info here.
   std::vector<bool> hal_led_status_;
+  // Last, so that the probe starts once the members it fills exist.
+  mutable std::future<void> probe_;
 
   DISALLOW_COPY_AND_ASSIGN(LedStatus);
 };
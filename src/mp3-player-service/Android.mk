@@ -1,14 +1,20 @@
 LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_MODULE := mp3-player-service
-LOCAL_INIT_RC := mp3-player-service.rc
-LOCAL_REQUIRED_MODULES := mediaplayer.json
+LOCAL_MODULE := libmp3-player
 
 LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
 
 LOCAL_SRC_FILES :=	\
+	buffered_pcm_source.cpp	\
+	loudness_analyzer.cpp	\
 	mp3-player-service.cpp	\
+	pcm_dsp.cpp	\
+	pcm_ring_buffer.cpp	\
+	stagefright_track_decoder.cpp	\
+	stream_server.cpp	\
+	track_index.cpp	\
+	track_source.cpp	\
 
 LOCAL_SHARED_LIBRARIES := \
 	libbinder \
@@ -22,8 +28,10 @@ LOCAL_SHARED_LIBRARIES := \
 	libstagefright \
 	libstagefright_foundation \
 	libutils \
+	libweaved \
 
 LOCAL_STATIC_LIBRARIES := \
+	libledservice-common \
 	libmp3-player-service \
 
 LOCAL_C_INCLUDES := \
@@ -32,8 +40,55 @@ LOCAL_C_INCLUDES := \
 	$(TOP)/frameworks/native/include/media/openmax \
 	$(TOP)/system/media/audio_utils/include
 
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := mp3-player-service
+LOCAL_INIT_RC := mp3-player-service.rc
+LOCAL_REQUIRED_MODULES := mediaplayer.json
+
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+
+LOCAL_SRC_FILES :=	\
+	main.cpp	\
+
+LOCAL_SHARED_LIBRARIES := \
+	libbinder \
+	libbinderwrapper \
+	libbrillo \
+	libbrillo-binder \
+	libbrillo-stream \
+	libchrome \
+	libhardware \
+	libmedia \
+	libstagefright \
+	libstagefright_foundation \
+	libutils \
+	libweaved \
+
+LOCAL_STATIC_LIBRARIES := \
+	libmp3-player \
+	libledservice-common \
+	libmp3-player-service \
+
 include $(BUILD_EXECUTABLE)
 
+# Host benchmarks
+# ========================================================
+include $(CLEAR_VARS)
+LOCAL_MODULE := mp3-player-bench
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_SRC_FILES := \
+	loudness_analyzer.cpp \
+	mp3-player-bench.cpp \
+	pcm_dsp.cpp \
+	stream_server.cpp \
+	track_index.cpp \
+
+LOCAL_SHARED_LIBRARIES := libchrome
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := mediaplayer.json
 LOCAL_MODULE_CLASS := ETC
@@ -50,5 +105,11 @@ LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
 LOCAL_SRC_FILES := \
 	aidl/brillo/demo/IMp3PlayerService.aidl \
 	binder_constants.cpp \
+	playback_metrics.cpp \
+
+LOCAL_SHARED_LIBRARIES := \
+	libbinder \
+	libchrome \
+	libutils \
 
 include $(BUILD_STATIC_LIBRARY)
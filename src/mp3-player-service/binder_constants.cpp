@@ -1,6 +1,9 @@
 #include "mp3-player-service.h"
 
 namespace mp3_player_service {
+	const char kWeaveComponent[] = "mediaplayer";
 	const char kWeaveTrait[] = "_mediaplayer";
 	const char kBinderServiceName[] = "mp3_player_service";
+	const char kSoundtracksFolder[] = "/data/soundtracks";
+	const char kLoudnessIndex[] = "/data/misc/mp3-player/loudness";
 }
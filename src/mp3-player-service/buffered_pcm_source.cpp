@@ -0,0 +1,527 @@
+#include "buffered_pcm_source.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
+
+using namespace android;
+
+namespace mp3_player_service {
+
+/* Size of each buffer handed to AudioPlayer, in frames. */
+static const size_t kReadFrames = 1024;
+/* Time for a volume change across the full 0..1 range. */
+static const float kGainSlewSeconds = 0.05f;
+
+BufferedPcmSource::BufferedPcmSource(const sp<MediaSource>& decoder,
+                                     const sp<TrackSource>& trackSource,
+                                     int64_t bufferedUs, int64_t crossfadeUs)
+	: decoder(decoder),
+	  trackSource(trackSource),
+	  bufferedUs(bufferedUs),
+	  crossfadeUs(crossfadeUs),
+	  sampleRate(0),
+	  frameSize(0),
+	  framesRead(0),
+	  fadeState(kFadeIdle),
+	  fadeFrames(0),
+	  fadeTailBytes(0),
+	  fadeTailStart(0),
+	  fadeMark(0),
+	  fadeOffset(0),
+	  fadeTotal(0),
+	  fadeDone(0),
+	  fadeOutGain(1.0f),
+	  nextTrackGain(1.0f),
+	  trackStart(0),
+	  readerTrackGain(1.0f),
+	  readerTrackStart(0),
+	  targetGain(1.0f),
+	  currentGain(1.0f),
+	  eqDirty(false),
+	  running(false),
+	  decoderEOS(false),
+	  primed(false),
+	  underruns(0),
+	  decodedFrames(0),
+	  decodeNsTotal(0),
+	  decodeNsMax(0),
+	  firstAudioAt(0),
+	  decodeTime(metrics::Registry::Get()->GetHistogram("mp3_player.decode_us")),
+	  underrunMetric(metrics::Registry::Get()->GetCounter("mp3_player.underruns")),
+	  pendingCrossfade(false),
+	  pendingTrackGain(1.0f),
+	  switchResult(OK),
+	  switchPending(false),
+	  paused(false),
+	  spaceWanted(0)
+{
+	for (int band = 0; band < Equalizer::kBands; band++)
+		eqGains[band] = 0.0f;
+}
+
+BufferedPcmSource::~BufferedPcmSource()
+{
+	stop();
+}
+
+status_t BufferedPcmSource::start(MetaData* params)
+{
+	if (running)
+		return OK;
+
+	status_t err = decoder->start(params);
+	if (err != OK)
+		return err;
+
+	format = decoder->getFormat();
+	int32_t channels = 0;
+	if (!format->findInt32(kKeySampleRate, &sampleRate) ||
+	    !format->findInt32(kKeyChannelCount, &channels)) {
+		LOG(ERROR) << "Decoder did not report sample rate / channel count";
+		decoder->stop();
+		return ERROR_UNSUPPORTED;
+	}
+	frameSize = channels * sizeof(int16_t);
+
+	size_t bytes = bufferedUs * sampleRate / 1000000 * frameSize;
+	ring.reset(new PcmRingBuffer(std::max(bytes, kReadFrames * frameSize)));
+	fadeFrames = crossfadeUs * sampleRate / 1000000;
+	fadeTail.resize(fadeFrames * frameSize);
+	carry.clear();
+	fadeState = kFadeIdle;
+	group.add_buffer(new MediaBuffer(kReadFrames * frameSize));
+	group.add_buffer(new MediaBuffer(kReadFrames * frameSize));
+	fadeScratch.resize(kReadFrames * frameSize);
+	equalizer.reset(new Equalizer(sampleRate, channels));
+	eqDirty = true;
+	LOG(INFO) << "Buffering " << ring->capacity() << " bytes of PCM ("
+	          << sampleRate << " Hz, " << channels << " ch, "
+	          << dsp::simdName() << " DSP), " << fadeTail.size()
+	          << " bytes for crossfades";
+
+	framesRead = 0;
+	fadeTotal = 0;
+	trackStart = 0;
+	readerTrackStart = 0;
+	resetStats();
+	decoderEOS = false;
+	primed = false;
+	running = true;
+	decodeThread = std::thread(&BufferedPcmSource::decodeLoop, this);
+	return OK;
+}
+
+status_t BufferedPcmSource::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(switchLock);
+		if (!running.exchange(false))
+			return OK;
+	}
+	switchCond.notify_all();
+	if (decodeThread.joinable())
+		decodeThread.join();
+	return decoder->stop();
+}
+
+sp<MetaData> BufferedPcmSource::getFormat()
+{
+	return format != NULL ? format : decoder->getFormat();
+}
+
+status_t BufferedPcmSource::switchTrack(const sp<MediaSource>& track, bool crossfade,
+                                        float gain)
+{
+	std::unique_lock<std::mutex> lock(switchLock);
+	pendingTrack = track;
+	pendingCrossfade = crossfade;
+	pendingTrackGain = gain;
+	switchPending = true;
+	switchCond.notify_all();
+	switchCond.wait(lock, [this] { return !switchPending || !running; });
+	return switchPending ? static_cast<status_t>(NO_INIT) : switchResult;
+}
+
+void BufferedPcmSource::setPaused(bool pause)
+{
+	std::lock_guard<std::mutex> lock(switchLock);
+	paused = pause;
+	switchCond.notify_all();
+}
+
+/*
+ * Copies the next fadeFrames of the outgoing track into fadeTail: what the
+ * reader has not played yet from the ring, the rest of the last decoded
+ * buffer, then fresh output from the decoder, which is still reading the
+ * old track. Run before the input is switched.
+ */
+void BufferedPcmSource::fillFadeTail()
+{
+	const uint64_t start = ring->readPosition();
+	const uint64_t end = ring->writePosition();
+	size_t filled = std::min<uint64_t>(end - start, fadeTail.size());
+	ring->peek(start, fadeTail.data(), filled);
+
+	size_t n = std::min(carry.size(), fadeTail.size() - filled);
+	memcpy(fadeTail.data() + filled, carry.data(), n);
+	filled += n;
+
+	while (filled < fadeTail.size() && running && !decoderEOS) {
+		MediaBuffer* buffer = NULL;
+		status_t err = decoder->read(&buffer);
+		if (err == INFO_FORMAT_CHANGED)
+			continue;
+		if (err != OK)
+			break;
+		n = std::min(buffer->range_length(), fadeTail.size() - filled);
+		memcpy(fadeTail.data() + filled,
+		       static_cast<const uint8_t*>(buffer->data()) + buffer->range_offset(), n);
+		filled += n;
+		buffer->release();
+	}
+
+	fadeTailBytes = filled / frameSize * frameSize;
+	fadeTailStart = start;
+	fadeMark = end;
+	trackStart.store(end, std::memory_order_release);
+	fadeState.store(kFadeReady, std::memory_order_release);
+}
+
+void BufferedPcmSource::applySwitch(MediaSource::ReadOptions* options)
+{
+	sp<MediaSource> track;
+	bool crossfade;
+	float gain;
+	{
+		std::lock_guard<std::mutex> lock(switchLock);
+		track = pendingTrack;
+		crossfade = pendingCrossfade;
+		gain = pendingTrackGain;
+	}
+
+	/* Start the new track first, so that a failure leaves the old one as is. */
+	status_t err = trackSource->prepareTrack(track);
+	if (err == OK) {
+		nextTrackGain = gain;
+		/*
+		 * Whatever is still queued belongs to the previous track. Hand it to
+		 * the reader to fade out if it is not still busy with an earlier
+		 * fade; otherwise drop it.
+		 */
+		if (crossfade && fadeFrames > 0 &&
+		    fadeState.load(std::memory_order_acquire) == kFadeIdle) {
+			fillFadeTail();
+		} else {
+			int ready = kFadeReady;
+			fadeState.compare_exchange_strong(ready, kFadeIdle);
+			ring->flush();
+			trackStart.store(ring->writePosition(), std::memory_order_release);
+			primed = false;
+		}
+		carry.clear();
+		err = trackSource->setTrack(track);
+	}
+
+	std::lock_guard<std::mutex> lock(switchLock);
+	pendingTrack.clear();
+	switchResult = err;
+	if (err != OK) {
+		LOG(ERROR) << "Could not start the next track (err=" << err << ")";
+	} else {
+		/* A seek makes OMXCodec flush both ports before reading again. */
+		options->setSeekTo(0);
+		decoderEOS = false;
+		resetStats();
+	}
+	switchPending = false;
+	switchCond.notify_all();
+}
+
+/*
+ * Sleeps until the reader has made room for bytes, or for a quarter of the
+ * ring if that is more, so that a full ring costs one wake-up per quarter
+ * instead of one per buffer read.
+ */
+void BufferedPcmSource::waitForSpace(size_t bytes)
+{
+	const size_t wanted = std::min(ring->capacity(),
+	                               std::max(bytes, ring->capacity() / 4));
+	std::unique_lock<std::mutex> lock(switchLock);
+	spaceWanted.store(wanted, std::memory_order_relaxed);
+	/* Pairs with the fence in read(): either it sees spaceWanted, or this
+	 * sees the room it made. */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	switchCond.wait(lock, [&] {
+		return ring->space() >= wanted || switchPending || !running;
+	});
+	spaceWanted.store(0, std::memory_order_relaxed);
+}
+
+/* Returns how many bytes were left unwritten because of a switch or stop. */
+size_t BufferedPcmSource::queue(const uint8_t* data, size_t bytes)
+{
+	while (bytes > 0 && running && !switchPending) {
+		size_t n = ring->write(data, bytes);
+		data += n;
+		bytes -= n;
+		if (n > 0)
+			primed.store(true, std::memory_order_release);
+		if (bytes > 0)
+			waitForSpace(bytes);
+	}
+	return bytes;
+}
+
+void BufferedPcmSource::decodeLoop()
+{
+	ReadOptions options;
+
+	while (running) {
+		if (switchPending)
+			applySwitch(&options);
+
+		if (decoderEOS || paused) {
+			std::unique_lock<std::mutex> lock(switchLock);
+			switchCond.wait(lock, [this] {
+				return switchPending || !running || (!decoderEOS && !paused);
+			});
+			continue;
+		}
+		/* Left over from a switch that did not go through. */
+		if (!carry.empty()) {
+			std::vector<uint8_t> rest;
+			rest.swap(carry);
+			size_t left = queue(rest.data(), rest.size());
+			carry.assign(rest.end() - left, rest.end());
+			continue;
+		}
+
+		MediaBuffer* buffer = NULL;
+		nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+		status_t err = decoder->read(&buffer, &options);
+		nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - begin;
+		options.clearSeekTo();
+		if (err == INFO_FORMAT_CHANGED)
+			continue;
+		if (err != OK) {
+			if (err != ERROR_END_OF_STREAM)
+				LOG(ERROR) << "Decoder read failed (err=" << err << ")";
+			decoderEOS = true;
+			continue;
+		}
+		/* Only this thread updates the decode counters. */
+		decodedFrames.store(decodedFrames.load(std::memory_order_relaxed) + 1,
+		                    std::memory_order_relaxed);
+		decodeNsTotal.store(decodeNsTotal.load(std::memory_order_relaxed) + elapsed,
+		                    std::memory_order_relaxed);
+		if (elapsed > decodeNsMax.load(std::memory_order_relaxed))
+			decodeNsMax.store(elapsed, std::memory_order_relaxed);
+		decodeTime->Record(ns2us(elapsed));
+
+		const uint8_t* data = static_cast<const uint8_t*>(buffer->data()) +
+		                      buffer->range_offset();
+		size_t left = queue(data, buffer->range_length());
+		/* Interrupted by a switch; a crossfade still wants the rest. */
+		if (left > 0)
+			carry.assign(data + buffer->range_length() - left,
+			             data + buffer->range_length());
+		buffer->release();
+	}
+}
+
+size_t BufferedPcmSource::readFrames(uint8_t* data, size_t bytes)
+{
+	return ring->read(data, std::min(ring->fill(), bytes) / frameSize * frameSize);
+}
+
+/* Reads from the ring and levels what it got with the track's gain. */
+size_t BufferedPcmSource::readTrack(uint8_t* data, size_t bytes)
+{
+	size_t got = readFrames(data, bytes);
+	const uint64_t start = trackStart.load(std::memory_order_acquire);
+	if (start != readerTrackStart && ring->readPosition() > start) {
+		/* A cut: the ring skipped to the new track's data. */
+		readerTrackGain = nextTrackGain.load(std::memory_order_relaxed);
+		readerTrackStart = start;
+	}
+	if (got > 0 && readerTrackGain != 1.0f)
+		dsp::applyGainRamp(reinterpret_cast<int16_t*>(data), got / sizeof(int16_t),
+		                   readerTrackGain, readerTrackGain);
+	return got;
+}
+
+/*
+ * Takes over the tail the decode thread gathered. Part of it may have been
+ * played from the ring meanwhile; the fade starts from where playback is.
+ */
+void BufferedPcmSource::beginCrossfade()
+{
+	int ready = kFadeReady;
+	if (!fadeState.compare_exchange_strong(ready, kFadeActive,
+	                                       std::memory_order_acquire))
+		return;
+	const uint64_t played = ring->readPosition() - fadeTailStart;
+	fadeOffset = std::min<uint64_t>(played, fadeTailBytes);
+	fadeTotal = (fadeTailBytes - fadeOffset) / frameSize;
+	fadeDone = 0;
+	/* The rest of the old track in the ring is in the tail too. */
+	ring->skipTo(fadeMark);
+	fadeOutGain = readerTrackGain;
+	readerTrackGain = nextTrackGain.load(std::memory_order_relaxed);
+	readerTrackStart = fadeMark;
+}
+
+/*
+ * Mixes the rest of the outgoing track from the tail with the start of the
+ * incoming one from the ring. Returns 0 once the fade is over.
+ */
+size_t BufferedPcmSource::readCrossfade(uint8_t* data, size_t bytes)
+{
+	/* A cut to yet another track ends the fade. */
+	const size_t frames = trackStart.load(std::memory_order_acquire) == readerTrackStart ?
+	                      std::min(bytes / frameSize, fadeTotal - fadeDone) : 0;
+	if (frames == 0) {
+		fadeState.store(kFadeIdle, std::memory_order_release);
+		return 0;
+	}
+
+	const size_t len = frames * frameSize;
+	const uint8_t* a = fadeTail.data() + fadeOffset + fadeDone * frameSize;
+	uint8_t* b = fadeScratch.data();
+	size_t nb = readFrames(b, len);
+	memset(b + nb, 0, len - nb);
+
+	float out0, in0, out1, in1;
+	dsp::crossfadeGains(static_cast<float>(fadeDone) / fadeTotal, &out0, &in0);
+	fadeDone += frames;
+	dsp::crossfadeGains(static_cast<float>(fadeDone) / fadeTotal, &out1, &in1);
+	dsp::mixCrossfade(reinterpret_cast<int16_t*>(data),
+	                  reinterpret_cast<const int16_t*>(a),
+	                  reinterpret_cast<const int16_t*>(b), len / sizeof(int16_t),
+	                  out0 * fadeOutGain, out1 * fadeOutGain,
+	                  in0 * readerTrackGain, in1 * readerTrackGain);
+	if (fadeDone >= fadeTotal)
+		fadeState.store(kFadeIdle, std::memory_order_release);
+	return len;
+}
+
+/* Ramps from the last applied gain towards the target at a bounded rate. */
+void BufferedPcmSource::applyGain(uint8_t* data, size_t bytes)
+{
+	const float target = targetGain.load(std::memory_order_relaxed);
+	if (currentGain == target && target == 1.0f)
+		return;
+	const float maxStep = static_cast<float>(bytes / frameSize) /
+	                      (kGainSlewSeconds * sampleRate);
+	const float next = std::min(currentGain + maxStep,
+	                            std::max(currentGain - maxStep, target));
+	dsp::applyGainRamp(reinterpret_cast<int16_t*>(data), bytes / sizeof(int16_t),
+	                   currentGain, next);
+	currentGain = next;
+}
+
+status_t BufferedPcmSource::read(MediaBuffer** out, const ReadOptions* options)
+{
+	*out = NULL;
+	MediaBuffer* buffer = NULL;
+	status_t err = group.acquire_buffer(&buffer);
+	if (err != OK)
+		return err;
+
+	/* Never wait for setEqualizer() here; pick the change up next time. */
+	if (eqDirty.load(std::memory_order_relaxed)) {
+		std::unique_lock<std::mutex> lock(eqLock, std::try_to_lock);
+		if (lock.owns_lock() && eqDirty.exchange(false))
+			equalizer->setGains(eqGains);
+	}
+
+	uint8_t* data = static_cast<uint8_t*>(buffer->data());
+	size_t want = kReadFrames * frameSize;
+	size_t got = 0;
+	if (fadeState.load(std::memory_order_acquire) == kFadeReady)
+		beginCrossfade();
+	if (fadeState.load(std::memory_order_relaxed) == kFadeActive)
+		got = readCrossfade(data, want);
+	if (got == 0)
+		got = readTrack(data, want);
+	if (got == 0) {
+		/* Keep the sink fed rather than letting AudioTrack starve. */
+		if (primed.load(std::memory_order_acquire) && !decoderEOS) {
+			underruns++;
+			underrunMetric->Increment();
+		}
+		memset(data, 0, want);
+		got = want;
+	} else {
+		if (firstAudioAt.load(std::memory_order_relaxed) == 0)
+			firstAudioAt = systemTime(SYSTEM_TIME_MONOTONIC);
+		equalizer->process(reinterpret_cast<int16_t*>(data), got / frameSize);
+		applyGain(data, got);
+	}
+
+	/* Wake the decode thread if it is waiting for room. */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const size_t wanted = spaceWanted.load(std::memory_order_relaxed);
+	if (wanted != 0 && ring->space() >= wanted) {
+		std::lock_guard<std::mutex> lock(switchLock);
+		switchCond.notify_all();
+	}
+
+	buffer->set_range(0, got);
+	buffer->meta_data()->setInt64(kKeyTime, framesRead * 1000000ll / sampleRate);
+	framesRead += got / frameSize;
+	*out = buffer;
+	return OK;
+}
+
+void BufferedPcmSource::setGain(float gain)
+{
+	targetGain = gain;
+}
+
+void BufferedPcmSource::setEqualizer(const float gainsDb[Equalizer::kBands])
+{
+	std::lock_guard<std::mutex> lock(eqLock);
+	for (int band = 0; band < Equalizer::kBands; band++)
+		eqGains[band] = gainsDb[band];
+	eqDirty = true;
+}
+
+void BufferedPcmSource::resetStats()
+{
+	decodedFrames = 0;
+	decodeNsTotal = 0;
+	decodeNsMax = 0;
+	firstAudioAt = 0;
+}
+
+BufferedPcmSource::DecodeStats BufferedPcmSource::decodeStats() const
+{
+	DecodeStats stats;
+	stats.frames = decodedFrames.load(std::memory_order_relaxed);
+	stats.totalNs = decodeNsTotal.load(std::memory_order_relaxed);
+	stats.maxNs = decodeNsMax.load(std::memory_order_relaxed);
+	stats.firstAudioAt = firstAudioAt.load(std::memory_order_relaxed);
+	return stats;
+}
+
+bool BufferedPcmSource::reachedEOS() const
+{
+	return decoderEOS && fadeState.load(std::memory_order_relaxed) == kFadeIdle &&
+	       ring->fill() == 0;
+}
+
+int BufferedPcmSource::fillPercent() const
+{
+	if (!ring)
+		return 0;
+	return static_cast<int>(ring->fill() * 100 / ring->capacity());
+}
+
+}
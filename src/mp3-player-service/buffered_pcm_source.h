@@ -0,0 +1,207 @@
+#ifndef MP3_PLAYER_SERVICE_BUFFERED_PCM_SOURCE_H_
+#define MP3_PLAYER_SERVICE_BUFFERED_PCM_SOURCE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <media/stagefright/MediaBufferGroup.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/Timers.h>
+
+#include "metrics.h"
+#include "pcm_dsp.h"
+#include "pcm_ring_buffer.h"
+#include "track_source.h"
+
+namespace mp3_player_service {
+
+/*
+ * Decouples decoding from audio output.
+ *
+ * A dedicated decode thread pulls PCM from the decoder and pushes it into a
+ * lock-free PcmRingBuffer holding up to bufferedUs of audio. AudioPlayer reads
+ * from this source, which only ever copies out of the ring, so a CPU spike
+ * elsewhere on the board eats into the buffer instead of the output. When the
+ * ring runs dry before the decoder has finished, the sink is fed silence and
+ * the underrun is counted. Reads before the first decoded audio of a track
+ * has reached the ring are the decoder starting up, not underruns.
+ *
+ * The source never reports end of stream to AudioPlayer, so the same codec
+ * and sink can carry on with the next track: switchTrack() swaps the
+ * compressed input under the decoder, flushes the codec with a seek and drops
+ * whatever was still buffered from the previous track.
+ *
+ * The decode thread sleeps on a condition variable while the ring is full or
+ * the source is paused; the reader only signals it once there is room for a
+ * good part of the ring, so a paused or steadily playing source does not
+ * keep waking the CPU.
+ *
+ * For a crossfade the decode thread first gathers the next crossfadeUs of
+ * the outgoing track into a separate tail buffer: what is still in the ring,
+ * then as much more as it takes from the decoder. It then switches the input
+ * and carries on into the ring with the new track, and the reader mixes the
+ * tail with the start of the new track. The ring itself stays at bufferedUs
+ * however long the fade is.
+ *
+ * The per-track loudness gain, the equalizer and the volume are all applied
+ * by the reader, after the ring, so that changes are heard within one
+ * buffer. Volume and equalizer changes ramp in to avoid clicks.
+ */
+class BufferedPcmSource : public android::MediaSource {
+public:
+	BufferedPcmSource(const android::sp<android::MediaSource>& decoder,
+	                  const android::sp<TrackSource>& trackSource,
+	                  int64_t bufferedUs, int64_t crossfadeUs);
+
+	android::status_t start(android::MetaData* params = NULL) override;
+	android::status_t stop() override;
+	android::sp<android::MetaData> getFormat() override;
+	android::status_t read(android::MediaBuffer** buffer,
+	                       const ReadOptions* options = NULL) override;
+
+	/*
+	 * Replaces the compressed track feeding the decoder. Blocks until the
+	 * decode thread has picked it up: one decoder read in progress plus
+	 * starting the new track. With crossfade set, the audio still buffered
+	 * from the current track is faded out under the new one instead of being
+	 * dropped, and whatever part of crossfadeUs the ring does not already
+	 * hold is decoded from the current track first, so the wait can grow by
+	 * up to that much decoding. trackGain is
+	 * the loudness correction for the new track. If the new track cannot be
+	 * started, the current one carries on and the error is returned.
+	 */
+	android::status_t switchTrack(const android::sp<android::MediaSource>& track,
+	                              bool crossfade, float trackGain);
+	/* Stops decoding ahead while the sink is paused. */
+	void setPaused(bool paused);
+	/* Loudness correction for the first track; call before start(). */
+	void setTrackGain(float gain) { readerTrackGain = gain; }
+	/* Linear output gain, 1.0 for unity. */
+	void setGain(float gain);
+	/* Equalizer band gains in dB, see Equalizer. */
+	void setEqualizer(const float gainsDb[Equalizer::kBands]);
+	/* True once the decoder has finished and the ring has drained. */
+	bool reachedEOS() const;
+
+	/* Percentage of the ring currently holding decoded audio. */
+	int fillPercent() const;
+	/* Number of reads that found the ring empty before end of stream. */
+	uint32_t underrunCount() const { return underruns.load(); }
+
+	/* Decoder timings since start() or the last switchTrack(). */
+	struct DecodeStats {
+		uint32_t frames;
+		nsecs_t totalNs;
+		nsecs_t maxNs;
+		/* When the first decoded audio was handed to the sink, or 0. */
+		nsecs_t firstAudioAt;
+	};
+	DecodeStats decodeStats() const;
+
+protected:
+	~BufferedPcmSource() override;
+
+private:
+	void decodeLoop();
+	void applySwitch(android::MediaSource::ReadOptions* options);
+	void fillFadeTail();
+	size_t queue(const uint8_t* data, size_t bytes);
+	void waitForSpace(size_t bytes);
+	void resetStats();
+	size_t readFrames(uint8_t* data, size_t bytes);
+	size_t readTrack(uint8_t* data, size_t bytes);
+	void beginCrossfade();
+	size_t readCrossfade(uint8_t* data, size_t bytes);
+	void applyGain(uint8_t* data, size_t bytes);
+
+	android::sp<android::MediaSource> decoder;
+	android::sp<TrackSource> trackSource;
+	android::sp<android::MetaData> format;
+	int64_t bufferedUs;
+	int64_t crossfadeUs;
+	int32_t sampleRate;
+	size_t frameSize;
+
+	std::unique_ptr<PcmRingBuffer> ring;
+	android::MediaBufferGroup group;
+	uint64_t framesRead;
+
+	/*
+	 * Crossfade hand-off. The decode thread fills fadeTail while fadeState is
+	 * kFadeIdle and publishes it with kFadeReady; the reader takes it over
+	 * with kFadeActive and hands it back with kFadeIdle once mixed in.
+	 */
+	enum { kFadeIdle, kFadeReady, kFadeActive };
+	std::atomic<int> fadeState;
+	size_t fadeFrames;
+	std::vector<uint8_t> fadeTail;
+	size_t fadeTailBytes;
+	/* Ring position of the first tail byte, and where the new track starts. */
+	uint64_t fadeTailStart;
+	uint64_t fadeMark;
+	/* What the decode thread had left of its last buffer when a switch came. */
+	std::vector<uint8_t> carry;
+
+	/* Reader state for the crossfade in progress. */
+	size_t fadeOffset;
+	size_t fadeTotal;
+	size_t fadeDone;
+	float fadeOutGain;
+	std::vector<uint8_t> fadeScratch;
+
+	/*
+	 * Loudness correction of the track starting at ring position trackStart,
+	 * published by the decode thread on every switch.
+	 */
+	std::atomic<float> nextTrackGain;
+	std::atomic<uint64_t> trackStart;
+	/* The reader's copy, for the track it is playing. */
+	float readerTrackGain;
+	uint64_t readerTrackStart;
+
+	std::atomic<float> targetGain;
+	/* Gain the reader applied at the end of the last buffer. */
+	float currentGain;
+
+	/* Equalizer settings are handed to the reader under eqLock. */
+	std::unique_ptr<Equalizer> equalizer;
+	std::mutex eqLock;
+	float eqGains[Equalizer::kBands];
+	std::atomic<bool> eqDirty;
+
+	std::thread decodeThread;
+	std::atomic<bool> running;
+	std::atomic<bool> decoderEOS;
+	/* Set once the current track's first audio is in the ring. */
+	std::atomic<bool> primed;
+	std::atomic<uint32_t> underruns;
+	std::atomic<uint32_t> decodedFrames;
+	std::atomic<nsecs_t> decodeNsTotal;
+	std::atomic<nsecs_t> decodeNsMax;
+	std::atomic<nsecs_t> firstAudioAt;
+	/* The same, for dumpsys, kept across tracks and pipelines. */
+	metrics::Histogram* decodeTime;
+	metrics::Counter* underrunMetric;
+
+	/* Hand-off of the next track to the decode thread. */
+	std::mutex switchLock;
+	std::condition_variable switchCond;
+	android::sp<android::MediaSource> pendingTrack;
+	bool pendingCrossfade;
+	float pendingTrackGain;
+	android::status_t switchResult;
+	std::atomic<bool> switchPending;
+	/* Also guarded by switchLock, and waited for on switchCond. */
+	std::atomic<bool> paused;
+	/* Room the decode thread is waiting for in the ring, or 0. */
+	std::atomic<size_t> spaceWanted;
+};
+
+}
+
+#endif
@@ -0,0 +1,355 @@
+#include "loudness_analyzer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace mp3_player_service {
+
+/* Frames handed to the meter per decoder read. */
+static const size_t kChunkFrames = 4096;
+/* Analysis threads run at this nice value, well below playback. */
+static const int kWorkerNice = 10;
+/* Gating thresholds from EBU R128. */
+static const double kAbsoluteGate = -70.0;
+static const double kRelativeGate = -10.0;
+/* Limits on the gain applied to any one track, in dB. */
+static const double kMaxBoostDb = 12.0;
+static const double kMaxCutDb = -24.0;
+
+const double LoudnessAnalyzer::kReferenceLoudness = -18.0;
+
+static double blockLoudness(double power)
+{
+	return -0.691 + 10.0 * log10(power);
+}
+
+LoudnessMeter::LoudnessMeter(int sampleRate, int channels)
+	: stride(channels),
+	  channels(std::min<int>(channels, kMaxChannels)),
+	  stepFrames(sampleRate / 10),
+	  stepFill(0),
+	  stepEnergy(0),
+	  peakSample(0)
+{
+	/* BS.1770 pre-filter, re-derived for the actual sample rate. */
+	double K = tan(M_PI * 1681.974450955533 / sampleRate);
+	double Q = 0.7071752369554196;
+	double Vh = pow(10.0, 3.999843853973347 / 20.0);
+	double Vb = pow(Vh, 0.4996667741545416);
+	double a0 = 1.0 + K / Q + K * K;
+	shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+	shelf.b1 = 2.0 * (K * K - Vh) / a0;
+	shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+	shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+	shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+	/* RLB high pass. */
+	K = tan(M_PI * 38.13547087602444 / sampleRate);
+	Q = 0.5003270373238773;
+	a0 = 1.0 + K / Q + K * K;
+	highPass.b0 = 1.0;
+	highPass.b1 = -2.0;
+	highPass.b2 = 1.0;
+	highPass.a1 = 2.0 * (K * K - 1.0) / a0;
+	highPass.a2 = (1.0 - K / Q + K * K) / a0;
+
+	memset(z, 0, sizeof(z));
+}
+
+void LoudnessMeter::process(const int16_t* samples, size_t frames)
+{
+	for (size_t f = 0; f < frames; f++) {
+		for (int c = 0; c < channels; c++) {
+			int s = samples[f * stride + c];
+			peakSample = std::max(peakSample, s < 0 ? -s : s);
+
+			double x = s / 32768.0;
+			const Biquad* stages[2] = { &shelf, &highPass };
+			for (int i = 0; i < 2; i++) {
+				const Biquad& b = *stages[i];
+				double y = b.b0 * x + z[i][0][c];
+				z[i][0][c] = b.b1 * x - b.a1 * y + z[i][1][c];
+				z[i][1][c] = b.b2 * x - b.a2 * y;
+				x = y;
+			}
+			/* Left, right and centre all weigh 1.0; surrounds do not occur in mp3. */
+			stepEnergy += x * x;
+		}
+		if (++stepFill == stepFrames) {
+			steps.push_back(stepEnergy / stepFrames);
+			stepEnergy = 0;
+			stepFill = 0;
+			/* 400 ms blocks overlapping by 75%. */
+			if (steps.size() >= 4) {
+				const double* last = &steps[steps.size() - 4];
+				blocks.push_back((last[0] + last[1] + last[2] + last[3]) / 4);
+			}
+		}
+	}
+}
+
+double LoudnessMeter::integratedLoudness() const
+{
+	double sum = 0;
+	size_t count = 0;
+	for (double power : blocks) {
+		if (power > 0 && blockLoudness(power) > kAbsoluteGate) {
+			sum += power;
+			count++;
+		}
+	}
+	if (count == 0)
+		return kAbsoluteGate;
+
+	const double threshold = blockLoudness(sum / count) + kRelativeGate;
+	double gatedSum = 0;
+	size_t gatedCount = 0;
+	for (double power : blocks) {
+		if (power > 0 && blockLoudness(power) > kAbsoluteGate &&
+		    blockLoudness(power) > threshold) {
+			gatedSum += power;
+			gatedCount++;
+		}
+	}
+	return gatedCount > 0 ? blockLoudness(gatedSum / gatedCount) : kAbsoluteGate;
+}
+
+LoudnessAnalyzer::LoudnessAnalyzer(const std::string& folder,
+                                   const std::string& indexPath,
+                                   const DecoderFactory& factory)
+	: folder(folder),
+	  indexPath(indexPath),
+	  factory(factory),
+	  indexLines(0),
+	  nextWork(0),
+	  analyzed(0),
+	  failed(0),
+	  stopping(false),
+	  running(0)
+{
+	loadIndex();
+}
+
+LoudnessAnalyzer::~LoudnessAnalyzer()
+{
+	stop();
+}
+
+void LoudnessAnalyzer::start(const std::vector<std::string>& files, int threads)
+{
+	stop();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		work.clear();
+		for (const std::string& file : files) {
+			struct stat st;
+			if (stat((folder + "/" + file).c_str(), &st) != 0)
+				continue;
+			auto it = index.find(file);
+			if (it != index.end() && it->second.size == st.st_size &&
+			    it->second.mtime == st.st_mtime)
+				continue;
+			Entry entry = { st.st_size, st.st_mtime, 0, 0 };
+			work.push_back(std::make_pair(file, entry));
+		}
+		/*
+		 * An interrupted pass leaves superseded lines, and perhaps a torn
+		 * last line, behind; drop them before appending anything new.
+		 */
+		if (indexLines > index.size())
+			saveIndex();
+	}
+	nextWork = 0;
+	analyzed = 0;
+	failed = 0;
+	stopping = false;
+	if (work.empty())
+		return;
+
+	if (threads <= 0)
+		threads = std::max<int>(1, std::thread::hardware_concurrency() - 1);
+	threads = std::min<int>(threads, work.size());
+	running = threads;
+	LOG(INFO) << "Analyzing loudness of " << work.size() << " tracks on "
+	          << threads << " threads";
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(&LoudnessAnalyzer::worker, this);
+}
+
+void LoudnessAnalyzer::stop()
+{
+	stopping = true;
+	wait();
+}
+
+void LoudnessAnalyzer::wait()
+{
+	for (auto& t : workers)
+		t.join();
+	workers.clear();
+}
+
+void LoudnessAnalyzer::worker()
+{
+	/* On Linux a nice value set through the thread id affects only this thread. */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), kWorkerNice);
+
+	std::unique_ptr<TrackDecoder> decoder = factory();
+	while (!stopping) {
+		const size_t i = nextWork++;
+		if (i >= work.size())
+			break;
+
+		Entry entry = work[i].second;
+		if (!analyze(decoder.get(), work[i].first, &entry)) {
+			if (!stopping) {
+				LOG(WARNING) << "Could not analyze " << work[i].first;
+				failed++;
+			}
+			continue;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		index[work[i].first] = entry;
+		appendIndex(work[i].first, entry);
+		analyzed++;
+	}
+
+	if (--running == 0) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (indexLines > index.size())
+			saveIndex();
+	}
+}
+
+bool LoudnessAnalyzer::analyze(TrackDecoder* decoder, const std::string& file,
+                               Entry* entry)
+{
+	int sampleRate = 0, channels = 0;
+	if (!decoder->open(folder + "/" + file, &sampleRate, &channels) ||
+	    sampleRate <= 0 || channels <= 0)
+		return false;
+
+	LoudnessMeter meter(sampleRate, channels);
+	std::vector<int16_t> samples(kChunkFrames * channels);
+	size_t frames;
+	while ((frames = decoder->read(samples.data(), kChunkFrames)) > 0) {
+		if (stopping)
+			return false;
+		meter.process(samples.data(), frames);
+	}
+	entry->loudness = meter.integratedLoudness();
+	entry->peak = meter.peak();
+	return true;
+}
+
+float LoudnessAnalyzer::trackGain(const std::string& file) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = index.find(file);
+	if (it == index.end() || it->second.loudness <= kAbsoluteGate)
+		return 1.0f;
+
+	double gainDb = kReferenceLoudness - it->second.loudness;
+	/* Never push the loudest sample past full scale. */
+	if (it->second.peak > 0)
+		gainDb = std::min(gainDb, -20.0 * log10(it->second.peak));
+	gainDb = std::max(kMaxCutDb, std::min(kMaxBoostDb, gainDb));
+	return static_cast<float>(pow(10.0, gainDb / 20.0));
+}
+
+LoudnessAnalyzer::Progress LoudnessAnalyzer::progress() const
+{
+	Progress p;
+	p.analyzed = analyzed;
+	p.failed = failed;
+	/* start() may still be filling the queue. */
+	std::lock_guard<std::mutex> guard(lock);
+	p.queued = work.size();
+	p.indexed = index.size();
+	return p;
+}
+
+/* One line per track: size, mtime, loudness, peak, then the file name. */
+void LoudnessAnalyzer::loadIndex()
+{
+	FILE* f = fopen(indexPath.c_str(), "r");
+	if (!f)
+		return;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		indexLines++;
+		/* Only the last line can be torn by a crash mid-append. */
+		if (!strchr(line, '\n'))
+			continue;
+		long long size, mtime;
+		double loudness;
+		float peak;
+		int consumed = 0;
+		if (sscanf(line, "%lld %lld %lf %f %n", &size, &mtime, &loudness, &peak,
+		           &consumed) != 4 || consumed == 0)
+			continue;
+		std::string name(line + consumed);
+		while (!name.empty() && (name.back() == '\n' || name.back() == '\r'))
+			name.pop_back();
+		if (name.empty())
+			continue;
+		Entry entry = { static_cast<off_t>(size), static_cast<time_t>(mtime),
+		                loudness, peak };
+		/* Later lines were appended later and win. */
+		index[name] = entry;
+	}
+	fclose(f);
+	LOG(INFO) << "Loaded loudness for " << index.size() << " tracks";
+}
+
+static void writeEntry(FILE* f, const std::string& file, off_t size,
+                       time_t mtime, double loudness, float peak)
+{
+	fprintf(f, "%lld %lld %.2f %.6f %s\n", static_cast<long long>(size),
+	        static_cast<long long>(mtime), loudness, peak, file.c_str());
+}
+
+/* Called with lock held. */
+void LoudnessAnalyzer::appendIndex(const std::string& file, const Entry& entry)
+{
+	FILE* f = fopen(indexPath.c_str(), "a");
+	if (!f) {
+		PLOG(ERROR) << "Unable to write " << indexPath;
+		return;
+	}
+	writeEntry(f, file, entry.size, entry.mtime, entry.loudness, entry.peak);
+	if (fclose(f) != 0)
+		PLOG(ERROR) << "Unable to update " << indexPath;
+	else
+		indexLines++;
+}
+
+/* Called with lock held. Written to a temporary and renamed into place. */
+void LoudnessAnalyzer::saveIndex()
+{
+	const std::string tmp = indexPath + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		PLOG(ERROR) << "Unable to write " << tmp;
+		return;
+	}
+	for (const auto& it : index)
+		writeEntry(f, it.first, it.second.size, it.second.mtime,
+		           it.second.loudness, it.second.peak);
+	if (fclose(f) != 0 || rename(tmp.c_str(), indexPath.c_str()) != 0)
+		PLOG(ERROR) << "Unable to update " << indexPath;
+	else
+		indexLines = index.size();
+}
+
+}
@@ -0,0 +1,147 @@
+#ifndef MP3_PLAYER_SERVICE_LOUDNESS_ANALYZER_H_
+#define MP3_PLAYER_SERVICE_LOUDNESS_ANALYZER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mp3_player_service {
+
+/*
+ * Integrated loudness (ITU-R BS.1770, EBU R128 gating) and sample peak of
+ * one track. Feed it the whole track with process(), then read the results.
+ */
+class LoudnessMeter {
+public:
+	LoudnessMeter(int sampleRate, int channels);
+
+	void process(const int16_t* samples, size_t frames);
+	/* In LUFS; -70 or less for a silent track. */
+	double integratedLoudness() const;
+	/* Largest absolute sample, 1.0 being full scale. */
+	float peak() const { return peakSample / 32768.0f; }
+
+private:
+	enum { kMaxChannels = 8 };
+	struct Biquad {
+		double b0, b1, b2, a1, a2;
+	};
+
+	/* Interleaved channels in the input, and how many of them we measure. */
+	int stride;
+	int channels;
+	/* K-weighting: a high shelf followed by a high pass. */
+	Biquad shelf;
+	Biquad highPass;
+	double z[2][2][kMaxChannels];
+	/* Energy is summed over 100 ms steps; four steps make a gating block. */
+	size_t stepFrames;
+	size_t stepFill;
+	double stepEnergy;
+	std::vector<double> steps;
+	std::vector<double> blocks;
+	int peakSample;
+};
+
+/*
+ * Turns a library file into PCM for the analyzer. One instance is used per
+ * worker thread, for one track at a time.
+ */
+class TrackDecoder {
+public:
+	virtual ~TrackDecoder() {}
+	virtual bool open(const std::string& path, int* sampleRate, int* channels) = 0;
+	/* Returns the number of frames decoded, 0 at the end of the track. */
+	virtual size_t read(int16_t* samples, size_t maxFrames) = 0;
+};
+
+/*
+ * Works out ReplayGain-style loudness for the soundtrack library ahead of
+ * playback.
+ *
+ * Tracks are decoded and measured on a small pool of niced threads, so the
+ * analysis only uses otherwise idle cores. Every result is appended to an
+ * index file as soon as it is measured, and the file is rewritten without the
+ * superseded lines once at the end of the pass. Entries are keyed by file name
+ * and checked against size and mtime, so an interrupted pass picks up where it
+ * left off and only changed files are measured again. Playback looks gains up
+ * in the in-memory copy of the index and never waits on the analysis.
+ */
+class LoudnessAnalyzer {
+public:
+	typedef std::function<std::unique_ptr<TrackDecoder>()> DecoderFactory;
+
+	struct Progress {
+		size_t queued;
+		size_t analyzed;
+		size_t failed;
+		size_t indexed;
+	};
+
+	LoudnessAnalyzer(const std::string& folder, const std::string& indexPath,
+	                 const DecoderFactory& factory);
+	~LoudnessAnalyzer();
+
+	/*
+	 * Measures the given library files that are not already indexed. threads
+	 * <= 0 uses one thread per core beyond the first.
+	 */
+	void start(const std::vector<std::string>& files, int threads);
+	/* Abandons the pass; finished tracks stay in the index. */
+	void stop();
+	/* Blocks until the current pass is done. */
+	void wait();
+
+	/* Linear gain bringing a file to the reference loudness, 1.0 if unknown. */
+	float trackGain(const std::string& file) const;
+	Progress progress() const;
+
+	/* ReplayGain 2.0 reference level. */
+	static const double kReferenceLoudness;
+
+private:
+	struct Entry {
+		off_t size;
+		time_t mtime;
+		double loudness;
+		float peak;
+	};
+
+	void worker();
+	bool analyze(TrackDecoder* decoder, const std::string& file, Entry* entry);
+	void loadIndex();
+	void appendIndex(const std::string& file, const Entry& entry);
+	void saveIndex();
+
+	std::string folder;
+	std::string indexPath;
+	DecoderFactory factory;
+
+	mutable std::mutex lock;
+	std::map<std::string, Entry> index;
+	/* Lines in the index file; more than index.size() means it needs compacting. */
+	size_t indexLines;
+
+	std::vector<std::pair<std::string, Entry>> work;
+	std::atomic<size_t> nextWork;
+	std::atomic<size_t> analyzed;
+	std::atomic<size_t> failed;
+	std::atomic<bool> stopping;
+	/* The last worker out compacts the index. */
+	std::atomic<int> running;
+	std::vector<std::thread> workers;
+};
+
+}
+
+#endif
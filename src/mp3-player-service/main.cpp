@@ -0,0 +1,14 @@
+#include <brillo/flag_helper.h>
+#include <brillo/syslog_logging.h>
+
+#include "mp3-player-service.h"
+#include "service_module.h"
+
+int main(int argc, char* argv[])
+{
+	brillo::FlagHelper::Init(argc, argv, "MP3 player service");
+	brillo::InitLog(brillo::kLogToSyslog | brillo::kLogHeader);
+	service_hub::ModuleDaemon daemon;
+	daemon.AddModule(mp3_player_service::CreateModule());
+	return daemon.Run();
+}
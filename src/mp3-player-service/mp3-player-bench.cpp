@@ -0,0 +1,421 @@
+/*
+ * Host benchmarks for the mp3 player service building blocks.
+ *
+ *   mp3-player-bench stream [clients] [file_mb] [seconds]
+ *     Serves a scratch library over loopback with StreamServer and has N
+ *     parallel clients issue random byte-range GETs against it.
+ *
+ *   mp3-player-bench dsp [audio_seconds]
+ *     Runs the playback DSP stage (equalizer, gain ramp and crossfade) over
+ *     synthetic 48 kHz stereo PCM in AudioPlayer-sized blocks and reports
+ *     the cost as a share of one core in real time.
+ *
+ *   mp3-player-bench loudness [tracks] [track_seconds] [max_threads]
+ *     Runs LoudnessAnalyzer over a scratch library of synthetic tracks with
+ *     1, 2, 4 ... max_threads workers, then once more to check that an
+ *     up-to-date index is not analyzed again.
+ *
+ *   mp3-player-bench search [tracks] [queries]
+ *     Builds a TrackIndex over synthetic tags in batches, as the library
+ *     scan does, then times one- and two-word prefix queries.
+ */
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "loudness_analyzer.h"
+#include "pcm_dsp.h"
+#include "stream_server.h"
+#include "track_index.h"
+
+using mp3_player_service::Equalizer;
+using mp3_player_service::LoudnessAnalyzer;
+using mp3_player_service::TrackDecoder;
+using mp3_player_service::TrackIndex;
+using mp3_player_service::StreamServer;
+namespace dsp = mp3_player_service::dsp;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point begin)
+{
+	return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+/* Reads one response; returns the body size or -1 on error. */
+long long readResponse(int fd, std::vector<char>* scratch)
+{
+	std::string head;
+	char c;
+	while (head.size() < 4 || head.compare(head.size() - 4, 4, "\r\n\r\n") != 0) {
+		if (recv(fd, &c, 1, 0) != 1)
+			return -1;
+		head.push_back(c);
+	}
+	if (head.compare(0, 12, "HTTP/1.1 206") != 0 &&
+	    head.compare(0, 12, "HTTP/1.1 200") != 0)
+		return -1;
+	size_t pos = head.find("Content-Length: ");
+	if (pos == std::string::npos)
+		return -1;
+	long long length = atoll(head.c_str() + pos + 16);
+	long long left = length;
+	while (left > 0) {
+		ssize_t n = recv(fd, scratch->data(),
+		                 std::min<long long>(left, scratch->size()), 0);
+		if (n <= 0)
+			return -1;
+		left -= n;
+	}
+	return length;
+}
+
+int benchStream(int clients, int fileMb, int seconds)
+{
+	char dir[] = "/tmp/mp3-bench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string path = std::string(dir) + "/bench.mp3";
+	const long long fileSize = static_cast<long long>(fileMb) << 20;
+	FILE* f = fopen(path.c_str(), "w");
+	std::vector<char> block(1 << 20, 'x');
+	for (int i = 0; i < fileMb; i++)
+		fwrite(block.data(), 1, block.size(), f);
+	fclose(f);
+
+	StreamServer server(dir, 0, true);
+	if (!server.start())
+		return 1;
+
+	std::atomic<bool> done(false);
+	std::atomic<long long> bytes(0), requests(0), errors(0);
+	std::vector<std::thread> threads;
+	Clock::time_point begin = Clock::now();
+	for (int i = 0; i < clients; i++) {
+		threads.emplace_back([&, i] {
+			std::mt19937 rng(i);
+			std::vector<char> scratch(256 << 10);
+			int fd = socket(AF_INET, SOCK_STREAM, 0);
+			sockaddr_in addr = {};
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(server.port());
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+				errors++;
+				close(fd);
+				return;
+			}
+			while (!done) {
+				/* Ranges of 64 KiB .. 4 MiB, like a player seeking around. */
+				long long length = std::min<long long>(
+					fileSize, (64 << 10) << (rng() % 7));
+				long long first = rng() % (fileSize - length + 1);
+				char request[256];
+				int n = snprintf(request, sizeof(request),
+				                 "GET /bench.mp3 HTTP/1.1\r\nHost: bench\r\n"
+				                 "Range: bytes=%lld-%lld\r\n\r\n",
+				                 first, first + length - 1);
+				if (send(fd, request, n, 0) != n ||
+				    readResponse(fd, &scratch) != length) {
+					errors++;
+					break;
+				}
+				bytes += length;
+				requests++;
+			}
+			close(fd);
+		});
+	}
+	sleep(seconds);
+	done = true;
+	for (auto& t : threads)
+		t.join();
+	double elapsed = secondsSince(begin);
+
+	StreamServer::Stats stats = server.stats();
+	server.stop();
+	unlink(path.c_str());
+	rmdir(dir);
+
+	printf("{\"bench\": \"stream\", \"clients\": %d, \"file_mb\": %d, "
+	       "\"seconds\": %.2f, \"requests\": %lld, \"errors\": %lld, "
+	       "\"mb_per_s\": %.1f, \"requests_per_s\": %.1f, "
+	       "\"server_connections\": %llu}\n",
+	       clients, fileMb, elapsed, requests.load(), errors.load(),
+	       bytes.load() / elapsed / (1 << 20), requests.load() / elapsed,
+	       static_cast<unsigned long long>(stats.connections));
+	return errors.load() == 0 ? 0 : 1;
+}
+
+int benchDsp(int audioSeconds)
+{
+	const int kRate = 48000;
+	const int kChannels = 2;
+	const size_t kFrames = 1024;
+	const size_t kSamples = kFrames * kChannels;
+	const size_t blocks = static_cast<size_t>(audioSeconds) * kRate / kFrames;
+
+	/* Two tones at roughly -6 dBFS standing in for the two tracks. */
+	std::vector<int16_t> a(kSamples), b(kSamples), out(kSamples);
+	for (size_t i = 0; i < kFrames; i++) {
+		for (int c = 0; c < kChannels; c++) {
+			a[i * kChannels + c] = 16000 * sin(2 * M_PI * 440 * i / kRate);
+			b[i * kChannels + c] = 16000 * sin(2 * M_PI * 660 * i / kRate);
+		}
+	}
+	std::vector<int16_t> work(a);
+
+	Equalizer eq(kRate, kChannels);
+	const float gains[Equalizer::kBands] = { 6.0f, -3.0f, 4.0f };
+	eq.setGains(gains);
+
+	double eqSeconds = 0, gainSeconds = 0, fadeSeconds = 0;
+	long long checksum = 0;
+	for (size_t i = 0; i < blocks; i++) {
+		memcpy(work.data(), a.data(), kSamples * sizeof(int16_t));
+
+		Clock::time_point t0 = Clock::now();
+		eq.process(work.data(), kFrames);
+		Clock::time_point t1 = Clock::now();
+		/* Keep the gain moving so the ramp is never the trivial case. */
+		float g0 = 0.5f + 0.25f * ((i & 1) != 0);
+		dsp::applyGainRamp(work.data(), kSamples, g0, 1.25f - g0);
+		Clock::time_point t2 = Clock::now();
+		float out0, in0, out1, in1;
+		dsp::crossfadeGains(static_cast<float>(i % 64) / 64, &out0, &in0);
+		dsp::crossfadeGains(static_cast<float>(i % 64 + 1) / 64, &out1, &in1);
+		dsp::mixCrossfade(out.data(), work.data(), b.data(), kSamples,
+		                  out0, out1, in0, in1);
+		Clock::time_point t3 = Clock::now();
+
+		eqSeconds += std::chrono::duration<double>(t1 - t0).count();
+		gainSeconds += std::chrono::duration<double>(t2 - t1).count();
+		fadeSeconds += std::chrono::duration<double>(t3 - t2).count();
+		checksum += out[i % kSamples];
+	}
+
+	const double audio = static_cast<double>(blocks) * kFrames / kRate;
+	const double total = eqSeconds + gainSeconds + fadeSeconds;
+	printf("{\"bench\": \"dsp\", \"simd\": \"%s\", \"rate\": %d, "
+	       "\"channels\": %d, \"audio_seconds\": %.1f, "
+	       "\"eq_cpu_percent\": %.4f, \"gain_cpu_percent\": %.4f, "
+	       "\"crossfade_cpu_percent\": %.4f, \"total_cpu_percent\": %.4f, "
+	       "\"checksum\": %lld}\n",
+	       dsp::simdName(), kRate, kChannels, audio,
+	       100 * eqSeconds / audio, 100 * gainSeconds / audio,
+	       100 * fadeSeconds / audio, 100 * total / audio, checksum);
+	return 0;
+}
+
+/*
+ * Stands in for the mp3 decoder: 44.1 kHz stereo noise whose level depends
+ * on the file name, so each track ends up with a different gain.
+ */
+class SyntheticDecoder : public TrackDecoder {
+public:
+	explicit SyntheticDecoder(int seconds) : seconds(seconds), left(0), rng(0), level(0) {}
+
+	bool open(const std::string& path, int* sampleRate, int* channels) override
+	{
+		*sampleRate = kRate;
+		*channels = 2;
+		left = static_cast<size_t>(seconds) * kRate;
+		rng.seed(std::hash<std::string>()(path));
+		level = 1000 + rng() % 20000;
+		return true;
+	}
+
+	size_t read(int16_t* samples, size_t maxFrames) override
+	{
+		size_t frames = std::min(left, maxFrames);
+		std::uniform_int_distribution<int> noise(-level, level);
+		for (size_t i = 0; i < frames * 2; i++)
+			samples[i] = noise(rng);
+		left -= frames;
+		return frames;
+	}
+
+private:
+	static const int kRate = 44100;
+	int seconds;
+	size_t left;
+	std::minstd_rand rng;
+	int level;
+};
+
+int benchLoudness(int tracks, int trackSeconds, int maxThreads)
+{
+	char dir[] = "/tmp/mp3-bench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::vector<std::string> files;
+	for (int i = 0; i < tracks; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "track%03d.mp3", i);
+		files.push_back(name);
+		FILE* f = fopen((std::string(dir) + "/" + name).c_str(), "w");
+		fclose(f);
+	}
+	const std::string indexPath = std::string(dir) + "/.loudness";
+	LoudnessAnalyzer::DecoderFactory factory = [trackSeconds] {
+		return std::unique_ptr<TrackDecoder>(new SyntheticDecoder(trackSeconds));
+	};
+
+	printf("{\"bench\": \"loudness\", \"tracks\": %d, \"track_seconds\": %d, "
+	       "\"cores\": %u, \"runs\": [", tracks, trackSeconds,
+	       std::thread::hardware_concurrency());
+	double base = 0;
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		unlink(indexPath.c_str());
+		LoudnessAnalyzer analyzer(dir, indexPath, factory);
+		Clock::time_point begin = Clock::now();
+		analyzer.start(files, threads);
+		analyzer.wait();
+		double elapsed = secondsSince(begin);
+		if (threads == 1)
+			base = elapsed;
+		printf("%s{\"threads\": %d, \"seconds\": %.3f, \"tracks_per_s\": %.2f, "
+		       "\"x_realtime\": %.0f, \"speedup\": %.2f}",
+		       threads == 1 ? "" : ", ", threads, elapsed, tracks / elapsed,
+		       static_cast<double>(tracks) * trackSeconds / elapsed, base / elapsed);
+	}
+
+	/* A fresh analyzer over the same index should find nothing to do. */
+	LoudnessAnalyzer resumed(dir, indexPath, factory);
+	resumed.start(files, maxThreads);
+	resumed.wait();
+	LoudnessAnalyzer::Progress progress = resumed.progress();
+	printf("], \"indexed\": %zu, \"reanalyzed\": %zu, \"gain_track000\": %.3f}\n",
+	       progress.indexed, progress.queued, resumed.trackGain(files[0]));
+
+	for (const std::string& file : files)
+		unlink((std::string(dir) + "/" + file).c_str());
+	unlink(indexPath.c_str());
+	rmdir(dir);
+	return progress.queued == 0 && progress.indexed == files.size() ? 0 : 1;
+}
+
+int benchSearch(int tracks, int queries)
+{
+	static const char* const kSyllables[] = {
+		"ka", "lo", "mi", "ren", "sa", "to", "vel", "an", "dor", "is",
+		"que", "bra", "el", "fin", "go", "hu", "jo", "ny", "ox", "zu",
+	};
+	const size_t kSyllableCount = sizeof(kSyllables) / sizeof(kSyllables[0]);
+	std::mt19937 rng(1);
+	auto word = [&] {
+		std::string w;
+		for (int n = 2 + rng() % 3; n > 0; n--)
+			w += kSyllables[rng() % kSyllableCount];
+		return w;
+	};
+	auto phrase = [&](int words) {
+		std::string p = word();
+		while (--words > 0)
+			p += " " + word();
+		return p;
+	};
+	/* A few hundred artists with a handful of albums each, as in a real library. */
+	std::vector<std::string> artists, albums;
+	for (int i = 0; i < std::max(1, tracks / 40); i++)
+		artists.push_back(phrase(1 + rng() % 2));
+	for (int i = 0; i < std::max(1, tracks / 10); i++)
+		albums.push_back(phrase(1 + rng() % 3));
+
+	TrackIndex index;
+	std::vector<std::string> titles;
+	Clock::time_point begin = Clock::now();
+	for (int i = 0; i < tracks; i++) {
+		titles.push_back(phrase(1 + rng() % 4));
+		index.add(i, titles.back(), artists[i % artists.size()], albums[i % albums.size()]);
+		if (i % 32 == 31)
+			index.commit();
+	}
+	index.commit();
+	double buildSeconds = secondsSince(begin);
+
+	/* Queries are prefixes of words that exist, 2 to 5 characters long. */
+	std::vector<std::string> patterns;
+	for (int i = 0; i < 1024; i++) {
+		std::string w = titles[rng() % titles.size()];
+		w = w.substr(0, w.find(' '));
+		std::string q = w.substr(0, 2 + rng() % 4);
+		if (i % 2) {
+			std::string a = artists[rng() % artists.size()];
+			q += " " + a.substr(0, 3);
+		}
+		patterns.push_back(q);
+	}
+	size_t hits = 0;
+	std::vector<double> latencies;
+	latencies.reserve(queries);
+	for (int i = 0; i < queries; i++) {
+		Clock::time_point t0 = Clock::now();
+		hits += index.search(patterns[i % patterns.size()], 50).size();
+		latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+	}
+	std::sort(latencies.begin(), latencies.end());
+	double total = 0;
+	for (double l : latencies)
+		total += l;
+
+	printf("{\"bench\": \"search\", \"tracks\": %d, \"build_ms\": %.1f, "
+	       "\"index_kb\": %zu, \"queries\": %d, \"mean_us\": %.2f, "
+	       "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, "
+	       "\"mean_hits\": %.1f}\n",
+	       tracks, buildSeconds * 1000, index.memoryBytes() / 1024, queries,
+	       total / queries, latencies[queries / 2], latencies[queries * 99 / 100],
+	       latencies.back(), static_cast<double>(hits) / queries);
+	return 0;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		printf("Usage: mp3-player-bench <mode> [args...]\n");
+		printf(" Modes:\n");
+		printf("  stream [clients=8] [file_mb=64] [seconds=5]\n");
+		printf("  dsp [audio_seconds=600]\n");
+		printf("  loudness [tracks=32] [track_seconds=60] [max_threads=cores]\n");
+		printf("  search [tracks=10000] [queries=100000]\n");
+		return 1;
+	}
+	std::string mode = argv[1];
+	if (mode == "stream")
+		return benchStream(argc > 2 ? atoi(argv[2]) : 8,
+		                   argc > 3 ? atoi(argv[3]) : 64,
+		                   argc > 4 ? atoi(argv[4]) : 5);
+	if (mode == "dsp")
+		return benchDsp(argc > 2 ? atoi(argv[2]) : 600);
+	if (mode == "search")
+		return benchSearch(std::max(1, argc > 2 ? atoi(argv[2]) : 10000),
+		                   std::max(1, argc > 3 ? atoi(argv[3]) : 100000));
+	if (mode == "loudness")
+		return benchLoudness(argc > 2 ? atoi(argv[2]) : 32,
+		                     argc > 3 ? atoi(argv[3]) : 60,
+		                     argc > 4 ? atoi(argv[4])
+		                              : std::max(1u, std::thread::hardware_concurrency()));
+	fprintf(stderr, "Unknown mode '%s'\n", mode.c_str());
+	return 1;
+}
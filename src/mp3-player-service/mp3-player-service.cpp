@@ -2,14 +2,22 @@
 #include <dirent.h>
 #include <sysexits.h>
 
+#include <algorithm>
+#include <future>
+#include <mutex>
+
 #include <base/logging.h>
-#include <base/command_line.h>
 #include <base/macros.h>
 #include <base/bind.h>
-#include <binderwrapper/binder_wrapper.h>
-#include <brillo/binder_watcher.h>
-#include <brillo/daemons/daemon.h>
-#include <brillo/syslog_logging.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/strings/stringprintf.h>
+#include <base/thread_task_runner_handle.h>
+#include <base/threading/thread.h>
+#include <base/time/time.h>
+#include <brillo/flag_helper.h>
+#include <brillo/message_loops/message_loop.h>
+#include <libweaved/service.h>
 #include <media/stagefright/AudioPlayer.h>
 #include <media/stagefright/DataSource.h>
 #include <media/stagefright/FileSource.h>
@@ -21,44 +29,192 @@
 #include <include/MP3Extractor.h>
 
 #include "brillo/demo/BnMp3PlayerService.h"
+#include "buffered_pcm_source.h"
+#include "loudness_analyzer.h"
+#include "metrics.h"
 #include "mp3-player-service.h"
+#include "playback_metrics.h"
+#include "service_module.h"
+#include "stagefright_track_decoder.h"
+#include "stream_server.h"
+#include "track_index.h"
+#include "track_source.h"
 
 using namespace android;
+using brillo::demo::PlaybackMetrics;
+using mp3_player_service::BufferedPcmSource;
+using mp3_player_service::Equalizer;
+using mp3_player_service::LoudnessAnalyzer;
+using mp3_player_service::StagefrightTrackDecoder;
+using mp3_player_service::StreamServer;
+using mp3_player_service::TrackIndex;
+using mp3_player_service::TrackSource;
+
+DEFINE_int32(buffer_ms, 500,
+             "Decoded audio kept ahead of the audio sink, in milliseconds");
+DEFINE_int32(crossfade_ms, 2000,
+             "Crossfade between tracks on next(), in milliseconds, 0 to cut");
+DEFINE_int32(analysis_threads, -1,
+             "Threads for background loudness analysis, -1 for one per spare "
+             "core, 0 to disable");
+DEFINE_int32(stream_port, 8080,
+             "TCP port for streaming the library over HTTP, 0 to disable");
+DEFINE_bool(stream_lan, false,
+            "Serve the library to the whole network instead of only to "
+            "loopback; there is no authentication");
 
 class Mp3PlayerService : public brillo::demo::BnMp3PlayerService {
-	const std::string SOUNDTRACKS_FORDER = "/data/soundtracks/";
+	const std::string SOUNDTRACKS_FORDER =
+		std::string(mp3_player_service::kSoundtracksFolder) + "/";
 	enum PlayerState {
 		Idle,
+		Loading,
 		Playing,
 		Paused,
 	};
 public:
-	Mp3PlayerService() : player(nullptr), state(Idle) {
-		CHECK_EQ(client.connect(), (status_t)OK);
-		reloadPlaylist();
+	Mp3PlayerService(int bufferMs, int crossfadeMs, int analysisThreads)
+		: worker("mp3-player-worker"), scanner("mp3-player-scan"),
+		  omxStatus(NO_INIT), player(nullptr),
+		  playerActive(false), state(Idle), loadGeneration(0), pausePending(false),
+		  bufferMs(bufferMs), crossfadeMs(crossfadeMs),
+		  analysisThreads(analysisThreads), volume(1.0f),
+		  playRequestedAt(0), streamServer(nullptr),
+		  commands(metrics::Registry::Get()->GetCounter("mp3_player.commands")),
+		  loadTime(metrics::Registry::Get()->GetHistogram("mp3_player.track_load_us")),
+		  searchTime(metrics::Registry::Get()->GetHistogram("mp3_player.search_us")),
+		  tracks(metrics::Registry::Get()->GetGauge("mp3_player.tracks")),
+		  loudness(mp3_player_service::kSoundtracksFolder,
+		           mp3_player_service::kLoudnessIndex,
+		           [] { return std::unique_ptr<mp3_player_service::TrackDecoder>(
+		                       new StagefrightTrackDecoder()); }),
+		  playIndex(0) {
+		for (int band = 0; band < Equalizer::kBands; band++)
+			eqGainsDb[band] = 0.0f;
+		/* mediaserver may still be coming up; don't hold up boot on it. */
+		omxConnect = std::async(std::launch::async, [this] {
+			status_t status = client.connect();
+			service_hub::MarkBootPhase("mp3_player", "omx connected");
+			return status;
+		});
+		worker.Start();
+		/* A large library takes a while to list; play() sees it once it is. */
+		scanner.Start();
+		scanner.task_runner()->PostTask(
+			FROM_HERE, base::Bind(&Mp3PlayerService::reloadPlaylist,
+			                      base::Unretained(this)));
 	}
 	~Mp3PlayerService() {
-		if (player) delete player;
+		scanner.Stop();
+		worker.Stop();
+		loudness.stop();
+		releasePipeline();
 	}
 	android::binder::Status play();
 	android::binder::Status pause();
 	android::binder::Status stop();
+	android::binder::Status next();
+	android::binder::Status setVolume(float volume);
+	android::binder::Status setEqualizer(float bassDb, float midDb, float trebleDb);
 	android::binder::Status reachedEOS(bool* pEOS);
 	android::binder::Status status(String16* pInfo);
+	android::binder::Status bufferFillPercent(int32_t* pPercent);
+	android::binder::Status underrunCount(int32_t* pCount);
+	android::binder::Status getMetrics(PlaybackMetrics* pMetrics);
+	android::binder::Status search(const String16& query, int32_t limit,
+	                               std::vector<int32_t>* pIds);
+	android::binder::Status playTrack(int32_t id);
+	android::binder::Status trackInfo(int32_t id, String16* pInfo);
+	status_t dump(int fd, const Vector<String16>& args) override;
+
+	/*
+	 * One-line summary of the current track. Weave only hears about it on
+	 * state transitions, so it leaves out buffer fill and underruns, which
+	 * would be stale by then; getMetrics() and dumpsys have those.
+	 */
+	std::string displaySummary();
+	/* Weave _mediaplayer status: "idle", "loading", "playing" or "paused". */
+	std::string stateName() const;
+	/*
+	 * Run after every state transition, on the thread that made it: a binder
+	 * thread, or the worker once a track has loaded.
+	 */
+	void setStateListener(const base::Closure& listener) { stateListener = listener; }
+	/* Only used to report streaming statistics in dump(). */
+	void setStreamServer(StreamServer* server) { streamServer = server; }
 private:
+	PlaybackMetrics collectMetrics();
+	void setState(PlayerState newState);
+	void startLoad(bool crossfade);
+	void stopLocked();
+
+	/* Run on the scanner thread only. */
 	void reloadPlaylist();
-	status_t PlayStagefrightMp3(std::string filename);
+	void indexTags(size_t first);
+
+	/* Run on the worker thread only. */
+	void loadTrack(uint32_t generation, const std::string& filename, bool crossfade);
+	void pausePlayer();
+	void resumePlayer();
+	bool ensureOmxConnected();
+	void releasePipeline();
+	status_t PlayStagefrightMp3(std::string filename, bool crossfade);
 
+	/*
+	 * Opening a track, creating the codec and starting the sink take long
+	 * enough that binder calls only record the transition and leave the
+	 * work, and everything else touching the AudioPlayer, to this thread.
+	 */
+	base::Thread worker;
+	/*
+	 * Lists the library, checks it against the loudness index and indexes
+	 * its tags, none of which a play() should wait behind.
+	 */
+	base::Thread scanner;
 	OMXClient client;
+	std::future<status_t> omxConnect;
+	status_t omxStatus;
 	AudioPlayer* player;
+	bool playerActive;
+	sp<MetaData> pipelineFormat;
+
+	/* Guards everything below that binder calls and the worker share. */
+	mutable std::mutex stateLock;
+	/* Decode pipeline, kept across tracks while the PCM layout is unchanged. */
+	sp<TrackSource> trackSource;
+	sp<BufferedPcmSource> pcmSource;
 	PlayerState state;
+	/* Bumped by every load and stop, so a finished load can tell it is stale. */
+	uint32_t loadGeneration;
+	/* pause() arrived while loading. */
+	bool pausePending;
+	int bufferMs;
+	int crossfadeMs;
+	int analysisThreads;
+	/* Applied to every pipeline, including ones built later. */
+	float volume;
+	float eqGainsDb[Equalizer::kBands];
+	/* When the current track was asked for. */
+	nsecs_t playRequestedAt;
+	StreamServer* streamServer;
+	metrics::Counter* commands;
+	/* From the worker picking up a load to the track playing. */
+	metrics::Histogram* loadTime;
+	metrics::Histogram* searchTime;
+	metrics::Gauge* tracks;
+	/* Precomputed per-track gain; lookups never wait for analysis. */
+	LoudnessAnalyzer loudness;
+	/* Tags of playList, by playlist position; filled in from the scanner. */
+	TrackIndex library;
+	base::Closure stateListener;
+	/* Only the scanner changes it, with stateLock held. */
 	std::vector<std::string> playList;
 	size_t playIndex;
 };
 
 void Mp3PlayerService::reloadPlaylist()
 {
-	playList.clear();
+	std::vector<std::string> files;
 	DIR *dp;
 	if ((dp = opendir(SOUNDTRACKS_FORDER.c_str())) == NULL) {
 		LOG(ERROR) << "Unable to open directory '" << SOUNDTRACKS_FORDER
@@ -69,19 +225,91 @@ void Mp3PlayerService::reloadPlaylist()
 	while ((dirp = readdir(dp)) != NULL) {
 		std::string filename(dirp->d_name);
 		if (filename.find(".mp3") != std::string::npos)
-			playList.push_back(filename);
+			files.push_back(filename);
 	}
 	closedir(dp);
-	playIndex = 0;
 
-	LOG(INFO) << "Found " << playList.size() << " MP3 files";
-	for (size_t i = 0; i < playList.size(); i++)
-		LOG(INFO) << "\t" << i << ": " << playList[i];
+	LOG(INFO) << "Found " << files.size() << " MP3 files";
+	for (size_t i = 0; i < files.size(); i++)
+		VLOG(1) << "\t" << i << ": " << files[i];
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		playList = files;
+		playIndex = 0;
+		tracks->Set(playList.size());
+	}
+
+	/* Checking the library against the loudness index stats every track. */
+	if (analysisThreads != 0)
+		loudness.start(files, analysisThreads);
+	if (!files.empty())
+		indexTags(0);
+}
+
+bool Mp3PlayerService::ensureOmxConnected()
+{
+	if (omxConnect.valid())
+		omxStatus = omxConnect.get();	/* Waits only if still connecting. */
+	if (omxStatus != OK) {
+		LOG(WARNING) << "OMX not connected (status=" << omxStatus << "), retrying";
+		omxStatus = client.connect();
+	}
+	return omxStatus == OK;
 }
 
-status_t Mp3PlayerService::PlayStagefrightMp3(std::string filename)
+static bool samePcmLayout(const sp<MetaData>& a, const sp<MetaData>& b)
+{
+	int32_t rateA, rateB, channelsA, channelsB;
+	return a != NULL && b != NULL &&
+	       a->findInt32(kKeySampleRate, &rateA) &&
+	       b->findInt32(kKeySampleRate, &rateB) &&
+	       a->findInt32(kKeyChannelCount, &channelsA) &&
+	       b->findInt32(kKeyChannelCount, &channelsB) &&
+	       rateA == rateB && channelsA == channelsB;
+}
+
+void Mp3PlayerService::releasePipeline()
+{
+	delete player;
+	player = nullptr;
+	playerActive = false;
+	pipelineFormat = nullptr;
+
+	/* Let the sources go outside the lock; stopping them joins threads. */
+	sp<BufferedPcmSource> oldPcmSource;
+	sp<TrackSource> oldTrackSource;
+	std::lock_guard<std::mutex> lock(stateLock);
+	oldPcmSource.swap(pcmSource);
+	oldTrackSource.swap(trackSource);
+}
+
+void Mp3PlayerService::pausePlayer()
+{
+	if (player && playerActive) {
+		player->pause();
+		pcmSource->setPaused(true);
+		playerActive = false;
+	}
+}
+
+void Mp3PlayerService::resumePlayer()
+{
+	if (player && !playerActive) {
+		pcmSource->setPaused(false);
+		player->resume();
+		playerActive = true;
+	}
+}
+
+status_t Mp3PlayerService::PlayStagefrightMp3(std::string filename, bool crossfade)
 {
 	/* ${BDK_PATH}/device/generic/brillo/pts/audio/brillo-audio-test/stagefright_playback.cpp */
+	base::TimeTicks begin = base::TimeTicks::Now();
+	if (!ensureOmxConnected()) {
+		LOG(ERROR) << "Could not connect to OMX.";
+		return NO_INIT;
+	}
+
 	FileSource* file_source = new FileSource(filename.c_str());
 	status_t status = file_source->initCheck();
 	if (status != OK) {
@@ -94,73 +322,343 @@ status_t Mp3PlayerService::PlayStagefrightMp3(std::string filename)
 	sp<MediaExtractor> media_extractor = new MP3Extractor(file_source, message);
 	LOG(INFO) << "Num tracks: " << media_extractor->countTracks();
 	sp<MediaSource> media_source = media_extractor->getTrack(0);
+	sp<MetaData> meta_data = media_source->getFormat();
+	float gain = loudness.trackGain(base::FilePath(filename).BaseName().value());
+
+	// Same sample rate and channels: flush the running codec and sink and
+	// carry on with the new track. Only this thread replaces pcmSource.
+	if (player && samePcmLayout(pipelineFormat, meta_data)) {
+		status = pcmSource->switchTrack(media_source, crossfade, gain);
+		if (status != OK)
+			return status;
+		// Pausing leaves the old track's tail in the AudioTrack; a seek
+		// flushes it, unless that tail is what the new track fades in over.
+		if (!crossfade || !playerActive)
+			player->seekTo(0);
+		resumePlayer();
+		LOG(INFO) << "Switched track in "
+		          << (base::TimeTicks::Now() - begin).InMilliseconds()
+		          << " ms (reused decoder)";
+		return OK;
+	}
+	releasePipeline();
 
 	// Decode mp3.
-	sp<MetaData> meta_data = media_source->getFormat();
+	sp<TrackSource> track_source = new TrackSource(media_source);
 	sp<MediaSource> decoded_source =
-		OMXCodec::Create(client.interface(), meta_data, false, media_source);
+		OMXCodec::Create(client.interface(), meta_data, false, track_source);
+	if (decoded_source == NULL) {
+		LOG(ERROR) << "Could not create the mp3 decoder.";
+		return UNKNOWN_ERROR;
+	}
+
+	// Decode on a separate thread, ahead of the sink.
+	sp<BufferedPcmSource> pcm_source =
+		new BufferedPcmSource(decoded_source, track_source,
+		                      bufferMs * 1000ll, crossfadeMs * 1000ll);
+	pcm_source->setTrackGain(gain);
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		pcm_source->setGain(volume);
+		pcm_source->setEqualizer(eqGainsDb);
+		trackSource = track_source;
+		pcmSource = pcm_source;
+	}
 
 	// Play mp3.
 	player = new AudioPlayer(nullptr);	// Initialize without source.
-	player->setSource(decoded_source);
+	player->setSource(pcm_source);
 	status = player->start();
 	if (status != OK) {
 		LOG(ERROR) << "Could not start playing audio.";
+		releasePipeline();
 		return status;
 	}
+	playerActive = true;
+	pipelineFormat = meta_data;
+	LOG(INFO) << "Started track in "
+	          << (base::TimeTicks::Now() - begin).InMilliseconds()
+	          << " ms (new decoder)";
 	return status;
 }
 
+/* Called with stateLock held; the listener only posts a task. */
+void Mp3PlayerService::setState(PlayerState newState)
+{
+	if (state == newState)
+		return;
+	state = newState;
+	if (!stateListener.is_null())
+		stateListener.Run();
+}
+
+/* Called with stateLock held. Queues playList[playIndex] on the worker. */
+void Mp3PlayerService::startLoad(bool crossfade)
+{
+	playRequestedAt = systemTime(SYSTEM_TIME_MONOTONIC);
+	pausePending = false;
+	setState(Loading);
+	worker.task_runner()->PostTask(
+		FROM_HERE, base::Bind(&Mp3PlayerService::loadTrack, base::Unretained(this),
+		                      ++loadGeneration, SOUNDTRACKS_FORDER + playList[playIndex],
+		                      crossfade));
+}
+
+void Mp3PlayerService::loadTrack(uint32_t generation, const std::string& filename,
+                                 bool crossfade)
+{
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		if (generation != loadGeneration)
+			return;
+	}
+	status_t status;
+	{
+		metrics::ScopedTimer timer(loadTime);
+		status = PlayStagefrightMp3(filename, crossfade);
+	}
+
+	std::lock_guard<std::mutex> lock(stateLock);
+	if (generation != loadGeneration) {
+		/* stop() has queued a pause, or next() has queued another load. */
+		return;
+	}
+	if (status != OK) {
+		pausePlayer();
+		setState(Idle);
+	} else if (pausePending) {
+		pausePlayer();
+		setState(Paused);
+	} else {
+		setState(Playing);
+	}
+}
+
 android::binder::Status Mp3PlayerService::play()
 {
+	commands->Increment();
+	std::lock_guard<std::mutex> lock(stateLock);
 	switch (state) {
 	case Idle:
-		if (playIndex < playList.size() &&
-		    PlayStagefrightMp3(SOUNDTRACKS_FORDER + playList[playIndex]) == OK)
-			state = Playing;
+		if (playIndex < playList.size())
+			startLoad(false);
+		break;
+	case Loading:
+		pausePending = false;
+		break;
 	case Playing:
 		break;
 	case Paused:
-		player->resume();
-		state = Playing;
+		worker.task_runner()->PostTask(
+			FROM_HERE, base::Bind(&Mp3PlayerService::resumePlayer, base::Unretained(this)));
+		setState(Playing);
+		break;
 	}
 	return android::binder::Status::ok();
 }
 
 android::binder::Status Mp3PlayerService::pause()
 {
+	commands->Increment();
+	std::lock_guard<std::mutex> lock(stateLock);
 	if (state == Playing) {
-		player->pause();
-		state = Paused;
+		worker.task_runner()->PostTask(
+			FROM_HERE, base::Bind(&Mp3PlayerService::pausePlayer, base::Unretained(this)));
+		setState(Paused);
+	} else if (state == Loading) {
+		pausePending = true;
 	}
 	return android::binder::Status::ok();
 }
 
+/* Called with stateLock held. */
+void Mp3PlayerService::stopLocked()
+{
+	if (state == Idle)
+		return;
+	if (pcmSource != nullptr)
+		LOG(INFO) << "Stopping with " << pcmSource->underrunCount()
+		          << " buffer underruns";
+	/* Keep the pipeline; the next play() will usually reuse it. */
+	loadGeneration++;
+	worker.task_runner()->PostTask(
+		FROM_HERE, base::Bind(&Mp3PlayerService::pausePlayer, base::Unretained(this)));
+	if (++playIndex >= playList.size())
+		playIndex = 0;
+	setState(Idle);
+}
+
 android::binder::Status Mp3PlayerService::stop()
 {
-	if (state == Playing || state == Paused) {
-		delete player;
-		player = nullptr;
-		state  = Idle;
+	commands->Increment();
+	std::lock_guard<std::mutex> lock(stateLock);
+	stopLocked();
+	return android::binder::Status::ok();
+}
+
+/*
+ * Skips to the following track. While playing, the new track fades in over
+ * the end of the current one when the PCM layouts match; while paused, it
+ * is loaded and left paused.
+ */
+android::binder::Status Mp3PlayerService::next()
+{
+	commands->Increment();
+	std::lock_guard<std::mutex> lock(stateLock);
+	if (playList.empty())
+		return android::binder::Status::ok();
+	switch (state) {
+	case Idle:
+		if (++playIndex >= playList.size())
+			playIndex = 0;
+		break;
+	case Paused:
+		if (++playIndex >= playList.size())
+			playIndex = 0;
+		startLoad(false);
+		pausePending = true;
+		break;
+	case Loading:
+	case Playing:
 		if (++playIndex >= playList.size())
 			playIndex = 0;
+		startLoad(true);
+		break;
 	}
 	return android::binder::Status::ok();
 }
 
+static void readTags(const std::string& path, std::string* title,
+                     std::string* artist, std::string* album)
+{
+	sp<FileSource> file_source = new FileSource(path.c_str());
+	if (file_source->initCheck() != OK)
+		return;
+	sp<MediaExtractor> media_extractor = new MP3Extractor(file_source, new AMessage());
+	sp<MetaData> meta_data = media_extractor->getMetaData();
+	const char* value;
+	if (meta_data == NULL)
+		return;
+	if (meta_data->findCString(kKeyTitle, &value))
+		*title = value;
+	if (meta_data->findCString(kKeyArtist, &value) ||
+	    meta_data->findCString(kKeyAlbumArtist, &value))
+		*artist = value;
+	if (meta_data->findCString(kKeyAlbum, &value))
+		*album = value;
+}
+
+/*
+ * Reads ID3 tags for a batch of tracks and makes them searchable, then
+ * queues the next batch, so the scanner stays free to stop between batches.
+ */
+void Mp3PlayerService::indexTags(size_t first)
+{
+	static const size_t kBatch = 64;
+	const size_t last = std::min(first + kBatch, playList.size());
+	std::vector<std::string> tags;
+	for (size_t i = first; i < last; i++) {
+		std::string title, artist, album;
+		readTags(SOUNDTRACKS_FORDER + playList[i], &title, &artist, &album);
+		if (title.empty())
+			title = base::FilePath(playList[i]).RemoveExtension().value();
+		tags.push_back(title);
+		tags.push_back(artist);
+		tags.push_back(album);
+	}
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		for (size_t i = first; i < last; i++) {
+			const std::string* t = &tags[(i - first) * 3];
+			library.add(i, t[0], t[1], t[2]);
+		}
+		library.commit();
+	}
+	if (last < playList.size())
+		scanner.task_runner()->PostTask(
+			FROM_HERE, base::Bind(&Mp3PlayerService::indexTags,
+			                      base::Unretained(this), last));
+	else
+		LOG(INFO) << "Indexed tags of " << playList.size() << " tracks ("
+		          << library.memoryBytes() / 1024 << " KiB)";
+}
+
+android::binder::Status Mp3PlayerService::search(const String16& query, int32_t limit,
+                                                 std::vector<int32_t>* pIds)
+{
+	metrics::ScopedTimer timer(searchTime);
+	std::lock_guard<std::mutex> lock(stateLock);
+	std::vector<TrackIndex::TrackId> ids =
+		library.search(String8(query).string(), std::max(0, limit));
+	pIds->assign(ids.begin(), ids.end());
+	return android::binder::Status::ok();
+}
+
+android::binder::Status Mp3PlayerService::playTrack(int32_t id)
+{
+	commands->Increment();
+	std::lock_guard<std::mutex> lock(stateLock);
+	if (id < 0 || static_cast<size_t>(id) >= playList.size())
+		return android::binder::Status::fromExceptionCode(
+			android::binder::Status::EX_ILLEGAL_ARGUMENT);
+	playIndex = id;
+	startLoad(state == Playing || state == Loading);
+	return android::binder::Status::ok();
+}
+
+/* "title\tartist\talbum\tfile", with empty fields for tags not read yet. */
+android::binder::Status Mp3PlayerService::trackInfo(int32_t id, String16* pInfo)
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	if (id < 0 || static_cast<size_t>(id) >= playList.size())
+		return android::binder::Status::fromExceptionCode(
+			android::binder::Status::EX_ILLEGAL_ARGUMENT);
+	std::string title, artist, album;
+	library.describe(id, &title, &artist, &album);
+	pInfo->setTo(String16((title + "\t" + artist + "\t" + album + "\t" +
+	                       playList[id]).c_str()));
+	return android::binder::Status::ok();
+}
+
+android::binder::Status Mp3PlayerService::setVolume(float newVolume)
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	volume = std::min(1.0f, std::max(0.0f, newVolume));
+	if (pcmSource != nullptr)
+		pcmSource->setGain(volume);
+	return android::binder::Status::ok();
+}
+
+android::binder::Status Mp3PlayerService::setEqualizer(float bassDb, float midDb,
+                                                       float trebleDb)
+{
+	const float kMaxDb = 12.0f;
+	const float gains[Equalizer::kBands] = { bassDb, midDb, trebleDb };
+	std::lock_guard<std::mutex> lock(stateLock);
+	for (int band = 0; band < Equalizer::kBands; band++)
+		eqGainsDb[band] = std::min(kMaxDb, std::max(-kMaxDb, gains[band]));
+	if (pcmSource != nullptr)
+		pcmSource->setEqualizer(eqGainsDb);
+	return android::binder::Status::ok();
+}
+
 android::binder::Status Mp3PlayerService::reachedEOS(bool* pEOS)
 {
-	status_t s;
-	*pEOS = (state == Playing && player->reachedEOS(&s));
+	std::lock_guard<std::mutex> lock(stateLock);
+	*pEOS = (state == Playing && pcmSource->reachedEOS());
 	return android::binder::Status::ok();
 }
 
 android::binder::Status Mp3PlayerService::status(String16* pInfo)
 {
+	std::lock_guard<std::mutex> lock(stateLock);
 	switch (state) {
 	case Idle:
 		pInfo->setTo(String16("idle"));
 		break;
+	case Loading:
+		pInfo->setTo(String16("loading"));
+		break;
 	case Playing:
 		pInfo->setTo(String16(playList[playIndex].c_str()));
 		break;
@@ -171,16 +669,139 @@ android::binder::Status Mp3PlayerService::status(String16* pInfo)
 	return android::binder::Status::ok();
 }
 
-class MyDaemon final : public brillo::Daemon {
+std::string Mp3PlayerService::stateName() const
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	switch (state) {
+	case Loading:
+		return "loading";
+	case Playing:
+		return "playing";
+	case Paused:
+		return "paused";
+	case Idle:
+		break;
+	}
+	return "idle";
+}
+
+android::binder::Status Mp3PlayerService::bufferFillPercent(int32_t* pPercent)
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	*pPercent = pcmSource != nullptr ? pcmSource->fillPercent() : 0;
+	return android::binder::Status::ok();
+}
+
+android::binder::Status Mp3PlayerService::underrunCount(int32_t* pCount)
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	*pCount = pcmSource != nullptr ? pcmSource->underrunCount() : 0;
+	return android::binder::Status::ok();
+}
+
+/* Called with stateLock held. */
+PlaybackMetrics Mp3PlayerService::collectMetrics()
+{
+	PlaybackMetrics metrics;
+	if (pcmSource == nullptr)
+		return metrics;
+
+	BufferedPcmSource::DecodeStats stats = pcmSource->decodeStats();
+	if (stats.firstAudioAt >= playRequestedAt)
+		metrics.timeToFirstAudioUs = ns2us(stats.firstAudioAt - playRequestedAt);
+	metrics.decodedFrames = stats.frames;
+	if (stats.frames > 0)
+		metrics.decodeTimeAvgUs = ns2us(stats.totalNs / stats.frames);
+	metrics.decodeTimeMaxUs = ns2us(stats.maxNs);
+	metrics.underruns = pcmSource->underrunCount();
+	metrics.bufferFillPercent = pcmSource->fillPercent();
+
+	nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - playRequestedAt;
+	if (elapsed > 0)
+		metrics.bytesPerSecond = trackSource->bytesRead() * 1000000000ll / elapsed;
+	return metrics;
+}
+
+android::binder::Status Mp3PlayerService::getMetrics(PlaybackMetrics* pMetrics)
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	*pMetrics = collectMetrics();
+	return android::binder::Status::ok();
+}
+
+std::string Mp3PlayerService::displaySummary()
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	if (state == Idle || playIndex >= playList.size())
+		return "";
+	if (state == Loading)
+		return playList[playIndex] + " | loading";
+
+	PlaybackMetrics metrics = collectMetrics();
+	std::string summary = playList[playIndex];
+	if (metrics.timeToFirstAudioUs >= 0)
+		summary += base::StringPrintf(" | started in %lld ms",
+		                              static_cast<long long>(metrics.timeToFirstAudioUs / 1000));
+	return summary;
+}
+
+status_t Mp3PlayerService::dump(int fd, const Vector<String16>& args)
+{
+	String16 info;
+	status(&info);
+	std::string text = base::StringPrintf("mp3 player: %s\n",
+	                                      String8(info).string());
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		text += collectMetrics().toString();
+		text += base::StringPrintf("library: %zu/%zu tracks tagged, index %zu KiB\n",
+		                           library.trackCount(), playList.size(),
+		                           library.memoryBytes() / 1024);
+	}
+	LoudnessAnalyzer::Progress progress = loudness.progress();
+	text += base::StringPrintf(
+		"loudness: %zu tracks indexed, %zu/%zu analyzed this run, %zu failed\n",
+		progress.indexed, progress.analyzed, progress.queued, progress.failed);
+	if (streamServer) {
+		StreamServer::Stats stats = streamServer->stats();
+		text += base::StringPrintf(
+			"streaming on port %u: %u active, %llu connections, "
+			"%llu requests, %llu bytes sent\n",
+			streamServer->port(), stats.activeConnections,
+			static_cast<unsigned long long>(stats.connections),
+			static_cast<unsigned long long>(stats.requests),
+			static_cast<unsigned long long>(stats.bytesSent));
+	}
+	text += "boot timeline:\n" + service_hub::BootTimeline();
+	text += "metrics:\n" + metrics::Registry::Get()->Dump();
+	return base::WriteFileDescriptor(fd, text.data(), text.size()) ? OK
+	                                                              : UNKNOWN_ERROR;
+}
+
+class MyDaemon final : public service_hub::Module {
 public:
 	MyDaemon() = default;
-protected:
+	const char* name() const override { return "mp3_player"; }
 	int OnInit() override;
 private:
-	/* the bridge between libbinder and brillo::MessageLoop */
-	brillo::BinderWatcher binder_watcher_;
+	void OnWeaveServiceConnected(const std::weak_ptr<weaved::Service>& service);
+	void OnStateChanged();
+	void UpdateDeviceState();
+
+	// Weave command handlers for the _mediaplayer trait.
+	void OnPlay(std::unique_ptr<weaved::Command> command);
+	void OnPause(std::unique_ptr<weaved::Command> command);
+	void OnStop(std::unique_ptr<weaved::Command> command);
+
+	std::weak_ptr<weaved::Service> weave_service_;
+	std::unique_ptr<weaved::Service::Subscription> weave_service_subscription_;
+	// Last state published to weave, to skip no-op updates.
+	std::string published_status_;
+	std::string published_display_;
+	bool update_pending_{false};
 
 	android::sp<Mp3PlayerService> mp3_player_service_;
+	std::unique_ptr<StreamServer> stream_server_;
 
 	base::WeakPtrFactory<MyDaemon> weak_ptr_factory_{this};
 	DISALLOW_COPY_AND_ASSIGN(MyDaemon);
@@ -188,25 +809,119 @@ private:
 
 int MyDaemon::OnInit()
 {
-	int rc;
-	if ((rc = brillo::Daemon::OnInit()) != EX_OK)
-		return rc;
+	/* weaved handles the connection while the player starts up. */
+	weave_service_subscription_ = weaved::Service::Connect(
+		brillo::MessageLoop::current(),
+		base::Bind(&MyDaemon::OnWeaveServiceConnected,
+		           weak_ptr_factory_.GetWeakPtr()));
+	mp3_player_service_ = new Mp3PlayerService(FLAGS_buffer_ms, FLAGS_crossfade_ms,
+	                                           FLAGS_analysis_threads);
+	service_hub::RegisterService(mp3_player_service::kBinderServiceName,
+	                             mp3_player_service_);
+	/* Commands that arrive before OMX has connected wait for it. */
+	service_hub::MarkBootPhase(name(), "ready");
 
-	/* Create and initialize the singleton for communicating with the real binder system */
-	android::BinderWrapper::Create();
-	if (!binder_watcher_.Init())
-		return EX_OSERR;
+	if (FLAGS_stream_port > 0) {
+		stream_server_.reset(new StreamServer(mp3_player_service::kSoundtracksFolder,
+		                                      FLAGS_stream_port, !FLAGS_stream_lan));
+		if (!stream_server_->start())
+			stream_server_.reset();
+	}
+	mp3_player_service_->setStreamServer(stream_server_.get());
 
-	mp3_player_service_ = new Mp3PlayerService();
-	android::BinderWrapper::Get()->RegisterService(mp3_player_service::kBinderServiceName,
-	                                               mp3_player_service_);
+	/* Transitions can complete on the player's worker thread; hop back here. */
+	mp3_player_service_->setStateListener(base::Bind(
+		base::IgnoreResult(&base::TaskRunner::PostTask),
+		base::ThreadTaskRunnerHandle::Get(), FROM_HERE,
+		base::Bind(&MyDaemon::OnStateChanged, weak_ptr_factory_.GetWeakPtr())));
 	return EX_OK;
 }
 
-int main(int argc, char* argv[])
+void MyDaemon::OnWeaveServiceConnected(const std::weak_ptr<weaved::Service>& service)
+{
+	weave_service_ = service;
+	auto weave_service = weave_service_.lock();
+	if (!weave_service)
+		return;
+	service_hub::MarkBootPhase(name(), "weave connected");
+
+	weave_service->AddComponent(mp3_player_service::kWeaveComponent,
+	                            {mp3_player_service::kWeaveTrait}, nullptr);
+	weave_service->AddCommandHandler(
+		mp3_player_service::kWeaveComponent, mp3_player_service::kWeaveTrait, "play",
+		base::Bind(&MyDaemon::OnPlay, weak_ptr_factory_.GetWeakPtr()));
+	weave_service->AddCommandHandler(
+		mp3_player_service::kWeaveComponent, mp3_player_service::kWeaveTrait, "pause",
+		base::Bind(&MyDaemon::OnPause, weak_ptr_factory_.GetWeakPtr()));
+	weave_service->AddCommandHandler(
+		mp3_player_service::kWeaveComponent, mp3_player_service::kWeaveTrait, "stop",
+		base::Bind(&MyDaemon::OnStop, weak_ptr_factory_.GetWeakPtr()));
+
+	/* A new weaved connection has none of our state yet. */
+	published_status_.clear();
+	published_display_.clear();
+	UpdateDeviceState();
+}
+
+/*
+ * Called on every player transition. The update runs on the next loop
+ * iteration so that a burst of transitions from one call yields one patch.
+ */
+void MyDaemon::OnStateChanged()
+{
+	if (update_pending_)
+		return;
+	update_pending_ = true;
+	brillo::MessageLoop::current()->PostTask(
+		base::Bind(&MyDaemon::UpdateDeviceState, weak_ptr_factory_.GetWeakPtr()));
+}
+
+void MyDaemon::UpdateDeviceState()
+{
+	update_pending_ = false;
+	auto weave_service = weave_service_.lock();
+	if (!weave_service)
+		return;
+
+	std::string status = mp3_player_service_->stateName();
+	std::string display = mp3_player_service_->displaySummary();
+	if (status != published_status_) {
+		weave_service->SetStateProperty(mp3_player_service::kWeaveComponent,
+		                                mp3_player_service::kWeaveTrait, "status",
+		                                *brillo::ToValue(status), nullptr);
+		published_status_ = status;
+	}
+	if (display != published_display_) {
+		weave_service->SetStateProperty(mp3_player_service::kWeaveComponent,
+		                                mp3_player_service::kWeaveTrait, "display",
+		                                *brillo::ToValue(display), nullptr);
+		published_display_ = display;
+	}
+}
+
+void MyDaemon::OnPlay(std::unique_ptr<weaved::Command> command)
+{
+	mp3_player_service_->play();
+	command->Complete({}, nullptr);
+}
+
+void MyDaemon::OnPause(std::unique_ptr<weaved::Command> command)
+{
+	mp3_player_service_->pause();
+	command->Complete({}, nullptr);
+}
+
+void MyDaemon::OnStop(std::unique_ptr<weaved::Command> command)
 {
-	base::CommandLine::Init(argc, argv);
-	brillo::InitLog(brillo::kLogToSyslog | brillo::kLogHeader);
-	MyDaemon daemon;
-	return daemon.Run();
+	mp3_player_service_->stop();
+	command->Complete({}, nullptr);
+}
+
+namespace mp3_player_service {
+
+std::unique_ptr<service_hub::Module> CreateModule()
+{
+	return std::unique_ptr<service_hub::Module>(new MyDaemon());
+}
+
 }
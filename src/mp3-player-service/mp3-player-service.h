@@ -1,9 +1,21 @@
 #ifndef MP3_PLAYER_SERVICE_CONSTANTS_H_
 #define MP3_PLAYER_SERVICE_CONSTANTS_H_
 
+#include <memory>
+
+namespace service_hub {
+	class Module;
+}
+
 namespace mp3_player_service {
+	extern const char kWeaveComponent[];
 	extern const char kWeaveTrait[];
 	extern const char kBinderServiceName[];
+	extern const char kSoundtracksFolder[];
+	extern const char kLoudnessIndex[];
+
+	/* Plays the soundtrack library; see service_hub::ModuleDaemon. */
+	std::unique_ptr<service_hub::Module> CreateModule();
 }
 
 #endif
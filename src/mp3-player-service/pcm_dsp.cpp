@@ -0,0 +1,312 @@
+#include "pcm_dsp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PCM_DSP_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PCM_DSP_SSE2 1
+#endif
+
+namespace mp3_player_service {
+namespace dsp {
+
+static inline int16_t saturate(float v)
+{
+	long s = lrintf(v);
+	return static_cast<int16_t>(std::min(32767l, std::max(-32768l, s)));
+}
+
+#if PCM_DSP_NEON
+
+static inline float32x4_t ramp4(float start, float step)
+{
+	const float r[4] = { start, start + step, start + 2 * step, start + 3 * step };
+	return vld1q_f32(r);
+}
+
+static inline int32x4_t roundToInt(float32x4_t v)
+{
+#if defined(__aarch64__)
+	return vcvtnq_s32_f32(v);
+#else
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	uint32x4_t negative = vcltq_f32(v, vdupq_n_f32(0.0f));
+	return vcvtq_s32_f32(vaddq_f32(v, vbslq_f32(negative, vnegq_f32(half), half)));
+#endif
+}
+
+/* vcvt saturates to int32 and vqmovn to int16, so no explicit clamp. */
+static inline int16x8_t packFloats(float32x4_t lo, float32x4_t hi)
+{
+	return vcombine_s16(vqmovn_s32(roundToInt(lo)), vqmovn_s32(roundToInt(hi)));
+}
+
+static inline float32x4_t lowFloats(int16x8_t v)
+{
+	return vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+}
+
+static inline float32x4_t highFloats(int16x8_t v)
+{
+	return vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+}
+
+#elif PCM_DSP_SSE2
+
+static inline __m128 ramp4(float start, float step)
+{
+	return _mm_set_ps(start + 3 * step, start + 2 * step, start + step, start);
+}
+
+/* cvtps2dq turns out-of-range values into INT_MIN, so clamp first. */
+static inline __m128i packFloats(__m128 lo, __m128 hi)
+{
+	const __m128 maxv = _mm_set1_ps(32767.0f);
+	const __m128 minv = _mm_set1_ps(-32768.0f);
+	lo = _mm_max_ps(_mm_min_ps(lo, maxv), minv);
+	hi = _mm_max_ps(_mm_min_ps(hi, maxv), minv);
+	return _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+}
+
+static inline __m128 lowFloats(__m128i v)
+{
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+}
+
+static inline __m128 highFloats(__m128i v)
+{
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+}
+
+#endif
+
+void applyGainRamp(int16_t* samples, size_t count, float startGain, float endGain)
+{
+	if (count == 0)
+		return;
+	const float step = (endGain - startGain) / count;
+	float gain = startGain;
+	size_t i = 0;
+
+#if PCM_DSP_NEON
+	for (; i + 8 <= count; i += 8, gain += 8 * step) {
+		int16x8_t x = vld1q_s16(samples + i);
+		float32x4_t lo = vmulq_f32(lowFloats(x), ramp4(gain, step));
+		float32x4_t hi = vmulq_f32(highFloats(x), ramp4(gain + 4 * step, step));
+		vst1q_s16(samples + i, packFloats(lo, hi));
+	}
+#elif PCM_DSP_SSE2
+	for (; i + 8 <= count; i += 8, gain += 8 * step) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+		__m128 lo = _mm_mul_ps(lowFloats(x), ramp4(gain, step));
+		__m128 hi = _mm_mul_ps(highFloats(x), ramp4(gain + 4 * step, step));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(samples + i), packFloats(lo, hi));
+	}
+#endif
+	for (; i < count; i++, gain += step)
+		samples[i] = saturate(samples[i] * gain);
+}
+
+void mixCrossfade(int16_t* out, const int16_t* outgoing, const int16_t* incoming,
+                  size_t count, float outStart, float outEnd,
+                  float inStart, float inEnd)
+{
+	if (count == 0)
+		return;
+	const float outStep = (outEnd - outStart) / count;
+	const float inStep = (inEnd - inStart) / count;
+	float gOut = outStart;
+	float gIn = inStart;
+	size_t i = 0;
+
+#if PCM_DSP_NEON
+	for (; i + 8 <= count; i += 8, gOut += 8 * outStep, gIn += 8 * inStep) {
+		int16x8_t a = vld1q_s16(outgoing + i);
+		int16x8_t b = vld1q_s16(incoming + i);
+		float32x4_t lo = vmlaq_f32(vmulq_f32(lowFloats(a), ramp4(gOut, outStep)),
+		                           lowFloats(b), ramp4(gIn, inStep));
+		float32x4_t hi = vmlaq_f32(vmulq_f32(highFloats(a), ramp4(gOut + 4 * outStep, outStep)),
+		                           highFloats(b), ramp4(gIn + 4 * inStep, inStep));
+		vst1q_s16(out + i, packFloats(lo, hi));
+	}
+#elif PCM_DSP_SSE2
+	for (; i + 8 <= count; i += 8, gOut += 8 * outStep, gIn += 8 * inStep) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(outgoing + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(incoming + i));
+		__m128 lo = _mm_add_ps(_mm_mul_ps(lowFloats(a), ramp4(gOut, outStep)),
+		                       _mm_mul_ps(lowFloats(b), ramp4(gIn, inStep)));
+		__m128 hi = _mm_add_ps(_mm_mul_ps(highFloats(a), ramp4(gOut + 4 * outStep, outStep)),
+		                       _mm_mul_ps(highFloats(b), ramp4(gIn + 4 * inStep, inStep)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packFloats(lo, hi));
+	}
+#endif
+	for (; i < count; i++, gOut += outStep, gIn += inStep)
+		out[i] = saturate(outgoing[i] * gOut + incoming[i] * gIn);
+}
+
+void crossfadeGains(float t, float* outgoing, float* incoming)
+{
+	t = std::min(1.0f, std::max(0.0f, t));
+	*outgoing = cosf(t * static_cast<float>(M_PI_2));
+	*incoming = sinf(t * static_cast<float>(M_PI_2));
+}
+
+const char* simdName()
+{
+#if PCM_DSP_NEON
+	return "neon";
+#elif PCM_DSP_SSE2
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
+
+}
+
+/* How long new gains take to fully apply. */
+static const float kEqRampSeconds = 0.02f;
+/* Frames filtered with one set of coefficients while ramping. */
+static const size_t kEqRampBlock = 32;
+/* State below this is inaudible once the output is rounded to 16 bits. */
+static const float kEqQuietState = 0.25f;
+
+Equalizer::Equalizer(int sampleRate, int channels)
+	: sampleRate(sampleRate),
+	  stride(channels),
+	  channels(std::min<int>(channels, kMaxChannels)),
+	  flat(true),
+	  targetFlat(true),
+	  rampLeft(0)
+{
+	const float zero[kBands] = { 0, 0, 0 };
+	design(zero, targets);
+	memcpy(stages, targets, sizeof(stages));
+	memset(z1, 0, sizeof(z1));
+	memset(z2, 0, sizeof(z2));
+}
+
+void Equalizer::setGains(const float gainsDb[kBands])
+{
+	targetFlat = true;
+	for (int band = 0; band < kBands; band++) {
+		if (gainsDb[band] != 0.0f)
+			targetFlat = false;
+	}
+	if (targetFlat && flat)
+		return;
+	design(gainsDb, targets);
+	rampLeft = std::max<size_t>(1, sampleRate * kEqRampSeconds);
+	flat = false;
+}
+
+void Equalizer::design(const float gainsDb[kBands], Biquad out[kBands]) const
+{
+	static const float kFrequencies[kBands] = { 100.0f, 1000.0f, 8000.0f };
+
+	for (int band = 0; band < kBands; band++) {
+		/* Robert Bristow-Johnson's audio EQ cookbook, shelf slope 1, Q 0.707. */
+		const double A = pow(10.0, gainsDb[band] / 40.0);
+		const double f0 = std::min<double>(kFrequencies[band], 0.45 * sampleRate);
+		const double w0 = 2.0 * M_PI * f0 / sampleRate;
+		const double cosw = cos(w0);
+		const double alpha = sin(w0) / (2.0 * M_SQRT1_2);
+		const double beta = 2.0 * sqrt(A) * alpha;
+		double b0, b1, b2, a0, a1, a2;
+		if (band == 0) {
+			b0 = A * ((A + 1) - (A - 1) * cosw + beta);
+			b1 = 2 * A * ((A - 1) - (A + 1) * cosw);
+			b2 = A * ((A + 1) - (A - 1) * cosw - beta);
+			a0 = (A + 1) + (A - 1) * cosw + beta;
+			a1 = -2 * ((A - 1) + (A + 1) * cosw);
+			a2 = (A + 1) + (A - 1) * cosw - beta;
+		} else if (band == kBands - 1) {
+			b0 = A * ((A + 1) + (A - 1) * cosw + beta);
+			b1 = -2 * A * ((A - 1) + (A + 1) * cosw);
+			b2 = A * ((A + 1) + (A - 1) * cosw - beta);
+			a0 = (A + 1) - (A - 1) * cosw + beta;
+			a1 = 2 * ((A - 1) - (A + 1) * cosw);
+			a2 = (A + 1) - (A - 1) * cosw - beta;
+		} else {
+			b0 = 1 + alpha * A;
+			b1 = -2 * cosw;
+			b2 = 1 - alpha * A;
+			a0 = 1 + alpha / A;
+			a1 = -2 * cosw;
+			a2 = 1 - alpha / A;
+		}
+		out[band].b0 = b0 / a0;
+		out[band].b1 = b1 / a0;
+		out[band].b2 = b2 / a0;
+		out[band].a1 = a1 / a0;
+		out[band].a2 = a2 / a0;
+	}
+}
+
+void Equalizer::process(int16_t* samples, size_t frames)
+{
+	if (flat)
+		return;
+	while (rampLeft > 0 && frames > 0) {
+		const size_t block = std::min(kEqRampBlock, frames);
+		if (block >= rampLeft) {
+			memcpy(stages, targets, sizeof(stages));
+			rampLeft = 0;
+		} else {
+			const float t = static_cast<float>(block) / rampLeft;
+			for (int band = 0; band < kBands; band++) {
+				Biquad& s = stages[band];
+				const Biquad& d = targets[band];
+				s.b0 += (d.b0 - s.b0) * t;
+				s.b1 += (d.b1 - s.b1) * t;
+				s.b2 += (d.b2 - s.b2) * t;
+				s.a1 += (d.a1 - s.a1) * t;
+				s.a2 += (d.a2 - s.a2) * t;
+			}
+			rampLeft -= block;
+		}
+		filter(samples, block);
+		samples += block * stride;
+		frames -= block;
+	}
+	filter(samples, frames);
+
+	/* Back at 0 dB, the state decays on its own; skip once it has. */
+	if (targetFlat && rampLeft == 0) {
+		for (int band = 0; band < kBands; band++) {
+			for (int c = 0; c < channels; c++) {
+				if (fabsf(z1[band][c]) > kEqQuietState ||
+				    fabsf(z2[band][c]) > kEqQuietState)
+					return;
+			}
+		}
+		memset(z1, 0, sizeof(z1));
+		memset(z2, 0, sizeof(z2));
+		flat = true;
+	}
+}
+
+void Equalizer::filter(int16_t* samples, size_t frames)
+{
+	for (size_t f = 0; f < frames; f++) {
+		for (int c = 0; c < channels; c++) {
+			float x = samples[f * stride + c];
+			for (int band = 0; band < kBands; band++) {
+				const Biquad& s = stages[band];
+				float y = s.b0 * x + z1[band][c];
+				z1[band][c] = s.b1 * x - s.a1 * y + z2[band][c];
+				z2[band][c] = s.b2 * x - s.a2 * y;
+				x = y;
+			}
+			samples[f * stride + c] = dsp::saturate(x);
+		}
+	}
+}
+
+}
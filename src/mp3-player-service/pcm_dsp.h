@@ -0,0 +1,79 @@
+#ifndef MP3_PLAYER_SERVICE_PCM_DSP_H_
+#define MP3_PLAYER_SERVICE_PCM_DSP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mp3_player_service {
+
+/*
+ * PCM kernels for the playback path. They work on interleaved 16-bit
+ * samples, compute in float and saturate on the way back. Each has a NEON
+ * and an SSE2 path with a scalar fallback for everything else.
+ */
+namespace dsp {
+
+/* Multiplies by a gain ramping linearly from startGain to endGain. */
+void applyGainRamp(int16_t* samples, size_t count, float startGain, float endGain);
+
+/*
+ * out = outgoing * gOut + incoming * gIn, with both gains ramping linearly
+ * across the block. Feed it crossfadeGains() at the block edges.
+ */
+void mixCrossfade(int16_t* out, const int16_t* outgoing, const int16_t* incoming,
+                  size_t count, float outStart, float outEnd,
+                  float inStart, float inEnd);
+
+/* Equal-power (cos/sin) crossfade gains at position t in [0, 1]. */
+void crossfadeGains(float t, float* outgoing, float* incoming);
+
+/* Name of the kernel implementation compiled in, for logs and benchmarks. */
+const char* simdName();
+
+}
+
+/*
+ * Three-band equalizer: 100 Hz low shelf, 1 kHz peak and 8 kHz high shelf,
+ * as RBJ biquads in transposed direct form II. A biquad is a recurrence over
+ * time, so it runs sample by sample; with every band at 0 dB it is skipped.
+ *
+ * New gains do not restart the filters. Their coefficients move towards the
+ * new values a block at a time over a few milliseconds while the state
+ * carries on, so a change mid-stream does not click.
+ */
+class Equalizer {
+public:
+	enum { kBands = 3, kMaxChannels = 2 };
+
+	Equalizer(int sampleRate, int channels);
+
+	void setGains(const float gainsDb[kBands]);
+	bool isFlat() const { return flat; }
+	void process(int16_t* samples, size_t frames);
+
+private:
+	struct Biquad {
+		float b0, b1, b2, a1, a2;
+	};
+
+	void design(const float gainsDb[kBands], Biquad out[kBands]) const;
+	void filter(int16_t* samples, size_t frames);
+
+	int sampleRate;
+	/* Interleaved channels in the input, and how many of them we filter. */
+	int stride;
+	int channels;
+	/* At 0 dB with nothing left ringing in the state: process() is a no-op. */
+	bool flat;
+	bool targetFlat;
+	/* Frames until stages reach targets. */
+	size_t rampLeft;
+	Biquad stages[kBands];
+	Biquad targets[kBands];
+	float z1[kBands][kMaxChannels];
+	float z2[kBands][kMaxChannels];
+};
+
+}
+
+#endif
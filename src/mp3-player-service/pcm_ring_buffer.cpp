@@ -0,0 +1,123 @@
+#include "pcm_ring_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace mp3_player_service {
+
+static size_t roundUpToPowerOfTwo(size_t n)
+{
+	size_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+PcmRingBuffer::PcmRingBuffer(size_t minCapacity)
+	: storage(roundUpToPowerOfTwo(std::max<size_t>(minCapacity, 2))),
+	  mask(storage.size() - 1),
+	  writePos(0),
+	  discardPos(0),
+	  readPos(0)
+{
+}
+
+void* PcmRingBuffer::operator new(size_t size)
+{
+	void* p = NULL;
+	if (posix_memalign(&p, alignof(PcmRingBuffer), size) != 0)
+		abort();
+	return p;
+}
+
+void PcmRingBuffer::operator delete(void* p)
+{
+	free(p);
+}
+
+size_t PcmRingBuffer::fill() const
+{
+	const uint64_t w = writePos.load(std::memory_order_acquire);
+	const uint64_t r = std::max(readPos.load(std::memory_order_acquire),
+	                            discardPos.load(std::memory_order_acquire));
+	return w - r;
+}
+
+size_t PcmRingBuffer::space() const
+{
+	return capacity() - (writePos.load(std::memory_order_relaxed) -
+	                     readPos.load(std::memory_order_acquire));
+}
+
+size_t PcmRingBuffer::write(const void* data, size_t bytes)
+{
+	const uint64_t w = writePos.load(std::memory_order_relaxed);
+	const uint64_t r = readPos.load(std::memory_order_acquire);
+	bytes = std::min<size_t>(bytes, capacity() - (w - r));
+	if (bytes == 0)
+		return 0;
+
+	const size_t offset = w & mask;
+	const size_t first = std::min(bytes, capacity() - offset);
+	memcpy(&storage[offset], data, first);
+	memcpy(&storage[0], static_cast<const uint8_t*>(data) + first, bytes - first);
+	writePos.store(w + bytes, std::memory_order_release);
+	return bytes;
+}
+
+size_t PcmRingBuffer::read(void* data, size_t bytes)
+{
+	uint64_t r = readPos.load(std::memory_order_relaxed);
+	const uint64_t d = discardPos.load(std::memory_order_acquire);
+	if (d > r) {
+		r = d;
+		readPos.store(r, std::memory_order_release);
+	}
+	const uint64_t w = writePos.load(std::memory_order_acquire);
+	bytes = std::min<size_t>(bytes, w - r);
+	if (bytes == 0)
+		return 0;
+
+	const size_t offset = r & mask;
+	const size_t first = std::min(bytes, capacity() - offset);
+	memcpy(data, &storage[offset], first);
+	memcpy(static_cast<uint8_t*>(data) + first, &storage[0], bytes - first);
+	readPos.store(r + bytes, std::memory_order_release);
+	return bytes;
+}
+
+void PcmRingBuffer::flush()
+{
+	discardPos.store(writePos.load(std::memory_order_relaxed),
+	                 std::memory_order_release);
+}
+
+uint64_t PcmRingBuffer::readPosition() const
+{
+	return std::max(readPos.load(std::memory_order_acquire),
+	                discardPos.load(std::memory_order_acquire));
+}
+
+void PcmRingBuffer::peek(uint64_t pos, void* data, size_t bytes) const
+{
+	const size_t offset = pos & mask;
+	const size_t first = std::min(bytes, capacity() - offset);
+	memcpy(data, &storage[offset], first);
+	memcpy(static_cast<uint8_t*>(data) + first, &storage[0], bytes - first);
+}
+
+void PcmRingBuffer::skipTo(uint64_t pos)
+{
+	if (pos > readPos.load(std::memory_order_relaxed))
+		readPos.store(pos, std::memory_order_release);
+}
+
+void PcmRingBuffer::skipAll()
+{
+	readPos.store(writePos.load(std::memory_order_acquire),
+	              std::memory_order_release);
+}
+
+}
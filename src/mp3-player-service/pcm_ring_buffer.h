@@ -0,0 +1,72 @@
+#ifndef MP3_PLAYER_SERVICE_PCM_RING_BUFFER_H_
+#define MP3_PLAYER_SERVICE_PCM_RING_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+namespace mp3_player_service {
+
+/*
+ * Single-producer/single-consumer ring of decoded PCM bytes.
+ *
+ * The decode thread is the only writer and the AudioPlayer fill callback the
+ * only reader, so the two positions are plain atomics and neither side ever
+ * takes a lock. Positions count bytes since creation and never wrap; the
+ * capacity is rounded up to a power of two so indexing is a mask.
+ *
+ * flush() lets the producer drop data it has already published without
+ * touching the read position: it records a discard mark that the consumer
+ * skips to on its next read.
+ */
+class PcmRingBuffer {
+public:
+	explicit PcmRingBuffer(size_t minCapacity);
+
+	/* operator new only guarantees the alignment of the members before C++17. */
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+
+	size_t capacity() const { return mask + 1; }
+	/* Bytes the consumer could read right now. */
+	size_t fill() const;
+	/* Bytes the producer could write right now. */
+	size_t space() const;
+
+	/* Producer side; returns the number of bytes actually copied. */
+	size_t write(const void* data, size_t bytes);
+	/* Consumer side; returns the number of bytes actually copied. */
+	size_t read(void* data, size_t bytes);
+	/* Producer side; everything written so far is skipped by the consumer. */
+	void flush();
+	/* Consumer side; drops everything currently readable. */
+	void skipAll();
+
+	/* Where the next read and the next write start, in bytes since creation. */
+	uint64_t readPosition() const;
+	uint64_t writePosition() const { return writePos.load(std::memory_order_acquire); }
+	/*
+	 * Producer side; copies out bytes already written, from pos on, without
+	 * consuming them. The consumer may read them meanwhile: only the producer
+	 * overwrites data, so they stay intact until its next write().
+	 */
+	void peek(uint64_t pos, void* data, size_t bytes) const;
+	/* Consumer side; drops everything before pos. */
+	void skipTo(uint64_t pos);
+
+private:
+	std::vector<uint8_t> storage;
+	size_t mask;
+
+	/* Keep what the producer and the consumer write on separate cache lines
+	 * so their cores do not bounce a shared line on every update. */
+	alignas(64) std::atomic<uint64_t> writePos;
+	std::atomic<uint64_t> discardPos;
+	alignas(64) std::atomic<uint64_t> readPos;
+};
+
+}
+
+#endif
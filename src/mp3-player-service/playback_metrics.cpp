@@ -0,0 +1,56 @@
+#include "playback_metrics.h"
+
+#include <base/strings/stringprintf.h>
+
+using android::OK;
+using android::Parcel;
+using android::status_t;
+
+namespace brillo {
+namespace demo {
+
+status_t PlaybackMetrics::writeToParcel(Parcel* parcel) const
+{
+	status_t err;
+	if ((err = parcel->writeInt64(timeToFirstAudioUs)) != OK ||
+	    (err = parcel->writeInt32(decodedFrames)) != OK ||
+	    (err = parcel->writeInt64(decodeTimeAvgUs)) != OK ||
+	    (err = parcel->writeInt64(decodeTimeMaxUs)) != OK ||
+	    (err = parcel->writeInt32(underruns)) != OK ||
+	    (err = parcel->writeInt32(bufferFillPercent)) != OK ||
+	    (err = parcel->writeInt64(bytesPerSecond)) != OK)
+		return err;
+	return OK;
+}
+
+status_t PlaybackMetrics::readFromParcel(const Parcel* parcel)
+{
+	status_t err;
+	if ((err = parcel->readInt64(&timeToFirstAudioUs)) != OK ||
+	    (err = parcel->readInt32(&decodedFrames)) != OK ||
+	    (err = parcel->readInt64(&decodeTimeAvgUs)) != OK ||
+	    (err = parcel->readInt64(&decodeTimeMaxUs)) != OK ||
+	    (err = parcel->readInt32(&underruns)) != OK ||
+	    (err = parcel->readInt32(&bufferFillPercent)) != OK ||
+	    (err = parcel->readInt64(&bytesPerSecond)) != OK)
+		return err;
+	return OK;
+}
+
+std::string PlaybackMetrics::toString() const
+{
+	return base::StringPrintf(
+		"  time to first audio: %lld us\n"
+		"  decoded frames:      %d\n"
+		"  decode time:         avg %lld us, max %lld us\n"
+		"  buffer underruns:    %d\n"
+		"  buffer fill:         %d%%\n"
+		"  bytes read:          %lld B/s\n",
+		static_cast<long long>(timeToFirstAudioUs), decodedFrames,
+		static_cast<long long>(decodeTimeAvgUs),
+		static_cast<long long>(decodeTimeMaxUs), underruns,
+		bufferFillPercent, static_cast<long long>(bytesPerSecond));
+}
+
+}
+}
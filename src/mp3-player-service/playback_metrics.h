@@ -0,0 +1,43 @@
+#ifndef MP3_PLAYER_SERVICE_PLAYBACK_METRICS_H_
+#define MP3_PLAYER_SERVICE_PLAYBACK_METRICS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include <binder/Parcel.h>
+#include <binder/Parcelable.h>
+
+namespace brillo {
+namespace demo {
+
+/*
+ * Snapshot of playback performance for the current track, returned by
+ * IMp3PlayerService::getMetrics() and printed by dumpsys.
+ */
+class PlaybackMetrics : public android::Parcelable {
+public:
+	PlaybackMetrics() = default;
+
+	android::status_t writeToParcel(android::Parcel* parcel) const override;
+	android::status_t readFromParcel(const android::Parcel* parcel) override;
+
+	/* Multi-line human readable form, used by dump(). */
+	std::string toString() const;
+
+	/* From play() to the first decoded audio reaching the sink; -1 if not yet. */
+	int64_t timeToFirstAudioUs = -1;
+	/* Decoder output buffers (one mp3 frame each) and the time spent on them. */
+	int32_t decodedFrames = 0;
+	int64_t decodeTimeAvgUs = 0;
+	int64_t decodeTimeMaxUs = 0;
+	int32_t underruns = 0;
+	int32_t bufferFillPercent = 0;
+	/* Compressed bytes read from the file, averaged over the track so far. */
+	int64_t bytesPerSecond = 0;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,110 @@
+#include "stagefright_track_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <media/stagefright/FileSource.h>
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MetaData.h>
+#include <media/stagefright/OMXCodec.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <include/MP3Extractor.h>
+
+using namespace android;
+
+namespace mp3_player_service {
+
+StagefrightTrackDecoder::StagefrightTrackDecoder()
+	: connected(false), buffer(nullptr), frameSize(0)
+{
+}
+
+StagefrightTrackDecoder::~StagefrightTrackDecoder()
+{
+	close();
+	if (connected)
+		client.disconnect();
+}
+
+void StagefrightTrackDecoder::close()
+{
+	if (buffer) {
+		buffer->release();
+		buffer = nullptr;
+	}
+	if (decoder != NULL) {
+		decoder->stop();
+		decoder.clear();
+	}
+}
+
+bool StagefrightTrackDecoder::open(const std::string& path, int* sampleRate,
+                                   int* channels)
+{
+	close();
+	if (!connected) {
+		if (client.connect() != OK) {
+			LOG(ERROR) << "Could not connect to OMX for analysis.";
+			return false;
+		}
+		connected = true;
+	}
+
+	sp<FileSource> file_source = new FileSource(path.c_str());
+	if (file_source->initCheck() != OK)
+		return false;
+	sp<MediaExtractor> media_extractor = new MP3Extractor(file_source, new AMessage());
+	if (media_extractor->countTracks() == 0)
+		return false;
+	sp<MediaSource> media_source = media_extractor->getTrack(0);
+	decoder = OMXCodec::Create(client.interface(), media_source->getFormat(), false,
+	                           media_source, NULL, OMXCodec::kSoftwareCodecsOnly);
+	if (decoder == NULL || decoder->start() != OK) {
+		decoder.clear();
+		return false;
+	}
+
+	int32_t rate = 0, count = 0;
+	sp<MetaData> format = decoder->getFormat();
+	if (!format->findInt32(kKeySampleRate, &rate) ||
+	    !format->findInt32(kKeyChannelCount, &count)) {
+		close();
+		return false;
+	}
+	*sampleRate = rate;
+	*channels = count;
+	frameSize = count * sizeof(int16_t);
+	return true;
+}
+
+size_t StagefrightTrackDecoder::read(int16_t* samples, size_t maxFrames)
+{
+	uint8_t* out = reinterpret_cast<uint8_t*>(samples);
+	size_t left = maxFrames * frameSize;
+	while (left > 0 && decoder != NULL) {
+		if (!buffer) {
+			status_t err = decoder->read(&buffer);
+			if (err == INFO_FORMAT_CHANGED)
+				continue;
+			if (err != OK) {
+				buffer = nullptr;
+				break;
+			}
+		}
+		size_t n = std::min(left, buffer->range_length());
+		memcpy(out, static_cast<const uint8_t*>(buffer->data()) + buffer->range_offset(), n);
+		out += n;
+		left -= n;
+		buffer->set_range(buffer->range_offset() + n, buffer->range_length() - n);
+		if (buffer->range_length() == 0) {
+			buffer->release();
+			buffer = nullptr;
+		}
+	}
+	return (maxFrames * frameSize - left) / frameSize;
+}
+
+}
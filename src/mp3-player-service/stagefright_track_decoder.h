@@ -0,0 +1,37 @@
+#ifndef MP3_PLAYER_SERVICE_STAGEFRIGHT_TRACK_DECODER_H_
+#define MP3_PLAYER_SERVICE_STAGEFRIGHT_TRACK_DECODER_H_
+
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/OMXClient.h>
+
+#include "loudness_analyzer.h"
+
+namespace mp3_player_service {
+
+/*
+ * Decodes a library mp3 for analysis with the software OMX decoder, so it
+ * never competes with playback for a hardware codec instance. Each instance
+ * keeps its own OMX connection for the tracks it is given.
+ */
+class StagefrightTrackDecoder : public TrackDecoder {
+public:
+	StagefrightTrackDecoder();
+	~StagefrightTrackDecoder() override;
+
+	bool open(const std::string& path, int* sampleRate, int* channels) override;
+	size_t read(int16_t* samples, size_t maxFrames) override;
+
+private:
+	void close();
+
+	android::OMXClient client;
+	bool connected;
+	android::sp<android::MediaSource> decoder;
+	android::MediaBuffer* buffer;
+	size_t frameSize;
+};
+
+}
+
+#endif
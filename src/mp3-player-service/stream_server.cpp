@@ -0,0 +1,618 @@
+#include "stream_server.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+
+namespace mp3_player_service {
+
+/* Request headers larger than this are rejected. */
+static const size_t kMaxRequestBytes = 8192;
+/* Upper bound on one sendfile() call so a fast client cannot hog the loop. */
+static const size_t kMaxSendChunk = 1 << 20;
+static const int kMaxEvents = 64;
+/* Further clients are turned away until one of these closes. */
+static const size_t kMaxConnections = 16;
+/* A client that neither sends nor takes data for this long is dropped. */
+static const int64_t kIdleTimeoutMs = 30000;
+/* How often idle connections are looked for. */
+static const int kIdleCheckMs = 1000;
+/* epoll data of the listening socket and the wake-up eventfd; connections
+ * are numbered after them. */
+static const uint64_t kListenId = 0;
+static const uint64_t kWakeId = 1;
+static const uint64_t kFirstConnectionId = 2;
+
+static int64_t nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ll + ts.tv_nsec / 1000000;
+}
+
+struct StreamServer::Connection {
+	/* Never reused, unlike fd; what epoll reports events for. */
+	uint64_t id;
+	int fd;
+	std::string input;
+	/* Response head (or a small generated body) still to be sent. */
+	std::string output;
+	size_t outputSent;
+	/* File body still to be sent with sendfile(). */
+	int fileFd;
+	off_t fileOffset;
+	off_t fileRemaining;
+	bool keepAlive;
+	uint32_t events;
+	/* When the client last sent or took any data. */
+	int64_t lastActiveMs;
+};
+
+StreamServer::StreamServer(const std::string& root, uint16_t port,
+                           bool loopbackOnly)
+	: root(root),
+	  requestedPort(port),
+	  boundPort(0),
+	  loopbackOnly(loopbackOnly),
+	  listenFd(-1),
+	  epollFd(-1),
+	  wakeFd(-1),
+	  running(false),
+	  nextConnectionId(kFirstConnectionId),
+	  totalConnections(0),
+	  totalRequests(0),
+	  totalBytesSent(0),
+	  activeConnections(0)
+{
+}
+
+StreamServer::~StreamServer()
+{
+	stop();
+}
+
+bool StreamServer::start()
+{
+	/* A client hanging up mid-sendfile() would otherwise kill the process. */
+	signal(SIGPIPE, SIG_IGN);
+
+	listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		PLOG(ERROR) << "socket";
+		return false;
+	}
+	int one = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(requestedPort);
+	addr.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+	if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+	    listen(listenFd, SOMAXCONN) < 0) {
+		PLOG(ERROR) << "Could not listen on port " << requestedPort;
+		stop();
+		return false;
+	}
+	socklen_t len = sizeof(addr);
+	getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+	boundPort = ntohs(addr.sin_port);
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || wakeFd < 0) {
+		PLOG(ERROR) << "epoll/eventfd";
+		stop();
+		return false;
+	}
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = kListenId;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+	ev.data.u64 = kWakeId;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+	running = true;
+	thread = std::thread(&StreamServer::loop, this);
+	LOG(INFO) << "Streaming " << root << " on port " << boundPort;
+	return true;
+}
+
+void StreamServer::stop()
+{
+	if (running.exchange(false)) {
+		uint64_t one = 1;
+		if (write(wakeFd, &one, sizeof(one)) < 0)
+			PLOG(WARNING) << "Could not wake the stream server";
+		thread.join();
+	}
+	while (!connections.empty())
+		closeConnection(connections.begin()->second.get());
+	for (int* fd : { &listenFd, &epollFd, &wakeFd }) {
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+	}
+}
+
+StreamServer::Stats StreamServer::stats() const
+{
+	Stats s;
+	s.connections = totalConnections.load();
+	s.requests = totalRequests.load();
+	s.bytesSent = totalBytesSent.load();
+	s.activeConnections = activeConnections.load();
+	return s;
+}
+
+void StreamServer::loop()
+{
+	epoll_event events[kMaxEvents];
+	int64_t lastIdleCheck = nowMs();
+	while (running) {
+		int n = epoll_wait(epollFd, events, kMaxEvents,
+		                   connections.empty() ? -1 : kIdleCheckMs);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			PLOG(ERROR) << "epoll_wait";
+			return;
+		}
+		for (int i = 0; i < n; i++) {
+			uint64_t id = events[i].data.u64;
+			if (id == kWakeId)
+				continue;
+			if (id == kListenId) {
+				acceptClients();
+				continue;
+			}
+			/* Gone if closed earlier in this batch. */
+			auto it = connections.find(id);
+			if (it == connections.end())
+				continue;
+			Connection* conn = it->second.get();
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				closeConnection(conn);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT)
+				onWritable(conn);
+			else if (events[i].events & EPOLLIN)
+				onReadable(conn);
+		}
+		int64_t now = nowMs();
+		if (now - lastIdleCheck >= kIdleCheckMs) {
+			closeIdleConnections(now);
+			lastIdleCheck = now;
+		}
+	}
+}
+
+void StreamServer::closeIdleConnections(int64_t now)
+{
+	std::vector<Connection*> idle;
+	for (const auto& entry : connections) {
+		if (now - entry.second->lastActiveMs >= kIdleTimeoutMs)
+			idle.push_back(entry.second.get());
+	}
+	for (Connection* conn : idle)
+		closeConnection(conn);
+}
+
+void StreamServer::acceptClients()
+{
+	for (;;) {
+		int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				PLOG(WARNING) << "accept";
+			return;
+		}
+		if (connections.size() >= kMaxConnections) {
+			close(fd);
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		std::unique_ptr<Connection> conn(new Connection());
+		conn->id = nextConnectionId++;
+		conn->fd = fd;
+		conn->outputSent = 0;
+		conn->fileFd = -1;
+		conn->fileOffset = 0;
+		conn->fileRemaining = 0;
+		conn->keepAlive = false;
+		conn->events = 0;
+		conn->lastActiveMs = nowMs();
+		Connection* raw = conn.get();
+		connections[raw->id] = std::move(conn);
+		totalConnections++;
+		activeConnections++;
+		watch(raw, EPOLLIN);
+	}
+}
+
+void StreamServer::watch(Connection* conn, uint32_t events)
+{
+	if (conn->events == events)
+		return;
+	epoll_event ev = {};
+	ev.events = events;
+	ev.data.u64 = conn->id;
+	epoll_ctl(epollFd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+	          conn->fd, &ev);
+	conn->events = events;
+}
+
+void StreamServer::closeConnection(Connection* conn)
+{
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	if (conn->fileFd >= 0)
+		close(conn->fileFd);
+	activeConnections--;
+	/* The key must not live in the node being erased. */
+	const uint64_t id = conn->id;
+	connections.erase(id);
+}
+
+void StreamServer::onReadable(Connection* conn)
+{
+	char buf[2048];
+	for (;;) {
+		ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+		if (n > 0) {
+			conn->lastActiveMs = nowMs();
+			conn->input.append(buf, n);
+			if (conn->input.size() > kMaxRequestBytes) {
+				prepareError(conn, 431, "Request Header Fields Too Large");
+				conn->keepAlive = false;
+				onWritable(conn);
+				return;
+			}
+			continue;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			closeConnection(conn);
+			return;
+		}
+		if (errno == EINTR)
+			continue;
+		break;
+	}
+	if (startResponse(conn))
+		onWritable(conn);
+}
+
+static std::string lowerCase(std::string s)
+{
+	std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+	return s;
+}
+
+static bool urlDecode(const std::string& in, std::string* out)
+{
+	out->clear();
+	for (size_t i = 0; i < in.size(); i++) {
+		if (in[i] != '%') {
+			out->push_back(in[i] == '+' ? ' ' : in[i]);
+			continue;
+		}
+		if (i + 2 >= in.size() || !isxdigit(in[i + 1]) || !isxdigit(in[i + 2]))
+			return false;
+		out->push_back(static_cast<char>(strtol(in.substr(i + 1, 2).c_str(), NULL, 16)));
+		i += 2;
+	}
+	return true;
+}
+
+/*
+ * Parses one complete request out of conn->input and prepares its response.
+ * Returns false if the request is not complete yet.
+ */
+bool StreamServer::startResponse(Connection* conn)
+{
+	size_t end = conn->input.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return false;
+	std::string head = conn->input.substr(0, end);
+	conn->input.erase(0, end + 4);
+	totalRequests++;
+
+	size_t lineEnd = head.find("\r\n");
+	std::string requestLine = head.substr(0, lineEnd);
+	size_t sp1 = requestLine.find(' ');
+	size_t sp2 = requestLine.rfind(' ');
+	if (sp1 == std::string::npos || sp2 == sp1) {
+		conn->keepAlive = false;
+		prepareError(conn, 400, "Bad Request");
+		return true;
+	}
+	std::string method = requestLine.substr(0, sp1);
+	std::string target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+	std::string version = requestLine.substr(sp2 + 1);
+
+	std::string range;
+	std::string connection;
+	size_t pos = lineEnd;
+	while (pos != std::string::npos && pos < head.size()) {
+		size_t next = head.find("\r\n", pos + 2);
+		std::string line = head.substr(pos + 2, next == std::string::npos ?
+		                                        std::string::npos : next - pos - 2);
+		size_t colon = line.find(':');
+		if (colon != std::string::npos) {
+			std::string name = lowerCase(line.substr(0, colon));
+			size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+			std::string value = valueStart == std::string::npos ?
+			                    "" : line.substr(valueStart);
+			if (name == "range")
+				range = value;
+			else if (name == "connection")
+				connection = lowerCase(value);
+		}
+		pos = next;
+	}
+	conn->keepAlive = (version == "HTTP/1.1") ? connection != "close"
+	                                          : connection == "keep-alive";
+
+	if (method != "GET" && method != "HEAD") {
+		prepareError(conn, 405, "Method Not Allowed");
+		return true;
+	}
+	std::string name;
+	if (target.empty() || target[0] != '/' ||
+	    !urlDecode(target.substr(1, target.find('?') - 1), &name)) {
+		prepareError(conn, 400, "Bad Request");
+		return true;
+	}
+	if (name.empty())
+		prepareListing(conn, method);
+	else
+		prepareFile(conn, method, name, range);
+	return true;
+}
+
+void StreamServer::prepareError(Connection* conn, int code, const char* reason)
+{
+	char head[256];
+	snprintf(head, sizeof(head),
+	         "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+	         code, reason, conn->keepAlive ? "keep-alive" : "close");
+	conn->output = head;
+	conn->outputSent = 0;
+}
+
+void StreamServer::prepareListing(Connection* conn, const std::string& method)
+{
+	std::string body;
+	DIR* dp = opendir(root.c_str());
+	if (dp) {
+		struct dirent* dirp;
+		while ((dirp = readdir(dp)) != NULL) {
+			std::string filename(dirp->d_name);
+			if (filename.find(".mp3") != std::string::npos)
+				body += filename + "\n";
+		}
+		closedir(dp);
+	}
+	char head[256];
+	snprintf(head, sizeof(head),
+	         "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+	         "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+	         body.size(), conn->keepAlive ? "keep-alive" : "close");
+	conn->output = head;
+	if (method == "GET")
+		conn->output += body;
+	conn->outputSent = 0;
+}
+
+enum RangeResult {
+	kRangeIgnored,
+	kRangeSatisfiable,
+	kRangeUnsatisfiable,
+};
+
+static bool parseBytePos(const std::string& s, long long* value)
+{
+	if (s.empty() || !isdigit(static_cast<unsigned char>(s[0])))
+		return false;
+	char* endp;
+	errno = 0;
+	*value = strtoll(s.c_str(), &endp, 10);
+	return *endp == '\0' && errno == 0;
+}
+
+/*
+ * Parses a single "bytes=first-last" range against a file of the given size.
+ * As RFC 7233 allows, anything this server does not handle, a malformed
+ * header or several ranges included, is ignored and the whole file sent.
+ */
+static RangeResult parseRange(const std::string& range, off_t size,
+                              off_t* first, off_t* last)
+{
+	if (range.compare(0, 6, "bytes=") != 0 ||
+	    range.find(',') != std::string::npos)
+		return kRangeIgnored;
+	std::string spec = range.substr(6);
+	size_t dash = spec.find('-');
+	if (dash == std::string::npos)
+		return kRangeIgnored;
+	std::string a = spec.substr(0, dash);
+	std::string b = spec.substr(dash + 1);
+	if (a.empty()) {
+		/* Suffix range: the last N bytes. */
+		long long n;
+		if (!parseBytePos(b, &n))
+			return kRangeIgnored;
+		if (n == 0 || size == 0)
+			return kRangeUnsatisfiable;
+		*first = size > n ? size - n : 0;
+		*last = size - 1;
+		return kRangeSatisfiable;
+	}
+	long long f, l = size - 1;
+	if (!parseBytePos(a, &f))
+		return kRangeIgnored;
+	if (!b.empty() && (!parseBytePos(b, &l) || l < f))
+		return kRangeIgnored;
+	if (f >= size)
+		return kRangeUnsatisfiable;
+	*first = f;
+	*last = std::min<long long>(l, size - 1);
+	return kRangeSatisfiable;
+}
+
+void StreamServer::prepareFile(Connection* conn, const std::string& method,
+                               const std::string& name, const std::string& range)
+{
+	/* The library is flat; refuse anything that could leave it. */
+	if (name.find('/') != std::string::npos || name[0] == '.') {
+		prepareError(conn, 404, "Not Found");
+		return;
+	}
+	int fd = open((root + "/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		if (fd >= 0)
+			close(fd);
+		prepareError(conn, 404, "Not Found");
+		return;
+	}
+
+	off_t first = 0, last = st.st_size - 1;
+	char head[512];
+	RangeResult ranged = range.empty() ? kRangeIgnored
+	                                   : parseRange(range, st.st_size, &first, &last);
+	if (ranged == kRangeUnsatisfiable) {
+		close(fd);
+		snprintf(head, sizeof(head),
+		         "HTTP/1.1 416 Range Not Satisfiable\r\n"
+		         "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n"
+		         "Connection: %s\r\n\r\n",
+		         static_cast<long long>(st.st_size),
+		         conn->keepAlive ? "keep-alive" : "close");
+		conn->output = head;
+		conn->outputSent = 0;
+		return;
+	}
+
+	off_t length = last - first + 1;
+	if (ranged == kRangeIgnored) {
+		snprintf(head, sizeof(head),
+		         "HTTP/1.1 200 OK\r\nContent-Type: audio/mpeg\r\n"
+		         "Accept-Ranges: bytes\r\nContent-Length: %lld\r\n"
+		         "Connection: %s\r\n\r\n",
+		         static_cast<long long>(length),
+		         conn->keepAlive ? "keep-alive" : "close");
+	} else {
+		snprintf(head, sizeof(head),
+		         "HTTP/1.1 206 Partial Content\r\nContent-Type: audio/mpeg\r\n"
+		         "Accept-Ranges: bytes\r\nContent-Range: bytes %lld-%lld/%lld\r\n"
+		         "Content-Length: %lld\r\nConnection: %s\r\n\r\n",
+		         static_cast<long long>(first), static_cast<long long>(last),
+		         static_cast<long long>(st.st_size),
+		         static_cast<long long>(length),
+		         conn->keepAlive ? "keep-alive" : "close");
+	}
+	conn->output = head;
+	conn->outputSent = 0;
+	if (method == "HEAD" || length == 0) {
+		close(fd);
+		return;
+	}
+	conn->fileFd = fd;
+	conn->fileOffset = first;
+	conn->fileRemaining = length;
+}
+
+/* Sends as much of the pending response as the socket takes. */
+bool StreamServer::sendPending(Connection* conn)
+{
+	while (conn->outputSent < conn->output.size()) {
+		int flags = MSG_NOSIGNAL | (conn->fileRemaining > 0 ? MSG_MORE : 0);
+		ssize_t n = send(conn->fd, conn->output.data() + conn->outputSent,
+		                 conn->output.size() - conn->outputSent, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		conn->outputSent += n;
+		conn->lastActiveMs = nowMs();
+		totalBytesSent += n;
+	}
+	while (conn->fileRemaining > 0) {
+		size_t chunk = std::min<off_t>(conn->fileRemaining, kMaxSendChunk);
+		ssize_t n = sendfile(conn->fd, conn->fileFd, &conn->fileOffset, chunk);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (n == 0) {
+			/* File shrank under us; the response cannot be completed. */
+			return false;
+		}
+		conn->fileRemaining -= n;
+		conn->lastActiveMs = nowMs();
+		totalBytesSent += n;
+		if (static_cast<size_t>(n) == chunk && conn->fileRemaining > 0) {
+			/* Yield to other clients; come back on the next EPOLLOUT. */
+			return true;
+		}
+	}
+	return true;
+}
+
+void StreamServer::onWritable(Connection* conn)
+{
+	for (;;) {
+		if (!sendPending(conn)) {
+			closeConnection(conn);
+			return;
+		}
+		if (conn->outputSent < conn->output.size() || conn->fileRemaining > 0) {
+			watch(conn, EPOLLOUT);
+			return;
+		}
+
+		/* Response complete. */
+		conn->output.clear();
+		conn->outputSent = 0;
+		if (conn->fileFd >= 0) {
+			close(conn->fileFd);
+			conn->fileFd = -1;
+		}
+		if (!conn->keepAlive) {
+			closeConnection(conn);
+			return;
+		}
+		/* Serve a pipelined request, or wait for the next one. */
+		if (!startResponse(conn)) {
+			watch(conn, EPOLLIN);
+			return;
+		}
+	}
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef MP3_PLAYER_SERVICE_STREAM_SERVER_H_
+#define MP3_PLAYER_SERVICE_STREAM_SERVER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace mp3_player_service {
+
+/*
+ * Minimal HTTP/1.1 server that streams the soundtrack library to the LAN.
+ *
+ * One thread runs an epoll loop over every client connection. Requests are
+ * limited to GET/HEAD of a file in the library root (or "/" for a listing)
+ * with an optional single byte range. File data goes from the page cache to
+ * the socket with sendfile(), so it never enters userspace.
+ *
+ * There is no authentication, so the server only listens on loopback unless
+ * told otherwise. At most kMaxConnections clients are served at once, and a
+ * connection that makes no progress for kIdleTimeoutMs is closed.
+ */
+class StreamServer {
+public:
+	struct Stats {
+		uint64_t connections;
+		uint64_t requests;
+		uint64_t bytesSent;
+		uint32_t activeConnections;
+	};
+
+	/* port 0 picks an ephemeral port; see port(). */
+	StreamServer(const std::string& root, uint16_t port, bool loopbackOnly);
+	~StreamServer();
+
+	bool start();
+	void stop();
+
+	uint16_t port() const { return boundPort; }
+	Stats stats() const;
+
+private:
+	struct Connection;
+
+	void loop();
+	void acceptClients();
+	void onReadable(Connection* conn);
+	void onWritable(Connection* conn);
+	bool startResponse(Connection* conn);
+	void prepareFile(Connection* conn, const std::string& method,
+	                 const std::string& name, const std::string& range);
+	void prepareListing(Connection* conn, const std::string& method);
+	void prepareError(Connection* conn, int code, const char* reason);
+	bool sendPending(Connection* conn);
+	void watch(Connection* conn, uint32_t events);
+	void closeConnection(Connection* conn);
+	void closeIdleConnections(int64_t now);
+
+	std::string root;
+	uint16_t requestedPort;
+	uint16_t boundPort;
+	bool loopbackOnly;
+
+	int listenFd;
+	int epollFd;
+	int wakeFd;
+	std::thread thread;
+	std::atomic<bool> running;
+	/*
+	 * Keyed by connection id rather than fd: an fd closed while handling one
+	 * epoll batch can be reused by a client accepted in the same batch, and
+	 * the batch's later events for the old fd must not reach it.
+	 */
+	std::map<uint64_t, std::unique_ptr<Connection>> connections;
+	uint64_t nextConnectionId;
+
+	std::atomic<uint64_t> totalConnections;
+	std::atomic<uint64_t> totalRequests;
+	std::atomic<uint64_t> totalBytesSent;
+	std::atomic<uint32_t> activeConnections;
+};
+
+}
+
+#endif
@@ -0,0 +1,205 @@
+#include "track_index.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace mp3_player_service {
+
+/* Words longer than this are cut; nobody types 64 characters of a prefix. */
+static const size_t kMaxWordLength = 64;
+
+static bool isWordByte(unsigned char c)
+{
+	/* Anything non-ASCII is kept so UTF-8 words survive intact. */
+	return c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+	       (c >= 'A' && c <= 'Z');
+}
+
+static char foldByte(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* Calls fn(start, length) for each word of s, already case-folded into buf. */
+template <typename Fn>
+static void forEachWord(const std::string& s, std::string* buf, Fn fn)
+{
+	buf->clear();
+	for (size_t i = 0; i <= s.size(); i++) {
+		if (i < s.size() && isWordByte(s[i])) {
+			buf->push_back(foldByte(s[i]));
+			continue;
+		}
+		if (!buf->empty()) {
+			fn(buf->data(), std::min(buf->size(), kMaxWordLength));
+			buf->clear();
+		}
+	}
+}
+
+static int compareBytes(const char* a, size_t aLen, const char* b, size_t bLen)
+{
+	int c = memcmp(a, b, std::min(aLen, bLen));
+	if (c != 0)
+		return c;
+	return aLen < bLen ? -1 : (aLen > bLen ? 1 : 0);
+}
+
+TrackIndex::TrackIndex()
+	: sortedCount(0), indexedTracks(0)
+{
+}
+
+TrackIndex::Field TrackIndex::store(const std::string& value)
+{
+	Field field = { static_cast<uint32_t>(text.size()),
+	                static_cast<uint32_t>(value.size()) };
+	text.insert(text.end(), value.begin(), value.end());
+	return field;
+}
+
+void TrackIndex::addWords(TrackId id, const std::string& value)
+{
+	std::string buf;
+	forEachWord(value, &buf, [this, id](const char* word, size_t length) {
+		Posting posting = { static_cast<uint32_t>(words.size()), id,
+		                    static_cast<uint16_t>(length) };
+		words.insert(words.end(), word, word + length);
+		words.push_back('\0');
+		postings.push_back(posting);
+	});
+}
+
+void TrackIndex::add(TrackId id, const std::string& title,
+                     const std::string& artist, const std::string& album)
+{
+	if (id >= tracks.size())
+		tracks.resize(id + 1, Track());
+	tracks[id].title = store(title);
+	tracks[id].artist = store(artist);
+	tracks[id].album = store(album);
+	const size_t firstWord = words.size();
+	addWords(id, title);
+	addWords(id, artist);
+	addWords(id, album);
+	tracks[id].words.offset = firstWord;
+	tracks[id].words.length = words.size() - firstWord;
+	indexedTracks++;
+}
+
+bool TrackIndex::postingLess(const Posting& a, const Posting& b) const
+{
+	int c = compareBytes(&words[a.word], a.length, &words[b.word], b.length);
+	return c != 0 ? c < 0 : a.track < b.track;
+}
+
+void TrackIndex::commit()
+{
+	if (sortedCount == postings.size())
+		return;
+	auto less = [this](const Posting& a, const Posting& b) { return postingLess(a, b); };
+	std::sort(postings.begin() + sortedCount, postings.end(), less);
+	std::inplace_merge(postings.begin(), postings.begin() + sortedCount,
+	                   postings.end(), less);
+	sortedCount = postings.size();
+}
+
+void TrackIndex::prefixRun(const std::string& prefix, PostingIterator* first,
+                           PostingIterator* last) const
+{
+	const PostingIterator begin = postings.begin();
+	const PostingIterator end = postings.begin() + sortedCount;
+	*first = std::lower_bound(begin, end, prefix,
+		[this](const Posting& p, const std::string& key) {
+			return compareBytes(&words[p.word], p.length, key.data(), key.size()) < 0;
+		});
+	/* Compared on the prefix length only, every word starting with it is equal. */
+	*last = std::upper_bound(*first, end, prefix,
+		[this](const std::string& key, const Posting& p) {
+			return compareBytes(key.data(), key.size(), &words[p.word],
+			                    std::min<size_t>(p.length, key.size())) < 0;
+		});
+}
+
+bool TrackIndex::hasWordWithPrefix(TrackId id, const std::string& prefix) const
+{
+	const char* p = &words[tracks[id].words.offset];
+	const char* end = p + tracks[id].words.length;
+	while (p < end) {
+		size_t length = strlen(p);
+		if (length >= prefix.size() && memcmp(p, prefix.data(), prefix.size()) == 0)
+			return true;
+		p += length + 1;
+	}
+	return false;
+}
+
+std::vector<TrackIndex::TrackId> TrackIndex::search(const std::string& query,
+                                                    size_t limit) const
+{
+	std::vector<std::string> prefixes;
+	std::string buf;
+	forEachWord(query, &buf, [&prefixes](const char* word, size_t length) {
+		prefixes.push_back(std::string(word, length));
+	});
+
+	std::vector<TrackId> result;
+	if (prefixes.empty() || limit == 0)
+		return result;
+
+	/* Drive the search from the word with the fewest postings. */
+	size_t driver = 0;
+	PostingIterator first, last;
+	prefixRun(prefixes[0], &first, &last);
+	for (size_t i = 1; i < prefixes.size() && first != last; i++) {
+		PostingIterator f, l;
+		prefixRun(prefixes[i], &f, &l);
+		if (l - f < last - first) {
+			first = f;
+			last = l;
+			driver = i;
+		}
+	}
+
+	std::vector<uint64_t> seen((tracks.size() + 63) / 64);
+	for (PostingIterator it = first; it != last && result.size() < limit; ++it) {
+		const TrackId id = it->track;
+		uint64_t& bits = seen[id / 64];
+		const uint64_t bit = 1ull << (id % 64);
+		if (bits & bit)
+			continue;
+		bits |= bit;
+
+		bool match = true;
+		for (size_t i = 0; i < prefixes.size() && match; i++)
+			match = i == driver || hasWordWithPrefix(id, prefixes[i]);
+		if (match)
+			result.push_back(id);
+	}
+	return result;
+}
+
+std::string TrackIndex::fieldString(const Field& field) const
+{
+	return field.length ? std::string(&text[field.offset], field.length) : std::string();
+}
+
+bool TrackIndex::describe(TrackId id, std::string* title, std::string* artist,
+                          std::string* album) const
+{
+	if (id >= tracks.size())
+		return false;
+	*title = fieldString(tracks[id].title);
+	*artist = fieldString(tracks[id].artist);
+	*album = fieldString(tracks[id].album);
+	return true;
+}
+
+size_t TrackIndex::memoryBytes() const
+{
+	return text.capacity() + words.capacity() +
+	       tracks.capacity() * sizeof(Track) + postings.capacity() * sizeof(Posting);
+}
+
+}
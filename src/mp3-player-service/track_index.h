@@ -0,0 +1,85 @@
+#ifndef MP3_PLAYER_SERVICE_TRACK_INDEX_H_
+#define MP3_PLAYER_SERVICE_TRACK_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace mp3_player_service {
+
+/*
+ * Prefix-searchable index over track titles, artists and albums.
+ *
+ * Every string lives in one of two byte arenas: the tags as given, for
+ * display, and their case-folded words, for matching. A posting is just an
+ * offset into the word arena, a length and a track id. Postings are kept
+ * sorted by word, so the postings for a prefix are one contiguous run found
+ * by two binary searches. A query walks the shortest run among its words and
+ * checks each candidate's own words for the others, stopping at the limit,
+ * so the cost depends on the limit rather than on how common a prefix is.
+ *
+ * Tracks can be added at any time; they become searchable at the next
+ * commit(), which sorts only the new postings and merges them in.
+ */
+class TrackIndex {
+public:
+	typedef uint32_t TrackId;
+
+	TrackIndex();
+
+	void add(TrackId id, const std::string& title, const std::string& artist,
+	         const std::string& album);
+	void commit();
+
+	/*
+	 * Tracks matching every word of the query, each word as a prefix of some
+	 * word in the tags. Returns at most limit ids, ordered by matching word.
+	 */
+	std::vector<TrackId> search(const std::string& query, size_t limit) const;
+	bool describe(TrackId id, std::string* title, std::string* artist,
+	              std::string* album) const;
+
+	size_t trackCount() const { return indexedTracks; }
+	size_t memoryBytes() const;
+
+private:
+	struct Field {
+		uint32_t offset;
+		uint32_t length;
+	};
+	struct Track {
+		Field title;
+		Field artist;
+		Field album;
+		/* The track's words, NUL-separated, in the word arena. */
+		Field words;
+	};
+	struct Posting {
+		uint32_t word;
+		uint32_t track;
+		uint16_t length;
+	};
+
+	Field store(const std::string& value);
+	void addWords(TrackId id, const std::string& value);
+	std::string fieldString(const Field& field) const;
+	typedef std::vector<Posting>::const_iterator PostingIterator;
+	void prefixRun(const std::string& prefix, PostingIterator* first,
+	               PostingIterator* last) const;
+	bool hasWordWithPrefix(TrackId id, const std::string& prefix) const;
+	bool postingLess(const Posting& a, const Posting& b) const;
+
+	std::vector<char> text;
+	std::vector<char> words;
+	std::vector<Track> tracks;
+	std::vector<Posting> postings;
+	/* postings[0, sortedCount) is sorted; the rest awaits commit(). */
+	size_t sortedCount;
+	size_t indexedTracks;
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "track_source.h"
+
+#include <media/stagefright/MediaErrors.h>
+
+using namespace android;
+
+namespace mp3_player_service {
+
+TrackSource::TrackSource(const sp<MediaSource>& track)
+	: track(track), started(false), readBytes(0)
+{
+}
+
+status_t TrackSource::setTrack(const sp<MediaSource>& next)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (started) {
+		if (next != prepared) {
+			status_t err = next->start();
+			if (err != OK)
+				return err;
+		}
+		track->stop();
+	}
+	if (prepared != NULL && prepared != next)
+		prepared->stop();
+	prepared.clear();
+	track = next;
+	readBytes = 0;
+	return OK;
+}
+
+status_t TrackSource::prepareTrack(const sp<MediaSource>& next)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (!started || next == prepared)
+		return OK;
+	status_t err = next->start();
+	if (err != OK)
+		return err;
+	if (prepared != NULL)
+		prepared->stop();
+	prepared = next;
+	return OK;
+}
+
+status_t TrackSource::start(MetaData* params)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	status_t err = track->start(params);
+	started = (err == OK);
+	return err;
+}
+
+status_t TrackSource::stop()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (!started)
+		return OK;
+	started = false;
+	if (prepared != NULL)
+		prepared->stop();
+	prepared.clear();
+	return track->stop();
+}
+
+sp<MetaData> TrackSource::getFormat()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return track->getFormat();
+}
+
+status_t TrackSource::read(MediaBuffer** buffer, const ReadOptions* options)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	status_t err = track->read(buffer, options);
+	if (err == OK)
+		readBytes += (*buffer)->range_length();
+	return err;
+}
+
+}
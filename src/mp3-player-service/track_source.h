@@ -0,0 +1,49 @@
+#ifndef MP3_PLAYER_SERVICE_TRACK_SOURCE_H_
+#define MP3_PLAYER_SERVICE_TRACK_SOURCE_H_
+
+#include <atomic>
+#include <mutex>
+
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+
+namespace mp3_player_service {
+
+/*
+ * Compressed-track source whose upstream can be swapped while the decoder
+ * reading from it stays alive. OMXCodec pulls from its source on the OMX
+ * observer thread, so the swap and every read are serialized by a lock.
+ */
+class TrackSource : public android::MediaSource {
+public:
+	explicit TrackSource(const android::sp<android::MediaSource>& track);
+
+	/* Starts the new track, stops the old one and redirects reads. */
+	android::status_t setTrack(const android::sp<android::MediaSource>& track);
+	/*
+	 * Starts a track ahead of setTrack(), which then cannot fail for it.
+	 * Reads keep coming from the current track until then.
+	 */
+	android::status_t prepareTrack(const android::sp<android::MediaSource>& track);
+
+	android::status_t start(android::MetaData* params = NULL) override;
+	android::status_t stop() override;
+	android::sp<android::MetaData> getFormat() override;
+	android::status_t read(android::MediaBuffer** buffer,
+	                       const ReadOptions* options = NULL) override;
+
+	/* Compressed bytes handed to the decoder since the last setTrack(). */
+	uint64_t bytesRead() const { return readBytes.load(); }
+
+private:
+	std::mutex lock;
+	android::sp<android::MediaSource> track;
+	/* Started by prepareTrack() and not yet passed to setTrack(). */
+	android::sp<android::MediaSource> prepared;
+	bool started;
+	std::atomic<uint64_t> readBytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+LOCAL_PATH := $(call my-dir)
+
+# ledservice, ledflasher, the mp3 player and home_cloud_service in one process
+include $(CLEAR_VARS)
+LOCAL_MODULE := service_hub
+LOCAL_INIT_RC := service_hub.rc
+LOCAL_REQUIRED_MODULES := \
+    home_cloud.json \
+    ledflasher.json \
+    mediaplayer.json \
+    rules.conf
+LOCAL_SRC_FILES := service_hub.cpp
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_SHARED_LIBRARIES := \
+    libbinder \
+    libbinderwrapper \
+    libbrillo \
+    libbrillo-binder \
+    libbrillo-stream \
+    libchrome \
+    libcutils \
+    libhardware \
+    libmedia \
+    libsensor \
+    libstagefright \
+    libstagefright_foundation \
+    libutils \
+    libweaved
+LOCAL_STATIC_LIBRARIES := \
+    libhome_cloud_service \
+    libledflasher \
+    libledservice \
+    libmp3-player \
+    libledservice-common \
+    libmp3-player-service
+include $(BUILD_EXECUTABLE)
+
+
+# Memory and call latency, split across processes or not
+include $(CLEAR_VARS)
+LOCAL_MODULE := service_hub_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := service_hub_bench.cpp
+LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
+LOCAL_SHARED_LIBRARIES := \
+    libbinder \
+    libbinderwrapper \
+    libchrome \
+    libcutils \
+    libhardware \
+    libutils
+LOCAL_STATIC_LIBRARIES := \
+    libledservice \
+    libledservice-common
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// Runs ledservice, the mp3 player, ledflasher and home_cloud_service in one
+// process, on one message loop. Each still registers its binder service for
+// other processes, but calls between them go straight to the service
+// object through the same AIDL interfaces.
+
+#include <sysexits.h>
+
+#include <memory>
+
+#include <brillo/flag_helper.h>
+#include <brillo/syslog_logging.h>
+
+#include "home_cloud_service.h"
+#include "ledflasher.h"
+#include "ledservice.h"
+#include "mp3-player-service.h"
+#include "service_module.h"
+
+int main(int argc, char* argv[]) {
+  brillo::FlagHelper::Init(argc, argv, "Home cloud services in one process");
+  brillo::InitLog(brillo::kLogToSyslog | brillo::kLogHeader);
+
+  std::unique_ptr<service_hub::Module> home_cloud = home_cloud::CreateModule();
+  if (!home_cloud)
+    return EX_USAGE;
+  service_hub::ModuleDaemon daemon;
+  // Services before their clients, so that the clients find them here.
+  daemon.AddModule(ledservice::CreateModule());
+  daemon.AddModule(mp3_player_service::CreateModule());
+  daemon.AddModule(ledflasher::CreateModule());
+  daemon.AddModule(std::move(home_cloud));
+  return daemon.Run();
+}
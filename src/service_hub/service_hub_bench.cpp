@@ -0,0 +1,147 @@
+/*
+ * Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// Compares the services in their own processes with the same services in
+// service_hub: the memory of whichever of them are running, and the cost of
+// an ILEDService call through a binder proxy against the same call on a
+// service in the caller's process.
+//
+// Usage: service_hub_bench [calls]
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/files/file_path.h>
+#include <binderwrapper/binder_wrapper.h>
+
+#include "binder_constants.h"
+#include "brillo/examples/ledflasher/ILEDService.h"
+#include "ledservice.h"
+
+using brillo::examples::ledflasher::ILEDService;
+
+namespace {
+
+const char* const kProcesses[] = {
+  "ledservice",
+  "ledflasher",
+  "mp3-player-service",
+  "home_cloud_service",
+  "service_hub",
+};
+
+int64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// VmRSS of one process in kB; -1 if it is gone.
+int64_t ResidentKb(const std::string& pid) {
+  std::string status;
+  if (!base::ReadFileToString(
+          base::FilePath("/proc/" + pid + "/status"), &status)) {
+    return -1;
+  }
+  size_t at = status.find("VmRSS:");
+  if (at == std::string::npos)
+    return -1;
+  return strtoll(status.c_str() + at + 6, nullptr, 10);
+}
+
+// Prints the resident memory of each of the services that is running.
+void ReportMemory() {
+  DIR* proc = opendir("/proc");
+  if (!proc)
+    return;
+  int64_t total_kb = 0;
+  while (struct dirent* entry = readdir(proc)) {
+    std::string pid = entry->d_name;
+    if (pid.find_first_not_of("0123456789") != std::string::npos)
+      continue;
+    std::string cmdline;
+    if (!base::ReadFileToString(
+            base::FilePath("/proc/" + pid + "/cmdline"), &cmdline)) {
+      continue;
+    }
+    std::string program = base::FilePath(cmdline.c_str()).BaseName().value();
+    for (const char* name : kProcesses) {
+      if (program != name)
+        continue;
+      int64_t kb = ResidentKb(pid);
+      if (kb < 0)
+        break;
+      printf("%-20s pid %-6s %7lld kB resident\n", name, pid.c_str(),
+             static_cast<long long>(kb));
+      total_kb += kb;
+    }
+  }
+  closedir(proc);
+  printf("%-20s %18lld kB resident\n", "total",
+         static_cast<long long>(total_kb));
+}
+
+// Mean time of a getLED() and of a getAllLEDs() call.
+void TimeCalls(const char* label, const android::sp<ILEDService>& leds,
+               int calls) {
+  bool on;
+  int64_t start = NowNs();
+  for (int i = 0; i < calls; i++)
+    leds->getLED(0, &on);
+  int64_t get_ns = NowNs() - start;
+
+  std::vector<bool> all;
+  start = NowNs();
+  for (int i = 0; i < calls; i++)
+    leds->getAllLEDs(&all);
+  int64_t get_all_ns = NowNs() - start;
+
+  printf("%-12s getLED %8.0f ns, getAllLEDs %8.0f ns\n", label,
+         static_cast<double>(get_ns) / calls,
+         static_cast<double>(get_all_ns) / calls);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int calls = argc > 1 ? atoi(argv[1]) : 10000;
+  if (calls <= 0) {
+    fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+    return EX_USAGE;
+  }
+
+  ReportMemory();
+
+  android::BinderWrapper::Create();
+  android::sp<android::IBinder> remote =
+      android::BinderWrapper::Get()->GetService(ledservice::kBinderServiceName);
+  if (remote.get()) {
+    TimeCalls("binder", android::interface_cast<ILEDService>(remote), calls);
+  } else {
+    printf("%s is not running\n", ledservice::kBinderServiceName);
+  }
+  TimeCalls("in-process",
+            android::interface_cast<ILEDService>(ledservice::CreateService()),
+            calls);
+  return EX_OK;
+}